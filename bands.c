@@ -0,0 +1,66 @@
+// Computing an image in bands of rows, on separate threads
+
+#include <pthread.h>
+#include <unistd.h>
+#include "image.h"
+#include "bands.h"
+
+struct BandJob {
+  BandFn fn;
+  void *ctx;
+  int32_t first, end;
+  int rc;
+  pthread_t thread;
+  int started;
+};
+
+static void *band_thread(void *arg) {
+  struct BandJob *job = (struct BandJob *) arg;
+  job->rc = job->fn(job->ctx, job->first, job->end);
+  return NULL;
+}
+
+// fewest rows worth giving to a thread of their own
+#define MIN_BAND_ROWS 32
+
+int run_bands(int32_t height, int num_threads, BandFn fn, void *ctx) {
+  if (num_threads <= 0) {
+    num_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (num_threads > height / MIN_BAND_ROWS) {
+    num_threads = height / MIN_BAND_ROWS;
+  }
+  if (num_threads > BANDS_MAX_THREADS) {
+    num_threads = BANDS_MAX_THREADS;
+  }
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+
+  struct BandJob jobs[BANDS_MAX_THREADS];
+  for (int i = 0; i < num_threads; i++) {
+    jobs[i].fn = fn;
+    jobs[i].ctx = ctx;
+    jobs[i].first = (int32_t) ((int64_t) height * i / num_threads);
+    jobs[i].end = (int32_t) ((int64_t) height * (i + 1) / num_threads);
+    jobs[i].started = 0;
+  }
+
+  // the first band is run by this thread, as are any bands whose
+  // thread couldn't be started
+  for (int i = 1; i < num_threads; i++) {
+    jobs[i].started = pthread_create(&jobs[i].thread, NULL, band_thread, &jobs[i]) == 0;
+  }
+  int rc = IMG_SUCCESS;
+  for (int i = 0; i < num_threads; i++) {
+    if (i == 0 || !jobs[i].started) {
+      band_thread(&jobs[i]);
+    } else {
+      pthread_join(jobs[i].thread, NULL);
+    }
+    if (jobs[i].rc != IMG_SUCCESS) {
+      rc = jobs[i].rc;
+    }
+  }
+  return rc;
+}
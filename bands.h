@@ -0,0 +1,31 @@
+#ifndef BANDS_H
+#define BANDS_H
+
+#include <stdint.h>
+
+// Compute rows first to end - 1 of an image, given the caller's context.
+//
+// Returns:
+//   IMG_SUCCESS, or an IMG_ERR_* error code
+typedef int (*BandFn)(void *ctx, int32_t first, int32_t end);
+
+// most threads run_bands uses (the kernels split into bands are
+// limited by memory bandwidth long before this)
+#define BANDS_MAX_THREADS 16
+
+// Split the rows of an image into bands of at least 32 rows, and
+// compute them with separate threads. The first band is run by the
+// calling thread, as are any bands whose thread couldn't be started.
+//
+// Parameters:
+//   height - the number of rows
+//   num_threads - maximum number of threads, or 0 for one per CPU
+//                 (never more than BANDS_MAX_THREADS)
+//   fn - computes one band
+//   ctx - passed to fn
+//
+// Returns:
+//   IMG_SUCCESS, or the error code of a band which failed
+int run_bands(int32_t height, int num_threads, BandFn fn, void *ctx);
+
+#endif // BANDS_H
@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include "imgproc.h"
+#include "ellipse_mask.h"
 
 // TODO: define your helper functions here
 
@@ -34,8 +35,8 @@ uint32_t make_pixel( uint32_t r, uint32_t g, uint32_t b, uint32_t a ){
   return (r << 24) | (g << 16) | (b << 8) | a;
 }
 
-int32_t compute_index( struct Image *img, int32_t row, int32_t col ){
-  return row * img->width + col;
+int64_t compute_index( struct Image *img, int32_t row, int32_t col ){
+  return (int64_t) row * img->width + col;
   // does this need error checking for row/col out of bounds?
 }
 
@@ -51,8 +52,18 @@ int is_in_ellipse( struct Image *img, int32_t row, int32_t col ){
   // check ellispe equation: ⌊(10,000*x^2)/a^2⌋ + ⌊(10,000*y^2)/b^2⌋ ≤ 10,000
   // where the center pixel has row b and col a, and x is horizontal distance
   // from the center pixel and y is vertical distance from center pixel
-  int32_t term1 = (10000 * xDistFromCenter * xDistFromCenter) / (centerCol * centerCol);
-  int32_t term2 = (10000 * yDistFromCenter * yDistFromCenter) / (centerRow * centerRow);
+  // (terms are computed in 64 bits, since 10000*x*x overflows 32 bits once
+  // the image is wider than about 926 pixels)
+  // an image one pixel wide has a == 0, but then x is always 0 as well,
+  // so the term is taken to be 0 (and likewise for one pixel high)
+  int64_t term1 = 0;
+  int64_t term2 = 0;
+  if (centerCol != 0) {
+    term1 = (10000 * (int64_t) xDistFromCenter * xDistFromCenter) / ((int64_t) centerCol * centerCol);
+  }
+  if (centerRow != 0) {
+    term2 = (10000 * (int64_t) yDistFromCenter * yDistFromCenter) / ((int64_t) centerRow * centerRow);
+  }
 
   return (term1 + term2) <= 10000;
 }
@@ -99,10 +110,10 @@ int32_t clamp_gray_value(int32_t value){
 }
 
 void process_interior_pixel(struct Image *input_img, struct Image *output_img, 
-                          int32_t row, int32_t col, int32_t index, uint32_t current_pixel,
+                          int32_t row, int32_t col, int64_t index, uint32_t current_pixel,
                           uint32_t alpha) {
   // get upper-left neighbor pixel
-  int32_t neighbor_index = compute_index(input_img, row - 1, col - 1);
+  int64_t neighbor_index = compute_index(input_img, row - 1, col - 1);
   uint32_t neighbor_pixel = input_img->data[neighbor_index];
   
   // calculate RGB differences between current and neighbor pixel
@@ -119,6 +130,27 @@ void process_interior_pixel(struct Image *input_img, struct Image *output_img,
   output_img->data[index] = make_pixel(gray, gray, gray, alpha);
 }
 
+void imgproc_orient( struct Image *input_img, struct Image *output_img,
+                     int64_t origin, int64_t row_step, int64_t col_step ) {
+  int32_t width = input_img->width;
+  int32_t height = input_img->height;
+
+  for (int32_t block_row = 0; block_row < height; block_row += IMGPROC_ORIENT_BLOCK){
+    int32_t row_end = height - block_row < IMGPROC_ORIENT_BLOCK ? height : block_row + IMGPROC_ORIENT_BLOCK;
+    for (int32_t block_col = 0; block_col < width; block_col += IMGPROC_ORIENT_BLOCK){
+      int32_t col_end = width - block_col < IMGPROC_ORIENT_BLOCK ? width : block_col + IMGPROC_ORIENT_BLOCK;
+
+      for (int32_t row = block_row; row < row_end; row++){
+        const uint32_t *in = input_img->data + compute_index(input_img, row, 0);
+        uint32_t *out = output_img->data + origin + row * row_step;
+        for (int32_t col = block_col; col < col_end; col++){
+          out[col * col_step] = in[col];
+        }
+      }
+    }
+  }
+}
+
 // ---------- BEGIN IMAGE PROCESSING FUNCTIONS HERE ---------- //
 
 //! Transform the color component values in each input pixel
@@ -136,7 +168,7 @@ void imgproc_complement( struct Image *input_img, struct Image *output_img ) {
 
   for (int32_t row = 0; row < height; row++){
     for (int32_t col = 0; col < width; col++){
-      int32_t dataIdx = compute_index(input_img, row, col);
+      int64_t dataIdx = compute_index(input_img, row, col);
       uint32_t pixel = input_img->data[dataIdx];
       
       // extract RGBA components
@@ -177,21 +209,71 @@ int imgproc_transpose( struct Image *input_img, struct Image *output_img ) {
   // check if image is square
   if (width != height) return 0;
 
-  for (int32_t row = 0; row < height; row++){
-    for (int32_t col = 0; col < width; col++){
-      // get pixel at (row, col) from input image
-      int32_t input_index = compute_index(input_img, row, col);
-      int32_t transposed_index = compute_index(input_img, col, row);
-      
-      // and store it at (col, row) in output image
-      uint32_t pixel = input_img->data[input_index];
-      output_img->data[transposed_index] = pixel;
-    }
-  }
+  // pixel (row, col) is stored at (col, row) in the output image
+  imgproc_orient(input_img, output_img, 0, 1, width);
 
   return 1;
 }
 
+//! Rotate the input image 90 degrees clockwise: the pixel at row i
+//! and column j is copied to row j and column (height-1-i). The output
+//! image must be height pixels wide and width pixels high.
+//!
+//! @param input_img pointer to the input Image
+//! @param output_img pointer to the output Image (in which the
+//!                   transformed pixels should be stored)
+void imgproc_rotate90( struct Image *input_img, struct Image *output_img ) {
+  int64_t height = input_img->height;
+  // (row, col) goes to (col, height-1-row), in output rows of height pixels
+  imgproc_orient(input_img, output_img, height - 1, -1, height);
+}
+
+//! Rotate the input image 180 degrees: the pixel at row i and column j
+//! is copied to row (height-1-i) and column (width-1-j).
+//!
+//! @param input_img pointer to the input Image
+//! @param output_img pointer to the output Image (in which the
+//!                   transformed pixels should be stored)
+void imgproc_rotate180( struct Image *input_img, struct Image *output_img ) {
+  int64_t width = input_img->width, height = input_img->height;
+  imgproc_orient(input_img, output_img, width * height - 1, -width, -1);
+}
+
+//! Rotate the input image 90 degrees counterclockwise: the pixel at
+//! row i and column j is copied to row (width-1-j) and column i. The
+//! output image must be height pixels wide and width pixels high.
+//!
+//! @param input_img pointer to the input Image
+//! @param output_img pointer to the output Image (in which the
+//!                   transformed pixels should be stored)
+void imgproc_rotate270( struct Image *input_img, struct Image *output_img ) {
+  int64_t width = input_img->width, height = input_img->height;
+  // (row, col) goes to (width-1-col, row), in output rows of height pixels
+  imgproc_orient(input_img, output_img, (width - 1) * height, 1, -height);
+}
+
+//! Mirror the input image left to right: the pixel at row i and
+//! column j is copied to row i and column (width-1-j).
+//!
+//! @param input_img pointer to the input Image
+//! @param output_img pointer to the output Image (in which the
+//!                   transformed pixels should be stored)
+void imgproc_flip_h( struct Image *input_img, struct Image *output_img ) {
+  int64_t width = input_img->width;
+  imgproc_orient(input_img, output_img, width - 1, width, -1);
+}
+
+//! Mirror the input image top to bottom: the pixel at row i and
+//! column j is copied to row (height-1-i) and column j.
+//!
+//! @param input_img pointer to the input Image
+//! @param output_img pointer to the output Image (in which the
+//!                   transformed pixels should be stored)
+void imgproc_flip_v( struct Image *input_img, struct Image *output_img ) {
+  int64_t width = input_img->width, height = input_img->height;
+  imgproc_orient(input_img, output_img, (height - 1) * width, -width, 1);
+}
+
 //! Transform the input image by copying only those pixels that are
 //! within an ellipse centered within the bounds of the image.
 //! Pixels not in the ellipse should be left unmodified, which will
@@ -217,7 +299,7 @@ void imgproc_ellipse( struct Image *input_img, struct Image *output_img ) {
 
   for (int32_t row = 0; row < height; row++){
     for (int32_t col = 0; col < width; col++){
-      int32_t index = compute_index(input_img, row, col);
+      int64_t index = compute_index(input_img, row, col);
       
       if (is_in_ellipse(input_img, row, col)){
         // copy the pixel over if it's in the ellipse
@@ -228,6 +310,17 @@ void imgproc_ellipse( struct Image *input_img, struct Image *output_img ) {
   }
 }
 
+//! The ellipse kernel used by the "ellipse" transformation: the C
+//! build uses the cached ellipse masks, which skip the per-pixel
+//! ellipse test.
+//!
+//! @param input_img pointer to the input Image
+//! @param output_img pointer to the output Image (in which the
+//!                   transformed pixels should be stored)
+void imgproc_ellipse_xform( struct Image *input_img, struct Image *output_img ) {
+  ellipse_masked(input_img, output_img);
+}
+
 //! Transform the input image using an "emboss" effect. The pixels
 //! of the source image are transformed as follows.
 //!
@@ -264,7 +357,7 @@ void imgproc_emboss( struct Image *input_img, struct Image *output_img ) {
 
   for (int32_t row = 0; row < height; row++){
     for (int32_t col = 0; col < width; col++){
-      int32_t index = compute_index(input_img, row, col);
+      int64_t index = compute_index(input_img, row, col);
       uint32_t pixel = input_img->data[index];
       int32_t a = get_a(pixel);
 
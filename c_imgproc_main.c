@@ -4,158 +4,738 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
-#include "imgproc.h"
+#include <pthread.h>
+#include "transforms.h"
+#include "stats.h"
+#include "perfctr.h"
+#include "ellipse_mask.h"
+#include "resultcache.h"
+#include "serve.h"
+#include "imggraph.h"
+#include "resize.h"
 
-struct Transformation {
-  const char *name;
-  int (*apply)( struct Image *input_img, struct Image *output_img, int argc, char **argv );
-};
+// Options given before the transformation name
+struct Options {
+  // if nonzero, process the image out-of-core using a file-backed
+  // tile store, keeping at most this many bytes of pixel data in memory
+  size_t tile_cache_bytes;
+
+  // if non-NULL, per-stage statistics are written as JSON to this
+  // file ("-" means stderr)
+  const char *stats_file;
+
+  // if nonzero, hardware performance counters are sampled around
+  // the transformation and reported on stderr
+  int perf;
+
+  // if non-NULL, ellipse masks are loaded from this file at startup,
+  // and saved back to it afterwards
+  const char *mask_cache_file;
+
+  // if non-NULL, results are looked up in (and added to) a
+  // content-addressed cache in this directory, limited to
+  // result_cache_bytes bytes
+  const char *result_cache_dir;
+  uint64_t result_cache_bytes;
+
+  // if non-NULL, run as a server listening on this socket,
+  // with num_workers worker threads (0 means one per CPU)
+  const char *serve_socket;
+  int num_workers;
 
-int apply_complement( struct Image *input_img, struct Image *output_img, int argc, char **argv );
-int apply_transpose( struct Image *input_img, struct Image *output_img, int argc, char **argv );
-int apply_ellipse( struct Image *input_img, struct Image *output_img, int argc, char **argv );
-int apply_emboss( struct Image *input_img, struct Image *output_img, int argc, char **argv );
-
-static const struct Transformation s_transformations[] = {
-  { "complement", apply_complement },
-  { "transpose", apply_transpose },
-  { "ellipse", apply_ellipse },
-  { "emboss", apply_emboss },
-  { NULL, NULL },
+  // if nonzero, just print the dimensions and format of each image
+  int probe;
+
+  // if num_rows is nonzero, only rows first_row..first_row+num_rows-1
+  // of the input are read (and transformed)
+  int32_t first_row;
+  int32_t num_rows;
+
+  // if nonzero, print the plan for a chain of transformations
+  int plan;
+  // if nonzero, don't compile chains of transformations (see jit.h)
+  int no_jit;
+
+  // if nonzero, the output's pyramid is written too: this many levels
+  // (-1 means all of them) of successive halvings, <name>_1.<ext> etc.,
+  // by up to write_threads threads
+  int pyramid_levels;
+  int write_threads;
+
+  // if nonzero, per-channel histograms of the output are added to the
+  // statistics (which must be requested too)
+  int histogram;
 };
 
+// performance counters around the transformation (see --perf)
+static struct PerfCounters s_perf;
+
 void usage( const char *progname ) {
   fprintf( stderr, "Error: invalid command-line arguments\n" );
-  fprintf( stderr, "Usage: %s <transform> <input img> <output img> [args...]\n", progname );
+  fprintf( stderr, "Usage: %s [options] <transform> <input img> <output img> [args...]\n", progname );
+  fprintf( stderr, "       %s --serve=<socket> [--workers=<n>]\n", progname );
+  fprintf( stderr, "       %s --probe <img>...\n", progname );
+  fprintf( stderr, "Use - as the input or output image to read from stdin or write to stdout.\n" );
+  fprintf( stderr, "Images named *.raw or *.pam are read/written uncompressed instead of as PNG.\n" );
+  fprintf( stderr, "A comma-separated list of transformations (e.g. complement,ellipse,emboss)\n" );
+  fprintf( stderr, "is applied in order, fused into a single pass where possible.\n" );
+  fprintf( stderr, "convolve takes a square kernel's weights as a comma-separated list, then\n" );
+  fprintf( stderr, "optionally a right shift and a bias for the sums.\n" );
+  fprintf( stderr, "resize takes a width and height (0 to keep the aspect ratio), then box\n" );
+  fprintf( stderr, "(the default) or bilinear.\n" );
+  fprintf( stderr, "rotate90, rotate180 and rotate270 turn the image clockwise; flipH and flipV\n" );
+  fprintf( stderr, "mirror it left to right and top to bottom.\n" );
+  fprintf( stderr, "rgb makes a 2x2 grid of the image and its red, green and blue channels.\n" );
+  fprintf( stderr, "composite draws an overlay image, given as its argument, over the image.\n" );
+  fprintf( stderr, "Options:\n" );
+  fprintf( stderr, "  --tiled=<MiB>   process the image out-of-core, with at most <MiB>\n" );
+  fprintf( stderr, "                  megabytes of pixel data in memory\n" );
+  fprintf( stderr, "  --stats=json[:<file>]\n" );
+  fprintf( stderr, "                  write per-stage timings, byte counts and allocation\n" );
+  fprintf( stderr, "                  high-water marks as JSON to <file> (default: stderr)\n" );
+  fprintf( stderr, "  --histogram     add per-channel histograms and min/max/mean of the output\n" );
+  fprintf( stderr, "                  image to the --stats output\n" );
+  fprintf( stderr, "  --perf          report hardware performance counters (cycles,\n" );
+  fprintf( stderr, "                  instructions, cache/TLB/branch misses) for the\n" );
+  fprintf( stderr, "                  transformation, in total and per megapixel\n" );
+  fprintf( stderr, "  --mask-cache=<file>\n" );
+  fprintf( stderr, "                  keep the precomputed ellipse masks in <file> (saved\n" );
+  fprintf( stderr, "                  after a successful run, or when the server stops)\n" );
+  fprintf( stderr, "  --result-cache=<dir>\n" );
+  fprintf( stderr, "                  reuse results of identical earlier runs, cached in <dir>\n" );
+  fprintf( stderr, "  --result-cache-size=<MiB>\n" );
+  fprintf( stderr, "                  maximum size of the result cache (default 1024)\n" );
+  fprintf( stderr, "  --serve=<socket>\n" );
+  fprintf( stderr, "                  process requests from imgclient/imgloadgen on a Unix socket\n" );
+  fprintf( stderr, "  --workers=<n>   number of server worker threads (default: one per CPU)\n" );
+  fprintf( stderr, "  --probe         print the width, height and format of each image,\n" );
+  fprintf( stderr, "                  reading only its header\n" );
+  fprintf( stderr, "  --rows=<first>:<n>\n" );
+  fprintf( stderr, "                  only read and transform n rows of the input, starting\n" );
+  fprintf( stderr, "                  at row <first> (decoding stops after the last of them)\n" );
+  fprintf( stderr, "  --plan          print how a list of transformations will be executed\n" );
+  fprintf( stderr, "  --no-jit        run a list of transformations in bands, without\n" );
+  fprintf( stderr, "                  compiling it to machine code\n" );
+  fprintf( stderr, "  --pyramid[=<n>] also write the output halved n times (default: down to\n" );
+  fprintf( stderr, "                  1x1) as <output>_1.<ext>, <output>_2.<ext>, ...\n" );
+  fprintf( stderr, "  --write-threads=<n>\n" );
+  fprintf( stderr, "                  write the pyramid levels with up to n threads (default 1)\n" );
   exit( 1 );
 }
 
-// Make a new empty image.
-// If transformation is "rgb", then the new image will
-// have width and height twice that of the input image,
-// otherwise the output image will be the same dimensions as
-// the input image.
-struct Image *create_output_img( struct Image *input_img, const char *transformation ) {
-  struct Image *out_img;
-  int32_t out_w = input_img->width, out_h = input_img->height;
+// Parse the options at the start of the command line.
+// Returns the number of arguments consumed.
+int parse_options( int argc, char **argv, struct Options *opts ) {
+  int i;
+
+  memset( opts, 0, sizeof( struct Options ) );
+  opts->result_cache_bytes = (uint64_t) 1024 << 20;
+  opts->write_threads = 1;
 
-  if ( strcmp( transformation, "rgb" ) == 0 ) {
-    out_w *= 2;
-    out_h *= 2;
+  for ( i = 1; i < argc && strncmp( argv[i], "--", 2 ) == 0; ++i ) {
+    const char *opt = argv[i];
+
+    if ( strncmp( opt, "--tiled=", 8 ) == 0 ) {
+      char *end;
+      unsigned long mib = strtoul( opt + 8, &end, 10 );
+      if ( *end != '\0' || mib == 0 )
+        usage( argv[0] );
+      opts->tile_cache_bytes = (size_t) mib << 20;
+    } else if ( strcmp( opt, "--stats=json" ) == 0 ) {
+      opts->stats_file = "-";
+    } else if ( strncmp( opt, "--stats=json:", 13 ) == 0 && opt[13] != '\0' ) {
+      opts->stats_file = opt + 13;
+    } else if ( strcmp( opt, "--histogram" ) == 0 ) {
+      opts->histogram = 1;
+    } else if ( strcmp( opt, "--perf" ) == 0 ) {
+      opts->perf = 1;
+    } else if ( strncmp( opt, "--mask-cache=", 13 ) == 0 && opt[13] != '\0' ) {
+      opts->mask_cache_file = opt + 13;
+    } else if ( strncmp( opt, "--result-cache=", 15 ) == 0 && opt[15] != '\0' ) {
+      opts->result_cache_dir = opt + 15;
+    } else if ( strncmp( opt, "--result-cache-size=", 20 ) == 0 ) {
+      char *end;
+      unsigned long long mib = strtoull( opt + 20, &end, 10 );
+      if ( *end != '\0' || mib == 0 )
+        usage( argv[0] );
+      opts->result_cache_bytes = (uint64_t) mib << 20;
+    } else if ( strncmp( opt, "--serve=", 8 ) == 0 && opt[8] != '\0' ) {
+      opts->serve_socket = opt + 8;
+    } else if ( strncmp( opt, "--workers=", 10 ) == 0 ) {
+      char *end;
+      long n = strtol( opt + 10, &end, 10 );
+      if ( *end != '\0' || n < 1 || n > 1024 )
+        usage( argv[0] );
+      opts->num_workers = (int) n;
+    } else if ( strcmp( opt, "--probe" ) == 0 ) {
+      opts->probe = 1;
+    } else if ( strncmp( opt, "--rows=", 7 ) == 0 ) {
+      char *end;
+      long first = strtol( opt + 7, &end, 10 );
+      long n = ( *end == ':' ) ? strtol( end + 1, &end, 10 ) : 0;
+      if ( *end != '\0' || first < 0 || first > INT32_MAX || n < 1 || n > INT32_MAX )
+        usage( argv[0] );
+      opts->first_row = (int32_t) first;
+      opts->num_rows = (int32_t) n;
+    } else if ( strcmp( opt, "--plan" ) == 0 ) {
+      opts->plan = 1;
+    } else if ( strcmp( opt, "--no-jit" ) == 0 ) {
+      opts->no_jit = 1;
+    } else if ( strcmp( opt, "--pyramid" ) == 0 ) {
+      opts->pyramid_levels = -1;
+    } else if ( strncmp( opt, "--pyramid=", 10 ) == 0 ) {
+      char *end;
+      long n = strtol( opt + 10, &end, 10 );
+      if ( *end != '\0' || n < 1 || n > 31 )
+        usage( argv[0] );
+      opts->pyramid_levels = (int) n;
+    } else if ( strncmp( opt, "--write-threads=", 16 ) == 0 ) {
+      char *end;
+      long n = strtol( opt + 16, &end, 10 );
+      if ( *end != '\0' || n < 1 || n > 64 )
+        usage( argv[0] );
+      opts->write_threads = (int) n;
+    } else {
+      usage( argv[0] );
+    }
   }
 
-  // Allocate Image object
-  out_img = (struct Image *) malloc( sizeof( struct Image ) );
-  if ( out_img == NULL )
-    return NULL;
+  // out-of-core processing always reads the whole image
+  if ( opts->num_rows != 0 && opts->tile_cache_bytes != 0 )
+    usage( argv[0] );
+  // nor does it keep the output image around to build a pyramid from,
+  // or feed the histograms
+  if ( ( opts->pyramid_levels != 0 || opts->histogram ) && opts->tile_cache_bytes != 0 )
+    usage( argv[0] );
+  // the histograms are only written with the other statistics
+  if ( opts->histogram && opts->stats_file == NULL )
+    usage( argv[0] );
 
-  // Set data to NULL for now
-  out_img->data = NULL;
+  return i - 1;
+}
 
-  // Attempt to initialize the Image object by calling img_init
-  if ( img_init( out_img, out_w, out_h ) != IMG_SUCCESS ) {
-    free( out_img );
-    return NULL;
+// Write the collected statistics, if they were requested
+void write_stats( const struct Options *opts, const char *transformation, uint64_t start ) {
+  if ( opts->stats_file == NULL )
+    return;
+
+  uint64_t wall_ns = stats_start() - start;
+
+  if ( strcmp( opts->stats_file, "-" ) == 0 ) {
+    stats_write_json( stderr, transformation, wall_ns );
+    return;
+  }
+
+  FILE *out = fopen( opts->stats_file, "w" );
+  if ( out == NULL ) {
+    fprintf( stderr, "Error: couldn't write statistics to '%s'\n", opts->stats_file );
+    return;
   }
+  stats_write_json( out, transformation, wall_ns );
+  fclose( out );
+}
+
+// An image file to be written by write_images
+struct ImageWrite {
+  char *filename;
+  struct Image *img;
+  int rc;
+};
+
+// Writes every stride'th image, starting at first, on its own thread
+// if started is nonzero
+struct ImageWriter {
+  struct ImageWrite *writes;
+  int num_writes;
+  int first;
+  int stride;
+  int started;
+  pthread_t thread;
+};
 
-  // Success!
-  return out_img;
+void *write_images( void *arg ) {
+  struct ImageWriter *writer = (struct ImageWriter *) arg;
+  for ( int i = writer->first; i < writer->num_writes; i += writer->stride )
+    writer->writes[i].rc = img_write( writer->writes[i].filename, writer->writes[i].img );
+  return NULL;
 }
 
-// Free memory allocated to given Image object
-void cleanup_image( struct Image *img ) {
-  if ( img != NULL ) {
-    img_cleanup( img );
-    free( img );
+// The file name of a pyramid level: the output's name with _<level>
+// added before the extension, if it has one.
+char *level_filename( const char *output_filename, int level ) {
+  const char *base = strrchr( output_filename, '/' );
+  const char *ext = strrchr( base != NULL ? base : output_filename, '.' );
+  size_t stem_len = ext != NULL ? (size_t) ( ext - output_filename ) : strlen( output_filename );
+  size_t len = strlen( output_filename ) + 16;
+  char *filename = (char *) malloc( len );
+  if ( filename != NULL )
+    snprintf( filename, len, "%.*s_%d%s", (int) stem_len, output_filename, level, ext != NULL ? ext : "" );
+  return filename;
+}
+
+// Write the output image, and with --pyramid, its pyramid levels, which
+// are built in one pass over the output (see pyramid_build).
+// Returns 0 if successful, after printing an error otherwise.
+int write_output( const struct Options *opts, const char *output_filename, struct Image *output_img ) {
+  if ( opts->pyramid_levels == 0 ) {
+    if ( img_write( output_filename, output_img ) != IMG_SUCCESS ) {
+      fprintf( stderr, "Error: couldn't write output image\n" );
+      return 0;
+    }
+    return 1;
+  }
+  if ( strcmp( output_filename, IMG_STDIO ) == 0 ) {
+    fprintf( stderr, "Error: the pyramid levels need an output file name to be named after\n" );
+    return 0;
+  }
+
+  int num_levels = pyramid_depth( output_img->width, output_img->height );
+  if ( opts->pyramid_levels > 0 && opts->pyramid_levels < num_levels )
+    num_levels = opts->pyramid_levels;
+
+  struct Image levels[32];
+  struct ImageWrite writes[33];
+  struct ImageWriter writers[64];
+  if ( pyramid_build( output_img, levels, num_levels ) != IMG_SUCCESS ) {
+    fprintf( stderr, "Error: couldn't allocate the pyramid\n" );
+    return 0;
   }
+
+  int success = 1;
+  for ( int i = 0; i <= num_levels; ++i ) {
+    writes[i].img = i == 0 ? output_img : &levels[i - 1];
+    writes[i].filename = i == 0 ? strdup( output_filename ) : level_filename( output_filename, i );
+    writes[i].rc = IMG_SUCCESS;
+    if ( writes[i].filename == NULL )
+      success = 0;
+  }
+
+  if ( success ) {
+    // the statistics aren't thread-safe, so with --stats the images are
+    // written one at a time
+    int num_writers = stats_enabled ? 1 : opts->write_threads;
+    if ( num_writers > num_levels + 1 )
+      num_writers = num_levels + 1;
+    for ( int i = 0; i < num_writers; ++i ) {
+      writers[i] = (struct ImageWriter) { .writes = writes, .num_writes = num_levels + 1,
+                                          .first = i, .stride = num_writers };
+      writers[i].started = i > 0 && pthread_create( &writers[i].thread, NULL, write_images, &writers[i] ) == 0;
+    }
+    // this thread writes the images of any writer that couldn't be started
+    for ( int i = 0; i < num_writers; ++i ) {
+      if ( writers[i].started )
+        pthread_join( writers[i].thread, NULL );
+      else
+        write_images( &writers[i] );
+    }
+  } else {
+    fprintf( stderr, "Error: couldn't allocate the pyramid's file names\n" );
+  }
+
+  for ( int i = 0; i <= num_levels; ++i ) {
+    if ( success && writes[i].rc != IMG_SUCCESS ) {
+      fprintf( stderr, "Error: couldn't write output image '%s'\n", writes[i].filename );
+      success = 0;
+    }
+    free( writes[i].filename );
+    if ( i > 0 )
+      img_cleanup( &levels[i - 1] );
+  }
+  return success;
 }
 
-int main( int argc, char **argv ) {
-  if ( argc < 4 )
-    usage( argv[0] );
+// Whether any of a comma-separated list of transformations reads files
+// named by its arguments, so that its result can't be cached by name.
+int reads_files( const char *transformations ) {
+  char *names = strdup( transformations );
+  char *save = NULL;
+  int reads = names == NULL;
+  for ( char *name = names ? strtok_r( names, ",", &save ) : NULL; name != NULL && !reads;
+        name = strtok_r( NULL, ",", &save ) ) {
+    const struct Transformation *xform = find_transformation( name );
+    reads = xform != NULL && ( xform->flags & XFORM_READS_FILES );
+  }
+  free( names );
+  return reads;
+}
+
+// Print "<file> <width> <height> <format>" for each image file.
+// Returns 0 if every file could be probed, 1 otherwise.
+int probe_images( int num_files, char **filenames ) {
+  static const char *color_names[] = { "unknown", "grey", "grey-alpha", "palette", "rgb", "rgba" };
+  int rc = 0;
+
+  for ( int i = 0; i < num_files; ++i ) {
+    int32_t width, height;
+    int format;
+    if ( img_probe( filenames[i], &width, &height, &format ) != IMG_SUCCESS ) {
+      fprintf( stderr, "Error: couldn't probe image '%s'\n", filenames[i] );
+      rc = 1;
+      continue;
+    }
+
+    int color = format & IMG_FORMAT_COLOR_MASK;
+    printf( "%s %d %d %s%s\n", filenames[i], width, height,
+            color_names[color <= IMG_FORMAT_RGBA ? color : 0],
+            ( format & IMG_FORMAT_16BIT ) ? "16" : ( format & IMG_FORMAT_LOW_DEPTH ) ? "-lowdepth" : "" );
+  }
+
+  return rc;
+}
+
+// Run a transformation out-of-core: the input is streamed into a
+// file-backed tile store, transformed a band or tile at a time,
+// and streamed back out.
+int run_tiled( const struct Options *opts, int argc, char **argv ) {
+  const char *transformation = argv[1];
+  const char *input_filename = argv[2];
+  const char *output_filename = argv[3];
+
+  const struct Transformation *xform = find_transformation( transformation );
+  if ( xform == NULL ) {
+    fprintf( stderr, "Error: unknown transformation '%s'\n", transformation );
+    return 1;
+  }
+  if ( xform->apply_tiled == NULL ) {
+    fprintf( stderr, "Error: transformation '%s' doesn't support tiled mode\n", transformation );
+    return 1;
+  }
+
+  struct TileStore input, output;
+  if ( img_read_tiled( input_filename, &input, opts->tile_cache_bytes ) != IMG_SUCCESS ) {
+    fprintf( stderr, "Error: couldn't read input image\n" );
+    return 1;
+  }
+  if ( ts_init( &output, input.width, input.height, opts->tile_cache_bytes, NULL ) != IMG_SUCCESS ) {
+    fprintf( stderr, "Error: couldn't create output tile store\n" );
+    ts_cleanup( &input );
+    return 1;
+  }
+  stats_set_image( input.width, input.height );
+
+  uint64_t num_pixels = (uint64_t) input.width * input.height;
+  uint64_t start = stats_start();
+  perf_start( &s_perf );
+  int success = xform->apply_tiled( &input, &output, argc, argv ) != 0;
+  perf_stop( &s_perf, num_pixels );
+  stats_stop( STATS_TRANSFORM, start, num_pixels * sizeof(uint32_t) );
+
+  if ( success ) {
+    if ( img_write_tiled( output_filename, &output ) != IMG_SUCCESS ) {
+      fprintf( stderr, "Error: couldn't write output image\n" );
+      success = false;
+    }
+  }
+
+  ts_cleanup( &input );
+  ts_cleanup( &output );
+
+  return success ? 0 : 1;
+}
 
+// Run a transformation on a 16 bit per channel image held in memory.
+int run_in_memory16( int argc, char **argv ) {
   const char *transformation = argv[1];
   const char *input_filename = argv[2];
   const char *output_filename = argv[3];
 
-  // Allocate and read the input image
+  const struct Transformation *xform = find_transformation( transformation );
+  if ( xform == NULL || xform->apply16 == NULL ) {
+    fprintf( stderr, "Error: transformation '%s' doesn't support 16-bit images\n", transformation );
+    return 1;
+  }
+
+  struct Image16 *input_img = (struct Image16 *) malloc( sizeof( struct Image16 ) );
+  if ( input_img == NULL || img16_read( input_filename, input_img ) != IMG_SUCCESS ) {
+    fprintf( stderr, "Error: couldn't read input image\n" );
+    free( input_img );
+    return 1;
+  }
+
+  struct Image16 *output_img = create_output_img16( input_img );
+  if ( output_img == NULL ) {
+    fprintf( stderr, "Error: couldn't create output image object\n" );
+    cleanup_image16( input_img );
+    return 1;
+  }
+
+  stats_set_image( input_img->width, input_img->height );
+  uint64_t num_pixels = (uint64_t) input_img->width * input_img->height;
+  uint64_t start = stats_start();
+  perf_start( &s_perf );
+  int success = xform->apply16( input_img, output_img, argc, argv ) != 0;
+  perf_stop( &s_perf, num_pixels );
+  stats_stop( STATS_TRANSFORM, start, num_pixels * sizeof(uint64_t) );
+
+  if ( success && img16_write( output_filename, output_img ) != IMG_SUCCESS ) {
+    fprintf( stderr, "Error: couldn't write output image (16-bit images can only be written as PNG)\n" );
+    success = 0;
+  }
+
+  cleanup_image16( input_img );
+  cleanup_image16( output_img );
+
+  return success ? 0 : 1;
+}
+
+// Release the input image, which was either read or mapped
+void release_input( struct Image *img, int mapped ) {
+  if ( mapped ) {
+    img_unmap( img );
+    free( img );
+  } else {
+    cleanup_image( img );
+  }
+}
+
+// Read (or map) the input image, or just the rows selected by --rows.
+// Returns NULL, after printing an error, if it couldn't be read.
+struct Image *read_input( const struct Options *opts, const char *input_filename, int *mapped ) {
   struct Image *input_img = (struct Image *) malloc( sizeof( struct Image ) );
   if ( input_img == NULL ) {
     fprintf( stderr, "Error: couldn't allocate input image\n" );
     exit( 1 );
   }
-  if ( img_read( input_filename, input_img ) != IMG_SUCCESS ) {
-    fprintf( stderr, "Error: couldn't read input image\n" );
+  // raw images are mapped rather than read
+  *mapped = 0;
+  int rc;
+  if ( opts->num_rows != 0 ) {
+    rc = img_read_rows( input_filename, opts->first_row, opts->num_rows, input_img );
+  } else {
+    *mapped = img_map( input_filename, input_img ) == IMG_SUCCESS;
+    rc = *mapped ? IMG_SUCCESS : img_read( input_filename, input_img );
+  }
+  if ( rc != IMG_SUCCESS ) {
+    if ( rc == IMG_ERR_INVALID_ROWS )
+      fprintf( stderr, "Error: rows %d..%d are not all in the input image\n",
+               opts->first_row, opts->first_row + opts->num_rows - 1 );
+    else if ( rc == IMG_ERR_NOT_TRUECOLOR && strcmp( input_filename, IMG_STDIO ) == 0 )
+      // 16-bit input is detected by probing the file first, which
+      // standard input can't be rewound for
+      fprintf( stderr, "Error: the input isn't an 8-bit image (16-bit input isn't supported on stdin)\n" );
+    else
+      fprintf( stderr, "Error: couldn't read input image\n" );
     free( input_img );
+    return NULL;
+  }
+  return input_img;
+}
+
+// Run a comma-separated list of transformations as a graph (see
+// imggraph.h), so that they are fused rather than run one at a time.
+int run_graph( const struct Options *opts, int argc, char **argv ) {
+  const char *output_filename = argv[3];
+
+  if ( opts->tile_cache_bytes != 0 ) {
+    fprintf( stderr, "Error: a list of transformations can't be run in tiled mode\n" );
+    return 1;
+  }
+
+  int mapped;
+  struct Image *input_img = read_input( opts, argv[2], &mapped );
+  if ( input_img == NULL )
     return 1;
+
+  struct ImgGraph *graph = graph_create();
+  struct GraphNode *node = graph ? graph_input( graph, input_img ) : NULL;
+  char *names = strdup( argv[1] );
+  // the output's histogram is collected by the graph as it's computed
+  struct StatsHistogram *hist = opts->histogram
+    ? (struct StatsHistogram *) calloc( 1, sizeof( struct StatsHistogram ) ) : NULL;
+  int success = node != NULL && names != NULL && ( hist != NULL || !opts->histogram );
+  if ( graph != NULL ) {
+    graph->no_jit = opts->no_jit;
+    graph->histogram = hist;
+  }
+
+  char *save = NULL;
+  for ( char *name = names ? strtok_r( names, ",", &save ) : NULL; success && name != NULL;
+        name = strtok_r( NULL, ",", &save ) ) {
+    node = graph_apply( graph, node, name, argc, argv );
+    if ( node == NULL ) {
+      fprintf( stderr, "Error: unknown transformation '%s'\n", name );
+      success = 0;
+    }
+  }
+  free( names );
+
+  if ( success ) {
+    stats_set_image( input_img->width, input_img->height );
+    // the pyramid is built from the kept result after the graph is run
+    int rc = IMG_SUCCESS;
+    if ( opts->pyramid_levels != 0 )
+      graph_keep( graph, node );
+    else
+      rc = graph_write( graph, node, output_filename );
+    if ( rc == IMG_SUCCESS )
+      rc = graph_plan( graph );
+    if ( rc == IMG_SUCCESS && opts->plan )
+      graph_print_plan( graph, stderr );
+    if ( rc == IMG_SUCCESS )
+      rc = graph_run( graph );
+
+    if ( rc == GRAPH_ERR_TRANSFORM_FAILED )
+      fprintf( stderr, "Error: transformation '%s' failed\n", argv[1] );
+    else if ( rc != IMG_SUCCESS )
+      fprintf( stderr, "Error: couldn't write output image\n" );
+    success = rc == IMG_SUCCESS;
+    if ( success && opts->pyramid_levels != 0 )
+      success = write_output( opts, output_filename, graph_result( node ) );
+    if ( success && hist != NULL )
+      stats_histogram_merge( hist );
+  }
+
+  free( hist );
+  graph_destroy( graph );
+  release_input( input_img, mapped );
+  return success ? 0 : 1;
+}
+
+// Run a transformation on an image held in memory.
+int run_in_memory( const struct Options *opts, int argc, char **argv ) {
+  const char *transformation = argv[1];
+  const char *input_filename = argv[2];
+  const char *output_filename = argv[3];
+
+  // 16-bit PNGs are processed at full precision
+  int32_t width, height;
+  int format;
+  if ( opts->num_rows == 0 && img_probe( input_filename, &width, &height, &format ) == IMG_SUCCESS
+       && ( format & IMG_FORMAT_16BIT ) ) {
+    if ( opts->pyramid_levels != 0 || opts->histogram ) {
+      fprintf( stderr, "Error: pyramids and histograms of 16-bit images aren't supported\n" );
+      return 1;
+    }
+    return run_in_memory16( argc, argv );
   }
 
+  // the graph feeds the histogram while the output is computed, even
+  // for a single transformation
+  if ( opts->histogram )
+    return run_graph( opts, argc, argv );
+
+  int mapped;
+  struct Image *input_img = read_input( opts, input_filename, &mapped );
+  if ( input_img == NULL )
+    return 1;
+
   // Create output Image object
-  struct Image *output_img = create_output_img( input_img, transformation );
+  struct Image *output_img = create_output_img( input_img, transformation, argc, argv );
   if ( output_img == NULL ) {
     fprintf( stderr, "Error: couldn't create output image object\n" );
-    cleanup_image( input_img );
+    release_input( input_img, mapped );
     return 1;
   }
 
   // find transformation
-  const struct Transformation *xform = NULL;
-  for ( int i = 0; s_transformations[i].name != NULL; ++i )
-    if ( strcmp( s_transformations[i].name, transformation ) == 0 ) {
-      xform = &s_transformations[i];
-      break;
-    }
+  const struct Transformation *xform = find_transformation( transformation );
 
   int success;
 
   if ( xform != NULL ) {
     // apply the transformation!
+    stats_set_image( input_img->width, input_img->height );
+    uint64_t num_pixels = (uint64_t) input_img->width * input_img->height;
+    uint64_t start = stats_start();
+    perf_start( &s_perf );
     success = xform->apply( input_img, output_img, argc, argv ) != 0;
+    perf_stop( &s_perf, num_pixels );
+    stats_stop( STATS_TRANSFORM, start, num_pixels * sizeof(uint32_t) );
   } else {
     fprintf( stderr, "Error: unknown transformation '%s'\n", transformation );
     success = 0;
   }
 
-  if ( success ) {
-    // Write output image
-    if ( img_write( output_filename, output_img ) != IMG_SUCCESS ) {
-      fprintf( stderr, "Error: couldn't write output image\n" );
-      success = false;
-    }
-  }
+  // Write output image
+  if ( success )
+    success = write_output( opts, output_filename, output_img );
 
-  cleanup_image( input_img );
+  release_input( input_img, mapped );
   cleanup_image( output_img );
 
   return success ? 0 : 1;
 }
 
-int apply_complement( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
-  (void) argc;
-  (void) argv;
-  imgproc_complement( input_img, output_img );
-  return 1;
+// Save the ellipse masks to the --mask-cache file, if there is one.
+void save_masks( const struct Options *opts ) {
+  if ( opts->mask_cache_file != NULL && ellipse_mask_save( opts->mask_cache_file ) != IMG_SUCCESS )
+    fprintf( stderr, "Warning: couldn't save ellipse masks to '%s'\n", opts->mask_cache_file );
 }
 
-int apply_transpose( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
-  (void) argc;
-  (void) argv;
-  int success = imgproc_transpose( input_img,  output_img );
-  if ( !success )
-    fprintf( stderr, "Error: transpose transformation failed\n" );
-  return success;
-}
+int main( int argc, char **argv ) {
+  struct Options opts;
+  int num_opts = parse_options( argc, argv, &opts );
 
-int apply_ellipse( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
-  (void) argc;
-  (void) argv;
-  imgproc_ellipse( input_img,  output_img );
-  return 1;
-}
+  // drop the options, so that argv[1] is the transformation name
+  argv[num_opts] = argv[0];
+  argv += num_opts;
+  argc -= num_opts;
+
+  // a missing or invalid mask file just means the masks are recomputed
+  if ( opts.mask_cache_file != NULL )
+    ellipse_mask_load( opts.mask_cache_file );
+
+  if ( opts.serve_socket != NULL ) {
+    int rc = serve( opts.serve_socket, opts.num_workers );
+    save_masks( &opts );
+    return rc;
+  }
+
+  if ( opts.probe ) {
+    if ( argc < 2 )
+      usage( argv[0] );
+    return probe_images( argc - 1, argv + 1 );
+  }
+
+  if ( argc < 4 )
+    usage( argv[0] );
+
+  stats_enabled = ( opts.stats_file != NULL );
+  uint64_t start = stats_start();
+
+  perf_init( &s_perf );
+  if ( opts.perf && perf_open( &s_perf ) == 0 )
+    fprintf( stderr, "Warning: no performance counters available\n" );
+
+  // on a result cache hit, the output is just a copy of the cached file
+  // (so the cache isn't used with stdin/stdout, which can't be rewound,
+  // for a range of rows, which isn't part of the key, for a pyramid,
+  // which has more than one output, with histograms, which are
+  // collected while the output is computed, or for transformations
+  // which read other files, whose contents aren't part of the key)
+  struct ResultCache result_cache = { opts.result_cache_dir, opts.result_cache_bytes };
+  char key[RESULT_CACHE_KEY_LEN];
+  int have_key = opts.result_cache_dir != NULL && opts.num_rows == 0 && opts.pyramid_levels == 0 && !opts.histogram
+    && strcmp( argv[2], IMG_STDIO ) != 0 && strcmp( argv[3], IMG_STDIO ) != 0 && !reads_files( argv[1] )
+    && result_cache_key( argv[2], argv[3], argv[1], argc - 4, argv + 4, key ) == IMG_SUCCESS;
+
+  int rc;
+  if ( have_key && result_cache_fetch( &result_cache, key, argv[3] ) == IMG_SUCCESS ) {
+    rc = 0;
+  } else {
+    if ( strchr( argv[1], ',' ) != NULL )
+      rc = run_graph( &opts, argc, argv );
+    else if ( opts.tile_cache_bytes != 0 )
+      rc = run_tiled( &opts, argc, argv );
+    else
+      rc = run_in_memory( &opts, argc, argv );
+
+    if ( rc == 0 && have_key && result_cache_store( &result_cache, key, argv[3] ) != IMG_SUCCESS )
+      fprintf( stderr, "Warning: couldn't add result to cache '%s'\n", opts.result_cache_dir );
+  }
+
+  if ( rc == 0 )
+    write_stats( &opts, argv[1], start );
+
+  if ( rc == 0 )
+    save_masks( &opts );
+
+  if ( rc == 0 && opts.perf ) {
+    char label[256];
+    snprintf( label, sizeof( label ), "%s %s", argv[0], argv[1] );
+    perf_report( stderr, &s_perf, label );
+  }
+  perf_close( &s_perf );
 
-int apply_emboss( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
-  (void) argc;
-  (void) argv;
-  imgproc_emboss( input_img,  output_img );
-  return 1;
+  return rc;
 }
@@ -0,0 +1,123 @@
+// Compositing an overlay image over a base image
+
+#include <string.h>
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+#include "composite.h"
+#include "bands.h"
+
+// Rounded t / 255, for t up to 255 * 255
+static inline uint32_t div255(uint32_t t) {
+  t += 128;
+  return (t + (t >> 8)) >> 8;
+}
+
+// Composite one pixel. Each color channel is the average of the
+// overlay's and the base's, weighted by a * 255 and by
+// base_alpha * (255 - a), rounded to nearest; a pixel that ends up
+// fully transparent is 0.
+static inline uint32_t over_pixel(uint32_t base, uint32_t over) {
+  uint32_t a = over & 0xFF, ba = base & 0xFF;
+  uint32_t wo = a * 255, wb = ba * (255 - a), total = wo + wb;
+  if (total == 0) {
+    return 0;
+  }
+  uint32_t pixel = a + div255(wb);
+  for (int c = 1; c < 4; c++) {
+    uint32_t o = (over >> (8 * c)) & 0xFF, b = (base >> (8 * c)) & 0xFF;
+    pixel |= ((o * wo + b * wb) + total / 2) / total << (8 * c);
+  }
+  return pixel;
+}
+
+#if defined(__x86_64__)
+// Blend 2 pixels over an opaque base, unpacked to 16-bit channels
+// (alpha in lanes 0 and 4)
+static inline __m128i blend2(__m128i over, __m128i base, __m128i alpha_lanes, __m128i c255, __m128i c128) {
+  // each pixel's alpha in all four of its lanes
+  __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(over, 0), 0);
+  // with 255 as the overlay's alpha, the alpha lanes come out as
+  // a + base_alpha * (255 - a) / 255
+  over = _mm_or_si128(over, alpha_lanes);
+  // at most 255 * 255, so the low 16 bits of the products are exact
+  __m128i t = _mm_add_epi16(_mm_mullo_epi16(over, a), _mm_mullo_epi16(base, _mm_sub_epi16(c255, a)));
+  t = _mm_add_epi16(t, c128);
+  return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+#endif
+
+// Composite the overlay's row over the first width pixels of the base row.
+static void blend_row(const uint32_t *base, const uint32_t *over, uint32_t *out, int32_t width) {
+  int32_t x = 0;
+
+#if defined(__x86_64__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i alpha_lanes = _mm_set_epi16(0, 0, 0, 255, 0, 0, 0, 255);
+  const __m128i alpha_bytes = _mm_set1_epi32(0xFF);
+  const __m128i c255 = _mm_set1_epi16(255);
+  const __m128i c128 = _mm_set1_epi16(128);
+  while (x + 8 <= width) {
+    __m128i o0 = _mm_loadu_si128((const __m128i *) (over + x));
+    __m128i o1 = _mm_loadu_si128((const __m128i *) (over + x + 4));
+    __m128i b0 = _mm_loadu_si128((const __m128i *) (base + x));
+    __m128i b1 = _mm_loadu_si128((const __m128i *) (base + x + 4));
+    // the weights reduce to a and 255 - a where the base is opaque (as
+    // it usually is); other groups of pixels are done one at a time
+    __m128i opaque = _mm_and_si128(_mm_cmpeq_epi32(_mm_and_si128(b0, alpha_bytes), alpha_bytes),
+                                   _mm_cmpeq_epi32(_mm_and_si128(b1, alpha_bytes), alpha_bytes));
+    if (_mm_movemask_epi8(opaque) != 0xFFFF) {
+      for (int32_t end = x + 8; x < end; x++) {
+        out[x] = over_pixel(base[x], over[x]);
+      }
+      continue;
+    }
+    __m128i r0 = _mm_packus_epi16(
+      blend2(_mm_unpacklo_epi8(o0, zero), _mm_unpacklo_epi8(b0, zero), alpha_lanes, c255, c128),
+      blend2(_mm_unpackhi_epi8(o0, zero), _mm_unpackhi_epi8(b0, zero), alpha_lanes, c255, c128));
+    __m128i r1 = _mm_packus_epi16(
+      blend2(_mm_unpacklo_epi8(o1, zero), _mm_unpacklo_epi8(b1, zero), alpha_lanes, c255, c128),
+      blend2(_mm_unpackhi_epi8(o1, zero), _mm_unpackhi_epi8(b1, zero), alpha_lanes, c255, c128));
+    _mm_storeu_si128((__m128i *) (out + x), r0);
+    _mm_storeu_si128((__m128i *) (out + x + 4), r1);
+    x += 8;
+  }
+#endif
+
+  for (; x < width; x++) {
+    out[x] = over_pixel(base[x], over[x]);
+  }
+}
+
+struct CompositeJob {
+  const struct Image *base_img;
+  const struct Image *overlay_img;
+  struct Image *output_img;
+};
+
+// Composite rows first to end - 1.
+static int composite_band(void *ctx, int32_t first, int32_t end) {
+  struct CompositeJob *job = (struct CompositeJob *) ctx;
+  int32_t width = job->base_img->width;
+  int32_t over_width = job->overlay_img->width < width ? job->overlay_img->width : width;
+
+  for (int32_t y = first; y < end; y++) {
+    const uint32_t *base = job->base_img->data + (size_t) y * width;
+    uint32_t *out = job->output_img->data + (size_t) y * width;
+    int32_t blended = y < job->overlay_img->height ? over_width : 0;
+
+    if (blended > 0) {
+      blend_row(base, job->overlay_img->data + (size_t) y * job->overlay_img->width, out, blended);
+    }
+    if (out != base) {
+      memcpy(out + blended, base + blended, (size_t) (width - blended) * sizeof(uint32_t));
+    }
+  }
+  return IMG_SUCCESS;
+}
+
+void composite_over(const struct Image *base_img, const struct Image *overlay_img, struct Image *output_img,
+                    int num_threads) {
+  struct CompositeJob job = { base_img, overlay_img, output_img };
+  run_bands(base_img->height, num_threads, composite_band, &job);
+}
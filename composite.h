@@ -0,0 +1,37 @@
+#ifndef COMPOSITE_H
+#define COMPOSITE_H
+
+#include <stdint.h>
+#include "image.h"
+
+// Composite an overlay image over a base image (Porter-Duff "over",
+// with straight alpha), with the overlay's top left corner at the base's
+// top left corner. Where they overlap, with a the overlay's alpha and
+// ba the base's,
+//
+//   alpha: a + ba * (255 - a) / 255
+//   color: (overlay * a * 255 + base * ba * (255 - a))
+//          / (a * 255 + ba * (255 - a))
+//
+// rounded to nearest (a pixel that ends up fully transparent is 0).
+// Over an opaque base, the color reduces to
+// (overlay * a + base * (255 - a)) / 255. The rest of the base is
+// copied unchanged.
+//
+// Where 8 base pixels in a row are opaque (as they are when
+// watermarking photos), they're blended at once with SSE2, on 16-bit
+// channels, dividing by 255 with a multiply and shifts; other pixels
+// are blended one at a time. The rows are split into bands computed by
+// separate threads.
+//
+// Parameters:
+//   base_img - pointer to the base Image
+//   overlay_img - pointer to the overlay Image (any size; the part
+//                 outside the base is ignored)
+//   output_img - pointer to the output Image, the same size as the base
+//                (it may be the base itself)
+//   num_threads - maximum number of threads, or 0 for one per CPU
+void composite_over(const struct Image *base_img, const struct Image *overlay_img, struct Image *output_img,
+                    int num_threads);
+
+#endif // COMPOSITE_H
@@ -0,0 +1,264 @@
+// Cache of precomputed ellipse masks, keyed by image dimensions
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "imgproc.h"
+#include "ellipse_mask.h"
+
+#define MASK_FILE_MAGIC "EMASK001"
+
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct EllipseMask *s_masks;
+static int s_num_masks;
+static uint64_t s_clock;
+
+// Compute the span of each row. Which pixels are in the ellipse
+// depends only on the distance from the center column, so each row's
+// span is symmetric about the center column (but clipped to the image
+// on the right, which has one column fewer when the width is even),
+// and its half-width can be found by binary search.
+static void compute_spans(struct EllipseMask *mask) {
+  struct Image dims = { mask->width, mask->height, NULL };
+  int32_t center_col = mask->width / 2;
+
+  for (int32_t row = 0; row < mask->height; row++) {
+    int32_t start = 0, end = 0;
+
+    if (is_in_ellipse(&dims, row, center_col)) {
+      // largest d such that column center_col - d is in the ellipse
+      int32_t lo = 0, hi = center_col;
+      while (lo < hi) {
+        int32_t mid = lo + (hi - lo + 1) / 2;
+        if (is_in_ellipse(&dims, row, center_col - mid)) {
+          lo = mid;
+        } else {
+          hi = mid - 1;
+        }
+      }
+      start = center_col - lo;
+      end = center_col + lo + 1;
+      if (end > mask->width) {
+        end = mask->width;
+      }
+    }
+
+    mask->spans[2*row] = start;
+    mask->spans[2*row + 1] = end;
+  }
+}
+
+static struct EllipseMask *alloc_mask(int32_t width, int32_t height) {
+  struct EllipseMask *mask = (struct EllipseMask *) malloc(sizeof(struct EllipseMask));
+  if (mask == NULL) {
+    return NULL;
+  }
+  mask->spans = (int32_t *) malloc((size_t) height * 2 * sizeof(int32_t));
+  if (mask->spans == NULL) {
+    free(mask);
+    return NULL;
+  }
+  mask->width = width;
+  mask->height = height;
+  mask->refcount = 0;
+  mask->last_used = 0;
+  mask->next = NULL;
+  return mask;
+}
+
+static void free_mask(struct EllipseMask *mask) {
+  free(mask->spans);
+  free(mask);
+}
+
+// Find a cached mask. Must be called with s_lock held.
+static struct EllipseMask *find_mask(int32_t width, int32_t height) {
+  for (struct EllipseMask *m = s_masks; m != NULL; m = m->next) {
+    if (m->width == width && m->height == height) {
+      return m;
+    }
+  }
+  return NULL;
+}
+
+// Add a mask to the cache, evicting the least recently used mask
+// that isn't in use if the cache is full. Must be called with
+// s_lock held.
+static void insert_mask(struct EllipseMask *mask) {
+  if (s_num_masks >= ELLIPSE_MASK_CACHE_SIZE) {
+    struct EllipseMask **victim = NULL;
+    for (struct EllipseMask **p = &s_masks; *p != NULL; p = &(*p)->next) {
+      if ((*p)->refcount == 0 && (victim == NULL || (*p)->last_used < (*victim)->last_used)) {
+        victim = p;
+      }
+    }
+    if (victim != NULL) {
+      struct EllipseMask *m = *victim;
+      *victim = m->next;
+      free_mask(m);
+      s_num_masks--;
+    }
+  }
+
+  mask->last_used = ++s_clock;
+  mask->next = s_masks;
+  s_masks = mask;
+  s_num_masks++;
+}
+
+const struct EllipseMask *ellipse_mask_get(int32_t width, int32_t height) {
+  pthread_mutex_lock(&s_lock);
+  struct EllipseMask *mask = find_mask(width, height);
+  if (mask != NULL) {
+    mask->refcount++;
+    mask->last_used = ++s_clock;
+    pthread_mutex_unlock(&s_lock);
+    return mask;
+  }
+  pthread_mutex_unlock(&s_lock);
+
+  // compute the mask without holding the lock; if another thread
+  // computes the same one in the meantime, use theirs
+  struct EllipseMask *computed = alloc_mask(width, height);
+  if (computed == NULL) {
+    return NULL;
+  }
+  compute_spans(computed);
+
+  pthread_mutex_lock(&s_lock);
+  mask = find_mask(width, height);
+  if (mask == NULL) {
+    mask = computed;
+    insert_mask(mask);
+  } else {
+    free_mask(computed);
+    mask->last_used = ++s_clock;
+  }
+  mask->refcount++;
+  pthread_mutex_unlock(&s_lock);
+  return mask;
+}
+
+void ellipse_mask_release(const struct EllipseMask *mask) {
+  pthread_mutex_lock(&s_lock);
+  ((struct EllipseMask *) mask)->refcount--;
+  pthread_mutex_unlock(&s_lock);
+}
+
+void ellipse_mask_clear(void) {
+  pthread_mutex_lock(&s_lock);
+  struct EllipseMask **p = &s_masks;
+  while (*p != NULL) {
+    struct EllipseMask *m = *p;
+    if (m->refcount == 0) {
+      *p = m->next;
+      free_mask(m);
+      s_num_masks--;
+    } else {
+      p = &m->next;
+    }
+  }
+  pthread_mutex_unlock(&s_lock);
+}
+
+// The mask file holds the magic string, followed by the width and
+// height and then the spans of each mask, as native-endian int32_t values.
+int ellipse_mask_load(const char *filename) {
+  FILE *in = fopen(filename, "rb");
+  if (in == NULL) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  char magic[8];
+  if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) || memcmp(magic, MASK_FILE_MAGIC, sizeof(magic)) != 0) {
+    fclose(in);
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  int rc = IMG_SUCCESS;
+  int32_t dims[2];
+  while (fread(dims, sizeof(int32_t), 2, in) == 2) {
+    if (dims[0] <= 0 || dims[1] <= 0) {
+      rc = IMG_ERR_COULD_NOT_OPEN;
+      break;
+    }
+
+    struct EllipseMask *mask = alloc_mask(dims[0], dims[1]);
+    if (mask == NULL) {
+      rc = IMG_ERR_MALLOC_FAILED;
+      break;
+    }
+
+    int valid = fread(mask->spans, sizeof(int32_t), (size_t) mask->height * 2, in) == (size_t) mask->height * 2;
+    for (int32_t row = 0; valid && row < mask->height; row++) {
+      int32_t start = mask->spans[2*row], end = mask->spans[2*row + 1];
+      valid = start >= 0 && start <= end && end <= mask->width;
+    }
+    if (!valid) {
+      free_mask(mask);
+      rc = IMG_ERR_COULD_NOT_OPEN;
+      break;
+    }
+
+    pthread_mutex_lock(&s_lock);
+    if (find_mask(mask->width, mask->height) == NULL) {
+      insert_mask(mask);
+    } else {
+      free_mask(mask);
+    }
+    pthread_mutex_unlock(&s_lock);
+  }
+
+  fclose(in);
+  return rc;
+}
+
+int ellipse_mask_save(const char *filename) {
+  // write to a temporary file and rename it, so that a concurrent
+  // reader never sees a partially written file
+  char tmp_filename[4096];
+  snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp%ld", filename, (long) getpid());
+
+  FILE *out = fopen(tmp_filename, "wb");
+  if (out == NULL) {
+    return IMG_ERR_COULD_NOT_WRITE;
+  }
+
+  int ok = fwrite(MASK_FILE_MAGIC, 1, 8, out) == 8;
+
+  pthread_mutex_lock(&s_lock);
+  for (struct EllipseMask *m = s_masks; ok && m != NULL; m = m->next) {
+    int32_t dims[2] = { m->width, m->height };
+    ok = fwrite(dims, sizeof(int32_t), 2, out) == 2
+      && fwrite(m->spans, sizeof(int32_t), (size_t) m->height * 2, out) == (size_t) m->height * 2;
+  }
+  pthread_mutex_unlock(&s_lock);
+
+  if (fclose(out) != 0) {
+    ok = 0;
+  }
+  if (!ok || rename(tmp_filename, filename) != 0) {
+    remove(tmp_filename);
+    return IMG_ERR_COULD_NOT_WRITE;
+  }
+  return IMG_SUCCESS;
+}
+
+void ellipse_masked(struct Image *input_img, struct Image *output_img) {
+  const struct EllipseMask *mask = ellipse_mask_get(input_img->width, input_img->height);
+  if (mask == NULL) {
+    // fall back to testing each pixel
+    imgproc_ellipse(input_img, output_img);
+    return;
+  }
+
+  for (int32_t row = 0; row < input_img->height; row++) {
+    int32_t start = mask->spans[2*row], end = mask->spans[2*row + 1];
+    size_t offset = (size_t) row * input_img->width + start;
+    memcpy(output_img->data + offset, input_img->data + offset, (size_t) (end - start) * sizeof(uint32_t));
+  }
+
+  ellipse_mask_release(mask);
+}
@@ -0,0 +1,81 @@
+#ifndef ELLIPSE_MASK_H
+#define ELLIPSE_MASK_H
+
+#include <stdint.h>
+#include "image.h"
+
+// The pixels of an image inside the ellipse transformation's ellipse,
+// as a span of columns for each row. The shape only depends on the
+// image dimensions, so masks are computed once (using is_in_ellipse)
+// and then shared, through a process-wide cache, by every image of
+// the same size.
+struct EllipseMask {
+  int32_t width;
+  int32_t height;
+
+  // the pixels in the ellipse in row r are columns
+  // spans[2*r] to spans[2*r + 1] - 1 (the span is empty if
+  // they're equal)
+  int32_t *spans;
+
+  // cache bookkeeping
+  int refcount;
+  uint64_t last_used;
+  struct EllipseMask *next;
+};
+
+// maximum number of masks kept in the cache
+#define ELLIPSE_MASK_CACHE_SIZE 32
+
+// Get the mask for the given image dimensions, computing it if it
+// isn't cached already. The mask must be released with
+// ellipse_mask_release when it's no longer needed. Thread-safe.
+//
+// Parameters:
+//   width - image width
+//   height - image height
+//
+// Returns:
+//   pointer to the mask, or NULL if memory couldn't be allocated
+const struct EllipseMask *ellipse_mask_get(int32_t width, int32_t height);
+
+// Release a mask obtained from ellipse_mask_get.
+//
+// Parameters:
+//   mask - pointer to the mask
+void ellipse_mask_release(const struct EllipseMask *mask);
+
+// Remove all masks which aren't currently in use from the cache.
+void ellipse_mask_clear(void);
+
+// Load masks saved by ellipse_mask_save into the cache.
+//
+// Parameters:
+//   filename - name of the file to read
+//
+// Returns:
+//   IMG_SUCCESS if successful, IMG_ERR_COULD_NOT_OPEN if the file
+//   doesn't exist or isn't a valid mask file, or IMG_ERR_MALLOC_FAILED
+int ellipse_mask_load(const char *filename);
+
+// Save all cached masks to a file, so that they can be loaded by
+// a later run. The file is replaced atomically.
+//
+// Parameters:
+//   filename - name of the file to write
+//
+// Returns:
+//   IMG_SUCCESS if successful, IMG_ERR_COULD_NOT_WRITE if not
+int ellipse_mask_save(const char *filename);
+
+// Apply the ellipse transformation using the cached mask for the
+// image's dimensions. This produces the same result as
+// imgproc_ellipse: pixels inside the ellipse are copied, the others
+// are left unchanged.
+//
+// Parameters:
+//   input_img - pointer to the input Image
+//   output_img - pointer to the output Image (same dimensions)
+void ellipse_masked(struct Image *input_img, struct Image *output_img);
+
+#endif // ELLIPSE_MASK_H
@@ -1,7 +1,37 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "pnglite.h"
 #include "image.h"
+#include "tilestore.h"
+#include "stats.h"
+
+// file formats, chosen by the filename extension
+enum FileFormat { FORMAT_PNG, FORMAT_RAW, FORMAT_PAM };
+
+// Header of a raw image file. The pixels follow immediately, laid
+// out exactly like the data array of a struct Image.
+struct RawHeader {
+  char magic[4];
+  // RAW_FORMAT_RGBA, stored in native byte order (as are the pixels),
+  // so a file written on a host with the other byte order is rejected
+  uint32_t format;
+  int32_t width;
+  int32_t height;
+};
+
+#define RAW_MAGIC "IMGR"
+#define RAW_FORMAT_RGBA 0x52474241U
 
 int png_init_called;
 
@@ -17,7 +47,8 @@ uint32_t byteswap(uint32_t val) {
 }
 
 int img_init(struct Image *img, int32_t width, int32_t height) {
-  int num_pixels = width * height;
+  // compute sizes in size_t so that gigapixel images don't overflow
+  size_t num_pixels = (size_t) width * (size_t) height;
 
   uint32_t *pixel_data = (uint32_t *) malloc(num_pixels * sizeof(uint32_t));
   if (pixel_data == NULL) {
@@ -25,7 +56,7 @@ int img_init(struct Image *img, int32_t width, int32_t height) {
   }
 
   // initialize every pixel to opaque black
-  for (int32_t i = 0; i < num_pixels; i++) {
+  for (size_t i = 0; i < num_pixels; i++) {
     pixel_data[i] = 0x000000FFU;
   }
 
@@ -36,47 +67,568 @@ int img_init(struct Image *img, int32_t width, int32_t height) {
   return IMG_SUCCESS;
 }
 
-int img_read(const char *filename, struct Image *img) {
+// Size of the buffer used when reading a PNG from standard input or
+// writing one to standard output, so that a pipe is drained or filled
+// with a few large read/write calls rather than many small ones
+#define STDIO_BUF_SIZE (1 << 20)
+
+// Buffered standard input or output, for the pnglite callbacks
+struct StdioStream {
+  int fd;
+  unsigned char *buf;
+  size_t len;   // number of bytes in buf
+  size_t pos;   // read position in buf (reading only)
+  int failed;
+};
+
+static unsigned stdio_read(void *output, size_t size, size_t numel, void *user_pointer) {
+  struct StdioStream *stream = (struct StdioStream *) user_pointer;
+  unsigned char *out = (unsigned char *) output;
+  size_t want = size * numel, got = 0;
+
+  while (got < want) {
+    if (stream->pos == stream->len) {
+      ssize_t n = read(stream->fd, stream->buf, STDIO_BUF_SIZE);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        break;
+      }
+      stream->len = (size_t) n;
+      stream->pos = 0;
+    }
+
+    size_t n = stream->len - stream->pos;
+    if (n > want - got) {
+      n = want - got;
+    }
+    // a NULL output means skip the data
+    if (out != NULL) {
+      memcpy(out + got, stream->buf + stream->pos, n);
+    }
+    stream->pos += n;
+    got += n;
+  }
+
+  return (unsigned) (got / size);
+}
+
+static int stdio_flush(struct StdioStream *stream) {
+  size_t done = 0;
+  while (done < stream->len && !stream->failed) {
+    ssize_t n = write(stream->fd, stream->buf + done, stream->len - done);
+    if (n < 0 && errno != EINTR) {
+      stream->failed = 1;
+    } else if (n > 0) {
+      done += (size_t) n;
+    }
+  }
+  stream->len = 0;
+  return !stream->failed;
+}
+
+static unsigned stdio_write(void *input, size_t size, size_t numel, void *user_pointer) {
+  struct StdioStream *stream = (struct StdioStream *) user_pointer;
+  const unsigned char *in = (const unsigned char *) input;
+  size_t n = size * numel, done = 0;
+
+  while (done < n) {
+    if (stream->len == STDIO_BUF_SIZE && !stdio_flush(stream)) {
+      return 0;
+    }
+    size_t chunk = STDIO_BUF_SIZE - stream->len;
+    if (chunk > n - done) {
+      chunk = n - done;
+    }
+    memcpy(stream->buf + stream->len, in + done, chunk);
+    stream->len += chunk;
+    done += chunk;
+  }
+  return (unsigned) numel;
+}
+
+// Open a PNG for reading from a file, or from standard input if
+// the filename is "-" (in which case stream is used for buffering).
+static int open_png_read(png_t *png, const char *filename, struct StdioStream *stream) {
   if (!png_init_called) {
     png_init(0, 0);
     png_init_called = 1;
   }
 
-  png_t png;
+  stream->buf = NULL;
+  if (strcmp(filename, IMG_STDIO) != 0) {
+    // (png_open_file_read would leave the file open if the header is invalid)
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL) {
+      return IMG_ERR_COULD_NOT_OPEN;
+    }
+    if (png_open_read(png, 0, fp) != PNG_NO_ERROR) {
+      fclose(fp);
+      return IMG_ERR_COULD_NOT_OPEN;
+    }
+    return IMG_SUCCESS;
+  }
+
+  stream->fd = STDIN_FILENO;
+  stream->len = stream->pos = 0;
+  stream->failed = 0;
+  stream->buf = (unsigned char *) malloc(STDIO_BUF_SIZE);
+  if (stream->buf == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+  if (png_open_read(png, stdio_read, stream) != PNG_NO_ERROR) {
+    free(stream->buf);
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+  return IMG_SUCCESS;
+}
+
+// Open a PNG for writing to a file, or to standard output if
+// the filename is "-".
+static int open_png_write(png_t *png, const char *filename, struct StdioStream *stream) {
+  if (!png_init_called) {
+    png_init(0, 0);
+    png_init_called = 1;
+  }
+
+  stream->buf = NULL;
+  if (strcmp(filename, IMG_STDIO) != 0) {
+    return png_open_file_write(png, filename) == PNG_NO_ERROR ? IMG_SUCCESS : IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  stream->fd = STDOUT_FILENO;
+  stream->len = stream->pos = 0;
+  stream->failed = 0;
+  stream->buf = (unsigned char *) malloc(STDIO_BUF_SIZE);
+  if (stream->buf == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+  png_open_write(png, stdio_write, stream);
+  return IMG_SUCCESS;
+}
+
+// Close a PNG opened by open_png_read or open_png_write, writing out
+// any buffered output.
+//
+// Returns:
+//   IMG_SUCCESS, or IMG_ERR_COULD_NOT_WRITE if buffered output
+//   couldn't be written
+static int close_png(png_t *png, struct StdioStream *stream) {
+  if (stream->buf == NULL) {
+    png_close_file(png);
+    return IMG_SUCCESS;
+  }
+
+  int ok = 1;
+  if (png->write_fun != NULL) {
+    ok = stdio_flush(stream);
+  }
+  free(stream->buf);
+  return ok ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+}
+
+// Convert one row of 8-bit grey (bpp 1), grey+alpha (bpp 2), RGB
+// (bpp 3) or RGBA (bpp 4) bytes, as stored in PNG and PAM files, to
+// pixels
+static void unpack_row(const unsigned char *row_data, uint32_t *pixels, int32_t width, int bpp) {
+  uint64_t start = stats_start();
+  for (int32_t i = 0; i < width; i++) {
+    const unsigned char *p = row_data + (size_t) i * bpp;
+    if (bpp <= 2) {
+      unsigned char a = (bpp == 2) ? p[1] : 255;
+      pixels[i] = (p[0] << 24) | (p[0] << 16) | (p[0] << 8) | a;
+    } else {
+      unsigned char a = (bpp == 4) ? p[3] : 255;
+      pixels[i] = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | a;
+    }
+  }
+  stats_stop(STATS_BYTESWAP, start, (size_t) width * bpp);
+}
+
+// Whether a PNG opened for reading has a color type and depth that
+// can be converted to 8-bit RGBA pixels
+static int png_is_8bit(const png_t *png) {
+  return png->depth == 8 && (png->color_type == PNG_GREYSCALE || png->color_type == PNG_GREYSCALE_ALPHA
+                             || png->color_type == PNG_TRUECOLOR || png->color_type == PNG_TRUECOLOR_ALPHA);
+}
+
+// What a scan of the pixels found: the bits where red, green and blue
+// differ, and the alpha values ANDed together. The narrowest PNG color
+// type that stores the pixels exactly follows from these.
+struct PixelScan {
+  uint32_t color_diff;
+  uint32_t alpha;
+};
+
+#define PIXEL_SCAN_INIT { 0, 0xFF }
+
+// Fold n pixels into a scan. Stops early once the pixels are known to
+// need truecolor with alpha.
+static void scan_pixels(struct PixelScan *scan, const uint32_t *pixels, size_t n) {
+  size_t i = 0;
+
+  // in blocks, so that the check for stopping stays out of the inner loop
+  while (i < n && (scan->color_diff == 0 || scan->alpha == 0xFF)) {
+    size_t end = n - i > 1024 ? i + 1024 : n;
+#ifdef __SSE2__
+    __m128i diff = _mm_setzero_si128(), alpha = _mm_set1_epi32(0xFF);
+    for (; i + 4 <= end; i += 4) {
+      __m128i p = _mm_loadu_si128((const __m128i *) (pixels + i));
+      diff = _mm_or_si128(diff, _mm_xor_si128(_mm_srli_epi32(p, 8), _mm_srli_epi32(p, 16)));
+      alpha = _mm_and_si128(alpha, p);
+    }
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i *) lanes, diff);
+    scan->color_diff |= (lanes[0] | lanes[1] | lanes[2] | lanes[3]) & 0xFFFF;
+    _mm_storeu_si128((__m128i *) lanes, alpha);
+    scan->alpha &= lanes[0] & lanes[1] & lanes[2] & lanes[3];
+#endif
+    for (; i < end; i++) {
+      // (p >> 8) ^ (p >> 16) has g^b in its low byte and r^g above it
+      scan->color_diff |= ((pixels[i] >> 8) ^ (pixels[i] >> 16)) & 0xFFFF;
+      scan->alpha &= pixels[i];
+    }
+  }
+}
+
+// The PNG color type for scanned pixels
+static int scan_color_type(const struct PixelScan *scan) {
+  if (scan->color_diff == 0) {
+    return scan->alpha == 0xFF ? PNG_GREYSCALE : PNG_GREYSCALE_ALPHA;
+  }
+  return scan->alpha == 0xFF ? PNG_TRUECOLOR : PNG_TRUECOLOR_ALPHA;
+}
+
+// Bytes per pixel of an 8-bit PNG color type
+static int color_type_bpp(int color_type) {
+  switch (color_type) {
+  case PNG_GREYSCALE:       return 1;
+  case PNG_GREYSCALE_ALPHA: return 2;
+  case PNG_TRUECOLOR:       return 3;
+  default:                  return 4;
+  }
+}
+
+// Convert one row of pixels to bytes in PNG order with bpp bytes per
+// pixel (the reverse of unpack_row)
+static void pack_row(const uint32_t *pixels, unsigned char *row_data, int32_t width, int bpp) {
+  uint64_t start = stats_start();
+  int32_t i = 0;
+
+  switch (bpp) {
+  case 1:
+#ifdef __SSE2__
+    // the red byte of 16 pixels per iteration
+    for (; i + 16 <= width; i += 16) {
+      __m128i p0 = _mm_srli_epi32(_mm_loadu_si128((const __m128i *) (pixels + i)), 24);
+      __m128i p1 = _mm_srli_epi32(_mm_loadu_si128((const __m128i *) (pixels + i + 4)), 24);
+      __m128i p2 = _mm_srli_epi32(_mm_loadu_si128((const __m128i *) (pixels + i + 8)), 24);
+      __m128i p3 = _mm_srli_epi32(_mm_loadu_si128((const __m128i *) (pixels + i + 12)), 24);
+      __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(p0, p1), _mm_packs_epi32(p2, p3));
+      _mm_storeu_si128((__m128i *) (row_data + i), bytes);
+    }
+#endif
+    for (; i < width; i++) {
+      row_data[i] = pixels[i] >> 24;
+    }
+    break;
+  case 2:
+    for (; i < width; i++) {
+      row_data[i*2 + 0] = pixels[i] >> 24;
+      row_data[i*2 + 1] = pixels[i];
+    }
+    break;
+  case 3:
+    for (; i < width; i++) {
+      row_data[i*3 + 0] = pixels[i] >> 24;
+      row_data[i*3 + 1] = pixels[i] >> 16;
+      row_data[i*3 + 2] = pixels[i] >> 8;
+    }
+    break;
+  default:
+    for (; i < width; i++) {
+      row_data[i*4 + 0] = pixels[i] >> 24;
+      row_data[i*4 + 1] = pixels[i] >> 16;
+      row_data[i*4 + 2] = pixels[i] >> 8;
+      row_data[i*4 + 3] = pixels[i];
+    }
+    break;
+  }
+  stats_stop(STATS_BYTESWAP, start, (size_t) width * bpp);
+}
+
+static int file_format(const char *filename) {
+  const char *ext = strrchr(filename, '.');
+  if (ext != NULL && strchr(ext, '/') == NULL) {
+    if (strcasecmp(ext, ".raw") == 0) {
+      return FORMAT_RAW;
+    }
+    if (strcasecmp(ext, ".pam") == 0) {
+      return FORMAT_PAM;
+    }
+  }
+  return FORMAT_PNG;
+}
+
+const char *img_file_ext(const char *filename) {
+  static const char *const exts[] = { ".png", ".raw", ".pam" };
+  return exts[file_format(filename)];
+}
+
+// A raw or PAM image file being read or written a band of rows at a time
+struct PixelFile {
+  FILE *fp;
+  int format;
+  int32_t width;
+  int32_t height;
+  int depth;                // bytes per pixel in a PAM file (3 or 4)
+  unsigned char *row_data;  // one row of a PAM file
+};
+
+// Parse a PAM header, accepting 8-bit RGB and RGB_ALPHA images.
+static int pam_read_header(struct PixelFile *pf) {
+  char line[256];
+  long width = 0, height = 0, depth = 0, maxval = 0;
+
+  if (fgets(line, sizeof(line), pf->fp) == NULL || strcmp(line, "P7\n") != 0) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+  for (;;) {
+    if (fgets(line, sizeof(line), pf->fp) == NULL) {
+      return IMG_ERR_COULD_NOT_OPEN;
+    }
+    if (strcmp(line, "ENDHDR\n") == 0) {
+      break;
+    }
+    // TUPLTYPE is implied by DEPTH, and comments are ignored
+    sscanf(line, "WIDTH %ld", &width);
+    sscanf(line, "HEIGHT %ld", &height);
+    sscanf(line, "DEPTH %ld", &depth);
+    sscanf(line, "MAXVAL %ld", &maxval);
+  }
+
+  if (width <= 0 || height <= 0 || width > INT32_MAX || height > INT32_MAX) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+  if ((depth != 3 && depth != 4) || maxval != 255) {
+    return IMG_ERR_NOT_TRUECOLOR;
+  }
+  pf->width = (int32_t) width;
+  pf->height = (int32_t) height;
+  pf->depth = (int) depth;
+  return IMG_SUCCESS;
+}
+
+// Open a raw or PAM file and read its header.
+static int pixfile_open_read(struct PixelFile *pf, const char *filename, int format) {
+  pf->format = format;
+  pf->row_data = NULL;
+  pf->fp = fopen(filename, "rb");
+  if (pf->fp == NULL) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  int rc;
+  if (format == FORMAT_RAW) {
+    struct RawHeader header;
+    rc = IMG_SUCCESS;
+    if (fread(&header, sizeof(header), 1, pf->fp) != 1 || memcmp(header.magic, RAW_MAGIC, 4) != 0
+        || header.width <= 0 || header.height <= 0) {
+      rc = IMG_ERR_COULD_NOT_OPEN;
+    } else if (header.format != RAW_FORMAT_RGBA) {
+      rc = IMG_ERR_NOT_TRUECOLOR;
+    }
+    pf->width = header.width;
+    pf->height = header.height;
+  } else {
+    rc = pam_read_header(pf);
+    if (rc == IMG_SUCCESS) {
+      pf->row_data = (unsigned char *) malloc((size_t) pf->width * pf->depth);
+      if (pf->row_data == NULL) {
+        rc = IMG_ERR_MALLOC_FAILED;
+      }
+    }
+  }
+
+  if (rc != IMG_SUCCESS) {
+    fclose(pf->fp);
+    free(pf->row_data);
+  }
+  return rc;
+}
 
-  if (png_open_file_read(&png, filename) != PNG_NO_ERROR) {
+// Create a raw or PAM file and write its header.
+static int pixfile_open_write(struct PixelFile *pf, const char *filename, int format, int32_t width, int32_t height) {
+  pf->format = format;
+  pf->width = width;
+  pf->height = height;
+  pf->depth = 4;
+  pf->row_data = NULL;
+  pf->fp = fopen(filename, "wb");
+  if (pf->fp == NULL) {
     return IMG_ERR_COULD_NOT_OPEN;
   }
 
-  // only allow truecolor 8bpp images
-  if (!(png.color_type == PNG_TRUECOLOR && png.bpp == 3) &&
-      !(png.color_type == PNG_TRUECOLOR_ALPHA && png.bpp == 4)) {
-    png_close_file(&png);
+  int ok;
+  if (format == FORMAT_RAW) {
+    struct RawHeader header;
+    memcpy(header.magic, RAW_MAGIC, 4);
+    header.format = RAW_FORMAT_RGBA;
+    header.width = width;
+    header.height = height;
+    ok = fwrite(&header, sizeof(header), 1, pf->fp) == 1;
+  } else {
+    pf->row_data = (unsigned char *) malloc((size_t) width * 4);
+    ok = pf->row_data != NULL
+      && fprintf(pf->fp, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n",
+                 width, height) > 0;
+  }
+
+  if (!ok) {
+    fclose(pf->fp);
+    free(pf->row_data);
+    return IMG_ERR_COULD_NOT_WRITE;
+  }
+  return IMG_SUCCESS;
+}
+
+// Read the next nrows rows of pixels. Raw pixels are read directly
+// into the destination, PAM pixels are converted from RGB(A) bytes.
+static int pixfile_read_rows(struct PixelFile *pf, uint32_t *pixels, int32_t nrows) {
+  if (pf->format == FORMAT_RAW) {
+    size_t n = (size_t) pf->width * nrows;
+    uint64_t start = stats_start();
+    size_t got = fread(pixels, sizeof(uint32_t), n, pf->fp);
+    stats_stop(STATS_READ, start, got * sizeof(uint32_t));
+    return got == n ? IMG_SUCCESS : IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  size_t row_bytes = (size_t) pf->width * pf->depth;
+  for (int32_t r = 0; r < nrows; r++) {
+    uint64_t start = stats_start();
+    size_t got = fread(pf->row_data, 1, row_bytes, pf->fp);
+    stats_stop(STATS_READ, start, got);
+    if (got != row_bytes) {
+      return IMG_ERR_COULD_NOT_OPEN;
+    }
+
+    unpack_row(pf->row_data, pixels + (size_t) r * pf->width, pf->width, pf->depth);
+  }
+  return IMG_SUCCESS;
+}
+
+// Skip the next nrows rows of pixels.
+static int pixfile_skip_rows(struct PixelFile *pf, int32_t nrows) {
+  size_t pixel_bytes = pf->format == FORMAT_RAW ? sizeof(uint32_t) : (size_t) pf->depth;
+  off_t offset = (off_t) pf->width * nrows * pixel_bytes;
+  return fseeko(pf->fp, offset, SEEK_CUR) == 0 ? IMG_SUCCESS : IMG_ERR_COULD_NOT_OPEN;
+}
+
+// Write the next nrows rows of pixels.
+static int pixfile_write_rows(struct PixelFile *pf, const uint32_t *pixels, int32_t nrows) {
+  if (pf->format == FORMAT_RAW) {
+    size_t n = (size_t) pf->width * nrows;
+    uint64_t start = stats_start();
+    size_t done = fwrite(pixels, sizeof(uint32_t), n, pf->fp);
+    stats_stop(STATS_WRITE, start, done * sizeof(uint32_t));
+    return done == n ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+  }
+
+  size_t row_bytes = (size_t) pf->width * 4;
+  for (int32_t r = 0; r < nrows; r++) {
+    pack_row(pixels + (size_t) r * pf->width, pf->row_data, pf->width, 4);
+
+    uint64_t start = stats_start();
+    size_t done = fwrite(pf->row_data, 1, row_bytes, pf->fp);
+    stats_stop(STATS_WRITE, start, done);
+    if (done != row_bytes) {
+      return IMG_ERR_COULD_NOT_WRITE;
+    }
+  }
+  return IMG_SUCCESS;
+}
+
+// Close a raw or PAM file.
+//
+// Returns:
+//   IMG_SUCCESS, or IMG_ERR_COULD_NOT_WRITE if buffered output
+//   couldn't be written
+static int pixfile_close(struct PixelFile *pf) {
+  free(pf->row_data);
+  return fclose(pf->fp) == 0 ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+}
+
+static int read_pixfile(const char *filename, int format, struct Image *img) {
+  struct PixelFile pf;
+  int rc = pixfile_open_read(&pf, filename, format);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+
+  uint32_t *pixel_data = (uint32_t *) malloc((size_t) pf.width * (size_t) pf.height * sizeof(uint32_t));
+  if (pixel_data == NULL) {
+    pixfile_close(&pf);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  rc = pixfile_read_rows(&pf, pixel_data, pf.height);
+  pixfile_close(&pf);
+  if (rc != IMG_SUCCESS) {
+    free(pixel_data);
+    return rc;
+  }
+
+  img->data = pixel_data;
+  img->width = pf.width;
+  img->height = pf.height;
+  return IMG_SUCCESS;
+}
+
+static int write_pixfile(const char *filename, int format, struct Image *img) {
+  struct PixelFile pf;
+  int rc = pixfile_open_write(&pf, filename, format, img->width, img->height);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+
+  rc = pixfile_write_rows(&pf, img->data, img->height);
+  int close_rc = pixfile_close(&pf);
+  return rc != IMG_SUCCESS ? rc : close_rc;
+}
+
+// Decode the image from a PNG opened for reading.
+static int read_png(png_t *png, struct Image *img) {
+  // only allow 8-bit grey and truecolor images, with or without alpha
+  if (!png_is_8bit(png)) {
     return IMG_ERR_NOT_TRUECOLOR;
   }
   
-  int num_pixels = png.width * png.height;
+  size_t num_pixels = (size_t) png->width * (size_t) png->height;
 
   // allocate buffer for pixel data in truecolor RGBA format
   uint32_t *pixel_data = (uint32_t *) malloc(num_pixels * sizeof(uint32_t));
+  if (pixel_data == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
 
-  if (png.color_type == PNG_TRUECOLOR) {
-    // PNG pixel data is in RGB form, expand it to add the alpha channel
+  if (png->color_type != PNG_TRUECOLOR_ALPHA) {
+    // PNG pixel data is grey, grey+alpha or RGB, expand it to RGBA
 
-    unsigned char *pixel_data_raw = (unsigned char *) malloc(num_pixels * 3);
-    if (png_get_data(&png, pixel_data_raw) != PNG_NO_ERROR) {
-      png_close_file(&png);
+    unsigned char *pixel_data_raw = (unsigned char *) malloc(num_pixels * png->bpp);
+    if (pixel_data_raw == NULL) {
+      free(pixel_data);
+      return IMG_ERR_MALLOC_FAILED;
+    }
+    if (png_get_data(png, pixel_data_raw) != PNG_NO_ERROR) {
+      free(pixel_data_raw);
       free(pixel_data);
       return IMG_ERR_MALLOC_FAILED;
     }
 
-    for (int i = 0; i < num_pixels; i++) {
-      unsigned char r = pixel_data_raw[i*3 + 0];
-      unsigned char g = pixel_data_raw[i*3 + 1];
-      unsigned char b = pixel_data_raw[i*3 + 2];
-      unsigned char a = 255;
-
-      pixel_data[i] = (r << 24) | (g << 16) | (b << 8) | a;
+    for (size_t row = 0; row < png->height; row++) {
+      unpack_row(pixel_data_raw + row * png->width * png->bpp, pixel_data + row * png->width,
+                 (int32_t) png->width, png->bpp);
     }
 
     free(pixel_data_raw);
@@ -84,68 +636,727 @@ int img_read(const char *filename, struct Image *img) {
     // PNG pixel data is already in the correct format,
     // except that the RGBA data is in big-endian form, so we
     // need to byteswap if on a little endian system
-    if (png_get_data(&png, (unsigned char *) pixel_data) != PNG_NO_ERROR) {
-      png_close_file(&png);
+    if (png_get_data(png, (unsigned char *) pixel_data) != PNG_NO_ERROR) {
       free(pixel_data);
       return IMG_ERR_MALLOC_FAILED;
     }
 
     if (is_little_endian()) {
-      for (int i = 0; i < num_pixels; i++) {
+      uint64_t start = stats_start();
+      for (size_t i = 0; i < num_pixels; i++) {
         pixel_data[i] = byteswap(pixel_data[i]);
       }
+      stats_stop(STATS_BYTESWAP, start, num_pixels * sizeof(uint32_t));
     }
   }
 
   // communicate pixel data and image dimensions to caller
   img->data = pixel_data;
-  img->width = png.width;
-  img->height = png.height;
-
-  png_close_file(&png);
+  img->width = png->width;
+  img->height = png->height;
 
   return IMG_SUCCESS;
 }
 
+// Encode the image to a PNG opened for writing, using the narrowest
+// color type that stores the pixels exactly: grey if red, green and
+// blue are equal in every pixel, and no alpha channel if every pixel
+// is opaque.
+static int write_png(png_t *png, struct Image *img) {
+  size_t num_pixels = (size_t) img->width * (size_t) img->height;
+  struct PixelScan scan = PIXEL_SCAN_INIT;
+  scan_pixels(&scan, img->data, num_pixels);
+  int color_type = scan_color_type(&scan);
+
+  if (color_type == PNG_TRUECOLOR_ALPHA && !is_little_endian()) {
+    // already in the byte order PNG requires
+    int rc = png_set_data(png, img->width, img->height, 8, color_type, (unsigned char *) img->data);
+    return rc == PNG_NO_ERROR ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+  }
+
+  int bpp = color_type_bpp(color_type);
+  unsigned char *data_to_write = (unsigned char *) malloc(num_pixels * bpp);
+  if (data_to_write == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  if (bpp == 4) {
+    // every uint32_t is byteswapped so that it is in big-endian order
+    uint32_t *swapped = (uint32_t *) data_to_write;
+    uint64_t start = stats_start();
+    for (size_t i = 0; i < num_pixels; i++) {
+      swapped[i] = byteswap(img->data[i]);
+    }
+    stats_stop(STATS_BYTESWAP, start, num_pixels * sizeof(uint32_t));
+  } else {
+    for (size_t row = 0; row < (size_t) img->height; row++) {
+      pack_row(img->data + row * img->width, data_to_write + row * img->width * bpp, img->width, bpp);
+    }
+  }
+
+  int rc = png_set_data(png, img->width, img->height, 8, color_type, data_to_write);
+  free(data_to_write);
+
+  return rc == PNG_NO_ERROR ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+}
+
+int img_read(const char *filename, struct Image *img) {
+  int format = file_format(filename);
+  if (format != FORMAT_PNG) {
+    return read_pixfile(filename, format, img);
+  }
+
+  png_t png;
+  struct StdioStream stream;
+
+  int rc = open_png_read(&png, filename, &stream);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+
+  rc = read_png(&png, img);
+  close_png(&png, &stream);
+  return rc;
+}
+
 int img_write(const char *filename, struct Image *img) {
+  int format = file_format(filename);
+  if (format != FORMAT_PNG) {
+    return write_pixfile(filename, format, img);
+  }
+
+  png_t png;
+  struct StdioStream stream;
+
+  int rc = open_png_write(&png, filename, &stream);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+
+  rc = write_png(&png, img);
+  int close_rc = close_png(&png, &stream);
+  return rc != IMG_SUCCESS ? rc : close_rc;
+}
+
+// Position in a PNG held in memory, for the pnglite read callback
+struct MemReader {
+  const unsigned char *data;
+  size_t len;
+  size_t pos;
+};
+
+static unsigned mem_read(void *output, size_t size, size_t numel, void *user_pointer) {
+  struct MemReader *reader = (struct MemReader *) user_pointer;
+  size_t avail = (reader->len - reader->pos) / size;
+  if (numel > avail) {
+    numel = avail;
+  }
+  // a NULL output means skip the data
+  if (output != NULL) {
+    memcpy(output, reader->data + reader->pos, numel * size);
+  }
+  reader->pos += numel * size;
+  return (unsigned) numel;
+}
+
+// Growable buffer that a PNG is written to, for the pnglite write callback
+struct MemWriter {
+  unsigned char *data;
+  size_t len;
+  size_t capacity;
+  int failed;
+};
+
+static unsigned mem_write(void *input, size_t size, size_t numel, void *user_pointer) {
+  struct MemWriter *writer = (struct MemWriter *) user_pointer;
+  size_t n = size * numel;
+
+  if (writer->len + n > writer->capacity) {
+    size_t capacity = writer->capacity ? writer->capacity : 65536;
+    while (capacity < writer->len + n) {
+      capacity *= 2;
+    }
+    unsigned char *grown = (unsigned char *) realloc(writer->data, capacity);
+    if (grown == NULL) {
+      writer->failed = 1;
+      return 0;
+    }
+    writer->data = grown;
+    writer->capacity = capacity;
+  }
+
+  memcpy(writer->data + writer->len, input, n);
+  writer->len += n;
+  return (unsigned) numel;
+}
+
+int img_probe(const char *filename, int32_t *width, int32_t *height, int *format) {
+  int file_fmt = file_format(filename);
+  if (file_fmt != FORMAT_PNG) {
+    struct PixelFile pf;
+    int rc = pixfile_open_read(&pf, filename, file_fmt);
+    if (rc != IMG_SUCCESS) {
+      return rc;
+    }
+    *width = pf.width;
+    *height = pf.height;
+    *format = (file_fmt == FORMAT_RAW || pf.depth == 4) ? IMG_FORMAT_RGBA : IMG_FORMAT_RGB;
+    pixfile_close(&pf);
+    return IMG_SUCCESS;
+  }
+
+  if (!png_init_called) {
+    png_init(0, 0);
+    png_init_called = 1;
+  }
+
+  FILE *fp = fopen(filename, "rb");
+  if (fp == NULL) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  // png_open_read reads just the signature and the IHDR chunk. Images
+  // pnglite can't decode are still described, since the IHDR fields
+  // have been filled in by then.
+  png_t png;
+  int png_rc = png_open_read(&png, 0, fp);
+  fclose(fp);
+  if (png_rc != PNG_NO_ERROR && png_rc != PNG_NOT_SUPPORTED) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  switch (png.color_type) {
+  case PNG_GREYSCALE:       *format = IMG_FORMAT_GREY; break;
+  case PNG_GREYSCALE_ALPHA: *format = IMG_FORMAT_GREY_ALPHA; break;
+  case PNG_INDEXED:         *format = IMG_FORMAT_PALETTE; break;
+  case PNG_TRUECOLOR:       *format = IMG_FORMAT_RGB; break;
+  case PNG_TRUECOLOR_ALPHA: *format = IMG_FORMAT_RGBA; break;
+  default:                  return IMG_ERR_COULD_NOT_OPEN;
+  }
+  if (png.depth == 16) {
+    *format |= IMG_FORMAT_16BIT;
+  } else if (png.depth != 8) {
+    *format |= IMG_FORMAT_LOW_DEPTH;
+  }
+
+  *width = (int32_t) png.width;
+  *height = (int32_t) png.height;
+  return IMG_SUCCESS;
+}
+
+int img_read_mem(const void *data, size_t len, struct Image *img) {
+  if (!png_init_called) {
+    png_init(0, 0);
+    png_init_called = 1;
+  }
+
+  png_t png;
+  struct MemReader reader = { (const unsigned char *) data, len, 0 };
+
+  if (png_open_read(&png, mem_read, &reader) != PNG_NO_ERROR) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  return read_png(&png, img);
+}
+
+int img_write_mem(struct Image *img, unsigned char **data, size_t *len, size_t *capacity) {
   if (!png_init_called) {
     png_init(0, 0);
     png_init_called = 1;
   }
 
   png_t png;
+  struct MemWriter writer = { *data, 0, *capacity, 0 };
 
-  if (png_open_file_write(&png, filename) != PNG_NO_ERROR) {
+  if (png_open_write(&png, mem_write, &writer) != PNG_NO_ERROR) {
     return IMG_ERR_COULD_NOT_OPEN;
   }
 
-  // if this is a little endian system, we need to byteswap
-  // every uint32_t so that it can be written in big-endian order
-  // (which is what PNG requires)
+  int rc = write_png(&png, img);
+
+  // the buffer may have been reallocated even if writing failed
+  *data = writer.data;
+  *capacity = writer.capacity;
+  *len = writer.len;
+
+  if (rc == IMG_SUCCESS && writer.failed) {
+    rc = IMG_ERR_MALLOC_FAILED;
+  }
+  return rc;
+}
+
+static int read_pixfile_tiled(const char *filename, int format, struct TileStore *store, size_t cache_bytes) {
+  struct PixelFile pf;
+  int rc = pixfile_open_read(&pf, filename, format);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+
+  rc = ts_init(store, pf.width, pf.height, cache_bytes, NULL);
+  if (rc != IMG_SUCCESS) {
+    pixfile_close(&pf);
+    return rc;
+  }
+
+  int32_t band_rows = ts_band_rows(store, 1);
+  for (int32_t row = 0; row < store->height && rc == IMG_SUCCESS; row += band_rows) {
+    int32_t nrows = store->height - row < band_rows ? store->height - row : band_rows;
+    struct TileView view;
+
+    rc = ts_map_rows(store, row, nrows, &view);
+    if (rc == IMG_SUCCESS) {
+      rc = pixfile_read_rows(&pf, view.img.data, nrows);
+      ts_unmap_rows(&view);
+    }
+  }
+
+  pixfile_close(&pf);
+  if (rc != IMG_SUCCESS) {
+    ts_cleanup(store);
+  }
+  return rc;
+}
+
+static int write_pixfile_tiled(const char *filename, int format, struct TileStore *store) {
+  struct PixelFile pf;
+  int rc = pixfile_open_write(&pf, filename, format, store->width, store->height);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+
+  int32_t band_rows = ts_band_rows(store, 1);
+  for (int32_t row = 0; row < store->height && rc == IMG_SUCCESS; row += band_rows) {
+    int32_t nrows = store->height - row < band_rows ? store->height - row : band_rows;
+    struct TileView view;
+
+    rc = ts_map_rows(store, row, nrows, &view);
+    if (rc == IMG_SUCCESS) {
+      rc = pixfile_write_rows(&pf, view.img.data, nrows);
+      ts_unmap_rows(&view);
+    }
+  }
+
+  int close_rc = pixfile_close(&pf);
+  return rc != IMG_SUCCESS ? rc : close_rc;
+}
+
+int img_map(const char *filename, struct Image *img) {
+  if (file_format(filename) != FORMAT_RAW) {
+    return IMG_ERR_NOT_RAW;
+  }
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  struct RawHeader header;
+  struct stat st;
+  if (pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header) || fstat(fd, &st) != 0
+      || memcmp(header.magic, RAW_MAGIC, 4) != 0 || header.width <= 0 || header.height <= 0) {
+    close(fd);
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+  if (header.format != RAW_FORMAT_RGBA) {
+    close(fd);
+    return IMG_ERR_NOT_TRUECOLOR;
+  }
+
+  size_t len = sizeof(header) + (size_t) header.width * (size_t) header.height * sizeof(uint32_t);
+  if ((uint64_t) st.st_size < len) {
+    close(fd);
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  // a private mapping, so writes to the pixels never reach the file
+  uint64_t start = stats_start();
+  void *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  stats_stop(STATS_READ, start, len);
+  close(fd);
+  if (base == MAP_FAILED) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  img->width = header.width;
+  img->height = header.height;
+  img->data = (uint32_t *) ((unsigned char *) base + sizeof(header));
+  return IMG_SUCCESS;
+}
+
+void img_unmap(struct Image *img) {
+  size_t len = sizeof(struct RawHeader) + (size_t) img->width * (size_t) img->height * sizeof(uint32_t);
+  munmap((unsigned char *) img->data - sizeof(struct RawHeader), len);
+  img->data = NULL;
+}
+
+int img_read_rows(const char *filename, int32_t first_row, int32_t nrows, struct Image *img) {
+  if (first_row < 0 || nrows <= 0) {
+    return IMG_ERR_INVALID_ROWS;
+  }
+
+  int format = file_format(filename);
+  if (format != FORMAT_PNG) {
+    // the rows are at known offsets, so the ones before first_row
+    // aren't even read
+    struct PixelFile pf;
+    int rc = pixfile_open_read(&pf, filename, format);
+    if (rc != IMG_SUCCESS) {
+      return rc;
+    }
+    if (first_row >= pf.height || nrows > pf.height - first_row) {
+      pixfile_close(&pf);
+      return IMG_ERR_INVALID_ROWS;
+    }
+
+    rc = img_init(img, pf.width, nrows);
+    if (rc == IMG_SUCCESS) {
+      rc = pixfile_skip_rows(&pf, first_row);
+    }
+    if (rc == IMG_SUCCESS) {
+      rc = pixfile_read_rows(&pf, img->data, nrows);
+    }
+    pixfile_close(&pf);
+    return rc;
+  }
+
+  png_t png;
+  struct StdioStream stream;
+
+  int rc = open_png_read(&png, filename, &stream);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+
+  // only allow 8-bit grey and truecolor images, with or without alpha
+  if (!png_is_8bit(&png)) {
+    close_png(&png, &stream);
+    return IMG_ERR_NOT_TRUECOLOR;
+  }
+  if ((uint32_t) first_row >= png.height || (uint32_t) nrows > png.height - first_row) {
+    close_png(&png, &stream);
+    return IMG_ERR_INVALID_ROWS;
+  }
+
+  rc = img_init(img, (int32_t) png.width, nrows);
+  if (rc != IMG_SUCCESS) {
+    close_png(&png, &stream);
+    return rc;
+  }
+
+  // every row up to the last requested one has to be inflated and
+  // unfiltered (each row is filtered relative to the one above it),
+  // but rows before first_row are decoded into a scratch buffer and
+  // nothing after the last requested row is read at all
+  unsigned char *row_data = (unsigned char *) malloc((size_t) png.width * png.bpp);
+  if (row_data == NULL || png_read_begin(&png) != PNG_NO_ERROR) {
+    free(row_data);
+    close_png(&png, &stream);
+    img_cleanup(img);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  // a row that can't be decoded means the image data is corrupt
+  for (int32_t row = 0; rc == IMG_SUCCESS && row < first_row + nrows; row++) {
+    if (png_read_row(&png, row_data) != PNG_NO_ERROR) {
+      rc = IMG_ERR_COULD_NOT_OPEN;
+    } else if (row >= first_row) {
+      unpack_row(row_data, img->data + (size_t) (row - first_row) * png.width, (int32_t) png.width, png.bpp);
+    }
+  }
+
+  png_read_end(&png);
+  close_png(&png, &stream);
+  free(row_data);
+
+  if (rc != IMG_SUCCESS) {
+    img_cleanup(img);
+  }
+  return rc;
+}
+
+int img16_init(struct Image16 *img, int32_t width, int32_t height) {
+  size_t num_pixels = (size_t) width * (size_t) height;
+
+  uint64_t *pixel_data = (uint64_t *) malloc(num_pixels * sizeof(uint64_t));
+  if (pixel_data == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  // initialize every pixel to opaque black
+  for (size_t i = 0; i < num_pixels; i++) {
+    pixel_data[i] = 0xFFFFU;
+  }
+
+  img->width = width;
+  img->height = height;
+  img->data = pixel_data;
+  return IMG_SUCCESS;
+}
+
+// Convert one decoded PNG row to 16-bit pixels. pnglite leaves 16-bit
+// samples in native byte order.
+static void unpack_row16(const unsigned char *row_data, uint64_t *pixels, int32_t width, int depth, int channels) {
+  uint64_t start = stats_start();
+  if (depth == 16) {
+    const uint16_t *samples = (const uint16_t *) row_data;
+    for (int32_t i = 0; i < width; i++) {
+      const uint16_t *p = samples + (size_t) i * channels;
+      uint64_t a = (channels == 4) ? p[3] : 0xFFFFU;
+      pixels[i] = ((uint64_t) p[0] << 48) | ((uint64_t) p[1] << 32) | ((uint64_t) p[2] << 16) | a;
+    }
+  } else {
+    for (int32_t i = 0; i < width; i++) {
+      const unsigned char *p = row_data + (size_t) i * channels;
+      uint64_t a = (channels == 4) ? p[3] : 0xFFU;
+      pixels[i] = (((uint64_t) p[0] << 48) | ((uint64_t) p[1] << 32) | ((uint64_t) p[2] << 16) | a) * 257;
+    }
+  }
+  stats_stop(STATS_BYTESWAP, start, (size_t) width * channels * (depth / 8));
+}
+
+int img16_read(const char *filename, struct Image16 *img) {
+  if (file_format(filename) != FORMAT_PNG) {
+    return IMG_ERR_NOT_TRUECOLOR;
+  }
+
+  png_t png;
+  struct StdioStream stream;
+
+  int rc = open_png_read(&png, filename, &stream);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+
+  int channels = png.color_type == PNG_TRUECOLOR ? 3 : 4;
+  if ((png.color_type != PNG_TRUECOLOR && png.color_type != PNG_TRUECOLOR_ALPHA)
+      || (png.depth != 8 && png.depth != 16)) {
+    close_png(&png, &stream);
+    return IMG_ERR_NOT_TRUECOLOR;
+  }
+
+  rc = img16_init(img, (int32_t) png.width, (int32_t) png.height);
+  if (rc != IMG_SUCCESS) {
+    close_png(&png, &stream);
+    return rc;
+  }
+
+  // decoded a row at a time, so there is no full-size intermediate
+  // buffer in PNG format
+  unsigned char *row_data = (unsigned char *) malloc((size_t) png.width * png.bpp);
+  if (row_data == NULL || png_read_begin(&png) != PNG_NO_ERROR) {
+    free(row_data);
+    close_png(&png, &stream);
+    img16_cleanup(img);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  // a row that can't be decoded means the image data is corrupt
+  for (int32_t row = 0; rc == IMG_SUCCESS && row < img->height; row++) {
+    if (png_read_row(&png, row_data) != PNG_NO_ERROR) {
+      rc = IMG_ERR_COULD_NOT_OPEN;
+    } else {
+      unpack_row16(row_data, img->data + (size_t) row * img->width, img->width, png.depth, channels);
+    }
+  }
+
+  png_read_end(&png);
+  close_png(&png, &stream);
+  free(row_data);
+
+  if (rc != IMG_SUCCESS) {
+    img16_cleanup(img);
+  }
+  return rc;
+}
+
+int img16_write(const char *filename, struct Image16 *img) {
+  if (file_format(filename) != FORMAT_PNG) {
+    return IMG_ERR_COULD_NOT_WRITE;
+  }
+
+  png_t png;
+  struct StdioStream stream;
+
+  int rc = open_png_write(&png, filename, &stream);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+
+  // one row of RGBA data with big-endian 16-bit samples, which is
+  // just each pixel in big-endian byte order
+  uint64_t *row_data = (uint64_t *) malloc((size_t) img->width * sizeof(uint64_t));
+  if (row_data == NULL) {
+    close_png(&png, &stream);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  int success = png_write_begin(&png, img->width, img->height, 16, PNG_TRUECOLOR_ALPHA) == PNG_NO_ERROR;
 
-  uint32_t *data_to_write = img->data;
   int need_byteswap = is_little_endian();
+  for (int32_t row = 0; row < img->height && success; row++) {
+    const uint64_t *pixels = img->data + (size_t) row * img->width;
+    if (need_byteswap) {
+      uint64_t start = stats_start();
+      for (int32_t i = 0; i < img->width; i++) {
+        row_data[i] = __builtin_bswap64(pixels[i]);
+      }
+      stats_stop(STATS_BYTESWAP, start, (size_t) img->width * sizeof(uint64_t));
+    } else {
+      memcpy(row_data, pixels, (size_t) img->width * sizeof(uint64_t));
+    }
+    success = png_write_row(&png, (unsigned char *) row_data) == PNG_NO_ERROR;
+  }
 
-  if (need_byteswap) {
-    data_to_write = (uint32_t *) malloc(img->width * img->height * sizeof(uint32_t));
-    if (data_to_write == NULL) {
-      png_close_file(&png);
-      return IMG_ERR_MALLOC_FAILED;
+  // png_write_end always releases the encoder state
+  if (png_write_end(&png) != PNG_NO_ERROR) {
+    success = 0;
+  }
+  if (close_png(&png, &stream) != IMG_SUCCESS) {
+    success = 0;
+  }
+  free(row_data);
+
+  return success ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+}
+
+void img16_cleanup(struct Image16 *img) {
+  free(img->data);
+  img->data = NULL;
+}
+
+int img_read_tiled(const char *filename, struct TileStore *store, size_t cache_bytes) {
+  int format = file_format(filename);
+  if (format != FORMAT_PNG) {
+    return read_pixfile_tiled(filename, format, store, cache_bytes);
+  }
+
+  png_t png;
+  struct StdioStream stream;
+
+  int rc = open_png_read(&png, filename, &stream);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+
+  // only allow 8-bit grey and truecolor images, with or without alpha
+  if (!png_is_8bit(&png)) {
+    close_png(&png, &stream);
+    return IMG_ERR_NOT_TRUECOLOR;
+  }
+
+  rc = ts_init(store, png.width, png.height, cache_bytes, NULL);
+  if (rc != IMG_SUCCESS) {
+    close_png(&png, &stream);
+    return rc;
+  }
+
+  // one decoded row in PNG format, before expanding it to RGBA pixels
+  unsigned char *row_data = (unsigned char *) malloc((size_t) png.width * png.bpp);
+  if (row_data == NULL || png_read_begin(&png) != PNG_NO_ERROR) {
+    free(row_data);
+    close_png(&png, &stream);
+    ts_cleanup(store);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  int32_t band_rows = ts_band_rows(store, 1);
+  for (int32_t row = 0; row < store->height && rc == IMG_SUCCESS; row += band_rows) {
+    int32_t nrows = store->height - row < band_rows ? store->height - row : band_rows;
+    struct TileView view;
+
+    rc = ts_map_rows(store, row, nrows, &view);
+    if (rc != IMG_SUCCESS) {
+      break;
     }
 
-    int32_t num_pixels = img->width * img->height;
-    for (int32_t i = 0; i < num_pixels; i++) {
-      data_to_write[i] = byteswap(img->data[i]);
+    for (int32_t r = 0; r < nrows; r++) {
+      if (png_read_row(&png, row_data) != PNG_NO_ERROR) {
+        rc = IMG_ERR_MALLOC_FAILED;
+        break;
+      }
+
+      unpack_row(row_data, view.img.data + (size_t) r * store->width, store->width, png.bpp);
     }
+
+    ts_unmap_rows(&view);
   }
 
-  int rc = png_set_data(&png, img->width, img->height, 8, PNG_TRUECOLOR_ALPHA, (unsigned char *) data_to_write);
-  int success = (rc == PNG_NO_ERROR);
+  png_read_end(&png);
+  close_png(&png, &stream);
+  free(row_data);
 
-  png_close_file(&png);
-  if (need_byteswap) {
-    free(data_to_write);
+  if (rc != IMG_SUCCESS) {
+    ts_cleanup(store);
+  }
+  return rc;
+}
+
+int img_write_tiled(const char *filename, struct TileStore *store) {
+  int format = file_format(filename);
+  if (format != FORMAT_PNG) {
+    return write_pixfile_tiled(filename, format, store);
+  }
+
+  png_t png;
+  struct StdioStream stream;
+
+  if (open_png_write(&png, filename, &stream) != IMG_SUCCESS) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  // choose the color type as write_png does, which takes an extra
+  // pass over the tiles
+  struct PixelScan scan = PIXEL_SCAN_INIT;
+  int32_t band_rows = ts_band_rows(store, 1);
+  for (int32_t row = 0; row < store->height; row += band_rows) {
+    int32_t nrows = store->height - row < band_rows ? store->height - row : band_rows;
+    struct TileView view;
+
+    if (ts_map_rows(store, row, nrows, &view) != IMG_SUCCESS) {
+      close_png(&png, &stream);
+      return IMG_ERR_MALLOC_FAILED;
+    }
+    scan_pixels(&scan, view.img.data, (size_t) nrows * store->width);
+    ts_unmap_rows(&view);
+  }
+  int color_type = scan_color_type(&scan);
+  int bpp = color_type_bpp(color_type);
+
+  // one row of data in PNG byte order
+  unsigned char *row_data = (unsigned char *) malloc((size_t) store->width * bpp);
+  if (row_data == NULL) {
+    close_png(&png, &stream);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  int success = png_write_begin(&png, store->width, store->height, 8, color_type) == PNG_NO_ERROR;
+
+  for (int32_t row = 0; row < store->height && success; row += band_rows) {
+    int32_t nrows = store->height - row < band_rows ? store->height - row : band_rows;
+    struct TileView view;
+
+    if (ts_map_rows(store, row, nrows, &view) != IMG_SUCCESS) {
+      success = 0;
+      break;
+    }
+
+    for (int32_t r = 0; r < nrows && success; r++) {
+      pack_row(view.img.data + (size_t) r * store->width, row_data, store->width, bpp);
+      success = png_write_row(&png, row_data) == PNG_NO_ERROR;
+    }
+
+    ts_unmap_rows(&view);
+  }
+
+  // png_write_end always releases the encoder state
+  if (png_write_end(&png) != PNG_NO_ERROR) {
+    success = 0;
+  }
+  if (close_png(&png, &stream) != IMG_SUCCESS) {
+    success = 0;
   }
+  free(row_data);
 
   return success ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
 }
@@ -7,16 +7,45 @@
 #define IMG_ERR_NOT_TRUECOLOR    -2
 #define IMG_ERR_MALLOC_FAILED    -3
 #define IMG_ERR_COULD_NOT_WRITE  -4
+#define IMG_ERR_NOT_RAW          -5
+#define IMG_ERR_INVALID_ROWS     -6
+
+// formats reported by img_probe: the color type, possibly combined
+// with IMG_FORMAT_16BIT or IMG_FORMAT_LOW_DEPTH (1, 2 or 4 bits per
+// channel); otherwise the image has 8 bits per channel
+#define IMG_FORMAT_GREY          1
+#define IMG_FORMAT_GREY_ALPHA    2
+#define IMG_FORMAT_PALETTE       3
+#define IMG_FORMAT_RGB           4
+#define IMG_FORMAT_RGBA          5
+#define IMG_FORMAT_COLOR_MASK    0xff
+#define IMG_FORMAT_16BIT         0x100
+#define IMG_FORMAT_LOW_DEPTH     0x200
 
 #ifndef ASM_SOURCE
+#include <stddef.h>
 #include <stdint.h>
 
+// filename meaning standard input (for reading) or standard
+// output (for writing)
+#define IMG_STDIO "-"
+
 struct Image {
   int32_t width;
   int32_t height;
   uint32_t *data;
 };
 
+// An image with 16 bits per channel. Each pixel is a uint64_t with
+// the red, green, blue and alpha values in bits 48-63, 32-47, 16-31
+// and 0-15, respectively (the same arrangement as the 8-bit pixels
+// of struct Image).
+struct Image16 {
+  int32_t width;
+  int32_t height;
+  uint64_t *data;
+};
+
 // Initialize an Image struct instance by creating a pixel
 // buffer large enough to accommodate an image of the specified
 // dimensions, initialzing all pixels to opaque black,
@@ -35,10 +64,20 @@ struct Image {
 int img_init(struct Image *img, int32_t width, int32_t height);
 
 // Read PNG image data from a file and initialize the specified
-// Image struct instance.
+// Image struct instance. The PNG must have 8 bits per channel, and
+// be greyscale or truecolor, with or without alpha.
+//
+// Files whose names end in ".raw" or ".pam" are read as raw images
+// or Netpbm PAM images instead of PNG. A raw image is a 16 byte
+// header ("IMGR", format, width, height, all native-endian) followed
+// by the pixels exactly as they are stored in the data array, so it
+// can be read (or mapped, see img_map) without any conversion. Raw
+// and PAM are meant for intermediate images between processing steps,
+// where PNG compression is wasted effort.
 //
 // Parameters:
-//   filename - name of PNG file to read
+//   filename - name of PNG file to read, or IMG_STDIO to read
+//              from standard input
 //   img - pointer to Image struct to initialize with the loaded
 //         image data
 //
@@ -48,10 +87,15 @@ int img_init(struct Image *img, int32_t width, int32_t height);
 int img_read(const char *filename, struct Image *img);
 
 // Write pixel data from specified Image struct instance to the
-// named PNG output file.
+// named PNG output file (or raw/PAM file, see img_read).
+//
+// The PNG color type is the narrowest one that stores the pixels
+// exactly: greyscale if every pixel has equal red, green and blue
+// values, and without an alpha channel if every pixel is opaque.
 //
 // Parameters:
-//   filename - name of PNG file to write
+//   filename - name of PNG file to write, or IMG_STDIO to write
+//              to standard output
 //   img - pointer to Image struct with the pixel data to write
 //         to a PNG file
 //
@@ -60,6 +104,178 @@ int img_read(const char *filename, struct Image *img);
 //   IMG_ERR_* values
 int img_write(const char *filename, struct Image *img);
 
+// The extension of the file format img_read and img_write use for
+// a file name: ".raw", ".pam", or ".png" for anything else.
+//
+// Parameters:
+//   filename - name of image file
+//
+// Returns:
+//   the extension, including the dot
+const char *img_file_ext(const char *filename);
+
+// Get the dimensions and format of an image file without decoding
+// it: only the PNG signature and IHDR chunk (or the raw/PAM header)
+// are read. Images that img_read can't load (e.g., palette or
+// 16-bit PNGs) are still described.
+//
+// Parameters:
+//   filename - name of image file
+//   width - receives the image width
+//   height - receives the image height
+//   format - receives one of the IMG_FORMAT_* values
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_probe(const char *filename, int32_t *width, int32_t *height, int *format);
+
+// Read only some of the rows of an image file (like img_read). Rows
+// after the last requested one are never decoded, and only the
+// requested rows are kept in memory, so reading the top band of a
+// tall image costs time and memory in proportion to the band.
+//
+// Parameters:
+//   filename - name of image file to read (or IMG_STDIO)
+//   first_row - index of the first row to read
+//   nrows - number of rows to read
+//   img - pointer to Image instance to initialize; its height will
+//         be nrows
+//
+// Returns:
+//   IMG_SUCCESS if successful, IMG_ERR_INVALID_ROWS if the rows aren't
+//   all within the image, IMG_ERR_COULD_NOT_OPEN if the file can't be
+//   read or its image data is corrupt, otherwise one of the other
+//   IMG_ERR_* values
+int img_read_rows(const char *filename, int32_t first_row, int32_t nrows, struct Image *img);
+
+// Read PNG image data held in memory and initialize the specified
+// Image struct instance (like img_read).
+//
+// Parameters:
+//   data - pointer to the PNG file contents
+//   len - length of the PNG file contents in bytes
+//   img - pointer to Image instance to initialize
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_read_mem(const void *data, size_t len, struct Image *img);
+
+// Encode an image as PNG data in memory. The data is written to a
+// buffer allocated with malloc, which is grown with realloc if it
+// isn't big enough, so a buffer can be reused for many images.
+//
+// Parameters:
+//   img - pointer to Image to encode
+//   data - pointer to the buffer pointer (which may initially be NULL)
+//   len - receives the length of the encoded data
+//   capacity - pointer to the size of the buffer (0 if the buffer is NULL)
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_write_mem(struct Image *img, unsigned char **data, size_t *len, size_t *capacity);
+
+// Map the pixels of a raw image file (see img_read) directly into
+// memory, rather than reading them. The mapping is private: the
+// pixels can be modified without affecting the file. The image must
+// be released with img_unmap rather than img_cleanup.
+//
+// Parameters:
+//   filename - name of the raw image file (ending in ".raw")
+//   img - pointer to Image instance to initialize
+//
+// Returns:
+//   IMG_SUCCESS if successful, IMG_ERR_NOT_RAW if the file name
+//   doesn't end in ".raw", otherwise one of the other IMG_ERR_* values
+int img_map(const char *filename, struct Image *img);
+
+// Release an image mapped by img_map. Note that this function does
+// NOT de-allocate the struct Image instance itself.
+//
+// Parameters:
+//   img - pointer to Image initialized by img_map
+void img_unmap(struct Image *img);
+
+// Initialize an Image16 struct instance (like img_init), with all
+// pixels opaque black.
+//
+// Parameters:
+//   img - pointer to Image16 instance to initialize
+//   width - image width (number of pixel columns)
+//   height - image height (number of pixel rows)
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img16_init(struct Image16 *img, int32_t width, int32_t height);
+
+// Read a truecolor PNG (with or without alpha) into an Image16.
+// 16-bit images are read at full precision; 8-bit images are scaled
+// up (v becomes v*257, so 255 becomes 65535).
+//
+// Parameters:
+//   filename - name of PNG file to read (or IMG_STDIO)
+//   img - pointer to Image16 struct to initialize
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img16_read(const char *filename, struct Image16 *img);
+
+// Write an Image16 as a 16-bit RGBA PNG. Only PNG output is
+// supported: a filename ending in ".raw" or ".pam" is an error.
+//
+// Parameters:
+//   filename - name of PNG file to write (or IMG_STDIO)
+//   img - pointer to Image16 struct with the pixel data to write
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img16_write(const char *filename, struct Image16 *img);
+
+// De-allocate the pixel data of an Image16 (but not the struct
+// Image16 instance itself).
+//
+// Parameters:
+//   img - pointer to Image16 object to clean up
+void img16_cleanup(struct Image16 *img);
+
+struct TileStore;
+
+// Read PNG image data from a file one row at a time, storing the
+// pixels in a newly created file-backed TileStore (see tilestore.h)
+// rather than in memory. At most cache_bytes of pixel data are
+// mapped into memory at any one time.
+//
+// Parameters:
+//   filename - name of PNG file to read (or IMG_STDIO)
+//   store - pointer to TileStore to initialize with the loaded
+//           image data
+//   cache_bytes - maximum number of bytes of pixel data to keep
+//                 in memory at once
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_read_tiled(const char *filename, struct TileStore *store, size_t cache_bytes);
+
+// Write pixel data from a TileStore to the named PNG output file,
+// encoding it one row at a time. The color type is chosen as in
+// img_write, which takes one extra pass over the tiles.
+//
+// Parameters:
+//   filename - name of PNG file to write (or IMG_STDIO)
+//   store - pointer to TileStore with the pixel data to write
+//           to a PNG file
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_write_tiled(const char *filename, struct TileStore *store);
+
 // De-allocate the dynamically-allocated memory used in the internal
 // representation of the given Image struct. Note that this function
 // does NOT de-allocate the struct Image instance itself (since allocating
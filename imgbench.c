@@ -0,0 +1,341 @@
+// Benchmark of the image transformations on synthetic images,
+// comparing the C and asm implementations
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include "imgproc.h"
+#include "imgproc_variants.h"
+
+#define MAX_REPS 1000
+#define MAX_WARMUP 1000
+#define MAX_RESULTS 1024
+
+enum Transform { XFORM_COMPLEMENT, XFORM_TRANSPOSE, XFORM_ELLIPSE, XFORM_EMBOSS, NUM_XFORMS };
+
+static const char *s_xform_names[NUM_XFORMS] = { "complement", "transpose", "ellipse", "emboss" };
+
+// Image sizes from 1 to 256 megapixels, square and 4:1
+static const struct {
+  int32_t width, height;
+} s_sizes[] = {
+  {  1000,  1000 }, {  2000,   500 },
+  {  2000,  2000 }, {  4000,  1000 },
+  {  4000,  4000 }, {  8000,  2000 },
+  {  8000,  8000 }, { 16000,  4000 },
+  { 16000, 16000 }, { 32000,  8000 },
+};
+
+struct Options {
+  double max_mp;
+  int reps;
+  int warmup;
+  const char *variants;
+  const char *save_file;
+  const char *baseline_file;
+  double tolerance;
+};
+
+struct Result {
+  const char *variant;
+  const char *xform;
+  int32_t width, height;
+  const char *format;
+  uint64_t median_ns;
+  uint64_t p95_ns;
+};
+
+static struct Result s_results[MAX_RESULTS];
+static int s_num_results;
+
+void usage( const char *progname ) {
+  fprintf( stderr, "Usage: %s [options]\n", progname );
+  fprintf( stderr, "Options:\n" );
+  fprintf( stderr, "  --max-mp=<n>        largest image size in megapixels, at least 1 (default 256)\n" );
+  fprintf( stderr, "  --reps=<n>          timed repetitions per case (default 5)\n" );
+  fprintf( stderr, "  --warmup=<n>        untimed repetitions per case (default 1)\n" );
+  fprintf( stderr, "  --variants=<list>   comma-separated kernel variants (default: all)\n" );
+  fprintf( stderr, "  --save=<file>       save the results as a baseline\n" );
+  fprintf( stderr, "  --baseline=<file>   compare against a saved baseline, failing if any\n" );
+  fprintf( stderr, "                      case is slower than the tolerance allows\n" );
+  fprintf( stderr, "  --tolerance=<pct>   allowed slowdown in percent (default 10)\n" );
+  exit( 1 );
+}
+
+int parse_options( int argc, char **argv, struct Options *opts ) {
+  opts->max_mp = 256;
+  opts->reps = 5;
+  opts->warmup = 1;
+  opts->variants = NULL;
+  opts->save_file = NULL;
+  opts->baseline_file = NULL;
+  opts->tolerance = 10;
+
+  for ( int i = 1; i < argc; ++i ) {
+    const char *opt = argv[i];
+    char *end = NULL;
+
+    if ( strncmp( opt, "--max-mp=", 9 ) == 0 ) {
+      opts->max_mp = strtod( opt + 9, &end );
+      // below the smallest size, nothing would be run
+      if ( end == opt + 9 || !isfinite( opts->max_mp ) || opts->max_mp < (double) s_sizes[0].width * s_sizes[0].height / 1e6 )
+        usage( argv[0] );
+    } else if ( strncmp( opt, "--reps=", 7 ) == 0 ) {
+      opts->reps = (int) strtol( opt + 7, &end, 10 );
+      if ( opts->reps < 1 || opts->reps > MAX_REPS )
+        usage( argv[0] );
+    } else if ( strncmp( opt, "--warmup=", 9 ) == 0 ) {
+      long warmup = strtol( opt + 9, &end, 10 );
+      if ( end == opt + 9 || warmup < 0 || warmup > MAX_WARMUP )
+        usage( argv[0] );
+      opts->warmup = (int) warmup;
+    } else if ( strncmp( opt, "--variants=", 11 ) == 0 ) {
+      opts->variants = opt + 11;
+    } else if ( strncmp( opt, "--save=", 7 ) == 0 ) {
+      opts->save_file = opt + 7;
+    } else if ( strncmp( opt, "--baseline=", 11 ) == 0 ) {
+      opts->baseline_file = opt + 11;
+    } else if ( strncmp( opt, "--tolerance=", 12 ) == 0 ) {
+      opts->tolerance = strtod( opt + 12, &end );
+      if ( end == opt + 12 || !isfinite( opts->tolerance ) || opts->tolerance <= 0 )
+        usage( argv[0] );
+    } else {
+      usage( argv[0] );
+    }
+
+    if ( end != NULL && *end != '\0' )
+      usage( argv[0] );
+  }
+
+  return 0;
+}
+
+// Check whether a variant was selected with --variants
+int variant_selected( const struct Options *opts, const char *name ) {
+  if ( opts->variants == NULL )
+    return 1;
+
+  size_t len = strlen( name );
+  const char *p = opts->variants;
+  while ( *p != '\0' ) {
+    const char *comma = strchr( p, ',' );
+    size_t item_len = comma ? (size_t) ( comma - p ) : strlen( p );
+    if ( item_len == len && strncmp( p, name, len ) == 0 )
+      return 1;
+    p += item_len;
+    if ( *p == ',' )
+      ++p;
+  }
+  return 0;
+}
+
+uint64_t now_ns( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+// Fill an image with deterministic pseudo-random content: smooth
+// gradients (so emboss sees realistic neighborhoods) plus noise.
+// If opaque is nonzero every alpha value is 255, as when an RGB
+// PNG is read; otherwise alpha varies too.
+void generate_image( struct Image *img, int opaque ) {
+  uint32_t state = 0x9e3779b9u ^ (uint32_t) img->width ^ ( (uint32_t) img->height << 16 );
+
+  for ( int32_t i = 0; i < img->height; ++i ) {
+    for ( int32_t j = 0; j < img->width; ++j ) {
+      // xorshift32
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+
+      uint32_t r = ( (uint32_t) j * 255 / img->width + ( state & 0x1f ) ) & 0xff;
+      uint32_t g = ( (uint32_t) i * 255 / img->height + ( ( state >> 8 ) & 0x1f ) ) & 0xff;
+      uint32_t b = ( state >> 16 ) & 0xff;
+      uint32_t a = opaque ? 255 : ( state >> 24 );
+      img->data[(size_t) i * img->width + j] = make_pixel( r, g, b, a );
+    }
+  }
+}
+
+int run_kernel( const struct KernelVariant *variant, int xform, struct Image *in, struct Image *out ) {
+  switch ( xform ) {
+  case XFORM_COMPLEMENT: variant->complement( in, out ); return 1;
+  case XFORM_TRANSPOSE:  return variant->transpose( in, out );
+  case XFORM_ELLIPSE:    variant->ellipse( in, out ); return 1;
+  case XFORM_EMBOSS:     variant->emboss( in, out ); return 1;
+  }
+  return 0;
+}
+
+int compare_u64( const void *a, const void *b ) {
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return ( x > y ) - ( x < y );
+}
+
+double mp_per_s( const struct Result *r, uint64_t ns ) {
+  return (double) r->width * r->height / 1e6 / ( ns / 1e9 );
+}
+
+// Time one kernel on one image, recording and printing the result.
+// Returns the result, or NULL if the kernel doesn't apply to the image.
+const struct Result *bench_case( const struct Options *opts, const struct KernelVariant *variant, int xform,
+                                 struct Image *in, struct Image *out, const char *format ) {
+  uint64_t times[MAX_REPS];
+
+  for ( int i = 0; i < opts->warmup; ++i ) {
+    if ( !run_kernel( variant, xform, in, out ) )
+      return NULL;
+  }
+  for ( int i = 0; i < opts->reps; ++i ) {
+    uint64_t start = now_ns();
+    if ( !run_kernel( variant, xform, in, out ) )
+      return NULL;
+    times[i] = now_ns() - start;
+  }
+  qsort( times, opts->reps, sizeof( uint64_t ), compare_u64 );
+
+  if ( s_num_results == MAX_RESULTS ) {
+    fprintf( stderr, "Error: too many results\n" );
+    exit( 1 );
+  }
+  struct Result *r = &s_results[s_num_results++];
+  r->variant = variant->name;
+  r->xform = s_xform_names[xform];
+  r->width = in->width;
+  r->height = in->height;
+  r->format = format;
+  r->median_ns = times[opts->reps / 2];
+  r->p95_ns = times[( opts->reps * 95 + 99 ) / 100 - 1];
+  return r;
+}
+
+void print_result( const struct Result *r, const struct Result *reference ) {
+  // each pixel is read once and written once
+  double gb_per_s = (double) r->width * r->height * 2 * sizeof( uint32_t ) / r->median_ns;
+
+  printf( "%-9s %-11s %5dx%-5d %-4s %10.2f %10.2f %9.1f %9.1f %7.2f",
+          r->variant, r->xform, r->width, r->height, r->format,
+          r->median_ns / 1e6, r->p95_ns / 1e6,
+          mp_per_s( r, r->median_ns ), mp_per_s( r, r->p95_ns ), gb_per_s );
+  if ( reference != NULL && reference != r )
+    printf( " %6.2fx", (double) reference->median_ns / r->median_ns );
+  printf( "\n" );
+  fflush( stdout );
+}
+
+int save_results( const char *filename ) {
+  FILE *out = fopen( filename, "w" );
+  if ( out == NULL ) {
+    fprintf( stderr, "Error: couldn't write baseline '%s'\n", filename );
+    return 0;
+  }
+  fprintf( out, "# variant transform width height format median_mp_per_s\n" );
+  for ( int i = 0; i < s_num_results; ++i ) {
+    const struct Result *r = &s_results[i];
+    fprintf( out, "%s %s %d %d %s %.3f\n", r->variant, r->xform, r->width, r->height, r->format,
+             mp_per_s( r, r->median_ns ) );
+  }
+  fclose( out );
+  return 1;
+}
+
+// Compare the results against a baseline file.
+// Returns the number of regressions, or -1 if the file couldn't be read
+// or none of its cases were run (e.g. after a case was renamed).
+int compare_baseline( const char *filename, double tolerance ) {
+  FILE *in = fopen( filename, "r" );
+  if ( in == NULL ) {
+    fprintf( stderr, "Error: couldn't read baseline '%s'\n", filename );
+    return -1;
+  }
+
+  int regressions = 0, compared = 0;
+  char line[256];
+  while ( fgets( line, sizeof( line ), in ) != NULL ) {
+    char variant[32], xform[32], format[8];
+    int32_t width, height;
+    double baseline_mps;
+
+    if ( line[0] == '#' )
+      continue;
+    if ( sscanf( line, "%31s %31s %d %d %7s %lf", variant, xform, &width, &height, format, &baseline_mps ) != 6 )
+      continue;
+
+    for ( int i = 0; i < s_num_results; ++i ) {
+      const struct Result *r = &s_results[i];
+      if ( strcmp( r->variant, variant ) != 0 || strcmp( r->xform, xform ) != 0
+           || r->width != width || r->height != height || strcmp( r->format, format ) != 0 )
+        continue;
+
+      double mps = mp_per_s( r, r->median_ns );
+      ++compared;
+      if ( mps < baseline_mps * ( 1.0 - tolerance / 100.0 ) ) {
+        printf( "REGRESSION: %s %s %dx%d %s: %.1f MP/s (baseline %.1f MP/s)\n",
+                variant, xform, width, height, format, mps, baseline_mps );
+        ++regressions;
+      }
+    }
+  }
+  fclose( in );
+
+  printf( "Compared %d case(s) against baseline, %d regression(s)\n", compared, regressions );
+  if ( compared == 0 ) {
+    fprintf( stderr, "Error: no case in baseline '%s' was run\n", filename );
+    return -1;
+  }
+  return regressions;
+}
+
+int main( int argc, char **argv ) {
+  struct Options opts;
+  parse_options( argc, argv, &opts );
+
+  printf( "%-9s %-11s %-11s %-4s %10s %10s %9s %9s %7s %7s\n",
+          "kernel", "transform", "size", "fmt", "median ms", "p95 ms", "MP/s", "p95 MP/s", "GB/s", "vs c" );
+
+  for ( size_t s = 0; s < sizeof( s_sizes ) / sizeof( s_sizes[0] ); ++s ) {
+    int32_t width = s_sizes[s].width, height = s_sizes[s].height;
+    if ( (double) width * height / 1e6 > opts.max_mp )
+      continue;
+
+    struct Image in, out;
+    if ( img_init( &in, width, height ) != IMG_SUCCESS || img_init( &out, width, height ) != IMG_SUCCESS ) {
+      fprintf( stderr, "Error: couldn't allocate %dx%d images\n", width, height );
+      return 1;
+    }
+
+    for ( int opaque = 1; opaque >= 0; --opaque ) {
+      const char *format = opaque ? "rgb" : "rgba";
+      generate_image( &in, opaque );
+
+      for ( int xform = 0; xform < NUM_XFORMS; ++xform ) {
+        const struct Result *reference = NULL;
+        for ( int v = 0; v < num_kernel_variants; ++v ) {
+          if ( !variant_selected( &opts, kernel_variants[v].name ) )
+            continue;
+          const struct Result *r = bench_case( &opts, &kernel_variants[v], xform, &in, &out, format );
+          if ( r == NULL )
+            continue;
+          if ( v == 0 )
+            reference = r;
+          print_result( r, reference );
+        }
+      }
+    }
+
+    img_cleanup( &in );
+    img_cleanup( &out );
+  }
+
+  if ( opts.save_file != NULL && !save_results( opts.save_file ) )
+    return 1;
+
+  if ( opts.baseline_file != NULL && compare_baseline( opts.baseline_file, opts.tolerance ) != 0 )
+    return 1;
+
+  return 0;
+}
@@ -0,0 +1,149 @@
+// Client for the image processing server (c_imgproc/asm_imgproc --serve):
+// sends one transformation request and writes the result
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include "imgproc_proto.h"
+
+void usage( const char *progname ) {
+  fprintf( stderr, "Usage: %s [options] <transform> <input img> <output img> [args...]\n", progname );
+  fprintf( stderr, "Options:\n" );
+  fprintf( stderr, "  --socket=<path>  server socket (default %s)\n", PROTO_DEFAULT_SOCKET );
+  fprintf( stderr, "  --paths          send file names instead of image data (the server\n" );
+  fprintf( stderr, "                   reads and writes the files itself)\n" );
+  exit( 1 );
+}
+
+// Read a whole file into memory
+unsigned char *read_file( const char *filename, size_t *len ) {
+  FILE *in = fopen( filename, "rb" );
+  if ( in == NULL )
+    return NULL;
+
+  size_t capacity = 65536, n = 0;
+  unsigned char *data = (unsigned char *) malloc( capacity );
+  size_t r;
+  while ( data != NULL && ( r = fread( data + n, 1, capacity - n, in ) ) > 0 ) {
+    n += r;
+    if ( n == capacity ) {
+      capacity *= 2;
+      unsigned char *grown = (unsigned char *) realloc( data, capacity );
+      if ( grown == NULL )
+        free( data );
+      data = grown;
+    }
+  }
+  fclose( in );
+
+  *len = n;
+  return data;
+}
+
+// The server may have a different working directory, so file names
+// are sent as absolute paths
+int absolute_path( const char *filename, char *path, size_t size ) {
+  if ( filename[0] == '/' )
+    return snprintf( path, size, "%s", filename ) < (int) size;
+
+  char cwd[PATH_MAX];
+  if ( getcwd( cwd, sizeof( cwd ) ) == NULL )
+    return 0;
+  return snprintf( path, size, "%s/%s", cwd, filename ) < (int) size;
+}
+
+int main( int argc, char **argv ) {
+  const char *socket_path = PROTO_DEFAULT_SOCKET;
+  int path_mode = 0;
+
+  int i;
+  for ( i = 1; i < argc && strncmp( argv[i], "--", 2 ) == 0; ++i ) {
+    if ( strncmp( argv[i], "--socket=", 9 ) == 0 )
+      socket_path = argv[i] + 9;
+    else if ( strcmp( argv[i], "--paths" ) == 0 )
+      path_mode = 1;
+    else
+      usage( argv[0] );
+  }
+  if ( argc - i < 3 || argc - i + 1 > PROTO_MAX_FIELDS )
+    usage( argv[0] );
+
+  const char *transformation = argv[i];
+  const char *input_filename = argv[i + 1];
+  const char *output_filename = argv[i + 2];
+
+  const void *fields[PROTO_MAX_FIELDS];
+  size_t lens[PROTO_MAX_FIELDS];
+  unsigned char *input_data = NULL;
+  char input_path[PATH_MAX], output_path[PATH_MAX];
+
+  fields[0] = path_mode ? PROTO_MODE_PATH : PROTO_MODE_MEM;
+  fields[1] = transformation;
+  if ( path_mode ) {
+    if ( !absolute_path( input_filename, input_path, sizeof( input_path ) )
+         || !absolute_path( output_filename, output_path, sizeof( output_path ) ) ) {
+      fprintf( stderr, "Error: file name too long\n" );
+      return 1;
+    }
+    fields[2] = input_path;
+    lens[2] = strlen( input_path );
+    fields[3] = output_path;
+    lens[3] = strlen( output_path );
+  } else {
+    input_data = read_file( input_filename, &lens[2] );
+    if ( input_data == NULL ) {
+      fprintf( stderr, "Error: couldn't read input image\n" );
+      return 1;
+    }
+    fields[2] = input_data;
+    fields[3] = "";
+    lens[3] = 0;
+  }
+  lens[0] = strlen( (const char *) fields[0] );
+  lens[1] = strlen( transformation );
+
+  uint32_t num_fields = 4;
+  for ( int j = i + 3; j < argc; ++j ) {
+    fields[num_fields] = argv[j];
+    lens[num_fields] = strlen( argv[j] );
+    ++num_fields;
+  }
+
+  int fd = proto_connect( socket_path );
+  if ( fd < 0 ) {
+    fprintf( stderr, "Error: couldn't connect to server at '%s'\n", socket_path );
+    free( input_data );
+    return 1;
+  }
+
+  struct ProtoMessage response = { 0 };
+  int ok = proto_send( fd, num_fields, fields, lens ) && proto_recv( fd, &response ) == 1
+    && response.num_fields == 2;
+  close( fd );
+  free( input_data );
+
+  if ( !ok ) {
+    fprintf( stderr, "Error: no valid response from server\n" );
+    proto_free( &response );
+    return 1;
+  }
+
+  int rc = 0;
+  if ( strcmp( (const char *) response.fields[0], PROTO_STATUS_OK ) != 0 ) {
+    fprintf( stderr, "Error: %s\n", (const char *) response.fields[1] );
+    rc = 1;
+  } else if ( !path_mode ) {
+    FILE *out = fopen( output_filename, "wb" );
+    if ( out == NULL || fwrite( response.fields[1], 1, response.lens[1], out ) != response.lens[1] ) {
+      fprintf( stderr, "Error: couldn't write output image\n" );
+      rc = 1;
+    }
+    if ( out != NULL && fclose( out ) != 0 )
+      rc = 1;
+  }
+
+  proto_free( &response );
+  return rc;
+}
@@ -0,0 +1,131 @@
+// Compare two images for exact equality, reporting the mean squared
+// error and writing a diff image if they differ
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "image.h"
+
+// exit codes (the same as ImageMagick compare)
+#define CMP_IDENTICAL 0
+#define CMP_DIFFERENT 1
+#define CMP_ERROR     2
+
+// Find the first pixel at which two pixel arrays differ.
+// Returns n if they are identical.
+size_t first_difference( const uint32_t *a, const uint32_t *b, size_t n ) {
+  size_t i = 0;
+
+#ifdef __SSE2__
+  // compare 16 pixels per iteration, stopping at the first block
+  // that contains a difference
+  for ( ; i + 16 <= n; i += 16 ) {
+    __m128i eq0 = _mm_cmpeq_epi32( _mm_loadu_si128( (const __m128i *) ( a + i ) ),
+                                   _mm_loadu_si128( (const __m128i *) ( b + i ) ) );
+    __m128i eq1 = _mm_cmpeq_epi32( _mm_loadu_si128( (const __m128i *) ( a + i + 4 ) ),
+                                   _mm_loadu_si128( (const __m128i *) ( b + i + 4 ) ) );
+    __m128i eq2 = _mm_cmpeq_epi32( _mm_loadu_si128( (const __m128i *) ( a + i + 8 ) ),
+                                   _mm_loadu_si128( (const __m128i *) ( b + i + 8 ) ) );
+    __m128i eq3 = _mm_cmpeq_epi32( _mm_loadu_si128( (const __m128i *) ( a + i + 12 ) ),
+                                   _mm_loadu_si128( (const __m128i *) ( b + i + 12 ) ) );
+    __m128i eq = _mm_and_si128( _mm_and_si128( eq0, eq1 ), _mm_and_si128( eq2, eq3 ) );
+    if ( _mm_movemask_epi8( eq ) != 0xffff )
+      break;
+  }
+#endif
+
+  while ( i < n && a[i] == b[i] )
+    ++i;
+  return i;
+}
+
+// Mean squared error over all color and alpha channels, starting
+// from the first differing pixel (everything before it contributes 0)
+double mean_squared_error( const uint32_t *a, const uint32_t *b, size_t n, size_t first ) {
+  uint64_t sum = 0;
+
+  for ( size_t i = first; i < n; ++i ) {
+    if ( a[i] == b[i] )
+      continue;
+    for ( int shift = 0; shift < 32; shift += 8 ) {
+      int32_t d = (int32_t) ( ( a[i] >> shift ) & 0xff ) - (int32_t) ( ( b[i] >> shift ) & 0xff );
+      sum += (uint64_t) ( d * d );
+    }
+  }
+  return (double) sum / ( (double) n * 4 );
+}
+
+// Write an image highlighting the differing pixels in red over a
+// faded copy of the expected image
+int write_diff_image( const char *filename, const struct Image *expected, const struct Image *actual ) {
+  struct Image diff;
+  if ( img_init( &diff, expected->width, expected->height ) != IMG_SUCCESS )
+    return 0;
+
+  size_t n = (size_t) expected->width * expected->height;
+  for ( size_t i = 0; i < n; ++i ) {
+    uint32_t p = expected->data[i];
+    if ( p != actual->data[i] ) {
+      diff.data[i] = 0xff0000ffU;
+    } else {
+      // fade towards white
+      uint32_t gray = ( ( ( p >> 24 ) & 0xff ) + ( ( p >> 16 ) & 0xff ) + ( ( p >> 8 ) & 0xff ) ) / 3;
+      uint32_t v = 255 - ( 255 - gray ) / 4;
+      diff.data[i] = ( v << 24 ) | ( v << 16 ) | ( v << 8 ) | 0xff;
+    }
+  }
+
+  int ok = img_write( filename, &diff ) == IMG_SUCCESS;
+  img_cleanup( &diff );
+  return ok;
+}
+
+int main( int argc, char **argv ) {
+  if ( argc != 3 && argc != 4 ) {
+    fprintf( stderr, "Usage: %s <expected img> <actual img> [<diff img>]\n", argv[0] );
+    fprintf( stderr, "Exits with 0 if the images are identical, 1 if they differ, 2 on error.\n" );
+    fprintf( stderr, "If they differ, the mean squared error is printed and the\n" );
+    fprintf( stderr, "differing pixels are written to <diff img>.\n" );
+    return CMP_ERROR;
+  }
+
+  struct Image expected, actual;
+  if ( img_read( argv[1], &expected ) != IMG_SUCCESS ) {
+    fprintf( stderr, "Error: couldn't read image '%s'\n", argv[1] );
+    return CMP_ERROR;
+  }
+  if ( img_read( argv[2], &actual ) != IMG_SUCCESS ) {
+    fprintf( stderr, "Error: couldn't read image '%s'\n", argv[2] );
+    img_cleanup( &expected );
+    return CMP_ERROR;
+  }
+
+  int result;
+  if ( expected.width != actual.width || expected.height != actual.height ) {
+    fprintf( stderr, "Images have different sizes: %dx%d vs. %dx%d\n",
+             expected.width, expected.height, actual.width, actual.height );
+    result = CMP_DIFFERENT;
+  } else {
+    size_t n = (size_t) expected.width * expected.height;
+    size_t first = first_difference( expected.data, actual.data, n );
+
+    if ( first == n ) {
+      result = CMP_IDENTICAL;
+    } else {
+      double mse = mean_squared_error( expected.data, actual.data, n, first );
+      fprintf( stderr, "Images differ, first at pixel (row %zu, col %zu): MSE %g (%g)\n",
+               first / expected.width, first % expected.width, mse, mse / ( 255.0 * 255.0 ) );
+      if ( argc == 4 && !write_diff_image( argv[3], &expected, &actual ) )
+        fprintf( stderr, "Error: couldn't write diff image '%s'\n", argv[3] );
+      result = CMP_DIFFERENT;
+    }
+  }
+
+  img_cleanup( &expected );
+  img_cleanup( &actual );
+  return result;
+}
@@ -0,0 +1,235 @@
+// Differential fuzzing of the image transformations: every kernel
+// variant must produce exactly the same output as the C reference
+// implementation.
+//
+// By default this is a standalone program that generates random
+// images. Compiled with -DIMGFUZZ_LIBFUZZER (and -fsanitize=fuzzer)
+// it instead provides a libFuzzer entry point, which takes the image
+// dimensions and pixels from the fuzzer's input.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "imgproc.h"
+#include "imgproc_variants.h"
+
+enum Transform { XFORM_COMPLEMENT, XFORM_TRANSPOSE, XFORM_ELLIPSE, XFORM_EMBOSS, NUM_XFORMS };
+
+static const char *s_xform_names[NUM_XFORMS] = { "complement", "transpose", "ellipse", "emboss" };
+
+// Deterministic pseudo-random numbers (xorshift64*), so that a failing
+// case can be reproduced from its seed
+static uint64_t s_rng_state;
+
+void rng_seed( uint64_t seed ) {
+  s_rng_state = seed ? seed : 0x9e3779b97f4a7c15ULL;
+}
+
+uint64_t rng_next( void ) {
+  s_rng_state ^= s_rng_state >> 12;
+  s_rng_state ^= s_rng_state << 25;
+  s_rng_state ^= s_rng_state >> 27;
+  return s_rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+// Random integer in [lo, hi]
+int32_t rng_range( int32_t lo, int32_t hi ) {
+  return lo + (int32_t) ( rng_next() % (uint64_t) ( hi - lo + 1 ) );
+}
+
+int run_kernel( const struct KernelVariant *variant, int xform, struct Image *in, struct Image *out ) {
+  switch ( xform ) {
+  case XFORM_COMPLEMENT: variant->complement( in, out ); return 1;
+  case XFORM_TRANSPOSE:  return variant->transpose( in, out );
+  case XFORM_ELLIPSE:    variant->ellipse( in, out ); return 1;
+  case XFORM_EMBOSS:     variant->emboss( in, out ); return 1;
+  }
+  return 0;
+}
+
+// Run one transformation with every variant on the given input and
+// compare each result with the reference (the first variant).
+// The output images all start out with the same (arbitrary) contents,
+// so pixels a variant fails to write are detected as well.
+//
+// Returns:
+//   1 if all variants agree, 0 (after describing the difference) if not
+int check_xform( int xform, struct Image *input, uint32_t fill ) {
+  size_t num_pixels = (size_t) input->width * input->height;
+  int ok = 1;
+
+  struct Image in_copy, ref_out, out;
+  if ( img_init( &in_copy, input->width, input->height ) != IMG_SUCCESS
+       || img_init( &ref_out, input->width, input->height ) != IMG_SUCCESS
+       || img_init( &out, input->width, input->height ) != IMG_SUCCESS ) {
+    fprintf( stderr, "Error: couldn't allocate images\n" );
+    exit( 1 );
+  }
+
+  for ( size_t i = 0; i < num_pixels; ++i )
+    ref_out.data[i] = fill;
+  memcpy( in_copy.data, input->data, num_pixels * sizeof( uint32_t ) );
+  int ref_result = run_kernel( &kernel_variants[0], xform, &in_copy, &ref_out );
+
+  for ( int v = 1; v < num_kernel_variants && ok; ++v ) {
+    const struct KernelVariant *variant = &kernel_variants[v];
+
+    for ( size_t i = 0; i < num_pixels; ++i )
+      out.data[i] = fill;
+    memcpy( in_copy.data, input->data, num_pixels * sizeof( uint32_t ) );
+    int result = run_kernel( variant, xform, &in_copy, &out );
+
+    if ( result != ref_result ) {
+      printf( "MISMATCH: %s %s on %dx%d returned %d, %s returned %d\n",
+              variant->name, s_xform_names[xform], input->width, input->height,
+              result, kernel_variants[0].name, ref_result );
+      ok = 0;
+    } else if ( memcmp( in_copy.data, input->data, num_pixels * sizeof( uint32_t ) ) != 0 ) {
+      printf( "MISMATCH: %s %s on %dx%d modified its input image\n",
+              variant->name, s_xform_names[xform], input->width, input->height );
+      ok = 0;
+    } else if ( result && memcmp( out.data, ref_out.data, num_pixels * sizeof( uint32_t ) ) != 0 ) {
+      size_t i = 0;
+      while ( out.data[i] == ref_out.data[i] )
+        ++i;
+      printf( "MISMATCH: %s %s on %dx%d: pixel (row %zu, col %zu) is %08x, %s gives %08x\n",
+              variant->name, s_xform_names[xform], input->width, input->height,
+              i / input->width, i % input->width, out.data[i], kernel_variants[0].name, ref_out.data[i] );
+      ok = 0;
+    }
+  }
+
+  img_cleanup( &in_copy );
+  img_cleanup( &ref_out );
+  img_cleanup( &out );
+  return ok;
+}
+
+int check_all( struct Image *input, uint32_t fill ) {
+  int ok = 1;
+  for ( int xform = 0; xform < NUM_XFORMS; ++xform )
+    ok = check_xform( xform, input, fill ) && ok;
+  return ok;
+}
+
+#ifdef IMGFUZZ_LIBFUZZER
+
+// The first two bytes give the width and height (1-256), the
+// remaining bytes are the pixels (repeated if there aren't enough)
+int LLVMFuzzerTestOneInput( const uint8_t *data, size_t size ) {
+  if ( size < 3 )
+    return 0;
+
+  struct Image input;
+  int32_t width = data[0] + 1, height = data[1] + 1;
+  if ( img_init( &input, width, height ) != IMG_SUCCESS )
+    return 0;
+
+  const uint8_t *pixels = data + 2;
+  size_t num_bytes = size - 2;
+  for ( size_t i = 0; i < (size_t) width * height; ++i ) {
+    uint32_t pixel = 0;
+    for ( size_t k = 0; k < 4; ++k )
+      pixel = ( pixel << 8 ) | pixels[( i * 4 + k ) % num_bytes];
+    input.data[i] = pixel;
+  }
+
+  if ( !check_all( &input, 0x000000FFU ) )
+    abort();
+
+  img_cleanup( &input );
+  return 0;
+}
+
+#else
+
+// Choose random dimensions, favoring the edge cases: a single row or
+// column, tiny and odd sizes, and square images (so transpose runs)
+void random_dims( int32_t max_dim, int32_t *width, int32_t *height ) {
+  switch ( rng_range( 0, 5 ) ) {
+  case 0: *width = 1; *height = rng_range( 1, max_dim ); break;
+  case 1: *width = rng_range( 1, max_dim ); *height = 1; break;
+  case 2: *width = rng_range( 1, 4 ); *height = rng_range( 1, 4 ); break;
+  case 3: *width = *height = rng_range( 1, max_dim ); break;
+  default: *width = rng_range( 1, max_dim ); *height = rng_range( 1, max_dim ); break;
+  }
+}
+
+// Fill an image with random pixels. Some images only use a few
+// distinct channel values, so that neighboring pixels often have
+// equal or opposite differences (exercising the tie-breaking in
+// get_max_diff); others are fully random or extreme (0/255).
+void random_pixels( struct Image *img ) {
+  int style = rng_range( 0, 2 );
+  size_t num_pixels = (size_t) img->width * img->height;
+
+  for ( size_t i = 0; i < num_pixels; ++i ) {
+    uint32_t c[4];
+    for ( int k = 0; k < 4; ++k ) {
+      if ( style == 0 )
+        c[k] = 128 + 8 * rng_range( -2, 2 );
+      else if ( style == 1 )
+        c[k] = rng_range( 0, 1 ) ? 255 : 0;
+      else
+        c[k] = rng_range( 0, 255 );
+    }
+    img->data[i] = make_pixel( c[0], c[1], c[2], c[3] );
+  }
+}
+
+void usage( const char *progname ) {
+  fprintf( stderr, "Usage: %s [options]\n", progname );
+  fprintf( stderr, "Options:\n" );
+  fprintf( stderr, "  --iterations=<n>  number of random images to test (default 2000)\n" );
+  fprintf( stderr, "  --seed=<n>        seed of the first image (default 1)\n" );
+  fprintf( stderr, "  --max-dim=<n>     maximum width/height (default 64)\n" );
+  exit( 1 );
+}
+
+int main( int argc, char **argv ) {
+  long iterations = 2000;
+  uint64_t seed = 1;
+  long max_dim = 64;
+
+  for ( int i = 1; i < argc; ++i ) {
+    char *end = NULL;
+    if ( strncmp( argv[i], "--iterations=", 13 ) == 0 )
+      iterations = strtol( argv[i] + 13, &end, 10 );
+    else if ( strncmp( argv[i], "--seed=", 7 ) == 0 )
+      seed = strtoull( argv[i] + 7, &end, 10 );
+    else if ( strncmp( argv[i], "--max-dim=", 10 ) == 0 )
+      max_dim = strtol( argv[i] + 10, &end, 10 );
+    else
+      usage( argv[0] );
+    if ( *end != '\0' || iterations < 1 || max_dim < 1 || max_dim > 32768 )
+      usage( argv[0] );
+  }
+
+  for ( long n = 0; n < iterations; ++n, ++seed ) {
+    // each image is generated from its own seed, so any failure
+    // can be rerun with --seed=<seed> --iterations=1
+    rng_seed( seed );
+
+    int32_t width, height;
+    random_dims( (int32_t) max_dim, &width, &height );
+
+    struct Image input;
+    if ( img_init( &input, width, height ) != IMG_SUCCESS ) {
+      fprintf( stderr, "Error: couldn't allocate %dx%d image\n", width, height );
+      return 1;
+    }
+    random_pixels( &input );
+
+    if ( !check_all( &input, (uint32_t) rng_next() ) ) {
+      printf( "Failed with --seed=%llu --max-dim=%ld\n", (unsigned long long) seed, max_dim );
+      return 1;
+    }
+    img_cleanup( &input );
+  }
+
+  printf( "%ld random images, %d kernel variants: all outputs identical\n", iterations, num_kernel_variants );
+  return 0;
+}
+
+#endif
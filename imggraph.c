@@ -0,0 +1,672 @@
+// Lazily evaluated graphs of image transformations (see imggraph.h)
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ellipse_mask.h"
+#include "jit.h"
+#include "imggraph.h"
+
+// estimated cost per pixel (in the units of struct Transformation's
+// cost) of writing a full intermediate image and reading it back
+#define MATERIALIZE_COST 4
+
+// L2 cache size to assume if the system doesn't report one
+#define DEFAULT_L2_BYTES (1024 * 1024)
+
+struct ImgGraph *graph_create(void) {
+  return (struct ImgGraph *) calloc(1, sizeof(struct ImgGraph));
+}
+
+static void release_image(struct GraphNode *node) {
+  if (!node->have_img) {
+    return;
+  }
+  if (node->mapped) {
+    img_unmap(&node->img);
+  } else {
+    img_cleanup(&node->img);
+  }
+  node->have_img = 0;
+}
+
+void graph_destroy(struct ImgGraph *graph) {
+  if (graph == NULL) {
+    return;
+  }
+  for (int i = 0; i < graph->num_nodes; i++) {
+    release_image(graph->nodes[i]);
+    free(graph->nodes[i]->filename);
+    free(graph->nodes[i]);
+  }
+  for (int i = 0; i < graph->num_outputs; i++) {
+    free(graph->outputs[i].filename);
+  }
+  free(graph->nodes);
+  free(graph->outputs);
+  free(graph);
+}
+
+static struct GraphNode *add_node(struct ImgGraph *graph) {
+  struct GraphNode *node = (struct GraphNode *) calloc(1, sizeof(struct GraphNode));
+  if (node == NULL) {
+    return NULL;
+  }
+  struct GraphNode **nodes = (struct GraphNode **) realloc(graph->nodes, (graph->num_nodes + 1) * sizeof(*nodes));
+  if (nodes == NULL) {
+    free(node);
+    return NULL;
+  }
+  graph->nodes = nodes;
+  node->id = graph->num_nodes;
+  graph->nodes[graph->num_nodes++] = node;
+  graph->planned = 0;
+  return node;
+}
+
+struct GraphNode *graph_read(struct ImgGraph *graph, const char *filename) {
+  char *copy = strdup(filename);
+  struct GraphNode *node = copy ? add_node(graph) : NULL;
+  if (node == NULL) {
+    free(copy);
+    return NULL;
+  }
+  node->filename = copy;
+  return node;
+}
+
+struct GraphNode *graph_input(struct ImgGraph *graph, struct Image *img) {
+  struct GraphNode *node = add_node(graph);
+  if (node != NULL) {
+    node->source = img;
+  }
+  return node;
+}
+
+struct GraphNode *graph_apply(struct ImgGraph *graph, struct GraphNode *input, const char *transformation,
+                              int argc, char **argv) {
+  const struct Transformation *xform = find_transformation(transformation);
+  if (xform == NULL || input == NULL) {
+    return NULL;
+  }
+  struct GraphNode *node = add_node(graph);
+  if (node != NULL) {
+    node->xform = xform;
+    node->input = input;
+    node->argc = argc;
+    node->argv = argv;
+  }
+  return node;
+}
+
+int graph_write(struct ImgGraph *graph, struct GraphNode *node, const char *filename) {
+  char *copy = strdup(filename);
+  struct GraphOutput *outputs = copy ? (struct GraphOutput *) realloc(graph->outputs,
+                                                                      (graph->num_outputs + 1) * sizeof(*outputs)) : NULL;
+  if (outputs == NULL) {
+    free(copy);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+  graph->outputs = outputs;
+  graph->outputs[graph->num_outputs].node = node;
+  graph->outputs[graph->num_outputs].filename = copy;
+  graph->num_outputs++;
+  graph->planned = 0;
+  return IMG_SUCCESS;
+}
+
+void graph_keep(struct ImgGraph *graph, struct GraphNode *node) {
+  node->keep = 1;
+  graph->planned = 0;
+}
+
+static struct GraphNode *resolve(struct GraphNode *node) {
+  while (node->alias != NULL) {
+    node = node->alias;
+  }
+  return node;
+}
+
+// Whether a transformation has to see its whole input at once
+static int is_global(const struct Transformation *xform) {
+  return xform->kind == XFORM_GLOBAL || xform->apply_band == NULL;
+}
+
+static int same_args(const struct GraphNode *a, const struct GraphNode *b) {
+  if (a->argc != b->argc) {
+    return 0;
+  }
+  for (int i = 4; i < a->argc; i++) {
+    if (strcmp(a->argv[i], b->argv[i]) != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Find the live nodes (those an output depends on), and count how
+// many live transformations use each one. Inputs are resolved to the
+// nodes their aliases stand for.
+static void count_consumers(struct ImgGraph *graph) {
+  for (int i = 0; i < graph->num_nodes; i++) {
+    struct GraphNode *node = graph->nodes[i];
+    node->live = node->requested = node->consumers = node->feeds_global = 0;
+  }
+  for (int i = 0; i < graph->num_nodes; i++) {
+    if (graph->nodes[i]->keep) {
+      // the image of an alias is that of the node it stands for
+      struct GraphNode *node = resolve(graph->nodes[i]);
+      node->live = node->keep = 1;
+    }
+  }
+  for (int i = 0; i < graph->num_outputs; i++) {
+    struct GraphNode *node = resolve(graph->outputs[i].node);
+    node->live = node->requested = 1;
+  }
+
+  // inputs always come before the nodes using them
+  for (int i = graph->num_nodes - 1; i >= 0; i--) {
+    struct GraphNode *node = graph->nodes[i];
+    if (node->alias != NULL || (!node->live && node->consumers == 0)) {
+      continue;
+    }
+    node->live = 1;
+    if (node->xform != NULL) {
+      node->input = resolve(node->input);
+      node->input->consumers++;
+      if (is_global(node->xform)) {
+        node->input->feeds_global = 1;
+      }
+    }
+  }
+}
+
+// Apply one simplification to a pair of the same transformation,
+// where the first one isn't used by anything else.
+//
+// Returns:
+//   1 if the graph was changed, 0 if there was nothing to simplify
+static int simplify_pair(struct ImgGraph *graph) {
+  for (int i = 0; i < graph->num_nodes; i++) {
+    struct GraphNode *node = graph->nodes[i];
+    if (!node->live || node->xform == NULL) {
+      continue;
+    }
+    struct GraphNode *in = node->input;
+    if (in->xform != node->xform || in->consumers != 1 || in->keep || in->requested || !same_args(in, node)) {
+      continue;
+    }
+
+    // a pair that cancels out must still fail on an image it doesn't
+    // apply to, which isn't known until the sources are read
+    if ((node->xform->flags & XFORM_INVOLUTION) && !(node->xform->flags & XFORM_SQUARE_ONLY)) {
+      node->alias = in->input;
+      node->rewrite = "cancels out with the same transformation before it";
+      in->rewrite = "cancels out with the same transformation after it";
+      return 1;
+    }
+    if (node->xform->flags & XFORM_IDEMPOTENT) {
+      node->input = in->input;
+      in->rewrite = "repeated by the transformation after it";
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Drop a mask transformation followed by another one, with only point
+// transformations in between: none of them move pixels, so the second
+// mask overwrites everything outside the ellipse anyway, and the first
+// one has no effect.
+//
+// Returns:
+//   1 if the graph was changed, 0 if there was nothing to drop
+static int drop_masked(struct ImgGraph *graph) {
+  for (int i = 0; i < graph->num_nodes; i++) {
+    struct GraphNode *node = graph->nodes[i];
+    if (!node->live || node->xform == NULL || node->xform->kind != XFORM_MASK) {
+      continue;
+    }
+
+    // walk back through the point transformations, which must not be
+    // used by anything else
+    struct GraphNode *after = node, *in = node->input;
+    while (in->xform != NULL && in->xform->kind == XFORM_POINT
+           && in->consumers == 1 && !in->keep && !in->requested) {
+      after = in;
+      in = in->input;
+    }
+    if (in->xform != NULL && in->xform->kind == XFORM_MASK && in->consumers == 1 && !in->keep && !in->requested) {
+      after->input = in->input;
+      in->rewrite = "fully masked by the ellipse after it";
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Read the live sources and work out the dimensions of every live node.
+static int load_sources(struct ImgGraph *graph) {
+  for (int i = 0; i < graph->num_nodes; i++) {
+    struct GraphNode *node = graph->nodes[i];
+    if (!node->live || node->alias != NULL) {
+      continue;
+    }
+
+    if (node->xform != NULL) {
+      node->width = node->input->width;
+      node->height = node->input->height;
+      if (node->xform->output_size != NULL
+          && !node->xform->output_size(&node->width, &node->height, node->argc, node->argv)) {
+        return GRAPH_ERR_TRANSFORM_FAILED;
+      }
+      if ((node->xform->flags & XFORM_SQUARE_ONLY) && node->width != node->height) {
+        return GRAPH_ERR_TRANSFORM_FAILED;
+      }
+    } else if (node->source != NULL) {
+      // not owned, so have_img stays 0
+      node->img = *node->source;
+      node->width = node->img.width;
+      node->height = node->img.height;
+    } else if (!node->have_img) {
+      // raw images are mapped rather than read
+      node->mapped = img_map(node->filename, &node->img) == IMG_SUCCESS;
+      if (!node->mapped) {
+        int rc = img_read(node->filename, &node->img);
+        if (rc != IMG_SUCCESS) {
+          return rc;
+        }
+      }
+      node->have_img = 1;
+      node->width = node->img.width;
+      node->height = node->img.height;
+    }
+  }
+  return IMG_SUCCESS;
+}
+
+// The nearest node before this one which is computed as a full image
+static struct GraphNode *chain_base(struct GraphNode *node) {
+  struct GraphNode *base = node->input;
+  while (!base->materialize) {
+    base = base->input;
+  }
+  return base;
+}
+
+int graph_plan(struct ImgGraph *graph) {
+  if (graph->planned) {
+    return IMG_SUCCESS;
+  }
+
+  // the counts change with every simplification
+  count_consumers(graph);
+  while (simplify_pair(graph) || drop_masked(graph)) {
+    count_consumers(graph);
+  }
+
+  int rc = load_sources(graph);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+
+  for (int i = 0; i < graph->num_nodes; i++) {
+    struct GraphNode *node = graph->nodes[i];
+    node->materialize = node->pending = 0;
+    if (!node->live || node->alias != NULL) {
+      continue;
+    }
+    if (node->xform == NULL) {
+      node->materialize = 1;
+      node->chain_cost = 0;
+      continue;
+    }
+
+    struct GraphNode *in = node->input;
+    node->chain_cost = node->xform->cost + (in->materialize ? 0 : in->chain_cost);
+    if (node->keep || node->requested || node->feeds_global || is_global(node->xform)) {
+      node->materialize = 1;
+    } else if (node->consumers > 1) {
+      // each extra user would compute the whole fused chain again
+      node->materialize = node->chain_cost * (node->consumers - 1) > MATERIALIZE_COST;
+    }
+  }
+
+  for (int i = 0; i < graph->num_nodes; i++) {
+    struct GraphNode *node = graph->nodes[i];
+    if (node->materialize && node->xform != NULL) {
+      chain_base(node)->pending++;
+    }
+  }
+
+  graph->planned = 1;
+  return IMG_SUCCESS;
+}
+
+// Rows per band for a fused chain on images of the given dimensions
+static int32_t chain_band_rows(const struct ImgGraph *graph, int32_t width, int32_t height) {
+  size_t band_bytes = graph->band_bytes;
+  if (band_bytes == 0) {
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    band_bytes = (l2 > 0 ? (size_t) l2 : DEFAULT_L2_BYTES) / 3;
+  }
+
+  size_t rows = band_bytes / ((size_t) width * sizeof(uint32_t) + 1);
+  if (rows < 1) {
+    rows = 1;
+  }
+  if (rows > (size_t) height) {
+    rows = height;
+  }
+  return (int32_t) rows;
+}
+
+// The transformations of the fused chain ending at a node, from the
+// first to the last. The caller frees the array.
+static struct GraphNode **chain_nodes(struct GraphNode *node, int *count) {
+  struct GraphNode *base = chain_base(node);
+  int n = 0;
+  for (struct GraphNode *p = node; p != base; p = p->input) {
+    n++;
+  }
+
+  struct GraphNode **ops = (struct GraphNode **) malloc(n * sizeof(*ops));
+  if (ops != NULL) {
+    int i = n;
+    for (struct GraphNode *p = node; p != base; p = p->input) {
+      ops[--i] = p;
+    }
+  }
+  *count = n;
+  return ops;
+}
+
+// Flag the point transformations whose output only matters inside the
+// ellipse: those followed by a mask transformation, with only point
+// or mask transformations in between.
+static void find_masked(struct GraphNode **ops, int n, int *masked) {
+  int mask_after = 0;
+  for (int i = n - 1; i >= 0; i--) {
+    enum TransformKind kind = ops[i]->xform->kind;
+    masked[i] = (kind == XFORM_POINT) && mask_after;
+    if (kind == XFORM_MASK) {
+      mask_after = 1;
+    } else if (kind != XFORM_POINT) {
+      mask_after = 0;
+    }
+  }
+}
+
+// Apply a point transformation to just the pixels of a band inside the ellipse
+static void apply_in_mask(const struct Transformation *xform, struct Image *input, struct Image *output,
+                          int32_t first_row, int32_t full_height, const struct EllipseMask *mask) {
+  for (int32_t r = 0; r < input->height; r++) {
+    int32_t begin = mask->spans[2 * (first_row + r)], end = mask->spans[2 * (first_row + r) + 1];
+    if (end > begin) {
+      struct Image in_span = { end - begin, 1, input->data + (size_t) r * input->width + begin };
+      struct Image out_span = { end - begin, 1, output->data + (size_t) r * output->width + begin };
+      xform->apply_band(&in_span, &out_span, first_row + r, full_height);
+    }
+  }
+}
+
+// Get the operations of a chain for the JIT compiler.
+//
+// Returns:
+//   nonzero if the whole chain can be compiled (see jit_supported)
+static int chain_jit_ops(const struct ImgGraph *graph, struct GraphNode **ops, int n, int32_t width,
+                         enum JitOp *jit_ops) {
+  if (graph->no_jit || n > JIT_MAX_OPS) {
+    return 0;
+  }
+  for (int i = 0; i < n; i++) {
+    jit_ops[i] = ops[i]->xform->jit_op;
+  }
+  return jit_supported(jit_ops, n, width);
+}
+
+// Compute a node from the nearest full image before it, running the
+// transformations in between one band at a time. Each transformation
+// of the chain reads the previous one's band from a scratch buffer;
+// the first reads the full image and the last writes the node's image.
+// If the chain can be compiled, the kernel computes the rows instead.
+static int run_chain(struct ImgGraph *graph, struct GraphNode *node) {
+  int n;
+  struct GraphNode **ops = chain_nodes(node, &n);
+  struct GraphNode *base = chain_base(node);
+  int32_t width = node->width, height = node->height;
+  int32_t band_rows = chain_band_rows(graph, width, height);
+  size_t row_pixels = (size_t) width;
+
+  // need[i] is how many rows above a band transformation i has to
+  // compute, so that the transformations after it have their halos
+  int32_t *need = (int32_t *) malloc((n + 1) * sizeof(int32_t));
+  int *masked = (int *) malloc(n * sizeof(int));
+  uint32_t *scratch[2] = { NULL, NULL };
+  uint32_t *saved = NULL;
+  const struct EllipseMask *mask = NULL;
+  const struct JitKernel *kernel = NULL;
+  int rc = IMG_ERR_MALLOC_FAILED;
+
+  if (ops == NULL || need == NULL || masked == NULL) {
+    goto done;
+  }
+  enum JitOp jit_ops[JIT_MAX_OPS];
+  if (chain_jit_ops(graph, ops, n, width, jit_ops)) {
+    // if it can't be compiled after all, the bands are used
+    kernel = jit_get(jit_ops, n, width);
+  }
+  need[n] = 0;
+  for (int i = n - 1; i >= 0; i--) {
+    need[i] = need[i + 1] + ops[i]->xform->halo_rows;
+  }
+  find_masked(ops, n, masked);
+
+  int any_masked = 0;
+  for (int i = 0; i < n; i++) {
+    any_masked |= masked[i];
+  }
+  if (any_masked) {
+    // without the mask, the transformations just do the extra work
+    mask = ellipse_mask_get(width, height);
+    if (mask == NULL) {
+      memset(masked, 0, n * sizeof(int));
+    }
+  }
+
+  size_t scratch_pixels = (size_t) (band_rows + need[0]) * row_pixels;
+  for (int i = 0; i < 2 && i < n - 1; i++) {
+    scratch[i] = (uint32_t *) malloc(scratch_pixels * sizeof(uint32_t) + 1);
+    if (scratch[i] == NULL) {
+      goto done;
+    }
+  }
+  saved = (uint32_t *) malloc((size_t) ops[n - 1]->xform->halo_rows * row_pixels * sizeof(uint32_t) + 1);
+  node->img.data = (uint32_t *) malloc(row_pixels * height * sizeof(uint32_t) + 1);
+  if (saved == NULL || node->img.data == NULL) {
+    free(node->img.data);
+    goto done;
+  }
+  node->img.width = width;
+  node->img.height = height;
+  node->have_img = 1;
+  node->mapped = 0;
+
+  // an output is added to the histogram as its rows are written
+  struct StatsHistogram *hist = (node->requested || node->keep) ? graph->histogram : NULL;
+
+  // a kernel computes every row except the top row of an emboss, which
+  // is left to the bands
+  int32_t band_end = height;
+  if (kernel != NULL) {
+    band_end = kernel->emboss && height > 0 ? 1 : 0;
+  }
+
+  for (int32_t row = 0; row < band_end; row += band_rows) {
+    int32_t end = band_end - row < band_rows ? band_end : row + band_rows;
+    // the current band starts at row cur_start of the image
+    uint32_t *cur = base->img.data;
+    int32_t cur_start = 0;
+
+    for (int i = 0; i < n; i++) {
+      int32_t start = row - need[i] > 0 ? row - need[i] : 0;
+      int last = (i == n - 1);
+      struct Image in = { width, end - start, cur + (size_t) (start - cur_start) * row_pixels };
+      struct Image out = { width, end - start, last ? node->img.data + (size_t) start * row_pixels : scratch[i % 2] };
+
+      // the last transformation's halo rows overlap the previous band's
+      // output, which has to be preserved (as in ts_emboss)
+      size_t overlap = last ? (size_t) (row - start) * row_pixels : 0;
+      if (overlap > 0) {
+        memcpy(saved, out.data, overlap * sizeof(uint32_t));
+      }
+
+      if (masked[i]) {
+        apply_in_mask(ops[i]->xform, &in, &out, start, height, mask);
+      } else {
+        ops[i]->xform->apply_band(&in, &out, start, height);
+      }
+
+      if (overlap > 0) {
+        memcpy(out.data, saved, overlap * sizeof(uint32_t));
+      }
+      cur = out.data;
+      cur_start = start;
+    }
+    if (hist != NULL) {
+      stats_histogram_add(hist, node->img.data + (size_t) row * row_pixels, (size_t) (end - row) * row_pixels);
+    }
+  }
+
+  for (int32_t row = band_end; row < height; row++) {
+    const uint32_t *in = base->img.data + (size_t) row * row_pixels;
+    kernel->row(in, row > 0 ? in - row_pixels : in, node->img.data + (size_t) row * row_pixels);
+    if (hist != NULL) {
+      stats_histogram_add(hist, node->img.data + (size_t) row * row_pixels, row_pixels);
+    }
+  }
+  node->histogram_done = hist != NULL;
+  rc = IMG_SUCCESS;
+
+done:
+  if (kernel != NULL) {
+    jit_release(kernel);
+  }
+  if (mask != NULL) {
+    ellipse_mask_release(mask);
+  }
+  free(saved);
+  free(scratch[0]);
+  free(scratch[1]);
+  free(masked);
+  free(need);
+  free(ops);
+  return rc;
+}
+
+// Compute a node as a full image.
+static int run_node(struct ImgGraph *graph, struct GraphNode *node) {
+  if (!is_global(node->xform)) {
+    return run_chain(graph, node);
+  }
+
+  int rc = img_init(&node->img, node->width, node->height);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+  node->have_img = 1;
+  node->mapped = 0;
+  return node->xform->apply(&node->input->img, &node->img, node->argc, node->argv)
+    ? IMG_SUCCESS : GRAPH_ERR_TRANSFORM_FAILED;
+}
+
+int graph_run(struct ImgGraph *graph) {
+  int rc = graph_plan(graph);
+
+  for (int i = 0; i < graph->num_nodes && rc == IMG_SUCCESS; i++) {
+    struct GraphNode *node = graph->nodes[i];
+    if (!node->live || !node->materialize || node->alias != NULL) {
+      continue;
+    }
+
+    if (node->xform != NULL) {
+      rc = run_node(graph, node);
+      if (rc != IMG_SUCCESS) {
+        break;
+      }
+      struct GraphNode *base = chain_base(node);
+      if (--base->pending == 0 && !base->keep) {
+        release_image(base);
+      }
+    }
+
+    // anything not added as it was computed is added now
+    if (graph->histogram != NULL && (node->requested || node->keep) && !node->histogram_done) {
+      stats_histogram_add(graph->histogram, node->img.data, (size_t) node->img.width * node->img.height);
+      node->histogram_done = 1;
+    }
+
+    for (int j = 0; j < graph->num_outputs && rc == IMG_SUCCESS; j++) {
+      if (resolve(graph->outputs[j].node) == node) {
+        rc = img_write(graph->outputs[j].filename, &node->img);
+      }
+    }
+    if (node->pending == 0 && !node->keep) {
+      release_image(node);
+    }
+  }
+
+  return rc;
+}
+
+struct Image *graph_result(struct GraphNode *node) {
+  node = resolve(node);
+  if (node->source != NULL) {
+    return node->source;
+  }
+  return node->have_img ? &node->img : NULL;
+}
+
+void graph_print_plan(struct ImgGraph *graph, FILE *out) {
+  for (int i = 0; i < graph->num_nodes; i++) {
+    struct GraphNode *node = graph->nodes[i];
+
+    if (node->rewrite != NULL) {
+      fprintf(out, "#%d %s: dropped, %s\n", node->id, node->xform->name, node->rewrite);
+    } else if (!node->live) {
+      fprintf(out, "#%d: not needed\n", node->id);
+    } else if (node->xform == NULL) {
+      fprintf(out, "#%d = %s (%dx%d)\n", node->id, node->filename ? node->filename : "input image",
+              node->width, node->height);
+    } else if (node->materialize && is_global(node->xform)) {
+      fprintf(out, "#%d = %s of #%d, whole image\n", node->id, node->xform->name, node->input->id);
+    } else if (node->materialize) {
+      int n;
+      struct GraphNode **ops = chain_nodes(node, &n);
+      int *masked = (int *) malloc(n * sizeof(int));
+      if (ops == NULL || masked == NULL) {
+        free(ops);
+        free(masked);
+        continue;
+      }
+      find_masked(ops, n, masked);
+
+      fprintf(out, "#%d = #%d", node->id, chain_base(node)->id);
+      for (int j = 0; j < n; j++) {
+        fprintf(out, " -> %s%s", ops[j]->xform->name, masked[j] ? " (inside the ellipse only)" : "");
+      }
+      enum JitOp jit_ops[JIT_MAX_OPS];
+      if (chain_jit_ops(graph, ops, n, node->width, jit_ops)) {
+        fprintf(out, ", compiled to one loop per row\n");
+      } else {
+        fprintf(out, ", fused in %d-row bands\n", chain_band_rows(graph, node->width, node->height));
+      }
+      free(ops);
+      free(masked);
+    }
+  }
+
+  for (int i = 0; i < graph->num_outputs; i++) {
+    fprintf(out, "write #%d to %s\n", resolve(graph->outputs[i].node)->id, graph->outputs[i].filename);
+  }
+}
@@ -0,0 +1,174 @@
+#ifndef IMGGRAPH_H
+#define IMGGRAPH_H
+
+#include <stdio.h>
+#include "image.h"
+#include "transforms.h"
+#include "stats.h"
+
+// A graph of image operations which is only executed when its
+// outputs are requested. Callers add sources (image files or images
+// in memory), transformations of earlier nodes (any node can feed
+// several transformations) and outputs, then call graph_run, which
+// plans and executes the whole graph at once:
+//
+//  - nodes that no output depends on are never computed
+//  - adjacent pairs of the same transformation are simplified using
+//    the XFORM_INVOLUTION and XFORM_IDEMPOTENT flags (e.g. two
+//    complements cancel out, and a second ellipse is dropped)
+//  - chains of band transformations (everything except XFORM_GLOBAL)
+//    are fused: they run one band of rows at a time, with the band
+//    size chosen so that the intermediate bands stay in the L2 cache,
+//    and neighborhood transformations (emboss) recompute the halo rows
+//    they need above each band
+//  - point transformations followed by an ellipse are only applied to
+//    the pixels inside it, since the others are overwritten anyway
+//  - chains of complements with at most one emboss are compiled to one
+//    loop per row (see jit.h) instead, unless no_jit is set
+//  - a node used by several transformations is computed once into a
+//    full image, unless recomputing its fused chain for each user is
+//    cheaper (by the cost estimates in struct Transformation)
+//
+// Only the requested outputs, sources, inputs of XFORM_GLOBAL
+// transformations and shared nodes are ever held as full images.
+// Intermediate images are freed as soon as nothing else needs them.
+
+// graph_run result when a transformation can't be applied (e.g.
+// transpose of an image that isn't square)
+#define GRAPH_ERR_TRANSFORM_FAILED -100
+
+struct GraphNode {
+  int id;
+  // the transformation, or NULL for a source
+  const struct Transformation *xform;
+  struct GraphNode *input;
+  // the transformation's arguments, as for struct Transformation
+  int argc;
+  char **argv;
+  // a source is either read from a file, or an image given by the caller
+  char *filename;
+  struct Image *source;
+  // nonzero if the caller wants the image (see graph_result)
+  int keep;
+
+  // set by graph_plan
+  struct GraphNode *alias;  // if non-NULL, this node is equivalent to alias
+  const char *rewrite;      // why the node was simplified away, if it was
+  int live;
+  int requested;            // nonzero if an output is written from this node
+  int consumers;            // number of live transformations using this node
+  int feeds_global;         // nonzero if an XFORM_GLOBAL transformation uses it
+  int materialize;          // nonzero if the node is computed as a full image
+  int chain_cost;           // cost per pixel of computing it from the nearest full image
+  int32_t width;
+  int32_t height;
+
+  // set by graph_run
+  struct Image img;
+  int have_img;
+  int mapped;
+  int pending;              // transformations still to read img
+  int histogram_done;       // nonzero once img is in the graph's histogram
+};
+
+struct GraphOutput {
+  struct GraphNode *node;
+  char *filename;
+};
+
+struct ImgGraph {
+  struct GraphNode **nodes;
+  int num_nodes;
+  struct GraphOutput *outputs;
+  int num_outputs;
+  int planned;
+  // bytes of pixels per band in fused chains; 0 (the default) means a
+  // third of the L2 cache size, leaving room for the input, an
+  // intermediate and the output band
+  size_t band_bytes;
+  // nonzero to run every chain in bands, even if it could be compiled
+  int no_jit;
+  // if non-NULL, the pixels of every output (written or kept) are added
+  // to this histogram: by fused chains a band or row at a time, as soon
+  // as it's written, and otherwise in a pass over the finished image
+  struct StatsHistogram *histogram;
+};
+
+// Create an empty graph.
+//
+// Returns:
+//   pointer to the graph, or NULL if memory couldn't be allocated
+struct ImgGraph *graph_create(void);
+
+// Free a graph, its nodes and all images it computed (but not the
+// images given to graph_input).
+void graph_destroy(struct ImgGraph *graph);
+
+// Add a source node which reads an image file (see img_read) when the
+// graph is run.
+//
+// Returns:
+//   pointer to the node, or NULL if memory couldn't be allocated
+struct GraphNode *graph_read(struct ImgGraph *graph, const char *filename);
+
+// Add a source node for an image in memory. The image is only read,
+// and must remain valid until the graph is destroyed.
+//
+// Returns:
+//   pointer to the node, or NULL if memory couldn't be allocated
+struct GraphNode *graph_input(struct ImgGraph *graph, struct Image *img);
+
+// Add a node which applies a transformation to another node.
+//
+// Parameters:
+//   graph - pointer to the graph
+//   input - the node to transform
+//   transformation - name of the transformation (see find_transformation)
+//   argc, argv - the transformation arguments, starting at argv[4]
+//                (the arrays must remain valid until the graph is run)
+//
+// Returns:
+//   pointer to the node, or NULL if the transformation doesn't exist
+//   or memory couldn't be allocated
+struct GraphNode *graph_apply(struct ImgGraph *graph, struct GraphNode *input, const char *transformation,
+                              int argc, char **argv);
+
+// Request that a node's image be written to a file (see img_write).
+//
+// Returns:
+//   IMG_SUCCESS, or IMG_ERR_MALLOC_FAILED
+int graph_write(struct ImgGraph *graph, struct GraphNode *node, const char *filename);
+
+// Request that a node's image be kept, so that graph_result can return
+// it after the graph is run.
+void graph_keep(struct ImgGraph *graph, struct GraphNode *node);
+
+// Plan the execution of the graph: read the sources that are needed
+// (to learn the image dimensions), simplify it, and decide which nodes
+// are computed as full images. graph_run plans the graph if this
+// hasn't been done yet.
+//
+// Returns:
+//   IMG_SUCCESS if successful, GRAPH_ERR_TRANSFORM_FAILED if a
+//   transformation can't be applied to its input, otherwise one of
+//   the IMG_ERR_* values
+int graph_plan(struct ImgGraph *graph);
+
+// Print the plan, one line per step, for --plan.
+void graph_print_plan(struct ImgGraph *graph, FILE *out);
+
+// Compute all requested outputs.
+//
+// Returns:
+//   IMG_SUCCESS if successful, GRAPH_ERR_TRANSFORM_FAILED if a
+//   transformation failed, otherwise one of the IMG_ERR_* values
+int graph_run(struct ImgGraph *graph);
+
+// Get the image computed for a node passed to graph_keep. It remains
+// valid until the graph is destroyed.
+//
+// Returns:
+//   pointer to the image, or NULL if it wasn't computed
+struct Image *graph_result(struct GraphNode *node);
+
+#endif // IMGGRAPH_H
@@ -0,0 +1,248 @@
+// Load generator for the image processing server: sends the same
+// request many times over several connections and reports throughput
+// and latency. With --exec, it runs a separate process per request
+// instead, for comparison.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "image.h"
+#include "imgproc_proto.h"
+
+#define MAX_CONNECTIONS 256
+
+extern char **environ;
+
+struct Options {
+  const char *socket_path;
+  int connections;
+  long requests;
+  const char *exec_program;
+  int num_args;
+  char **args;  // transformation, input file, transformation arguments
+};
+
+// A client thread and the latencies of the requests it sent
+struct Client {
+  pthread_t thread;
+  int id;
+  uint64_t *latencies;
+  long count;
+  int failed;
+};
+
+static struct Options s_opts;
+static const void *s_fields[PROTO_MAX_FIELDS];
+static size_t s_lens[PROTO_MAX_FIELDS];
+static uint32_t s_num_fields;
+
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static long s_remaining;
+
+void usage( const char *progname ) {
+  fprintf( stderr, "Usage: %s [options] <transform> <input img> [args...]\n", progname );
+  fprintf( stderr, "Options:\n" );
+  fprintf( stderr, "  --socket=<path>     server socket (default %s)\n", PROTO_DEFAULT_SOCKET );
+  fprintf( stderr, "  --connections=<n>   number of concurrent connections (default 4)\n" );
+  fprintf( stderr, "  --requests=<n>      total number of requests (default 200)\n" );
+  fprintf( stderr, "  --exec=<program>    instead of using the server, run <program>\n" );
+  fprintf( stderr, "                      (e.g. ./c_imgproc) once per request\n" );
+  exit( 1 );
+}
+
+uint64_t now_ns( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+// Claim the next request to send. Returns 0 when all have been sent.
+int next_request( void ) {
+  pthread_mutex_lock( &s_lock );
+  int more = s_remaining > 0;
+  if ( more )
+    --s_remaining;
+  pthread_mutex_unlock( &s_lock );
+  return more;
+}
+
+int send_request( int fd, struct ProtoMessage *response ) {
+  return proto_send( fd, s_num_fields, s_fields, s_lens ) && proto_recv( fd, response ) == 1
+    && response->num_fields == 2 && strcmp( (const char *) response->fields[0], PROTO_STATUS_OK ) == 0;
+}
+
+int exec_request( int id ) {
+  char output[64];
+  snprintf( output, sizeof( output ), "/tmp/imgloadgen-%ld-%d.png", (long) getpid(), id );
+
+  char *argv[PROTO_MAX_FIELDS + 2];
+  int argc = 0;
+  argv[argc++] = (char *) s_opts.exec_program;
+  argv[argc++] = s_opts.args[0];
+  argv[argc++] = s_opts.args[1];
+  argv[argc++] = output;
+  for ( int i = 2; i < s_opts.num_args; ++i )
+    argv[argc++] = s_opts.args[i];
+  argv[argc] = NULL;
+
+  pid_t pid;
+  int status;
+  if ( posix_spawn( &pid, s_opts.exec_program, NULL, NULL, argv, environ ) != 0
+       || waitpid( pid, &status, 0 ) != pid )
+    return 0;
+  remove( output );
+  return WIFEXITED( status ) && WEXITSTATUS( status ) == 0;
+}
+
+void *client_main( void *arg ) {
+  struct Client *c = (struct Client *) arg;
+  struct ProtoMessage response = { 0 };
+
+  int fd = -1;
+  if ( s_opts.exec_program == NULL ) {
+    fd = proto_connect( s_opts.socket_path );
+    if ( fd < 0 ) {
+      c->failed = 1;
+      return NULL;
+    }
+  }
+
+  while ( next_request() ) {
+    uint64_t start = now_ns();
+    int ok = fd >= 0 ? send_request( fd, &response ) : exec_request( c->id );
+    if ( !ok ) {
+      c->failed = 1;
+      break;
+    }
+    c->latencies[c->count++] = now_ns() - start;
+  }
+
+  if ( fd >= 0 )
+    close( fd );
+  proto_free( &response );
+  return NULL;
+}
+
+int compare_u64( const void *a, const void *b ) {
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return ( x > y ) - ( x < y );
+}
+
+unsigned char *read_file( const char *filename, size_t *len ) {
+  FILE *in = fopen( filename, "rb" );
+  if ( in == NULL )
+    return NULL;
+  fseek( in, 0, SEEK_END );
+  long size = ftell( in );
+  fseek( in, 0, SEEK_SET );
+  unsigned char *data = size >= 0 ? (unsigned char *) malloc( (size_t) size + 1 ) : NULL;
+  if ( data != NULL && fread( data, 1, (size_t) size, in ) != (size_t) size ) {
+    free( data );
+    data = NULL;
+  }
+  fclose( in );
+  *len = (size_t) size;
+  return data;
+}
+
+int main( int argc, char **argv ) {
+  s_opts.socket_path = PROTO_DEFAULT_SOCKET;
+  s_opts.connections = 4;
+  s_opts.requests = 200;
+
+  int i;
+  for ( i = 1; i < argc && strncmp( argv[i], "--", 2 ) == 0; ++i ) {
+    char *end = NULL;
+    if ( strncmp( argv[i], "--socket=", 9 ) == 0 )
+      s_opts.socket_path = argv[i] + 9;
+    else if ( strncmp( argv[i], "--connections=", 14 ) == 0 )
+      s_opts.connections = (int) strtol( argv[i] + 14, &end, 10 );
+    else if ( strncmp( argv[i], "--requests=", 11 ) == 0 )
+      s_opts.requests = strtol( argv[i] + 11, &end, 10 );
+    else if ( strncmp( argv[i], "--exec=", 7 ) == 0 )
+      s_opts.exec_program = argv[i] + 7;
+    else
+      usage( argv[0] );
+    if ( end != NULL && *end != '\0' )
+      usage( argv[0] );
+  }
+  if ( argc - i < 2 || argc - i + 2 > PROTO_MAX_FIELDS || s_opts.connections < 1
+       || s_opts.connections > MAX_CONNECTIONS || s_opts.requests < 1 )
+    usage( argv[0] );
+  s_opts.num_args = argc - i;
+  s_opts.args = argv + i;
+
+  // the request is the same every time
+  size_t input_len;
+  unsigned char *input_data = read_file( s_opts.args[1], &input_len );
+  struct Image img;
+  if ( input_data == NULL || img_read_mem( input_data, input_len, &img ) != IMG_SUCCESS ) {
+    fprintf( stderr, "Error: couldn't read input image\n" );
+    return 1;
+  }
+  double megapixels = (double) img.width * img.height / 1e6;
+  img_cleanup( &img );
+
+  s_fields[0] = PROTO_MODE_MEM;
+  s_fields[1] = s_opts.args[0];
+  s_fields[2] = input_data;
+  s_fields[3] = "";
+  s_lens[0] = strlen( PROTO_MODE_MEM );
+  s_lens[1] = strlen( s_opts.args[0] );
+  s_lens[2] = input_len;
+  s_lens[3] = 0;
+  s_num_fields = 4;
+  for ( int j = 2; j < s_opts.num_args; ++j ) {
+    s_fields[s_num_fields] = s_opts.args[j];
+    s_lens[s_num_fields] = strlen( s_opts.args[j] );
+    ++s_num_fields;
+  }
+
+  s_remaining = s_opts.requests;
+  struct Client clients[MAX_CONNECTIONS];
+  uint64_t start = now_ns();
+  for ( int c = 0; c < s_opts.connections; ++c ) {
+    clients[c].id = c;
+    clients[c].latencies = (uint64_t *) malloc( s_opts.requests * sizeof( uint64_t ) );
+    clients[c].count = 0;
+    clients[c].failed = 0;
+    pthread_create( &clients[c].thread, NULL, client_main, &clients[c] );
+  }
+
+  // gather all latencies
+  uint64_t *latencies = (uint64_t *) malloc( s_opts.requests * sizeof( uint64_t ) );
+  long count = 0;
+  int failed = 0;
+  for ( int c = 0; c < s_opts.connections; ++c ) {
+    pthread_join( clients[c].thread, NULL );
+    memcpy( latencies + count, clients[c].latencies, clients[c].count * sizeof( uint64_t ) );
+    count += clients[c].count;
+    failed |= clients[c].failed;
+    free( clients[c].latencies );
+  }
+  double elapsed = ( now_ns() - start ) / 1e9;
+  free( input_data );
+
+  if ( failed )
+    fprintf( stderr, "Error: some requests failed (is the server running?)\n" );
+  if ( count == 0 ) {
+    free( latencies );
+    return 1;
+  }
+
+  qsort( latencies, count, sizeof( uint64_t ), compare_u64 );
+  printf( "%s: %ld requests, %d connection(s), %.2f s\n",
+          s_opts.exec_program ? s_opts.exec_program : s_opts.socket_path, count, s_opts.connections, elapsed );
+  printf( "  throughput: %.1f requests/s, %.1f MP/s\n", count / elapsed, count * megapixels / elapsed );
+  printf( "  latency: p50 %.2f ms, p95 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+          latencies[count / 2] / 1e6, latencies[( count * 95 + 99 ) / 100 - 1] / 1e6,
+          latencies[( count * 99 + 99 ) / 100 - 1] / 1e6, latencies[count - 1] / 1e6 );
+
+  free( latencies );
+  return failed ? 1 : 0;
+}
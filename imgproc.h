@@ -61,6 +61,16 @@ int imgproc_transpose( struct Image *input_img, struct Image *output_img );
 //!                   transformed pixels should be stored)
 void imgproc_ellipse( struct Image *input_img, struct Image *output_img );
 
+//! The ellipse kernel used by the "ellipse" transformation. The C
+//! build uses the cached ellipse masks (see ellipse_mask.h), which
+//! give the same result as imgproc_ellipse; the asm build runs
+//! imgproc_ellipse itself, so that the asm kernel is what is tested.
+//!
+//! @param input_img pointer to the input Image
+//! @param output_img pointer to the output Image (in which the
+//!                   transformed pixels should be stored)
+void imgproc_ellipse_xform( struct Image *input_img, struct Image *output_img );
+
 //! Transform the input image using an "emboss" effect. The pixels
 //! of the source image are transformed as follows.
 //!
@@ -93,8 +103,69 @@ void imgproc_ellipse( struct Image *input_img, struct Image *output_img );
 //!                   transformed pixels should be stored)
 void imgproc_emboss( struct Image *input_img, struct Image *output_img );
 
+//! Rotate the input image 90 degrees clockwise: the pixel at row i
+//! and column j is copied to row j and column (height-1-i). The output
+//! image must be height pixels wide and width pixels high.
+//!
+//! @param input_img pointer to the input Image
+//! @param output_img pointer to the output Image (in which the
+//!                   transformed pixels should be stored)
+void imgproc_rotate90( struct Image *input_img, struct Image *output_img );
+
+//! Rotate the input image 180 degrees: the pixel at row i and column j
+//! is copied to row (height-1-i) and column (width-1-j).
+//!
+//! @param input_img pointer to the input Image
+//! @param output_img pointer to the output Image (in which the
+//!                   transformed pixels should be stored)
+void imgproc_rotate180( struct Image *input_img, struct Image *output_img );
+
+//! Rotate the input image 90 degrees counterclockwise: the pixel at
+//! row i and column j is copied to row (width-1-j) and column i. The
+//! output image must be height pixels wide and width pixels high.
+//!
+//! @param input_img pointer to the input Image
+//! @param output_img pointer to the output Image (in which the
+//!                   transformed pixels should be stored)
+void imgproc_rotate270( struct Image *input_img, struct Image *output_img );
+
+//! Mirror the input image left to right: the pixel at row i and
+//! column j is copied to row i and column (width-1-j).
+//!
+//! @param input_img pointer to the input Image
+//! @param output_img pointer to the output Image (in which the
+//!                   transformed pixels should be stored)
+void imgproc_flip_h( struct Image *input_img, struct Image *output_img );
+
+//! Mirror the input image top to bottom: the pixel at row i and
+//! column j is copied to row (height-1-i) and column j.
+//!
+//! @param input_img pointer to the input Image
+//! @param output_img pointer to the output Image (in which the
+//!                   transformed pixels should be stored)
+void imgproc_flip_v( struct Image *input_img, struct Image *output_img );
+
 // TODO: add prototypes for your helper functions
 
+//! number of pixels (one 64-byte cache line) in each row and column
+//! of the blocks imgproc_orient copies
+#define IMGPROC_ORIENT_BLOCK 16
+
+//! Copy each pixel of the input image to the output image at index
+//! origin + row*row_step + col*col_step. This is the micro-kernel of
+//! transpose, the rotations and the flips: the input is copied in
+//! square blocks of IMGPROC_ORIENT_BLOCK pixels, so that however the
+//! output is strided, each block reads and writes whole cache lines
+//! which all fit in the L1 cache.
+//!
+//! @param input_img pointer to the input Image
+//! @param output_img pointer to the output Image
+//! @param origin output index of the input's top left pixel
+//! @param row_step output index step from one input row to the next
+//! @param col_step output index step from one input column to the next
+void imgproc_orient( struct Image *input_img, struct Image *output_img,
+                     int64_t origin, int64_t row_step, int64_t col_step );
+
 //! retreives the r value for a pixel
 //!
 //! @param pixel pixel to retreive value from
@@ -129,15 +200,18 @@ uint32_t get_a( uint32_t pixel );
 uint32_t make_pixel( uint32_t r, uint32_t g, uint32_t b, uint32_t a );
 
 //! calculates the index number of a particular pixel in an Image's data field
-//! based its row and column values
+//! based its row and column values. The index is computed in 64 bits so
+//! that images with more than 2^31 pixels can be addressed.
 //!
 //! @param img pointer to the input image 
 //! @param row the row number of the image's pixel
 //! @param col the column number of the image's pixel
-//! @return int32_t value representing the pixel's position in the Image's data field 
-int32_t compute_index( struct Image *img, int32_t row, int32_t col );
+//! @return int64_t value representing the pixel's position in the Image's data field 
+int64_t compute_index( struct Image *img, int32_t row, int32_t col );
 
 //! determines whether or not a particular pixel in an image is in an ellipse.
+//! For an image one pixel wide (or high), the horizontal (or vertical)
+//! term of the ellipse equation is taken to be 0.
 //!
 //! @param img pointer to the input image 
 //! @param row the row number of the image's pixel
@@ -189,7 +263,7 @@ int32_t clamp_gray_value(int32_t value);
 //! @param current_pixel uint32_t value representing the current pixel's RGBA values
 //! @param alpha uint32_t value repesenting the current pixel's alpha value
 void process_interior_pixel(struct Image *input_img, struct Image *output_img, 
-                          int32_t row, int32_t col, int32_t index, uint32_t current_pixel,
+                          int32_t row, int32_t col, int64_t index, uint32_t current_pixel,
                           uint32_t alpha);
 
 #endif // IMGPROC_H
@@ -0,0 +1,128 @@
+// Image transformations for 16 bit per channel images
+
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "ellipse_mask.h"
+#include "imgproc16.h"
+
+// the red, green and blue bits of a pixel
+#define RGB16_MASK 0xFFFFFFFFFFFF0000ULL
+
+// side of the square blocks in which transpose copies pixels, so that
+// the rows being written stay in the cache
+#define TRANSPOSE16_BLOCK 16
+
+void imgproc16_complement(struct Image16 *input_img, struct Image16 *output_img) {
+  size_t num_pixels = (size_t) input_img->width * input_img->height;
+  const uint64_t *in = input_img->data;
+  uint64_t *out = output_img->data;
+  size_t i = 0;
+
+#ifdef __SSE2__
+  // two pixels per iteration
+  __m128i mask = _mm_set1_epi64x((long long) RGB16_MASK);
+  for (; i + 2 <= num_pixels; i += 2) {
+    __m128i p = _mm_loadu_si128((const __m128i *) (in + i));
+    _mm_storeu_si128((__m128i *) (out + i), _mm_xor_si128(p, mask));
+  }
+#endif
+
+  for (; i < num_pixels; i++) {
+    out[i] = in[i] ^ RGB16_MASK;
+  }
+}
+
+int imgproc16_transpose(struct Image16 *input_img, struct Image16 *output_img) {
+  int32_t n = input_img->width;
+  if (n != input_img->height) {
+    return 0;
+  }
+
+  for (int32_t row0 = 0; row0 < n; row0 += TRANSPOSE16_BLOCK) {
+    int32_t row_end = row0 + TRANSPOSE16_BLOCK < n ? row0 + TRANSPOSE16_BLOCK : n;
+    for (int32_t col0 = 0; col0 < n; col0 += TRANSPOSE16_BLOCK) {
+      int32_t col_end = col0 + TRANSPOSE16_BLOCK < n ? col0 + TRANSPOSE16_BLOCK : n;
+      for (int32_t row = row0; row < row_end; row++) {
+        const uint64_t *in = input_img->data + (size_t) row * n;
+        for (int32_t col = col0; col < col_end; col++) {
+          output_img->data[(size_t) col * n + row] = in[col];
+        }
+      }
+    }
+  }
+  return 1;
+}
+
+int imgproc16_ellipse(struct Image16 *input_img, struct Image16 *output_img) {
+  // the shape only depends on the dimensions, so the 8-bit masks apply
+  const struct EllipseMask *mask = ellipse_mask_get(input_img->width, input_img->height);
+  if (mask == NULL) {
+    return 0;
+  }
+
+  for (int32_t row = 0; row < input_img->height; row++) {
+    int32_t begin = mask->spans[2 * row], end = mask->spans[2 * row + 1];
+    size_t offset = (size_t) row * input_img->width + begin;
+    memcpy(output_img->data + offset, input_img->data + offset, (size_t) (end - begin) * sizeof(uint64_t));
+  }
+
+  ellipse_mask_release(mask);
+  return 1;
+}
+
+// Same rule as get_max_diff: the difference with the largest absolute
+// value, preferring red, then green, then blue
+static int32_t max_diff16(int32_t diff_r, int32_t diff_g, int32_t diff_b) {
+  int32_t abs_r = diff_r < 0 ? -diff_r : diff_r;
+  int32_t abs_g = diff_g < 0 ? -diff_g : diff_g;
+  int32_t abs_b = diff_b < 0 ? -diff_b : diff_b;
+
+  if (abs_r >= abs_g && abs_r >= abs_b) {
+    return diff_r;
+  } else if (abs_g >= abs_b) {
+    return diff_g;
+  } else {
+    return diff_b;
+  }
+}
+
+static uint64_t gray16(int32_t gray, uint64_t pixel) {
+  uint64_t g = (uint64_t) gray;
+  return (g << 48) | (g << 32) | (g << 16) | (pixel & 0xFFFFU);
+}
+
+void imgproc16_emboss(struct Image16 *input_img, struct Image16 *output_img) {
+  int32_t width = input_img->width;
+  int32_t height = input_img->height;
+
+  for (int32_t row = 0; row < height; row++) {
+    const uint64_t *in = input_img->data + (size_t) row * width;
+    uint64_t *out = output_img->data + (size_t) row * width;
+
+    if (row == 0) {
+      for (int32_t col = 0; col < width; col++) {
+        out[col] = gray16(32768, in[col]);
+      }
+      continue;
+    }
+
+    const uint64_t *above = in - width;
+    out[0] = gray16(32768, in[0]);
+    for (int32_t col = 1; col < width; col++) {
+      uint64_t p = in[col], n = above[col - 1];
+      int32_t diff_r = (int32_t) ((n >> 48) & 0xFFFF) - (int32_t) ((p >> 48) & 0xFFFF);
+      int32_t diff_g = (int32_t) ((n >> 32) & 0xFFFF) - (int32_t) ((p >> 32) & 0xFFFF);
+      int32_t diff_b = (int32_t) ((n >> 16) & 0xFFFF) - (int32_t) ((p >> 16) & 0xFFFF);
+
+      int32_t gray = 32768 + max_diff16(diff_r, diff_g, diff_b);
+      if (gray < 0) {
+        gray = 0;
+      } else if (gray > 65535) {
+        gray = 65535;
+      }
+      out[col] = gray16(gray, p);
+    }
+  }
+}
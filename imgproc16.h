@@ -0,0 +1,34 @@
+#ifndef IMGPROC16_H
+#define IMGPROC16_H
+
+#include <stdint.h>
+#include "image.h"
+
+// Versions of the image transformations for images with 16 bits per
+// channel (struct Image16). They follow the same rules as the imgproc_*
+// functions in imgproc.h, with the 8-bit constants scaled up: the
+// emboss gray level for the top row and left column is 32768 (rather
+// than 128), gray is 32768 + diff, clamped to 0..65535, and pixels
+// outside the ellipse are opaque black (0x000000000000FFFF). The output
+// image must have the same dimensions as the input, and initially be
+// opaque black (as created by img16_init).
+
+// Complement the red, green and blue values of every pixel.
+void imgproc16_complement(struct Image16 *input_img, struct Image16 *output_img);
+
+// Transpose a square image.
+//
+// Returns:
+//   1 if successful, 0 if the image isn't square
+int imgproc16_transpose(struct Image16 *input_img, struct Image16 *output_img);
+
+// Copy the pixels inside the ellipse (see imgproc_ellipse).
+//
+// Returns:
+//   1 if successful, 0 if the ellipse mask couldn't be allocated
+int imgproc16_ellipse(struct Image16 *input_img, struct Image16 *output_img);
+
+// Apply the emboss effect (see imgproc_emboss).
+void imgproc16_emboss(struct Image16 *input_img, struct Image16 *output_img);
+
+#endif // IMGPROC16_H
@@ -0,0 +1,146 @@
+// Message framing for server mode
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "imgproc_proto.h"
+
+// largest message that will be accepted (to reject garbage lengths)
+#define PROTO_MAX_MESSAGE ((uint64_t) 1 << 36)
+
+// Read exactly len bytes. Returns len, 0 on EOF before any byte,
+// or -1 on error or EOF in the middle.
+static ssize_t read_full(int fd, void *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = read(fd, (char *) buf + done, len - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return (n == 0 && done == 0) ? 0 : -1;
+    }
+    done += (size_t) n;
+  }
+  return (ssize_t) len;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = send(fd, (const char *) buf + done, len - done, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return 0;
+    }
+    done += (size_t) n;
+  }
+  return 1;
+}
+
+int proto_recv(int fd, struct ProtoMessage *msg) {
+  uint32_t header[2];
+  ssize_t n = read_full(fd, header, sizeof(header));
+  if (n <= 0) {
+    return (int) n;
+  }
+  if (header[0] != PROTO_MAGIC || header[1] > PROTO_MAX_FIELDS) {
+    return -1;
+  }
+
+  uint64_t lens[PROTO_MAX_FIELDS];
+  size_t lens_size = header[1] * sizeof(uint64_t);
+  if (lens_size > 0 && read_full(fd, lens, lens_size) != (ssize_t) lens_size) {
+    return -1;
+  }
+
+  // all field lengths come first, so the whole message can be
+  // received into one buffer
+  uint64_t total = 0;
+  for (uint32_t i = 0; i < header[1]; i++) {
+    if (lens[i] > PROTO_MAX_MESSAGE) {
+      return -1;
+    }
+    total += lens[i] + 1;
+  }
+  if (total > PROTO_MAX_MESSAGE) {
+    return -1;
+  }
+
+  if (total > msg->capacity) {
+    unsigned char *grown = (unsigned char *) realloc(msg->buf, total);
+    if (grown == NULL) {
+      return -1;
+    }
+    msg->buf = grown;
+    msg->capacity = total;
+  }
+
+  unsigned char *p = msg->buf;
+  for (uint32_t i = 0; i < header[1]; i++) {
+    if (lens[i] > 0 && read_full(fd, p, lens[i]) != (ssize_t) lens[i]) {
+      return -1;
+    }
+    p[lens[i]] = '\0';
+    msg->fields[i] = p;
+    msg->lens[i] = lens[i];
+    p += lens[i] + 1;
+  }
+  msg->num_fields = header[1];
+  return 1;
+}
+
+int proto_send(int fd, uint32_t num_fields, const void *const *fields, const size_t *lens) {
+  if (num_fields > PROTO_MAX_FIELDS) {
+    return 0;
+  }
+
+  uint32_t header[2] = { PROTO_MAGIC, num_fields };
+  uint64_t lens64[PROTO_MAX_FIELDS];
+  for (uint32_t i = 0; i < num_fields; i++) {
+    lens64[i] = lens[i];
+  }
+
+  if (!write_full(fd, header, sizeof(header)) || !write_full(fd, lens64, num_fields * sizeof(uint64_t))) {
+    return 0;
+  }
+  for (uint32_t i = 0; i < num_fields; i++) {
+    if (!write_full(fd, fields[i], lens[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void proto_free(struct ProtoMessage *msg) {
+  free(msg->buf);
+  msg->buf = NULL;
+  msg->capacity = 0;
+  msg->num_fields = 0;
+}
+
+int proto_connect(const char *socket_path) {
+  struct sockaddr_un addr;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+  if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
@@ -0,0 +1,91 @@
+#ifndef IMGPROC_PROTO_H
+#define IMGPROC_PROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Framing of the messages exchanged with the image processing
+// server (c_imgproc/asm_imgproc --serve) over a Unix domain socket.
+// A connection carries any number of request/response pairs.
+//
+// A message is a list of byte-string fields:
+//   uint32_t magic (PROTO_MAGIC)
+//   uint32_t number of fields
+//   for each field: uint64_t length, followed by that many bytes
+// Integers are in host byte order, since the socket is local.
+//
+// Request fields:
+//   0: mode, PROTO_MODE_MEM or PROTO_MODE_PATH
+//   1: transformation name
+//   2: input PNG data (mem mode) or input file name (path mode)
+//   3: output file name (path mode; empty in mem mode)
+//   4...: transformation arguments
+//
+// Response fields:
+//   0: PROTO_STATUS_OK or PROTO_STATUS_ERROR
+//   1: output PNG data (mem mode, ok), error message (error),
+//      or empty (path mode, ok)
+
+#define PROTO_MAGIC 0x50474d49U // "IMGP"
+#define PROTO_MAX_FIELDS 64
+
+#define PROTO_MODE_MEM "mem"
+#define PROTO_MODE_PATH "path"
+#define PROTO_STATUS_OK "ok"
+#define PROTO_STATUS_ERROR "error"
+
+// socket used if none is specified
+#define PROTO_DEFAULT_SOCKET "/tmp/imgprocd.sock"
+
+// A received message. All fields are stored in one buffer, which
+// is reused (and only grown) by later calls to proto_recv. Each
+// field is followed by a NUL byte, so text fields can be used as
+// strings directly.
+struct ProtoMessage {
+  uint32_t num_fields;
+  unsigned char *fields[PROTO_MAX_FIELDS];
+  size_t lens[PROTO_MAX_FIELDS];
+
+  unsigned char *buf;
+  size_t capacity;
+};
+
+// Receive a message.
+//
+// Parameters:
+//   fd - connected socket
+//   msg - pointer to ProtoMessage (zero-initialized before first use)
+//
+// Returns:
+//   1 if a message was received, 0 if the connection was closed
+//   before a message started, -1 on error (including malformed messages)
+int proto_recv(int fd, struct ProtoMessage *msg);
+
+// Send a message.
+//
+// Parameters:
+//   fd - connected socket
+//   num_fields - number of fields
+//   fields - pointers to the field contents
+//   lens - lengths of the fields
+//
+// Returns:
+//   1 if successful, 0 if not
+int proto_send(int fd, uint32_t num_fields, const void *const *fields, const size_t *lens);
+
+// Free the buffer of a ProtoMessage.
+//
+// Parameters:
+//   msg - pointer to ProtoMessage
+void proto_free(struct ProtoMessage *msg);
+
+// Connect to the server.
+//
+// Parameters:
+//   socket_path - path of the server's socket
+//
+// Returns:
+//   the connected socket, or -1 on error
+int proto_connect(const char *socket_path);
+
+#endif // IMGPROC_PROTO_H
@@ -6,10 +6,30 @@
  */
 
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include "tctest.h"
 #include "imgproc.h"
+#include "tiled.h"
+#include "stats.h"
+#include "perfctr.h"
+#include "ellipse_mask.h"
+#include "xxhash.h"
+#include "resultcache.h"
+#include "imgproc_proto.h"
+#include "imgproc16.h"
+#include "planar.h"
+#include "imggraph.h"
+#include "jit.h"
+#include "stencil.h"
+#include "resize.h"
+#include "rgbsplit.h"
+#include "composite.h"
 
 // An expected color identified by a (non-zero) character code.
 // Used in the "struct Picture" data type.
@@ -94,6 +114,8 @@ struct Image *picture_to_img( const struct Picture *pic );
 uint32_t lookup_color(char c, const struct ExpectedColor *colors);
 bool images_equal( struct Image *a, struct Image *b );
 void destroy_img( struct Image *img );
+void img_to_store( struct Image *img, struct TileStore *ts, size_t cache_bytes );
+struct Image *store_to_img( struct TileStore *ts );
 
 // Test functions
 void test_complement_basic( TestObjs *objs );
@@ -113,6 +135,37 @@ void test_abs_value( TestObjs *objs );
 void test_get_max_diff( TestObjs *objs );
 void test_clamp_gray_value( TestObjs *objs );
 void test_process_interior_pixel( TestObjs *objs );
+void test_compute_index_large( TestObjs *objs );
+void test_is_in_ellipse_large( TestObjs *objs );
+void test_is_in_ellipse_thin( TestObjs *objs );
+void test_large_image_roundtrip( TestObjs *objs );
+void test_tiled_point_transforms( TestObjs *objs );
+void test_tiled_emboss( TestObjs *objs );
+void test_tiled_transpose( TestObjs *objs );
+void test_tiled_png_roundtrip( TestObjs *objs );
+void test_stats_json( TestObjs *objs );
+void test_perf_counters( TestObjs *objs );
+void test_ellipse_mask( TestObjs *objs );
+void test_xxh64( TestObjs *objs );
+void test_result_cache( TestObjs *objs );
+void test_mem_codec( TestObjs *objs );
+void test_proto_roundtrip( TestObjs *objs );
+void test_stdio_streams( TestObjs *objs );
+void test_raw_pam_formats( TestObjs *objs );
+void test_img_probe( TestObjs *objs );
+void test_img_read_rows( TestObjs *objs );
+void test_image16_roundtrip( TestObjs *objs );
+void test_imgproc16( TestObjs *objs );
+void test_planar( TestObjs *objs );
+void test_png_color_types( TestObjs *objs );
+void test_graph( TestObjs *objs );
+void test_jit( TestObjs *objs );
+void test_stencil( TestObjs *objs );
+void test_resize( TestObjs *objs );
+void test_rotate_flip( TestObjs *objs );
+void test_rgb_split( TestObjs *objs );
+void test_output_histogram( TestObjs *objs );
+void test_composite( TestObjs *objs );
 
 int main( int argc, char **argv ) {
   // allow the specific test to execute to be specified as the
@@ -142,6 +195,37 @@ int main( int argc, char **argv ) {
   TEST( test_get_max_diff );
   TEST( test_clamp_gray_value );
   TEST( test_process_interior_pixel );
+  TEST( test_compute_index_large );
+  TEST( test_is_in_ellipse_large );
+  TEST( test_is_in_ellipse_thin );
+  TEST( test_large_image_roundtrip );
+  TEST( test_tiled_point_transforms );
+  TEST( test_tiled_emboss );
+  TEST( test_tiled_transpose );
+  TEST( test_tiled_png_roundtrip );
+  TEST( test_stats_json );
+  TEST( test_perf_counters );
+  TEST( test_ellipse_mask );
+  TEST( test_xxh64 );
+  TEST( test_result_cache );
+  TEST( test_mem_codec );
+  TEST( test_proto_roundtrip );
+  TEST( test_stdio_streams );
+  TEST( test_raw_pam_formats );
+  TEST( test_img_probe );
+  TEST( test_img_read_rows );
+  TEST( test_image16_roundtrip );
+  TEST( test_imgproc16 );
+  TEST( test_planar );
+  TEST( test_png_color_types );
+  TEST( test_graph );
+  TEST( test_jit );
+  TEST( test_stencil );
+  TEST( test_resize );
+  TEST( test_rotate_flip );
+  TEST( test_rgb_split );
+  TEST( test_output_histogram );
+  TEST( test_composite );
 
   TEST_FINI();
 }
@@ -259,6 +343,26 @@ void destroy_img( struct Image *img ) {
   free( img );
 }
 
+// Copy an Image into a new TileStore
+void img_to_store( struct Image *img, struct TileStore *ts, size_t cache_bytes ) {
+  struct TileView view;
+  ts_init( ts, img->width, img->height, cache_bytes, NULL );
+  ts_map_rows( ts, 0, img->height, &view );
+  memcpy( view.img.data, img->data, (size_t) img->width * img->height * sizeof(uint32_t) );
+  ts_unmap_rows( &view );
+}
+
+// Copy the contents of a TileStore into a new Image
+struct Image *store_to_img( struct TileStore *ts ) {
+  struct TileView view;
+  struct Image *img = (struct Image *) malloc( sizeof(struct Image) );
+  img_init( img, ts->width, ts->height );
+  ts_map_rows( ts, 0, ts->height, &view );
+  memcpy( img->data, view.img.data, (size_t) img->width * img->height * sizeof(uint32_t) );
+  ts_unmap_rows( &view );
+  return img;
+}
+
 ////////////////////////////////////////////////////////////////////////
 // Test functions
 ////////////////////////////////////////////////////////////////////////
@@ -645,4 +749,1579 @@ void test_process_interior_pixel( TestObjs *objs ) {
     ASSERT( get_a(result) == alpha );
     ASSERT( get_r(result) == get_g(result) ); // r = g = b
     ASSERT( get_g(result) == get_b(result) );  
-}
\ No newline at end of file
+}
+
+void test_compute_index_large( TestObjs *objs ) {
+    // no pixel data is needed, compute_index only looks at the width
+    struct Image img = { 100000, 60000, NULL };
+
+    // indices past 2^31 and 2^32 must not wrap around
+    ASSERT( compute_index(&img, 30000, 0) == 3000000000LL );
+    ASSERT( compute_index(&img, 59999, 99999) == 5999999999LL );
+    ASSERT( compute_index(&img, 21474, 83648) == 2147483648LL );
+
+    // small images still produce the same indices as before
+    ASSERT( compute_index(objs->smiley, 9, 15) == 159 );
+}
+
+void test_is_in_ellipse_large( TestObjs *objs ) {
+    // 10000*x*x overflows 32 bits for images this wide
+    struct Image img = { 100000, 60000, NULL };
+
+    ASSERT( is_in_ellipse(&img, 30000, 50000) == 1 ); // center
+    ASSERT( is_in_ellipse(&img, 30000, 0) == 1 );     // left end of horizontal axis
+    ASSERT( is_in_ellipse(&img, 0, 50000) == 1 );     // top end of vertical axis
+    ASSERT( is_in_ellipse(&img, 30000, 99999) == 1 );
+    ASSERT( is_in_ellipse(&img, 0, 0) == 0 );
+    ASSERT( is_in_ellipse(&img, 59999, 99999) == 0 );
+    ASSERT( is_in_ellipse(&img, 8787, 14637) == 0 );  // just outside, near the diagonal
+    ASSERT( is_in_ellipse(&img, 8800, 14700) == 1 );  // just inside, near the diagonal
+
+    // inside only because each term is rounded down separately
+    ASSERT( is_in_ellipse(&img, 8787, 14638) == 1 );
+
+    (void) objs;
+}
+
+void test_is_in_ellipse_thin( TestObjs *objs ) {
+    // one pixel wide: a == 0, so only the vertical distance matters
+    struct Image column = { 1, 9, NULL };
+    for (int32_t row = 0; row < 9; row++) {
+        ASSERT( is_in_ellipse(&column, row, 0) == 1 );
+    }
+
+    // one pixel high: b == 0, so only the horizontal distance matters
+    struct Image row = { 8, 1, NULL };
+    for (int32_t col = 0; col < 8; col++) {
+        ASSERT( is_in_ellipse(&row, 0, col) == 1 );
+    }
+
+    // a single pixel
+    struct Image pixel = { 1, 1, NULL };
+    ASSERT( is_in_ellipse(&pixel, 0, 0) == 1 );
+
+    (void) objs;
+}
+
+// Encodes, decodes and transforms an image with more than 4 GiB of
+// RGBA pixel data. This needs roughly 20 GiB of memory, so it only
+// runs when the IMGPROC_LARGE_TESTS environment variable names a
+// directory to write the temporary PNG file to.
+void test_large_image_roundtrip( TestObjs *objs ) {
+    const char *dir = getenv( "IMGPROC_LARGE_TESTS" );
+    if ( dir == NULL )
+      return;
+
+    char filename[4096];
+    snprintf( filename, sizeof(filename), "%s/imgproc_large_test.png", dir );
+
+    // 33000*33000*4 bytes is about 4.06 GiB
+    const int32_t dim = 33000;
+    struct Image *img = (struct Image *) malloc( sizeof(struct Image) );
+    ASSERT( img != NULL );
+    ASSERT( img_init( img, dim, dim ) == IMG_SUCCESS );
+
+    size_t num_pixels = (size_t) dim * dim;
+    for ( size_t i = 0; i < num_pixels; ++i )
+      img->data[i] = make_pixel( (i >> 16) & 0xFF, (i >> 8) & 0xFF, i & 0xFF, 0xFF );
+
+    ASSERT( img_write( filename, img ) == IMG_SUCCESS );
+    destroy_img( img );
+
+    img = (struct Image *) malloc( sizeof(struct Image) );
+    ASSERT( img != NULL );
+    ASSERT( img_read( filename, img ) == IMG_SUCCESS );
+    remove( filename );
+    ASSERT( img->width == dim && img->height == dim );
+
+    // complement is a point operation, so it can be applied in place
+    imgproc_complement( img, img );
+
+    int64_t samples[] = { 0, 1, 2147483647LL, 2147483648LL, 4294967296LL, (int64_t) num_pixels - 1 };
+    for ( size_t k = 0; k < sizeof(samples) / sizeof(samples[0]); ++k ) {
+      uint64_t i = (uint64_t) samples[k];
+      uint32_t expected = make_pixel( ~(i >> 16) & 0xFF, ~(i >> 8) & 0xFF, ~i & 0xFF, 0xFF );
+      ASSERT( img->data[i] == expected );
+    }
+
+    destroy_img( img );
+    (void) objs;
+}
+
+void test_tiled_point_transforms( TestObjs *objs ) {
+  // a cache this small means every band is a single row
+  struct TileStore in, out;
+  img_to_store( objs->smiley, &in, 1 );
+  ts_init( &out, in.width, in.height, 1, NULL );
+
+  ASSERT( ts_complement( &in, &out ) == IMG_SUCCESS );
+  imgproc_complement( objs->smiley, objs->smiley_out );
+  struct Image *result = store_to_img( &out );
+  ASSERT( images_equal( result, objs->smiley_out ) );
+  destroy_img( result );
+
+  // the ellipse must not depend on the band it is computed in
+  ASSERT( ts_ellipse( &in, &out ) == IMG_SUCCESS );
+  img_cleanup( objs->smiley_out );
+  img_init( objs->smiley_out, objs->smiley->width, objs->smiley->height );
+  imgproc_ellipse( objs->smiley, objs->smiley_out );
+  result = store_to_img( &out );
+  ASSERT( images_equal( result, objs->smiley_out ) );
+  destroy_img( result );
+
+  ts_cleanup( &in );
+  ts_cleanup( &out );
+}
+
+void test_tiled_emboss( TestObjs *objs ) {
+  imgproc_emboss( objs->smiley, objs->smiley_out );
+
+  // try band sizes of 1, 2, 3 and 4 rows (plus the halo row)
+  size_t row_bytes = objs->smiley->width * sizeof(uint32_t);
+  for ( size_t rows = 2; rows <= 5; ++rows ) {
+    struct TileStore in, out;
+    img_to_store( objs->smiley, &in, rows * 2 * row_bytes );
+    ts_init( &out, in.width, in.height, in.cache_bytes, NULL );
+
+    ASSERT( ts_emboss( &in, &out ) == IMG_SUCCESS );
+    struct Image *result = store_to_img( &out );
+    ASSERT( images_equal( result, objs->smiley_out ) );
+    destroy_img( result );
+
+    ts_cleanup( &in );
+    ts_cleanup( &out );
+  }
+}
+
+void test_tiled_transpose( TestObjs *objs ) {
+  imgproc_transpose( objs->sq_test, objs->sq_test_out );
+
+  // 5x5 tiles don't divide 12x12 evenly, so the edge tiles are narrower
+  size_t row_bytes = objs->sq_test->width * sizeof(uint32_t);
+  struct TileStore in, out;
+  img_to_store( objs->sq_test, &in, 5 * 3 * row_bytes );
+  ts_init( &out, in.width, in.height, in.cache_bytes, NULL );
+
+  ASSERT( ts_transpose( &in, &out ) == IMG_SUCCESS );
+  struct Image *result = store_to_img( &out );
+  ASSERT( images_equal( result, objs->sq_test_out ) );
+  destroy_img( result );
+
+  ts_cleanup( &in );
+  ts_cleanup( &out );
+}
+
+void test_tiled_png_roundtrip( TestObjs *objs ) {
+  char filename[] = "/tmp/imgproc_tiled_test_XXXXXX";
+  int fd = mkstemp( filename );
+  ASSERT( fd >= 0 );
+  close( fd );
+
+  // write a PNG a row at a time from a store, then read it back both ways
+  struct TileStore ts;
+  img_to_store( objs->smiley, &ts, 1 );
+  ASSERT( img_write_tiled( filename, &ts ) == IMG_SUCCESS );
+  ts_cleanup( &ts );
+
+  struct Image img;
+  ASSERT( img_read( filename, &img ) == IMG_SUCCESS );
+  ASSERT( images_equal( &img, objs->smiley ) );
+  img_cleanup( &img );
+
+  ASSERT( img_read_tiled( filename, &ts, 1 ) == IMG_SUCCESS );
+  struct Image *result = store_to_img( &ts );
+  ASSERT( images_equal( result, objs->smiley ) );
+  destroy_img( result );
+  ts_cleanup( &ts );
+
+  remove( filename );
+}
+
+void test_stats_json( TestObjs *objs ) {
+  char filename[] = "/tmp/imgproc_stats_test_XXXXXX";
+  int fd = mkstemp( filename );
+  ASSERT( fd >= 0 );
+  close( fd );
+
+  // a PNG round trip passes through every stage except the transformation
+  stats_enabled = 1;
+  ASSERT( img_write( filename, objs->smiley ) == IMG_SUCCESS );
+  struct Image img;
+  ASSERT( img_read( filename, &img ) == IMG_SUCCESS );
+  img_cleanup( &img );
+  stats_set_image( objs->smiley->width, objs->smiley->height );
+
+  FILE *out = tmpfile();
+  ASSERT( out != NULL );
+  stats_write_json( out, "complement", 1234 );
+  stats_enabled = 0;
+
+  char buf[4096];
+  rewind( out );
+  size_t n = fread( buf, 1, sizeof( buf ) - 1, out );
+  buf[n] = '\0';
+  fclose( out );
+
+  ASSERT( strstr( buf, "\"transformation\": \"complement\"" ) != NULL );
+  ASSERT( strstr( buf, "\"width\": 16," ) != NULL );
+  ASSERT( strstr( buf, "\"wall_ns\": 1234," ) != NULL );
+  ASSERT( strstr( buf, "\"inflate\": { \"calls\": 1," ) != NULL );
+  ASSERT( strstr( buf, "\"deflate\": { \"calls\": 1," ) != NULL );
+  ASSERT( strstr( buf, "\"transform\": { \"calls\": 0," ) != NULL );
+
+  remove( filename );
+}
+
+void test_perf_counters( TestObjs *objs ) {
+  struct PerfCounters pc;
+  perf_init( &pc );
+
+  // nothing is open yet, so this only counts pixels
+  perf_start( &pc );
+  perf_stop( &pc, 10 );
+  ASSERT( pc.pixels == 10 );
+
+  // which counters are available depends on the machine, so just
+  // check that the ones that opened counted something
+  perf_open( &pc );
+  perf_start( &pc );
+  imgproc_emboss( objs->smiley, objs->smiley_out );
+  perf_stop( &pc, (uint64_t) objs->smiley->width * objs->smiley->height );
+  for ( int i = 0; i < PERF_NUM_COUNTERS; ++i ) {
+    if ( i == PERF_CYCLES || i == PERF_INSTRUCTIONS || i == PERF_TASK_CLOCK ) {
+      ASSERT( pc.fds[i] < 0 || pc.values[i] > 0 );
+    }
+  }
+  ASSERT( pc.pixels == 10 + 16 * 10 );
+
+  perf_close( &pc );
+  for ( int i = 0; i < PERF_NUM_COUNTERS; ++i )
+    ASSERT( pc.fds[i] == -1 );
+}
+
+void test_ellipse_mask( TestObjs *objs ) {
+  static const int32_t dims[][2] = { { 1, 1 }, { 1, 7 }, { 7, 1 }, { 2, 2 }, { 16, 10 }, { 33, 17 }, { 100, 3 } };
+
+  // the masked ellipse must match imgproc_ellipse exactly
+  for ( size_t i = 0; i < sizeof( dims ) / sizeof( dims[0] ); ++i ) {
+    struct Image in, expected, actual;
+    img_init( &in, dims[i][0], dims[i][1] );
+    img_init( &expected, dims[i][0], dims[i][1] );
+    img_init( &actual, dims[i][0], dims[i][1] );
+    for ( int64_t j = 0; j < (int64_t) dims[i][0] * dims[i][1]; ++j )
+      in.data[j] = 0x01020300U + (uint32_t) j;
+
+    imgproc_ellipse( &in, &expected );
+    ellipse_masked( &in, &actual );
+    ASSERT( images_equal( &expected, &actual ) );
+
+    img_cleanup( &in );
+    img_cleanup( &expected );
+    img_cleanup( &actual );
+  }
+
+  // masks are shared
+  const struct EllipseMask *mask = ellipse_mask_get( 33, 17 );
+  ASSERT( mask != NULL );
+  ASSERT( ellipse_mask_get( 33, 17 ) == mask );
+  ellipse_mask_release( mask );
+  int32_t spans[2 * 17];
+  memcpy( spans, mask->spans, sizeof( spans ) );
+  ellipse_mask_release( mask );
+
+  // and survive a save/load round trip
+  char filename[] = "/tmp/imgproc_mask_test_XXXXXX";
+  int fd = mkstemp( filename );
+  ASSERT( fd >= 0 );
+  close( fd );
+  ASSERT( ellipse_mask_save( filename ) == IMG_SUCCESS );
+  ellipse_mask_clear();
+  ASSERT( ellipse_mask_load( filename ) == IMG_SUCCESS );
+  mask = ellipse_mask_get( 33, 17 );
+  ASSERT( memcmp( mask->spans, spans, sizeof( spans ) ) == 0 );
+  ellipse_mask_release( mask );
+  remove( filename );
+
+  ASSERT( ellipse_mask_load( "/nonexistent/masks" ) == IMG_ERR_COULD_NOT_OPEN );
+
+  (void) objs;
+}
+
+void test_xxh64( TestObjs *objs ) {
+  // reference values
+  ASSERT( xxh64( "", 0, 0 ) == 0xef46db3751d8e999ULL );
+  ASSERT( xxh64( "a", 1, 0 ) == 0xd24ec4f1a98c6e5bULL );
+  ASSERT( xxh64( "abc", 3, 0 ) == 0x44bc2cf5ad770999ULL );
+
+  // hashing incrementally, in pieces of any size, gives the same result
+  size_t len = 10 * sizeof( uint32_t );
+  const unsigned char *data = (const unsigned char *) objs->smiley->data;
+  uint64_t expected = xxh64( data, len, 42 );
+  for ( size_t piece = 1; piece <= 40; piece += 3 ) {
+    struct Xxh64State state;
+    xxh64_reset( &state, 42 );
+    for ( size_t i = 0; i < len; i += piece )
+      xxh64_update( &state, data + i, len - i < piece ? len - i : piece );
+    ASSERT( xxh64_digest( &state ) == expected );
+  }
+}
+
+void test_result_cache( TestObjs *objs ) {
+  char dir[] = "/tmp/imgproc_cache_test_XXXXXX";
+  ASSERT( mkdtemp( dir ) != NULL );
+  char input[4096], output[4096];
+  snprintf( input, sizeof( input ), "%s/in.png", dir );
+  snprintf( output, sizeof( output ), "%s/out.png", dir );
+  ASSERT( img_write( input, objs->smiley ) == IMG_SUCCESS );
+
+  // the key depends on the transformation and arguments, not just the input
+  char *args[] = { "1", "2" };
+  char key[RESULT_CACHE_KEY_LEN], key2[RESULT_CACHE_KEY_LEN];
+  ASSERT( result_cache_key( input, output, "emboss", 0, NULL, key ) == IMG_SUCCESS );
+  ASSERT( result_cache_key( input, output, "ellipse", 0, NULL, key2 ) == IMG_SUCCESS );
+  ASSERT( strcmp( key, key2 ) != 0 );
+  ASSERT( result_cache_key( input, output, "emboss", 2, args, key2 ) == IMG_SUCCESS );
+  ASSERT( strcmp( key, key2 ) != 0 );
+  ASSERT( result_cache_key( input, output, "emboss", 0, NULL, key2 ) == IMG_SUCCESS );
+  ASSERT( strcmp( key, key2 ) == 0 );
+
+  // and on the format of the output, so a raw result is never served
+  // for a PNG output
+  char raw_output[4096];
+  snprintf( raw_output, sizeof( raw_output ), "%s/out.raw", dir );
+  char raw_key[RESULT_CACHE_KEY_LEN];
+  ASSERT( result_cache_key( input, raw_output, "emboss", 0, NULL, raw_key ) == IMG_SUCCESS );
+  ASSERT( strcmp( key, raw_key ) != 0 );
+
+  char cache_dir[4096];
+  snprintf( cache_dir, sizeof( cache_dir ), "%s/cache", dir );
+  struct ResultCache cache = { cache_dir, 1 << 20 };
+
+  // miss, store, then hit
+  ASSERT( result_cache_fetch( &cache, key, output ) == IMG_ERR_COULD_NOT_OPEN );
+  ASSERT( result_cache_store( &cache, key, input ) == IMG_SUCCESS );
+  ASSERT( result_cache_fetch( &cache, key, output ) == IMG_SUCCESS );
+  struct Image img;
+  ASSERT( img_read( output, &img ) == IMG_SUCCESS );
+  ASSERT( images_equal( &img, objs->smiley ) );
+  img_cleanup( &img );
+
+  // a raw entry is stored as a raw file, and doesn't hit for the PNG key
+  ASSERT( img_write( raw_output, objs->smiley ) == IMG_SUCCESS );
+  ASSERT( result_cache_store( &cache, raw_key, raw_output ) == IMG_SUCCESS );
+  remove( raw_output );
+  ASSERT( result_cache_fetch( &cache, raw_key, raw_output ) == IMG_SUCCESS );
+  ASSERT( img_read( raw_output, &img ) == IMG_SUCCESS );
+  ASSERT( images_equal( &img, objs->smiley ) );
+  img_cleanup( &img );
+  remove( output );
+  ASSERT( result_cache_fetch( &cache, key, output ) == IMG_SUCCESS );
+  ASSERT( img_read( output, &img ) == IMG_SUCCESS );
+  img_cleanup( &img );
+
+  // an entry bigger than the limit is evicted right away
+  cache.max_bytes = 1;
+  result_cache_evict( &cache );
+  ASSERT( result_cache_fetch( &cache, key, output ) == IMG_ERR_COULD_NOT_OPEN );
+
+  remove( input );
+  remove( output );
+  remove( raw_output );
+  rmdir( cache_dir );
+  ASSERT( rmdir( dir ) == 0 );
+}
+
+void test_mem_codec( TestObjs *objs ) {
+  unsigned char *data = NULL;
+  size_t len = 0, capacity = 0;
+  struct Image img;
+
+  ASSERT( img_write_mem( objs->smiley, &data, &len, &capacity ) == IMG_SUCCESS );
+  ASSERT( len > 8 && len <= capacity );
+  ASSERT( memcmp( data, "\x89PNG", 4 ) == 0 );
+  ASSERT( img_read_mem( data, len, &img ) == IMG_SUCCESS );
+  ASSERT( images_equal( &img, objs->smiley ) );
+  img_cleanup( &img );
+
+  // writing another image reuses the same buffer
+  unsigned char *first_data = data;
+  ASSERT( img_write_mem( objs->sq_test, &data, &len, &capacity ) == IMG_SUCCESS );
+  ASSERT( data == first_data );
+  ASSERT( img_read_mem( data, len, &img ) == IMG_SUCCESS );
+  ASSERT( images_equal( &img, objs->sq_test ) );
+  img_cleanup( &img );
+
+  // truncated data is an error, not a crash
+  ASSERT( img_read_mem( data, len / 2, &img ) != IMG_SUCCESS );
+  free( data );
+}
+
+void test_proto_roundtrip( TestObjs *objs ) {
+  (void) objs;
+  int fds[2];
+  ASSERT( socketpair( AF_UNIX, SOCK_STREAM, 0, fds ) == 0 );
+
+  const void *fields[] = { PROTO_MODE_MEM, "emboss", "", "\0binary\xff" };
+  size_t lens[] = { 3, 6, 0, 8 };
+  struct ProtoMessage msg = { 0 };
+
+  ASSERT( proto_send( fds[0], 4, fields, lens ) );
+  ASSERT( proto_send( fds[0], 1, fields, lens ) );
+  ASSERT( proto_recv( fds[1], &msg ) == 1 );
+  ASSERT( msg.num_fields == 4 );
+  ASSERT( strcmp( (const char *) msg.fields[1], "emboss" ) == 0 );
+  ASSERT( msg.lens[2] == 0 && ( (const char *) msg.fields[2] )[0] == '\0' );
+  ASSERT( msg.lens[3] == 8 && memcmp( msg.fields[3], "\0binary\xff", 8 ) == 0 );
+
+  // the second message reuses the buffer
+  ASSERT( proto_recv( fds[1], &msg ) == 1 );
+  ASSERT( msg.num_fields == 1 );
+  ASSERT( strcmp( (const char *) msg.fields[0], PROTO_MODE_MEM ) == 0 );
+
+  // end of file, then garbage
+  close( fds[0] );
+  ASSERT( proto_recv( fds[1], &msg ) == 0 );
+  close( fds[1] );
+  ASSERT( socketpair( AF_UNIX, SOCK_STREAM, 0, fds ) == 0 );
+  ASSERT( write( fds[0], "not a message", 13 ) == 13 );
+  close( fds[0] );
+  ASSERT( proto_recv( fds[1], &msg ) == -1 );
+  close( fds[1] );
+
+  proto_free( &msg );
+}
+
+void test_stdio_streams( TestObjs *objs ) {
+  char filename[] = "/tmp/imgproc_tests_XXXXXX";
+  int fd = mkstemp( filename );
+  ASSERT( fd >= 0 );
+
+  // write to stdout redirected to the temporary file
+  fflush( stdout );
+  int saved_stdout = dup( STDOUT_FILENO );
+  ASSERT( dup2( fd, STDOUT_FILENO ) == STDOUT_FILENO );
+  int rc = img_write( IMG_STDIO, objs->smiley );
+  ASSERT( dup2( saved_stdout, STDOUT_FILENO ) == STDOUT_FILENO );
+  close( saved_stdout );
+  ASSERT( rc == IMG_SUCCESS );
+
+  // and read it back from stdin, both in memory and tiled
+  struct Image img;
+  struct TileStore store;
+  int saved_stdin = dup( STDIN_FILENO );
+  ASSERT( lseek( fd, 0, SEEK_SET ) == 0 );
+  ASSERT( dup2( fd, STDIN_FILENO ) == STDIN_FILENO );
+  rc = img_read( IMG_STDIO, &img );
+  ASSERT( lseek( fd, 0, SEEK_SET ) == 0 );
+  int tiled_rc = img_read_tiled( IMG_STDIO, &store, 1 << 20 );
+  ASSERT( dup2( saved_stdin, STDIN_FILENO ) == STDIN_FILENO );
+  close( saved_stdin );
+  close( fd );
+  remove( filename );
+
+  ASSERT( rc == IMG_SUCCESS );
+  ASSERT( images_equal( &img, objs->smiley ) );
+  img_cleanup( &img );
+
+  ASSERT( tiled_rc == IMG_SUCCESS );
+  ASSERT( store.width == objs->smiley->width && store.height == objs->smiley->height );
+  struct TileView view;
+  ASSERT( ts_map_rows( &store, 0, store.height, &view ) == IMG_SUCCESS );
+  ASSERT( images_equal( &view.img, objs->smiley ) );
+  ts_unmap_rows( &view );
+  ts_cleanup( &store );
+}
+
+void test_raw_pam_formats( TestObjs *objs ) {
+  char dir[] = "/tmp/imgproc_tests_XXXXXX";
+  ASSERT( mkdtemp( dir ) != NULL );
+  char raw[4096], pam[4096];
+  snprintf( raw, sizeof( raw ), "%s/img.raw", dir );
+  snprintf( pam, sizeof( pam ), "%s/img.PAM", dir );
+
+  struct Image img;
+  ASSERT( img_write( raw, objs->smiley ) == IMG_SUCCESS );
+  ASSERT( img_write( pam, objs->smiley ) == IMG_SUCCESS );
+
+  // raw: header plus the pixels exactly as in memory
+  FILE *in = fopen( raw, "rb" );
+  ASSERT( in != NULL );
+  ASSERT( fseek( in, 0, SEEK_END ) == 0 );
+  ASSERT( ftell( in ) == 16 + objs->smiley->width * objs->smiley->height * 4 );
+  fclose( in );
+
+  ASSERT( img_read( raw, &img ) == IMG_SUCCESS );
+  ASSERT( images_equal( &img, objs->smiley ) );
+  img_cleanup( &img );
+  ASSERT( img_read( pam, &img ) == IMG_SUCCESS );
+  ASSERT( images_equal( &img, objs->smiley ) );
+  img_cleanup( &img );
+
+  // mapped pixels are private to the process
+  ASSERT( img_map( pam, &img ) == IMG_ERR_NOT_RAW );
+  ASSERT( img_map( raw, &img ) == IMG_SUCCESS );
+  ASSERT( images_equal( &img, objs->smiley ) );
+  img.data[0] = ~img.data[0];
+  img_unmap( &img );
+  ASSERT( img_read( raw, &img ) == IMG_SUCCESS );
+  ASSERT( images_equal( &img, objs->smiley ) );
+  img_cleanup( &img );
+
+  // tiled read and write
+  struct TileStore store;
+  struct TileView view;
+  ASSERT( img_read_tiled( pam, &store, 1 ) == IMG_SUCCESS );
+  ASSERT( img_write_tiled( raw, &store ) == IMG_SUCCESS );
+  ts_cleanup( &store );
+  ASSERT( img_read_tiled( raw, &store, 1 ) == IMG_SUCCESS );
+  ASSERT( ts_map_rows( &store, 0, store.height, &view ) == IMG_SUCCESS );
+  ASSERT( images_equal( &view.img, objs->smiley ) );
+  ts_unmap_rows( &view );
+  ts_cleanup( &store );
+
+  // truncated raw file
+  ASSERT( truncate( raw, 20 ) == 0 );
+  ASSERT( img_read( raw, &img ) != IMG_SUCCESS );
+  ASSERT( img_map( raw, &img ) != IMG_SUCCESS );
+
+  remove( raw );
+  remove( pam );
+  ASSERT( rmdir( dir ) == 0 );
+}
+
+void test_img_probe( TestObjs *objs ) {
+  char dir[] = "/tmp/imgproc_tests_XXXXXX";
+  ASSERT( mkdtemp( dir ) != NULL );
+  char png[4096], raw[4096];
+  snprintf( png, sizeof( png ), "%s/img.png", dir );
+  snprintf( raw, sizeof( raw ), "%s/img.raw", dir );
+
+  int32_t width, height;
+  int format;
+  ASSERT( img_write( png, objs->smiley ) == IMG_SUCCESS );
+  ASSERT( img_probe( png, &width, &height, &format ) == IMG_SUCCESS );
+  ASSERT( width == objs->smiley->width && height == objs->smiley->height );
+  // every pixel is opaque, so there is no alpha channel
+  ASSERT( format == IMG_FORMAT_RGB );
+
+  ASSERT( img_write( raw, objs->sq_test ) == IMG_SUCCESS );
+  ASSERT( img_probe( raw, &width, &height, &format ) == IMG_SUCCESS );
+  ASSERT( width == objs->sq_test->width && height == objs->sq_test->height );
+  ASSERT( format == IMG_FORMAT_RGBA );
+
+  // only the header is needed: truncating the pixel data doesn't matter
+  ASSERT( truncate( png, 8 + 25 ) == 0 );
+  ASSERT( img_probe( png, &width, &height, &format ) == IMG_SUCCESS );
+  ASSERT( width == objs->smiley->width && height == objs->smiley->height );
+  ASSERT( truncate( png, 20 ) == 0 );
+  ASSERT( img_probe( png, &width, &height, &format ) != IMG_SUCCESS );
+
+  ASSERT( img_probe( "/nonexistent.png", &width, &height, &format ) == IMG_ERR_COULD_NOT_OPEN );
+
+  remove( png );
+  remove( raw );
+  ASSERT( rmdir( dir ) == 0 );
+}
+
+void test_img_read_rows( TestObjs *objs ) {
+  char dir[] = "/tmp/imgproc_tests_XXXXXX";
+  ASSERT( mkdtemp( dir ) != NULL );
+  char filenames[2][4096];
+  snprintf( filenames[0], sizeof( filenames[0] ), "%s/img.png", dir );
+  snprintf( filenames[1], sizeof( filenames[1] ), "%s/img.pam", dir );
+
+  int32_t width = objs->smiley->width, height = objs->smiley->height;
+  for ( int f = 0; f < 2; ++f ) {
+    const char *filename = filenames[f];
+    ASSERT( img_write( filename, objs->smiley ) == IMG_SUCCESS );
+
+    // every band, including the first and last rows
+    for ( int32_t first = 0; first < height; ++first ) {
+      for ( int32_t n = 1; first + n <= height; n += 3 ) {
+        struct Image img;
+        ASSERT( img_read_rows( filename, first, n, &img ) == IMG_SUCCESS );
+        ASSERT( img.width == width && img.height == n );
+        ASSERT( memcmp( img.data, objs->smiley->data + (size_t) first * width, (size_t) n * width * 4 ) == 0 );
+        img_cleanup( &img );
+      }
+    }
+
+    struct Image img;
+    ASSERT( img_read_rows( filename, 0, height + 1, &img ) == IMG_ERR_INVALID_ROWS );
+    ASSERT( img_read_rows( filename, height, 1, &img ) == IMG_ERR_INVALID_ROWS );
+    ASSERT( img_read_rows( filename, -1, 1, &img ) == IMG_ERR_INVALID_ROWS );
+    ASSERT( img_read_rows( filename, 0, 0, &img ) == IMG_ERR_INVALID_ROWS );
+    remove( filename );
+  }
+
+  // a PNG whose image data is cut short can't be decoded
+  ASSERT( img_write( filenames[0], objs->smiley ) == IMG_SUCCESS );
+  struct stat st;
+  ASSERT( stat( filenames[0], &st ) == 0 );
+  ASSERT( truncate( filenames[0], st.st_size - 40 ) == 0 );
+  struct Image img;
+  ASSERT( img_read_rows( filenames[0], 0, height, &img ) == IMG_ERR_COULD_NOT_OPEN );
+  remove( filenames[0] );
+
+  ASSERT( rmdir( dir ) == 0 );
+}
+
+// Scale an 8-bit image up to 16 bits per channel (v becomes v*257)
+static void widen_image( struct Image *img, struct Image16 *img16 ) {
+  img16_init( img16, img->width, img->height );
+  for ( size_t i = 0; i < (size_t) img->width * img->height; ++i ) {
+    uint64_t p = img->data[i];
+    img16->data[i] = ( ( ( p & 0xFF000000U ) << 24 ) | ( ( p & 0xFF0000U ) << 16 )
+                       | ( ( p & 0xFF00U ) << 8 ) | ( p & 0xFFU ) ) * 257;
+  }
+}
+
+static bool images16_equal( struct Image16 *a, struct Image16 *b ) {
+  return a->width == b->width && a->height == b->height
+    && memcmp( a->data, b->data, (size_t) a->width * a->height * sizeof( uint64_t ) ) == 0;
+}
+
+void test_image16_roundtrip( TestObjs *objs ) {
+  char filename[] = "/tmp/imgproc_tests_XXXXXX";
+  int fd = mkstemp( filename );
+  ASSERT( fd >= 0 );
+  close( fd );
+
+  // 8-bit PNGs are scaled up when read as 16-bit
+  struct Image16 wide, img;
+  widen_image( objs->smiley, &wide );
+  ASSERT( img_write( filename, objs->smiley ) == IMG_SUCCESS );
+  ASSERT( img16_read( filename, &img ) == IMG_SUCCESS );
+  ASSERT( images16_equal( &img, &wide ) );
+  img16_cleanup( &img );
+
+  // values that don't fit in 8 bits survive a 16-bit round trip
+  for ( size_t i = 0; i < (size_t) wide.width * wide.height; ++i )
+    wide.data[i] ^= i * 0x0001000300050007ULL;
+  ASSERT( img16_write( filename, &wide ) == IMG_SUCCESS );
+  int32_t width, height;
+  int format;
+  ASSERT( img_probe( filename, &width, &height, &format ) == IMG_SUCCESS );
+  ASSERT( format == ( IMG_FORMAT_RGBA | IMG_FORMAT_16BIT ) );
+  ASSERT( img16_read( filename, &img ) == IMG_SUCCESS );
+  ASSERT( images16_equal( &img, &wide ) );
+  img16_cleanup( &img );
+
+  // the 8-bit reader doesn't accept 16-bit images
+  struct Image img8;
+  ASSERT( img_read( filename, &img8 ) == IMG_ERR_NOT_TRUECOLOR );
+
+  // and a 16-bit PNG whose image data is cut short can't be decoded
+  struct stat st;
+  ASSERT( stat( filename, &st ) == 0 );
+  ASSERT( truncate( filename, st.st_size - 40 ) == 0 );
+  ASSERT( img16_read( filename, &img ) == IMG_ERR_COULD_NOT_OPEN );
+
+  img16_cleanup( &wide );
+  remove( filename );
+}
+
+void test_imgproc16( TestObjs *objs ) {
+  struct Image *inputs[] = { objs->smiley, objs->sq_test };
+
+  for ( int k = 0; k < 2; ++k ) {
+    struct Image *input = inputs[k];
+    struct Image out8;
+    struct Image16 in16, out16, expected16;
+    widen_image( input, &in16 );
+
+    // complement, ellipse and transpose commute with scaling to 16 bits
+    for ( int xform = 0; xform < 3; ++xform ) {
+      if ( xform == 2 && input->width != input->height )
+        continue;
+      img_init( &out8, input->width, input->height );
+      img16_init( &out16, input->width, input->height );
+      if ( xform == 0 ) {
+        imgproc_complement( input, &out8 );
+        imgproc16_complement( &in16, &out16 );
+      } else if ( xform == 1 ) {
+        imgproc_ellipse( input, &out8 );
+        ASSERT( imgproc16_ellipse( &in16, &out16 ) );
+      } else {
+        ASSERT( imgproc_transpose( input, &out8 ) );
+        ASSERT( imgproc16_transpose( &in16, &out16 ) );
+      }
+      widen_image( &out8, &expected16 );
+      ASSERT( images16_equal( &out16, &expected16 ) );
+      img_cleanup( &out8 );
+      img16_cleanup( &out16 );
+      img16_cleanup( &expected16 );
+    }
+    img16_cleanup( &in16 );
+  }
+
+  // emboss: the gray level is 32768 + diff, with the same priorities
+  struct Image16 in16, out16;
+  img16_init( &in16, 3, 2 );
+  img16_init( &out16, 3, 2 );
+  in16.data[0] = 0x0000000000001234ULL;
+  in16.data[1] = 0xFFFF100020000000ULL;
+  in16.data[4] = 0x8000800080000001ULL; // neighbor data[0]: diffs -32768 (r wins ties)
+  in16.data[5] = 0xFFFF0FFF30004321ULL; // neighbor data[1]: diffs 0, +1, -4096
+  imgproc16_emboss( &in16, &out16 );
+  ASSERT( out16.data[0] == 0x8000800080001234ULL );
+  ASSERT( out16.data[3] == 0x800080008000FFFFULL );
+  ASSERT( out16.data[4] == 0x0000000000000001ULL );
+  ASSERT( out16.data[5] == 0x7000700070004321ULL );
+  ASSERT( imgproc16_transpose( &in16, &out16 ) == 0 );
+  img16_cleanup( &in16 );
+  img16_cleanup( &out16 );
+}
+
+void test_planar( TestObjs *objs ) {
+  // sizes around the 32-pixel conversion and 16-pixel emboss steps
+  int32_t sizes[][2] = { { 1, 1 }, { 17, 1 }, { 1, 40 }, { 31, 3 }, { 33, 7 }, { 64, 64 }, { 0, 5 } };
+  uint32_t seed = 12345;
+
+  for ( int k = 0; k < 8; ++k ) {
+    struct Image random_img, *input = objs->smiley;
+    if ( k < 7 ) {
+      img_init( &random_img, sizes[k][0], sizes[k][1] );
+      for ( int32_t i = 0; i < random_img.width * random_img.height; ++i ) {
+        seed = seed * 1103515245 + 12345;
+        random_img.data[i] = seed ^ ( seed >> 15 );
+      }
+      input = &random_img;
+    }
+
+    struct PlanarImage planar_in, planar_out;
+    struct Image out, expected;
+    ASSERT( planar_init( &planar_in, input->width, input->height ) == IMG_SUCCESS );
+    ASSERT( planar_init( &planar_out, input->width, input->height ) == IMG_SUCCESS );
+    img_init( &out, input->width, input->height );
+    img_init( &expected, input->width, input->height );
+
+    planar_from_image( input, &planar_in );
+    if ( input->width * input->height > 0 ) {
+      ASSERT( planar_in.r[0] == get_r( input->data[0] ) );
+      ASSERT( planar_in.a[0] == get_a( input->data[0] ) );
+    }
+    planar_to_image( &planar_in, &out );
+    ASSERT( images_equal( &out, input ) );
+
+    planar_complement( &planar_in, &planar_out );
+    planar_to_image( &planar_out, &out );
+    imgproc_complement( input, &expected );
+    ASSERT( images_equal( &out, &expected ) );
+
+    planar_emboss( &planar_in, &planar_out );
+    planar_to_image( &planar_out, &out );
+    imgproc_emboss( input, &expected );
+    ASSERT( images_equal( &out, &expected ) );
+
+    planar_cleanup( &planar_in );
+    planar_cleanup( &planar_out );
+    img_cleanup( &out );
+    img_cleanup( &expected );
+    if ( k < 7 )
+      img_cleanup( &random_img );
+  }
+}
+
+void test_png_color_types( TestObjs *objs ) {
+  char dir[] = "/tmp/imgproc_tests_XXXXXX";
+  ASSERT( mkdtemp( dir ) != NULL );
+  char png[4096];
+  snprintf( png, sizeof( png ), "%s/img.png", dir );
+
+  // gray, gray with alpha, color, color with alpha
+  int expected_formats[] = { IMG_FORMAT_GREY, IMG_FORMAT_GREY_ALPHA, IMG_FORMAT_RGB, IMG_FORMAT_RGBA };
+  for ( int k = 0; k < 4; ++k ) {
+    struct Image img, read_back;
+    img_init( &img, 37, 5 );
+    for ( int32_t i = 0; i < img.width * img.height; ++i ) {
+      uint32_t v = ( i * 7 ) & 0xFF;
+      img.data[i] = make_pixel( v, v, v, 255 );
+    }
+    // a single pixel is enough to need alpha or color
+    if ( k == 1 || k == 3 )
+      img.data[img.width * img.height - 1] &= 0xFFFFFF80;
+    if ( k >= 2 )
+      img.data[20] ^= 0x00010000;
+
+    int32_t width, height;
+    int format;
+    ASSERT( img_write( png, &img ) == IMG_SUCCESS );
+    ASSERT( img_probe( png, &width, &height, &format ) == IMG_SUCCESS );
+    ASSERT( format == expected_formats[k] );
+    ASSERT( img_read( png, &read_back ) == IMG_SUCCESS );
+    ASSERT( images_equal( &read_back, &img ) );
+    img_cleanup( &read_back );
+
+    ASSERT( img_read_rows( png, 2, 3, &read_back ) == IMG_SUCCESS );
+    ASSERT( memcmp( read_back.data, img.data + 2 * img.width, 3 * img.width * sizeof( uint32_t ) ) == 0 );
+    img_cleanup( &read_back );
+
+    // the tiled writer makes the same choice
+    struct TileStore store;
+    img_to_store( &img, &store, 1 );
+    ASSERT( img_write_tiled( png, &store ) == IMG_SUCCESS );
+    ts_cleanup( &store );
+    ASSERT( img_probe( png, &width, &height, &format ) == IMG_SUCCESS );
+    ASSERT( format == expected_formats[k] );
+    ASSERT( img_read_tiled( png, &store, 1 ) == IMG_SUCCESS );
+    struct Image *result = store_to_img( &store );
+    ASSERT( images_equal( result, &img ) );
+    destroy_img( result );
+    ts_cleanup( &store );
+
+    img_cleanup( &img );
+  }
+
+  remove( png );
+  ASSERT( rmdir( dir ) == 0 );
+}
+
+// Apply a comma-separated list of transformations one at a time
+struct Image *apply_sequentially( struct Image *input, const char *names ) {
+  char copy[256], *save = NULL;
+  snprintf( copy, sizeof( copy ), "%s", names );
+  struct Image *cur = create_output_img( input, "", 0, NULL );
+  memcpy( cur->data, input->data, (size_t) input->width * input->height * sizeof( uint32_t ) );
+
+  for ( char *name = strtok_r( copy, ",", &save ); name != NULL; name = strtok_r( NULL, ",", &save ) ) {
+    struct Image *next = create_output_img( cur, name, 0, NULL );
+    ASSERT( find_transformation( name )->apply( cur, next, 0, NULL ) );
+    cleanup_image( cur );
+    cur = next;
+  }
+  return cur;
+}
+
+void test_graph( TestObjs *objs ) {
+  static const char *chains[] = {
+    "complement", "emboss", "complement,ellipse,emboss", "emboss,emboss,complement",
+    "ellipse,complement,ellipse,emboss", "emboss,complement,complement,emboss",
+    "complement,complement", "transpose,emboss,transpose", "transpose,transpose,ellipse",
+  };
+  // bands of one row, a few rows, and the default size
+  size_t band_bytes[] = { 1, 3 * 16 * sizeof( uint32_t ), 0 };
+
+  for ( int c = 0; c < (int) ( sizeof( chains ) / sizeof( chains[0] ) ); ++c ) {
+    struct Image *input = strncmp( chains[c], "transpose", 9 ) == 0 ? objs->sq_test : objs->smiley;
+    struct Image *expected = apply_sequentially( input, chains[c] );
+
+    for ( int b = 0; b < 3; ++b ) {
+      struct ImgGraph *graph = graph_create();
+      graph->band_bytes = band_bytes[b];
+      struct GraphNode *node = graph_input( graph, input );
+      char copy[256], *save = NULL;
+      snprintf( copy, sizeof( copy ), "%s", chains[c] );
+      for ( char *name = strtok_r( copy, ",", &save ); name != NULL; name = strtok_r( NULL, ",", &save ) )
+        node = graph_apply( graph, node, name, 0, NULL );
+      graph_keep( graph, node );
+
+      ASSERT( graph_run( graph ) == IMG_SUCCESS );
+      ASSERT( images_equal( graph_result( node ), expected ) );
+      graph_destroy( graph );
+    }
+    cleanup_image( expected );
+  }
+
+  // branches: a complement shared by two chains is cheap enough to be
+  // recomputed by both, but a shared emboss is computed once
+  struct ImgGraph *graph = graph_create();
+  struct GraphNode *src = graph_input( graph, objs->smiley );
+  struct GraphNode *comp = graph_apply( graph, src, "complement", 0, NULL );
+  struct GraphNode *emb = graph_apply( graph, src, "emboss", 0, NULL );
+  struct GraphNode *outs[4] = {
+    graph_apply( graph, comp, "ellipse", 0, NULL ), graph_apply( graph, comp, "emboss", 0, NULL ),
+    graph_apply( graph, emb, "ellipse", 0, NULL ), graph_apply( graph, emb, "complement", 0, NULL ),
+  };
+  const char *out_chains[4] = { "complement,ellipse", "complement,emboss", "emboss,ellipse", "emboss,complement" };
+  // nothing depends on this one, so it is never computed
+  struct GraphNode *unused = graph_apply( graph, src, "emboss", 0, NULL );
+  for ( int i = 0; i < 4; ++i )
+    graph_keep( graph, outs[i] );
+
+  ASSERT( graph_plan( graph ) == IMG_SUCCESS );
+  ASSERT( !comp->materialize );
+  ASSERT( emb->materialize );
+  ASSERT( !unused->live );
+  ASSERT( graph_run( graph ) == IMG_SUCCESS );
+  for ( int i = 0; i < 4; ++i ) {
+    struct Image *expected = apply_sequentially( objs->smiley, out_chains[i] );
+    ASSERT( images_equal( graph_result( outs[i] ), expected ) );
+    cleanup_image( expected );
+  }
+  // the shared emboss was freed once both users were computed
+  ASSERT( graph_result( emb ) == NULL );
+  graph_destroy( graph );
+
+  // transpose of an image that isn't square
+  graph = graph_create();
+  graph_keep( graph, graph_apply( graph, graph_input( graph, objs->smiley ), "transpose", 0, NULL ) );
+  ASSERT( graph_run( graph ) == GRAPH_ERR_TRANSFORM_FAILED );
+  ASSERT( graph_apply( graph, graph->nodes[0], "nonexistent", 0, NULL ) == NULL );
+  graph_destroy( graph );
+  // even when a pair of them would cancel out
+  graph = graph_create();
+  struct GraphNode *turned = graph_apply( graph, graph_input( graph, objs->smiley ), "transpose", 0, NULL );
+  graph_keep( graph, graph_apply( graph, turned, "transpose", 0, NULL ) );
+  ASSERT( graph_run( graph ) == GRAPH_ERR_TRANSFORM_FAILED );
+  graph_destroy( graph );
+
+  // sources and outputs in files
+  char dir[] = "/tmp/imgproc_tests_XXXXXX";
+  ASSERT( mkdtemp( dir ) != NULL );
+  char in_png[4096], out_png[4096];
+  snprintf( in_png, sizeof( in_png ), "%s/in.png", dir );
+  snprintf( out_png, sizeof( out_png ), "%s/out.png", dir );
+  ASSERT( img_write( in_png, objs->smiley ) == IMG_SUCCESS );
+
+  graph = graph_create();
+  struct GraphNode *node = graph_apply( graph, graph_read( graph, in_png ), "emboss", 0, NULL );
+  ASSERT( graph_write( graph, graph_apply( graph, node, "complement", 0, NULL ), out_png ) == IMG_SUCCESS );
+  ASSERT( graph_run( graph ) == IMG_SUCCESS );
+  graph_destroy( graph );
+
+  struct Image written;
+  struct Image *expected = apply_sequentially( objs->smiley, "emboss,complement" );
+  ASSERT( img_read( out_png, &written ) == IMG_SUCCESS );
+  ASSERT( images_equal( &written, expected ) );
+  img_cleanup( &written );
+  cleanup_image( expected );
+
+  remove( in_png );
+  remove( out_png );
+  ASSERT( rmdir( dir ) == 0 );
+}
+
+void test_jit( TestObjs *objs ) {
+  (void) objs;
+  static const char *chains[] = {
+    "complement", "emboss", "complement,emboss", "emboss,complement", "complement,emboss,complement",
+  };
+  // widths around the 4-pixel groups, including one too narrow to compile
+  int32_t sizes[][2] = { { 4, 3 }, { 5, 1 }, { 5, 4 }, { 6, 3 }, { 7, 2 }, { 8, 5 }, { 9, 3 }, { 33, 6 } };
+  uint32_t seed = 54321;
+
+  for ( int k = 0; k < (int) ( sizeof( sizes ) / sizeof( sizes[0] ) ); ++k ) {
+    struct Image input;
+    img_init( &input, sizes[k][0], sizes[k][1] );
+    for ( int32_t i = 0; i < input.width * input.height; ++i ) {
+      seed = seed * 1103515245 + 12345;
+      input.data[i] = seed ^ ( seed >> 15 );
+    }
+
+    for ( int c = 0; c < (int) ( sizeof( chains ) / sizeof( chains[0] ) ); ++c ) {
+      struct Image *expected = apply_sequentially( &input, chains[c] );
+      struct ImgGraph *graph = graph_create();
+      struct GraphNode *node = graph_input( graph, &input );
+      char copy[256], *save = NULL;
+      snprintf( copy, sizeof( copy ), "%s", chains[c] );
+      for ( char *name = strtok_r( copy, ",", &save ); name != NULL; name = strtok_r( NULL, ",", &save ) )
+        node = graph_apply( graph, node, name, 0, NULL );
+      graph_keep( graph, node );
+
+      ASSERT( graph_run( graph ) == IMG_SUCCESS );
+      ASSERT( images_equal( graph_result( node ), expected ) );
+      graph_destroy( graph );
+      cleanup_image( expected );
+    }
+    img_cleanup( &input );
+  }
+
+  // kernels are cached by chain and width
+  enum JitOp ops[] = { JIT_COMPLEMENT, JIT_EMBOSS, JIT_COMPLEMENT, JIT_EMBOSS };
+  const struct JitKernel *a = jit_get( ops, 2, 100 );
+  const struct JitKernel *b = jit_get( ops, 2, 100 );
+  const struct JitKernel *c = jit_get( ops, 2, 101 );
+  ASSERT( a != NULL && a == b && c != NULL && c != a );
+  ASSERT( a->emboss && a->width == 100 );
+  jit_release( a );
+  jit_release( b );
+  jit_release( c );
+  jit_clear();
+
+  // chains that can't be compiled
+  ASSERT( jit_get( ops, 4, 100 ) == NULL );
+  ASSERT( jit_get( ops, 2, JIT_MIN_WIDTH - 1 ) == NULL );
+  enum JitOp none = JIT_NONE;
+  ASSERT( jit_get( &none, 1, 100 ) == NULL );
+}
+
+// Row or column i of n, read according to a stencil border policy
+// (-1 for a zero pixel)
+int32_t reference_border( enum StencilBorder border, int32_t i, int32_t n ) {
+  while ( i < 0 || i >= n ) {
+    if ( border == STENCIL_BORDER_ZERO )
+      return -1;
+    if ( border == STENCIL_BORDER_MIRROR && n > 1 )
+      i = i < 0 ? -i : 2 * n - 2 - i;
+    else
+      i = i < 0 ? 0 : n - 1;
+  }
+  return i;
+}
+
+// Direct evaluation of a STENCIL_OUT_CHANNELS or STENCIL_OUT_MAGNITUDE
+// stencil at one pixel
+uint32_t reference_stencil( const struct Stencil *st, struct Image *img, int32_t row, int32_t col ) {
+  int size = 2 * st->radius + 1;
+  int32_t channel[3];
+
+  for ( int c = 0; c < 3; ++c ) {
+    int32_t sums[2] = { 0, 0 };
+    for ( int k = 0; k < 2; ++k ) {
+      const int16_t *weights = k == 0 ? st->weights : st->weights2;
+      for ( int dy = 0; dy < size; ++dy ) {
+        for ( int dx = 0; dx < size; ++dx ) {
+          int32_t r = reference_border( st->border, row + dy - st->radius, img->height );
+          int32_t x = reference_border( st->border, col + dx - st->radius, img->width );
+          uint32_t pixel = r < 0 || x < 0 ? 0 : img->data[r * img->width + x];
+          sums[k] += weights[dy * size + dx] * (int32_t) ( ( pixel >> ( 24 - 8 * c ) ) & 0xFF );
+        }
+      }
+      int32_t round = st->shift > 0 ? 1 << ( st->shift - 1 ) : 0;
+      sums[k] = ( sums[k] + round ) >> st->shift;
+    }
+    int32_t value = st->output == STENCIL_OUT_MAGNITUDE ? abs( sums[0] ) + abs( sums[1] ) : sums[0];
+    value += st->bias;
+    channel[c] = value < 0 ? 0 : value > 255 ? 255 : value;
+  }
+  return make_pixel( channel[0], channel[1], channel[2], get_a( img->data[row * img->width + col] ) );
+}
+
+void test_stencil( TestObjs *objs ) {
+  // widths around the 8-pixel groups; 100 rows are enough for 3 bands
+  int32_t sizes[][2] = { { 1, 1 }, { 2, 3 }, { 7, 5 }, { 9, 2 }, { 33, 17 }, { 20, 100 } };
+  uint32_t seed = 2468;
+
+  int16_t custom[25];
+  for ( int i = 0; i < 25; ++i )
+    custom[i] = (int16_t) ( ( i * 37 ) % 19 - 9 );
+  struct Stencil custom5, blur_direct = stencil_blur, separable;
+  stencil_init( &custom5, 2, custom, 3, 100 );
+  blur_direct.separable = 0;
+  int16_t row[5] = { 1, 4, 6, 4, 1 }, col[5] = { -1, 0, 2, 0, -1 };
+  stencil_init_separable( &separable, 2, row, col, 2, 128 );
+
+  const struct Stencil *stencils[] = { &stencil_blur, &blur_direct, &stencil_sharpen, &stencil_sobel, &custom5,
+                                       &separable };
+  enum StencilBorder borders[] = { STENCIL_BORDER_REPLICATE, STENCIL_BORDER_MIRROR, STENCIL_BORDER_ZERO };
+
+  for ( int k = 0; k < (int) ( sizeof( sizes ) / sizeof( sizes[0] ) ); ++k ) {
+    struct Image input, out, expected;
+    img_init( &input, sizes[k][0], sizes[k][1] );
+    img_init( &out, sizes[k][0], sizes[k][1] );
+    img_init( &expected, sizes[k][0], sizes[k][1] );
+    for ( int32_t i = 0; i < input.width * input.height; ++i ) {
+      seed = seed * 1103515245 + 12345;
+      input.data[i] = seed ^ ( seed >> 15 );
+    }
+
+    // emboss is bit-exact, on any number of threads
+    imgproc_emboss( &input, &expected );
+    for ( int threads = 1; threads <= 3; threads += 2 ) {
+      ASSERT( stencil_apply( &stencil_emboss, &input, &out, threads ) == IMG_SUCCESS );
+      ASSERT( images_equal( &out, &expected ) );
+    }
+
+    for ( int s = 0; s < (int) ( sizeof( stencils ) / sizeof( stencils[0] ) ); ++s ) {
+      for ( int b = 0; b < 3; ++b ) {
+        struct Stencil st = *stencils[s];
+        st.border = borders[b];
+        for ( int32_t r = 0; r < input.height; ++r )
+          for ( int32_t c = 0; c < input.width; ++c )
+            expected.data[r * input.width + c] = reference_stencil( &st, &input, r, c );
+        ASSERT( stencil_apply( &st, &input, &out, 3 ) == IMG_SUCCESS );
+        ASSERT( images_equal( &out, &expected ) );
+      }
+    }
+
+    img_cleanup( &input );
+    img_cleanup( &out );
+    img_cleanup( &expected );
+  }
+
+  // convolve with a custom kernel: the identity, and invalid weights
+  struct Image *out_img = create_output_img( objs->smiley, "convolve", 0, NULL );
+  const struct Transformation *convolve = find_transformation( "convolve" );
+  char *args[] = { "", "convolve", "in", "out", "0,0,0, 0,1,0, 0,0,0", "0", "0", NULL };
+  ASSERT( convolve->apply( objs->smiley, out_img, 5, args ) );
+  ASSERT( images_equal( out_img, objs->smiley ) );
+  ASSERT( convolve->apply( objs->smiley, out_img, 7, args ) );
+  ASSERT( images_equal( out_img, objs->smiley ) );
+
+  // and invalid or out of range shifts and biases
+  const char *bad[][2] = { { "xyz", "0" }, { "3x", "0" }, { "", "0" }, { "31", "0" },
+                           { "0", "xyz" }, { "0", "99999999" }, { "0", "-99999999" } };
+  for ( int i = 0; i < (int) ( sizeof( bad ) / sizeof( bad[0] ) ); ++i ) {
+    args[5] = (char *) bad[i][0];
+    args[6] = (char *) bad[i][1];
+    ASSERT( !convolve->apply( objs->smiley, out_img, 7, args ) );
+  }
+
+  args[4] = "1,2,3";
+  ASSERT( !convolve->apply( objs->smiley, out_img, 5, args ) );
+  cleanup_image( out_img );
+}
+
+// Channel c (0 = alpha, as in memory) of a pixel
+uint32_t pixel_channel( uint32_t pixel, int c ) {
+  return ( pixel >> ( 8 * c ) ) & 0xFF;
+}
+
+// Direct evaluation of a box resize at one output pixel
+uint32_t reference_box( struct Image *img, int32_t out_w, int32_t out_h, int32_t row, int32_t col ) {
+  int32_t y0 = (int32_t) ( (int64_t) row * img->height / out_h ), y1 = (int32_t) ( (int64_t) ( row + 1 ) * img->height / out_h );
+  int32_t x0 = (int32_t) ( (int64_t) col * img->width / out_w ), x1 = (int32_t) ( (int64_t) ( col + 1 ) * img->width / out_w );
+  if ( y1 <= y0 )
+    y1 = y0 + 1;
+  if ( x1 <= x0 )
+    x1 = x0 + 1;
+  uint32_t count = ( y1 - y0 ) * ( x1 - x0 ), pixel = 0;
+  for ( int c = 0; c < 4; ++c ) {
+    uint32_t sum = 0;
+    for ( int32_t r = y0; r < y1; ++r )
+      for ( int32_t x = x0; x < x1; ++x )
+        sum += pixel_channel( img->data[r * img->width + x], c );
+    pixel |= ( ( sum + count / 2 ) / count ) << ( 8 * c );
+  }
+  return pixel;
+}
+
+// Center of output pixel i in the input, with 8 fractional bits
+int32_t reference_position( int32_t i, int32_t out_size, int32_t in_size ) {
+  int64_t pos = ( 2 * (int64_t) i + 1 ) * in_size * 256 / ( 2 * (int64_t) out_size ) - 128;
+  return pos < 0 ? 0 : pos > ( in_size - 1 ) * 256 ? ( in_size - 1 ) * 256 : (int32_t) pos;
+}
+
+// Direct evaluation of a bilinear resize at one output pixel
+uint32_t reference_bilinear( struct Image *img, int32_t out_w, int32_t out_h, int32_t row, int32_t col ) {
+  int32_t py = reference_position( row, out_h, img->height ), px = reference_position( col, out_w, img->width );
+  int32_t y0 = py >> 8, x0 = px >> 8, fy = py & 0xFF, fx = px & 0xFF;
+  int32_t y1 = y0 + 1 < img->height ? y0 + 1 : y0, x1 = x0 + 1 < img->width ? x0 + 1 : x0;
+  uint32_t pixel = 0;
+  for ( int c = 0; c < 4; ++c ) {
+    uint32_t top = pixel_channel( img->data[y0 * img->width + x0], c ) * ( 256 - fx )
+      + pixel_channel( img->data[y0 * img->width + x1], c ) * fx;
+    uint32_t bottom = pixel_channel( img->data[y1 * img->width + x0], c ) * ( 256 - fx )
+      + pixel_channel( img->data[y1 * img->width + x1], c ) * fx;
+    pixel |= ( ( top * ( 256 - fy ) + bottom * fy + 32768 ) >> 16 ) << ( 8 * c );
+  }
+  return pixel;
+}
+
+void test_resize( TestObjs *objs ) {
+  int32_t sizes[][2] = { { 1, 1 }, { 1, 7 }, { 6, 1 }, { 5, 3 }, { 16, 10 }, { 37, 23 }, { 64, 48 } };
+  int32_t targets[][2] = { { 1, 1 }, { 3, 2 }, { 8, 5 }, { 13, 29 }, { 40, 3 } };
+  uint32_t seed = 1357;
+
+  for ( int k = 0; k < (int) ( sizeof( sizes ) / sizeof( sizes[0] ) ); ++k ) {
+    struct Image input;
+    img_init( &input, sizes[k][0], sizes[k][1] );
+    for ( int32_t i = 0; i < input.width * input.height; ++i ) {
+      seed = seed * 1103515245 + 12345;
+      input.data[i] = seed ^ ( seed >> 15 );
+    }
+
+    // both filters, shrinking and enlarging, and the exact halving
+    int32_t halved[2] = { input.width / 2, input.height / 2 };
+    for ( int t = 0; t <= (int) ( sizeof( targets ) / sizeof( targets[0] ) ); ++t ) {
+      int32_t *size = t < (int) ( sizeof( targets ) / sizeof( targets[0] ) ) ? targets[t] : halved;
+      if ( size[0] == 0 || size[1] == 0 )
+        continue;
+      struct Image out;
+      img_init( &out, size[0], size[1] );
+      ASSERT( resize_image( &input, &out, RESIZE_BOX ) == IMG_SUCCESS );
+      for ( int32_t r = 0; r < out.height; ++r )
+        for ( int32_t c = 0; c < out.width; ++c )
+          ASSERT( out.data[r * out.width + c] == reference_box( &input, out.width, out.height, r, c ) );
+      ASSERT( resize_image( &input, &out, RESIZE_BILINEAR ) == IMG_SUCCESS );
+      for ( int32_t r = 0; r < out.height; ++r )
+        for ( int32_t c = 0; c < out.width; ++c )
+          ASSERT( out.data[r * out.width + c] == reference_bilinear( &input, out.width, out.height, r, c ) );
+      img_cleanup( &out );
+    }
+
+    // every level of the pyramid is the 2x2 reduction of the one above,
+    // with the edge pixels used twice where a level is 1 pixel wide or high
+    int depth = pyramid_depth( input.width, input.height );
+    struct Image levels[8];
+    ASSERT( depth <= 8 );
+    ASSERT( pyramid_build( &input, levels, depth ) == IMG_SUCCESS );
+    struct Image *above = &input;
+    for ( int i = 0; i < depth; ++i ) {
+      ASSERT( levels[i].width == ( above->width > 1 ? above->width / 2 : 1 ) );
+      ASSERT( levels[i].height == ( above->height > 1 ? above->height / 2 : 1 ) );
+      for ( int32_t r = 0; r < levels[i].height; ++r ) {
+        for ( int32_t c = 0; c < levels[i].width; ++c ) {
+          int32_t r1 = 2 * r + 1 < above->height ? 2 * r + 1 : 2 * r;
+          int32_t c1 = 2 * c + 1 < above->width ? 2 * c + 1 : 2 * c;
+          uint32_t expected = 0;
+          for ( int ch = 0; ch < 4; ++ch ) {
+            uint32_t sum = pixel_channel( above->data[2 * r * above->width + 2 * c], ch )
+              + pixel_channel( above->data[2 * r * above->width + c1], ch )
+              + pixel_channel( above->data[r1 * above->width + 2 * c], ch )
+              + pixel_channel( above->data[r1 * above->width + c1], ch );
+            expected |= ( ( sum + 2 ) / 4 ) << ( 8 * ch );
+          }
+          ASSERT( levels[i].data[r * levels[i].width + c] == expected );
+        }
+      }
+      above = &levels[i];
+    }
+    ASSERT( above->width == 1 && above->height == 1 );
+    for ( int i = 0; i < depth; ++i )
+      img_cleanup( &levels[i] );
+    img_cleanup( &input );
+  }
+
+  // the resize output is allocated at the new size, keeping the
+  // aspect ratio for a dimension given as 0
+  const struct Transformation *resize = find_transformation( "resize" );
+  char *args[] = { "", "resize", "in", "out", "8", "0", "bilinear", NULL };
+  struct Image *out_img = create_output_img( objs->smiley, "resize", 7, args );
+  int32_t width = objs->smiley->width, height = objs->smiley->height;
+  ASSERT( resize->output_size( &width, &height, 7, args ) );
+  ASSERT( width == 8 && height == 5 );
+  ASSERT( out_img->width == 8 && out_img->height == 5 );
+  ASSERT( resize->apply( objs->smiley, out_img, 7, args ) );
+  args[4] = "16";
+  args[5] = "10";
+  // an output of the wrong size is rejected rather than written past
+  ASSERT( !resize->apply( objs->smiley, out_img, 7, args ) );
+  cleanup_image( out_img );
+  out_img = create_output_img( objs->smiley, "resize", 7, args );
+  ASSERT( resize->apply( objs->smiley, out_img, 7, args ) );
+  ASSERT( images_equal( out_img, objs->smiley ) );
+  args[6] = "nearest";
+  ASSERT( !resize->apply( objs->smiley, out_img, 7, args ) );
+  args[4] = "0";
+  args[5] = "0";
+  ASSERT( !resize->apply( objs->smiley, out_img, 6, args ) );
+  cleanup_image( out_img );
+
+  // in a graph, the transformations after it see the new size
+  struct ImgGraph *graph = graph_create();
+  struct GraphNode *node = graph_input( graph, objs->smiley );
+  args[4] = "4";
+  args[5] = "2";
+  node = graph_apply( graph, node, "resize", 6, args );
+  node = graph_apply( graph, node, "complement", 6, args );
+  graph_keep( graph, node );
+  ASSERT( graph_run( graph ) == IMG_SUCCESS );
+  struct Image *result = graph_result( node );
+  ASSERT( result != NULL && result->width == 4 && result->height == 2 );
+  for ( int32_t i = 0; i < 8; ++i )
+    ASSERT( result->data[i] == ( reference_box( objs->smiley, 4, 2, i / 4, i % 4 ) ^ 0xFFFFFF00U ) );
+  graph_destroy( graph );
+}
+
+void test_rotate_flip( TestObjs *objs ) {
+  // sizes around the 16-pixel blocks, square and not
+  int32_t sizes[][2] = { { 1, 1 }, { 1, 5 }, { 7, 1 }, { 16, 16 }, { 17, 33 }, { 40, 23 } };
+  uint32_t seed = 9753;
+
+  for ( int k = 0; k < (int) ( sizeof( sizes ) / sizeof( sizes[0] ) ); ++k ) {
+    int32_t w = sizes[k][0], h = sizes[k][1];
+    struct Image input, turned, same, back;
+    img_init( &input, w, h );
+    img_init( &turned, h, w );
+    img_init( &same, w, h );
+    img_init( &back, w, h );
+    for ( int32_t i = 0; i < w * h; ++i ) {
+      seed = seed * 1103515245 + 12345;
+      input.data[i] = seed ^ ( seed >> 15 );
+    }
+
+    imgproc_rotate90( &input, &turned );
+    for ( int32_t r = 0; r < h; ++r )
+      for ( int32_t c = 0; c < w; ++c )
+        ASSERT( turned.data[c * h + ( h - 1 - r )] == input.data[r * w + c] );
+    imgproc_rotate270( &turned, &back );
+    ASSERT( images_equal( &back, &input ) );
+
+    imgproc_rotate270( &input, &turned );
+    for ( int32_t r = 0; r < h; ++r )
+      for ( int32_t c = 0; c < w; ++c )
+        ASSERT( turned.data[( w - 1 - c ) * h + r] == input.data[r * w + c] );
+    imgproc_rotate90( &turned, &back );
+    ASSERT( images_equal( &back, &input ) );
+
+    imgproc_rotate180( &input, &same );
+    for ( int32_t r = 0; r < h; ++r )
+      for ( int32_t c = 0; c < w; ++c )
+        ASSERT( same.data[( h - 1 - r ) * w + ( w - 1 - c )] == input.data[r * w + c] );
+
+    imgproc_flip_h( &input, &same );
+    for ( int32_t r = 0; r < h; ++r )
+      for ( int32_t c = 0; c < w; ++c )
+        ASSERT( same.data[r * w + ( w - 1 - c )] == input.data[r * w + c] );
+
+    imgproc_flip_v( &input, &same );
+    for ( int32_t r = 0; r < h; ++r )
+      for ( int32_t c = 0; c < w; ++c )
+        ASSERT( same.data[( h - 1 - r ) * w + c] == input.data[r * w + c] );
+
+    // the blocked transpose still only accepts square images
+    ASSERT( imgproc_transpose( &input, &same ) == ( w == h ) );
+    if ( w == h )
+      for ( int32_t r = 0; r < h; ++r )
+        for ( int32_t c = 0; c < w; ++c )
+          ASSERT( same.data[c * w + r] == input.data[r * w + c] );
+
+    img_cleanup( &input );
+    img_cleanup( &turned );
+    img_cleanup( &same );
+    img_cleanup( &back );
+  }
+
+  // the quarter turns give their output the swapped dimensions
+  const struct Transformation *rotate90 = find_transformation( "rotate90" );
+  char *args[] = { "", "rotate90", "in", "out", NULL };
+  struct Image *out_img = create_output_img( objs->smiley, "rotate90", 4, args );
+  ASSERT( rotate90->apply( objs->smiley, out_img, 4, args ) );
+  ASSERT( out_img->width == objs->smiley->height && out_img->height == objs->smiley->width );
+  ASSERT( out_img->data[0] == objs->smiley->data[( objs->smiley->height - 1 ) * objs->smiley->width] );
+  cleanup_image( out_img );
+
+  // and so do graph nodes, while a pair of flips cancels out
+  struct ImgGraph *graph = graph_create();
+  struct GraphNode *node = graph_input( graph, objs->smiley );
+  node = graph_apply( graph, node, "flipH", 4, args );
+  node = graph_apply( graph, node, "flipH", 4, args );
+  node = graph_apply( graph, node, "rotate270", 4, args );
+  node = graph_apply( graph, node, "rotate90", 4, args );
+  graph_keep( graph, node );
+  ASSERT( graph_run( graph ) == IMG_SUCCESS );
+  ASSERT( images_equal( graph_result( node ), objs->smiley ) );
+  graph_destroy( graph );
+}
+
+void test_rgb_split( TestObjs *objs ) {
+  // widths around the 4-pixel groups; 100 rows are enough for 3 bands
+  int32_t sizes[][2] = { { 1, 1 }, { 3, 2 }, { 9, 5 }, { 21, 100 } };
+  uint32_t seed = 8642;
+
+  for ( int k = 0; k < (int) ( sizeof( sizes ) / sizeof( sizes[0] ) ); ++k ) {
+    int32_t w = sizes[k][0], h = sizes[k][1];
+    struct Image input, out;
+    img_init( &input, w, h );
+    img_init( &out, 2 * w, 2 * h );
+    for ( int32_t i = 0; i < w * h; ++i ) {
+      seed = seed * 1103515245 + 12345;
+      input.data[i] = seed ^ ( seed >> 15 );
+    }
+
+    for ( int threads = 1; threads <= 3; threads += 2 ) {
+      memset( out.data, 0xAB, (size_t) 4 * w * h * sizeof( uint32_t ) );
+      rgb_split( &input, &out, threads );
+      for ( int32_t r = 0; r < h; ++r ) {
+        for ( int32_t c = 0; c < w; ++c ) {
+          uint32_t p = input.data[r * w + c];
+          ASSERT( out.data[r * 2 * w + c] == p );
+          ASSERT( out.data[r * 2 * w + w + c] == make_pixel( get_r( p ), 0, 0, get_a( p ) ) );
+          ASSERT( out.data[( h + r ) * 2 * w + c] == make_pixel( 0, get_g( p ), 0, get_a( p ) ) );
+          ASSERT( out.data[( h + r ) * 2 * w + w + c] == make_pixel( 0, 0, get_b( p ), get_a( p ) ) );
+        }
+      }
+    }
+
+    img_cleanup( &input );
+    img_cleanup( &out );
+  }
+
+  // the transformation's output is the size create_output_img gives it,
+  // and graphs size their nodes the same way
+  const struct Transformation *rgb = find_transformation( "rgb" );
+  char *args[] = { "", "rgb", "in", "out", NULL };
+  struct Image *out_img = create_output_img( objs->smiley, "rgb", 4, args );
+  int32_t width = objs->smiley->width, height = objs->smiley->height;
+  ASSERT( rgb->output_size( &width, &height, 4, args ) );
+  ASSERT( width == out_img->width && height == out_img->height );
+  ASSERT( rgb->apply( objs->smiley, out_img, 4, args ) );
+  ASSERT( out_img->width == 2 * objs->smiley->width && out_img->data[0] == objs->smiley->data[0] );
+
+  struct ImgGraph *graph = graph_create();
+  struct GraphNode *node = graph_input( graph, objs->smiley );
+  node = graph_apply( graph, node, "rgb", 4, args );
+  graph_keep( graph, node );
+  ASSERT( graph_run( graph ) == IMG_SUCCESS );
+  ASSERT( images_equal( graph_result( node ), out_img ) );
+  graph_destroy( graph );
+  cleanup_image( out_img );
+}
+
+void test_output_histogram( TestObjs *objs ) {
+  struct Image input;
+  img_init( &input, 37, 70 );
+  uint32_t seed = 4321;
+  for ( int32_t i = 0; i < input.width * input.height; ++i ) {
+    seed = seed * 1103515245 + 12345;
+    input.data[i] = seed ^ ( seed >> 15 );
+  }
+
+  // fused chains (compiled or in bands), a global transformation, and
+  // a chain that cancels out to the input
+  const char *chains[][3] = {
+    { "complement", "emboss", NULL }, { "ellipse", "complement", NULL }, { "blur", NULL, NULL },
+    { "complement", "complement", NULL },
+  };
+  char *args[] = { "", "", "in", "out", NULL };
+  struct StatsHistogram *hist = (struct StatsHistogram *) malloc( sizeof( struct StatsHistogram ) );
+  uint64_t expected[4][256];
+
+  for ( int k = 0; k < (int) ( sizeof( chains ) / sizeof( chains[0] ) ); ++k ) {
+    for ( int no_jit = 0; no_jit <= 1; ++no_jit ) {
+      struct ImgGraph *graph = graph_create();
+      struct GraphNode *node = graph_input( graph, &input );
+      for ( int i = 0; chains[k][i] != NULL; ++i )
+        node = graph_apply( graph, node, chains[k][i], 4, args );
+      memset( hist, 0, sizeof( struct StatsHistogram ) );
+      graph->histogram = hist;
+      graph->no_jit = no_jit;
+      graph->band_bytes = 16 * input.width * sizeof( uint32_t );
+      graph_keep( graph, node );
+      ASSERT( graph_run( graph ) == IMG_SUCCESS );
+
+      struct Image *result = graph_result( node );
+      memset( expected, 0, sizeof( expected ) );
+      for ( int32_t i = 0; i < result->width * result->height; ++i ) {
+        uint32_t p = result->data[i];
+        expected[0][get_r( p )]++;
+        expected[1][get_g( p )]++;
+        expected[2][get_b( p )]++;
+        expected[3][get_a( p )]++;
+      }
+      for ( int c = 0; c < 4; ++c )
+        for ( int v = 0; v < 256; ++v )
+          ASSERT( stats_histogram_count( hist, c, v ) == expected[c][v] );
+      graph_destroy( graph );
+    }
+  }
+
+  // the merged histograms are written with the statistics
+  memset( hist, 0, sizeof( struct StatsHistogram ) );
+  stats_histogram_add( hist, objs->smiley->data, (size_t) objs->smiley->width * objs->smiley->height );
+  stats_histogram_merge( hist );
+  FILE *out = tmpfile();
+  ASSERT( out != NULL );
+  stats_write_json( out, "complement", 1 );
+  char buf[32768];
+  rewind( out );
+  size_t n = fread( buf, 1, sizeof( buf ) - 1, out );
+  buf[n] = '\0';
+  fclose( out );
+  ASSERT( strstr( buf, "\"pixels\": 160," ) != NULL );
+  ASSERT( strstr( buf, "\"alpha\": { \"min\": 255, \"max\": 255, \"mean\": 255.000," ) != NULL );
+
+  free( hist );
+  img_cleanup( &input );
+}
+
+// Porter-Duff "over" of one straight-alpha pixel onto another, computed
+// in floating point and rounded to nearest
+uint32_t reference_over( uint32_t base, uint32_t overlay ) {
+  double a = get_a( overlay ) / 255.0, ba = get_a( base ) / 255.0;
+  double out_a = a + ba * ( 1 - a );
+  if ( out_a == 0 )
+    return 0;
+  uint32_t channels[3];
+  uint32_t o[3] = { get_r( overlay ), get_g( overlay ), get_b( overlay ) };
+  uint32_t b[3] = { get_r( base ), get_g( base ), get_b( base ) };
+  for ( int c = 0; c < 3; ++c )
+    channels[c] = (uint32_t) ( ( o[c] * a + b[c] * ba * ( 1 - a ) ) / out_a + 0.5 );
+  return make_pixel( channels[0], channels[1], channels[2], (uint32_t) ( out_a * 255 + 0.5 ) );
+}
+
+void test_composite( TestObjs *objs ) {
+  // overlays smaller, larger and the same size as the base, with widths
+  // around the 8-pixel groups; 100 rows are enough for 3 bands
+  int32_t sizes[][4] = {
+    { 1, 1, 1, 1 }, { 9, 5, 3, 2 }, { 7, 3, 17, 8 }, { 17, 100, 16, 100 }, { 25, 100, 25, 60 },
+  };
+  uint32_t seed = 97531;
+
+  for ( int k = 0; k < (int) ( sizeof( sizes ) / sizeof( sizes[0] ) ); ++k ) {
+    int32_t w = sizes[k][0], h = sizes[k][1], ow = sizes[k][2], oh = sizes[k][3];
+    struct Image base, overlay, out;
+    img_init( &base, w, h );
+    img_init( &overlay, ow, oh );
+    img_init( &out, w, h );
+    for ( int32_t i = 0; i < w * h; ++i ) {
+      seed = seed * 1103515245 + 12345;
+      base.data[i] = seed ^ ( seed >> 15 );
+      // opaque bases (blended 8 pixels at a time) and translucent ones,
+      // and opaque runs broken by a translucent pixel
+      if ( k % 2 == 1 || ( k == 4 && i % 11 != 0 ) )
+        base.data[i] |= 0xFF;
+    }
+    for ( int32_t i = 0; i < ow * oh; ++i ) {
+      seed = seed * 1103515245 + 12345;
+      overlay.data[i] = seed ^ ( seed >> 15 );
+    }
+    // include fully transparent and fully opaque overlay pixels
+    overlay.data[0] &= 0xFFFFFF00;
+    overlay.data[ow * oh - 1] |= 0xFF;
+
+    for ( int threads = 1; threads <= 3; threads += 2 ) {
+      memset( out.data, 0xAB, (size_t) w * h * sizeof( uint32_t ) );
+      composite_over( &base, &overlay, &out, threads );
+      for ( int32_t r = 0; r < h; ++r ) {
+        for ( int32_t c = 0; c < w; ++c ) {
+          uint32_t p = base.data[r * w + c];
+          if ( r < oh && c < ow )
+            p = reference_over( p, overlay.data[r * ow + c] );
+          ASSERT( out.data[r * w + c] == p );
+        }
+      }
+    }
+
+    // in place
+    composite_over( &base, &overlay, &base, 2 );
+    ASSERT( images_equal( &base, &out ) );
+
+    img_cleanup( &base );
+    img_cleanup( &overlay );
+    img_cleanup( &out );
+  }
+
+  // a half-transparent blue overlay over a fully transparent red base is
+  // just the overlay, and over nothing it's nothing
+  struct Image red, blue;
+  img_init( &red, 1, 1 );
+  img_init( &blue, 1, 1 );
+  red.data[0] = make_pixel( 255, 0, 0, 0 );
+  blue.data[0] = make_pixel( 0, 0, 255, 128 );
+  composite_over( &red, &blue, &red, 1 );
+  ASSERT( red.data[0] == blue.data[0] );
+  red.data[0] = blue.data[0] = make_pixel( 255, 0, 0, 0 );
+  composite_over( &red, &blue, &red, 1 );
+  ASSERT( red.data[0] == 0 );
+  img_cleanup( &red );
+  img_cleanup( &blue );
+
+  // the transformation reads the overlay from the file named by its
+  // argument, and fails if it can't
+  char filename[] = "/tmp/imgproc_composite_test_XXXXXX";
+  int fd = mkstemp( filename );
+  ASSERT( fd >= 0 );
+  close( fd );
+  ASSERT( img_write( filename, objs->smiley ) == IMG_SUCCESS );
+
+  const struct Transformation *composite = find_transformation( "composite" );
+  ASSERT( composite->flags & XFORM_READS_FILES );
+  char *args[] = { "", "composite", "in", "out", filename, NULL };
+  struct Image *out_img = create_output_img( objs->sq_test, "composite", 5, args );
+  ASSERT( composite->apply( objs->sq_test, out_img, 5, args ) );
+  for ( int32_t r = 0; r < out_img->height; ++r ) {
+    for ( int32_t c = 0; c < out_img->width; ++c ) {
+      uint32_t p = objs->sq_test->data[r * objs->sq_test->width + c];
+      if ( r < objs->smiley->height && c < objs->smiley->width )
+        p = reference_over( p, objs->smiley->data[r * objs->smiley->width + c] );
+      ASSERT( out_img->data[r * out_img->width + c] == p );
+    }
+  }
+  remove( filename );
+  ASSERT( !composite->apply( objs->sq_test, out_img, 5, args ) );
+  ASSERT( !composite->apply( objs->sq_test, out_img, 4, args ) );
+  cleanup_image( out_img );
+}
@@ -0,0 +1,122 @@
+// Table of the available implementations of the imgproc_* functions
+
+#include <string.h>
+#include "imgproc.h"
+#include "imgproc_variants.h"
+#include "ellipse_mask.h"
+#include "planar.h"
+#include "jit.h"
+#include "stencil.h"
+
+// the asm implementations, renamed by objcopy --prefix-symbols=asm_
+void asm_imgproc_complement( struct Image *input_img, struct Image *output_img );
+int asm_imgproc_transpose( struct Image *input_img, struct Image *output_img );
+void asm_imgproc_ellipse( struct Image *input_img, struct Image *output_img );
+void asm_imgproc_emboss( struct Image *input_img, struct Image *output_img );
+
+// Planar versions of complement and emboss, including the conversions
+// to and from the packed layout. The planar images are kept between
+// calls (the benchmarks and fuzzer are single-threaded), so that only
+// the first call at a given size allocates.
+static struct PlanarImage s_planar_in, s_planar_out;
+
+static int planar_scratch( int32_t width, int32_t height ) {
+  if ( s_planar_in.r != NULL && s_planar_in.width == width && s_planar_in.height == height )
+    return 1;
+  planar_cleanup( &s_planar_in );
+  planar_cleanup( &s_planar_out );
+  if ( planar_init( &s_planar_in, width, height ) != IMG_SUCCESS )
+    return 0;
+  if ( planar_init( &s_planar_out, width, height ) != IMG_SUCCESS ) {
+    planar_cleanup( &s_planar_in );
+    return 0;
+  }
+  return 1;
+}
+
+static void planar_variant_complement( struct Image *input_img, struct Image *output_img ) {
+  if ( !planar_scratch( input_img->width, input_img->height ) ) {
+    imgproc_complement( input_img, output_img );
+    return;
+  }
+  planar_from_image( input_img, &s_planar_in );
+  planar_complement( &s_planar_in, &s_planar_out );
+  planar_to_image( &s_planar_out, output_img );
+}
+
+static void planar_variant_emboss( struct Image *input_img, struct Image *output_img ) {
+  if ( !planar_scratch( input_img->width, input_img->height ) ) {
+    imgproc_emboss( input_img, output_img );
+    return;
+  }
+  planar_from_image( input_img, &s_planar_in );
+  planar_emboss( &s_planar_in, &s_planar_out );
+  planar_to_image( &s_planar_out, output_img );
+}
+
+// Complement and emboss compiled at run time (see jit.h); images too
+// narrow for the JIT use the C functions.
+static void jit_variant_complement( struct Image *input_img, struct Image *output_img ) {
+  enum JitOp op = JIT_COMPLEMENT;
+  const struct JitKernel *kernel = jit_get( &op, 1, input_img->width );
+  if ( kernel == NULL ) {
+    imgproc_complement( input_img, output_img );
+    return;
+  }
+  for ( int32_t row = 0; row < input_img->height; ++row ) {
+    size_t start = (size_t) row * input_img->width;
+    kernel->row( input_img->data + start, NULL, output_img->data + start );
+  }
+  jit_release( kernel );
+}
+
+static void jit_variant_emboss( struct Image *input_img, struct Image *output_img ) {
+  enum JitOp op = JIT_EMBOSS;
+  const struct JitKernel *kernel = jit_get( &op, 1, input_img->width );
+  if ( kernel == NULL || input_img->height == 0 ) {
+    imgproc_emboss( input_img, output_img );
+    if ( kernel != NULL )
+      jit_release( kernel );
+    return;
+  }
+
+  // the kernel can't compute the top row
+  struct Image top_in = { input_img->width, 1, input_img->data };
+  struct Image top_out = { output_img->width, 1, output_img->data };
+  imgproc_emboss( &top_in, &top_out );
+  for ( int32_t row = 1; row < input_img->height; ++row ) {
+    size_t start = (size_t) row * input_img->width;
+    kernel->row( input_img->data + start, input_img->data + start - input_img->width, output_img->data + start );
+  }
+  jit_release( kernel );
+}
+
+// Emboss as an instance of the stencil engine, on one thread so that
+// it can be compared with the other single-threaded variants
+static void stencil_variant_emboss( struct Image *input_img, struct Image *output_img ) {
+  if ( stencil_apply( &stencil_emboss, input_img, output_img, 1 ) != IMG_SUCCESS )
+    imgproc_emboss( input_img, output_img );
+}
+
+const struct KernelVariant kernel_variants[] = {
+  { "c",   imgproc_complement,     imgproc_transpose,     imgproc_ellipse,     imgproc_emboss },
+  { "asm", asm_imgproc_complement, asm_imgproc_transpose, asm_imgproc_ellipse, asm_imgproc_emboss },
+  // the C functions, except that ellipse uses the cached mask
+  { "c-mask", imgproc_complement,  imgproc_transpose,     ellipse_masked,      imgproc_emboss },
+  // complement and emboss on a planar copy of the image (see planar.h)
+  { "c-planar", planar_variant_complement, imgproc_transpose, ellipse_masked, planar_variant_emboss },
+  // complement and emboss compiled to machine code at run time
+  { "jit", jit_variant_complement, imgproc_transpose, ellipse_masked, jit_variant_emboss },
+  // emboss run through the generic stencil engine (see stencil.h)
+  { "c-stencil", imgproc_complement, imgproc_transpose, ellipse_masked, stencil_variant_emboss },
+};
+
+const int num_kernel_variants = sizeof( kernel_variants ) / sizeof( kernel_variants[0] );
+
+const struct KernelVariant *find_kernel_variant( const char *name ) {
+  for ( int i = 0; i < num_kernel_variants; ++i ) {
+    if ( strcmp( kernel_variants[i].name, name ) == 0 )
+      return &kernel_variants[i];
+  }
+  return NULL;
+}
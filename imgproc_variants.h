@@ -0,0 +1,29 @@
+#ifndef IMGPROC_VARIANTS_H
+#define IMGPROC_VARIANTS_H
+
+#include "image.h"
+
+// One implementation of the imgproc_* transformations. Programs
+// that need to compare implementations (benchmarks, differential
+// tests) link the C functions together with a copy of the asm
+// functions whose symbols are prefixed with "asm_" (see the
+// Makefile), and select between them through this table.
+struct KernelVariant {
+  const char *name;
+  void (*complement)( struct Image *input_img, struct Image *output_img );
+  int (*transpose)( struct Image *input_img, struct Image *output_img );
+  void (*ellipse)( struct Image *input_img, struct Image *output_img );
+  void (*emboss)( struct Image *input_img, struct Image *output_img );
+};
+
+// All available variants; the first one is the C reference implementation
+extern const struct KernelVariant kernel_variants[];
+extern const int num_kernel_variants;
+
+// Find a kernel variant by name.
+//
+// Returns:
+//   pointer to the variant, or NULL if there is no variant with that name
+const struct KernelVariant *find_kernel_variant( const char *name );
+
+#endif // IMGPROC_VARIANTS_H
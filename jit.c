@@ -0,0 +1,464 @@
+// Run-time compilation of chains of point operations and emboss to
+// x86-64 code, with a process-wide cache of the compiled kernels
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <sys/mman.h>
+#endif
+#include "jit.h"
+
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct JitKernel *s_kernels;
+static int s_num_kernels;
+static uint64_t s_clock;
+
+int jit_supported(const enum JitOp *ops, int n, int32_t width) {
+#if defined(__x86_64__)
+  if (n < 1 || n > JIT_MAX_OPS || width < JIT_MIN_WIDTH) {
+    return 0;
+  }
+  int embosses = 0;
+  for (int i = 0; i < n; i++) {
+    if (ops[i] == JIT_NONE) {
+      return 0;
+    }
+    embosses += (ops[i] == JIT_EMBOSS);
+  }
+  return embosses <= 1;
+#else
+  (void) ops;
+  (void) n;
+  (void) width;
+  return 0;
+#endif
+}
+
+#if defined(__x86_64__)
+
+// Size of the code buffer for one kernel: the constants, the first
+// column and two copies of the loop body (the loop and the last group
+// of pixels) take well under 2 KiB.
+#define CODE_BYTES 4096
+
+// The constants are at the start of the buffer, followed by the code.
+#define CONST_128        0   // eight 16-bit 128s
+#define CONST_ALPHA     16   // the alpha byte of four pixels
+#define CONST_COLOR     32   // the color bytes of four pixels
+#define CODE_START      48
+
+// Registers: the kernel's arguments are in rdi (in), rsi (above) and
+// rdx (out), and rcx is the byte offset of the current group of pixels.
+// xmm0-xmm11 hold pixels and intermediate values, xmm12-xmm15 the
+// constants.
+#define RDX 2
+#define RSI 6
+#define RDI 7
+#define XMM_ZERO  12
+#define XMM_COLOR 13
+#define XMM_ALPHA 14
+#define XMM_128   15
+
+// SSE2 opcodes (after the 0F escape byte)
+#define OP_MOVDQU_LOAD  0x6F  // with prefix F3
+#define OP_MOVDQU_STORE 0x7F  // with prefix F3
+#define OP_MOVDQA       0x6F  // with prefix 66
+#define OP_PSHUFLW_HW   0x70  // pshuflw with prefix F2, pshufhw with F3
+#define OP_PUNPCKLBW    0x60
+#define OP_PUNPCKHBW    0x68
+#define OP_PACKUSWB     0x67
+#define OP_PCMPGTW      0x65
+#define OP_PAND         0xDB
+#define OP_PANDN        0xDF
+#define OP_POR          0xEB
+#define OP_PXOR         0xEF
+#define OP_PSUBW        0xF9
+#define OP_PADDW        0xFD
+#define OP_PMAXSW       0xEE
+
+struct CodeBuf {
+  uint8_t *code;
+  size_t len;
+  int overflow;
+};
+
+static void emit8(struct CodeBuf *buf, uint8_t byte) {
+  if (buf->len >= CODE_BYTES) {
+    buf->overflow = 1;
+    return;
+  }
+  buf->code[buf->len++] = byte;
+}
+
+static void emit32(struct CodeBuf *buf, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    emit8(buf, (uint8_t) (value >> (8 * i)));
+  }
+}
+
+// Emit an SSE instruction with two xmm register operands.
+static void emit_rr(struct CodeBuf *buf, uint8_t prefix, uint8_t op, int reg, int rm) {
+  emit8(buf, prefix);
+  if (reg >= 8 || rm >= 8) {
+    emit8(buf, 0x40 | ((reg >> 3) << 2) | (rm >> 3));
+  }
+  emit8(buf, 0x0F);
+  emit8(buf, op);
+  emit8(buf, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// op xmm_reg, xmm_rm (66-prefixed integer SSE2 instructions)
+static void emit_op(struct CodeBuf *buf, uint8_t op, int reg, int rm) {
+  emit_rr(buf, 0x66, op, reg, rm);
+}
+
+static void emit_movdqa(struct CodeBuf *buf, int dst, int src) {
+  emit_rr(buf, 0x66, OP_MOVDQA, dst, src);
+}
+
+// Set every 16-bit lane of dst to lane `lane` (0 to 3) of the same
+// pixel (64-bit half) of src.
+static void emit_broadcast_lane(struct CodeBuf *buf, int dst, int src, int lane) {
+  uint8_t imm = (uint8_t) (lane * 0x55);
+  emit_rr(buf, 0xF2, OP_PSHUFLW_HW, dst, src);
+  emit8(buf, imm);
+  emit_rr(buf, 0xF3, OP_PSHUFLW_HW, dst, dst);
+  emit8(buf, imm);
+}
+
+// movdqu between xmm reg and [base + rcx + disp]
+static void emit_mem(struct CodeBuf *buf, uint8_t op, int reg, int base, int8_t disp) {
+  emit8(buf, 0xF3);
+  if (reg >= 8) {
+    emit8(buf, 0x44);
+  }
+  emit8(buf, 0x0F);
+  emit8(buf, op);
+  emit8(buf, 0x44 | ((reg & 7) << 3));  // disp8, SIB follows
+  emit8(buf, (1 << 3) | base);          // index rcx, scale 1
+  emit8(buf, (uint8_t) disp);
+}
+
+// movdqu xmm reg, [rip + offset of a constant]
+static void emit_load_const(struct CodeBuf *buf, int reg, size_t offset) {
+  emit8(buf, 0xF3);
+  if (reg >= 8) {
+    emit8(buf, 0x44);
+  }
+  emit8(buf, 0x0F);
+  emit8(buf, OP_MOVDQU_LOAD);
+  emit8(buf, 0x05 | ((reg & 7) << 3));
+  emit32(buf, (uint32_t) ((int64_t) offset - (int64_t) (buf->len + 4)));
+}
+
+// Apply a point operation to the four pixels in an xmm register.
+static void emit_point(struct CodeBuf *buf, enum JitOp op, int reg) {
+  if (op == JIT_COMPLEMENT) {
+    emit_op(buf, OP_PXOR, reg, XMM_COLOR);
+  }
+}
+
+// Apply a point operation to the pixel in eax.
+static void emit_point_scalar(struct CodeBuf *buf, enum JitOp op) {
+  if (op == JIT_COMPLEMENT) {
+    emit8(buf, 0x35);  // xor eax, imm32
+    emit32(buf, 0xFFFFFF00U);
+  }
+}
+
+// Turn the differences (above - current) of two pixels, as 16-bit
+// lanes a, b, g, r in register d, into 128 plus the difference that
+// emboss chooses, in every lane. Uses xmm6-xmm11.
+static void emit_emboss_diff(struct CodeBuf *buf, int d) {
+  const int mag = 6, ar = 7, ag = 8, ab = 9, dr = 10, dg = 11;
+
+  // |d| = max(d, 0 - d)
+  emit_movdqa(buf, mag, XMM_ZERO);
+  emit_op(buf, OP_PSUBW, mag, d);
+  emit_op(buf, OP_PMAXSW, mag, d);
+
+  emit_broadcast_lane(buf, dr, d, 3);
+  emit_broadcast_lane(buf, dg, d, 2);
+  emit_broadcast_lane(buf, d, d, 1);  // d is now the blue difference
+  emit_broadcast_lane(buf, ar, mag, 3);
+  emit_broadcast_lane(buf, ag, mag, 2);
+  emit_broadcast_lane(buf, ab, mag, 1);
+
+  // same priorities as get_max_diff: red, unless green or blue is
+  // strictly larger; then green, unless blue is strictly larger
+  const int b_over_g = mag;
+  emit_movdqa(buf, b_over_g, ab);
+  emit_op(buf, OP_PCMPGTW, b_over_g, ag);
+  emit_op(buf, OP_PCMPGTW, ag, ar);
+  emit_op(buf, OP_PCMPGTW, ab, ar);
+  emit_op(buf, OP_POR, ag, ab);  // ag is now "not red"
+
+  emit_op(buf, OP_PAND, d, b_over_g);
+  emit_op(buf, OP_PANDN, b_over_g, dg);
+  emit_op(buf, OP_POR, d, b_over_g);
+  emit_op(buf, OP_PAND, d, ag);
+  emit_op(buf, OP_PANDN, ag, dr);
+  emit_op(buf, OP_POR, d, ag);
+
+  emit_op(buf, OP_PADDW, d, XMM_128);
+}
+
+// Emit the loop body for the group of pixels at byte offset rcx.
+static void emit_body(struct CodeBuf *buf, const struct JitKernel *kernel) {
+  if (!kernel->emboss) {
+    emit_mem(buf, OP_MOVDQU_LOAD, 0, RDI, 0);
+    for (int i = 0; i < kernel->num_ops; i++) {
+      emit_point(buf, kernel->ops[i], 0);
+    }
+    emit_mem(buf, OP_MOVDQU_STORE, 0, RDX, 0);
+    return;
+  }
+
+  // the group starts at column 1, and its neighbors at column 0 of
+  // the row above
+  emit_mem(buf, OP_MOVDQU_LOAD, 0, RDI, 4);
+  emit_mem(buf, OP_MOVDQU_LOAD, 1, RSI, 0);
+  int i = 0;
+  for (; kernel->ops[i] != JIT_EMBOSS; i++) {
+    emit_point(buf, kernel->ops[i], 0);
+    emit_point(buf, kernel->ops[i], 1);
+  }
+
+  // widen to 16 bits and subtract, two pixels per register
+  emit_movdqa(buf, 2, 0);
+  emit_op(buf, OP_PUNPCKLBW, 2, XMM_ZERO);
+  emit_movdqa(buf, 3, 0);
+  emit_op(buf, OP_PUNPCKHBW, 3, XMM_ZERO);
+  emit_movdqa(buf, 4, 1);
+  emit_op(buf, OP_PUNPCKLBW, 4, XMM_ZERO);
+  emit_movdqa(buf, 5, 1);
+  emit_op(buf, OP_PUNPCKHBW, 5, XMM_ZERO);
+  emit_op(buf, OP_PSUBW, 4, 2);
+  emit_op(buf, OP_PSUBW, 5, 3);
+  emit_emboss_diff(buf, 4);
+  emit_emboss_diff(buf, 5);
+
+  // packing with unsigned saturation clamps to 0..255; the alpha
+  // comes from the current pixel
+  emit_op(buf, OP_PACKUSWB, 4, 5);
+  emit_movdqa(buf, 6, XMM_ALPHA);
+  emit_op(buf, OP_PANDN, 6, 4);
+  emit_op(buf, OP_PAND, 0, XMM_ALPHA);
+  emit_op(buf, OP_POR, 0, 6);
+
+  for (i++; i < kernel->num_ops; i++) {
+    emit_point(buf, kernel->ops[i], 0);
+  }
+  emit_mem(buf, OP_MOVDQU_STORE, 0, RDX, 4);
+}
+
+static void compile(struct CodeBuf *buf, const struct JitKernel *kernel) {
+  uint8_t *code = buf->code;
+  for (int i = 0; i < 8; i++) {
+    ((uint16_t *) (code + CONST_128))[i] = 128;
+  }
+  for (int i = 0; i < 4; i++) {
+    ((uint32_t *) (code + CONST_ALPHA))[i] = 0x000000FFU;
+    ((uint32_t *) (code + CONST_COLOR))[i] = 0xFFFFFF00U;
+  }
+  buf->len = CODE_START;
+
+  // pixels processed by the loop: all of them, or all but the first
+  // column (which emboss sets to gray)
+  int32_t pixels = kernel->width;
+  if (kernel->emboss) {
+    pixels--;
+    emit8(buf, 0x8B);  // mov eax, [rdi]
+    emit8(buf, 0x07);
+    int i = 0;
+    for (; kernel->ops[i] != JIT_EMBOSS; i++) {
+      emit_point_scalar(buf, kernel->ops[i]);
+    }
+    emit8(buf, 0x25);  // and eax, 0xFF
+    emit32(buf, 0x000000FFU);
+    emit8(buf, 0x0D);  // or eax, 0x80808000
+    emit32(buf, 0x80808000U);
+    for (i++; i < kernel->num_ops; i++) {
+      emit_point_scalar(buf, kernel->ops[i]);
+    }
+    emit8(buf, 0x89);  // mov [rdx], eax
+    emit8(buf, 0x02);
+  }
+
+  emit_op(buf, OP_PXOR, XMM_ZERO, XMM_ZERO);
+  emit_load_const(buf, XMM_COLOR, CONST_COLOR);
+  emit_load_const(buf, XMM_ALPHA, CONST_ALPHA);
+  emit_load_const(buf, XMM_128, CONST_128);
+  emit8(buf, 0x31);  // xor ecx, ecx
+  emit8(buf, 0xC9);
+
+  size_t loop = buf->len;
+  emit_body(buf, kernel);
+  emit8(buf, 0x48);  // add rcx, 16
+  emit8(buf, 0x83);
+  emit8(buf, 0xC1);
+  emit8(buf, 16);
+  emit8(buf, 0x48);  // cmp rcx, imm32
+  emit8(buf, 0x81);
+  emit8(buf, 0xF9);
+  emit32(buf, (uint32_t) (pixels / 4) * 16);
+  emit8(buf, 0x0F);  // jb loop
+  emit8(buf, 0x82);
+  emit32(buf, (uint32_t) ((int64_t) loop - (int64_t) (buf->len + 4)));
+
+  // the last partial group is done by recomputing the last 4 pixels
+  // (the output doesn't overlap the input, so this is harmless)
+  if (pixels % 4 != 0) {
+    emit8(buf, 0xB9);  // mov ecx, imm32
+    emit32(buf, (uint32_t) (pixels - 4) * 4);
+    emit_body(buf, kernel);
+  }
+  emit8(buf, 0xC3);  // ret
+}
+
+static struct JitKernel *create_kernel(const enum JitOp *ops, int n, int32_t width) {
+  struct JitKernel *kernel = (struct JitKernel *) calloc(1, sizeof(struct JitKernel));
+  if (kernel == NULL) {
+    return NULL;
+  }
+  kernel->width = width;
+  kernel->num_ops = n;
+  for (int i = 0; i < n; i++) {
+    kernel->ops[i] = ops[i];
+    kernel->emboss |= (ops[i] == JIT_EMBOSS);
+  }
+
+  // the code is written to ordinary pages, which are then made
+  // executable (and read-only)
+  void *code = mmap(NULL, CODE_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    free(kernel);
+    return NULL;
+  }
+  struct CodeBuf buf = { (uint8_t *) code, 0, 0 };
+  compile(&buf, kernel);
+  if (buf.overflow || mprotect(code, CODE_BYTES, PROT_READ | PROT_EXEC) != 0) {
+    munmap(code, CODE_BYTES);
+    free(kernel);
+    return NULL;
+  }
+
+  kernel->code = code;
+  kernel->code_bytes = CODE_BYTES;
+  kernel->row = (void (*)(const uint32_t *, const uint32_t *, uint32_t *)) ((uint8_t *) code + CODE_START);
+  return kernel;
+}
+
+static void free_kernel(struct JitKernel *kernel) {
+  munmap(kernel->code, kernel->code_bytes);
+  free(kernel);
+}
+
+#else
+
+static struct JitKernel *create_kernel(const enum JitOp *ops, int n, int32_t width) {
+  (void) ops;
+  (void) n;
+  (void) width;
+  return NULL;
+}
+
+static void free_kernel(struct JitKernel *kernel) {
+  free(kernel);
+}
+
+#endif
+
+// Find a cached kernel. Must be called with s_lock held.
+static struct JitKernel *find_kernel(const enum JitOp *ops, int n, int32_t width) {
+  for (struct JitKernel *k = s_kernels; k != NULL; k = k->next) {
+    if (k->width == width && k->num_ops == n && memcmp(k->ops, ops, n * sizeof(enum JitOp)) == 0) {
+      return k;
+    }
+  }
+  return NULL;
+}
+
+// Add a kernel to the cache, evicting the least recently used kernel
+// that isn't in use if the cache is full. Must be called with s_lock
+// held.
+static void insert_kernel(struct JitKernel *kernel) {
+  if (s_num_kernels >= JIT_CACHE_SIZE) {
+    struct JitKernel **victim = NULL;
+    for (struct JitKernel **p = &s_kernels; *p != NULL; p = &(*p)->next) {
+      if ((*p)->refcount == 0 && (victim == NULL || (*p)->last_used < (*victim)->last_used)) {
+        victim = p;
+      }
+    }
+    if (victim != NULL) {
+      struct JitKernel *k = *victim;
+      *victim = k->next;
+      free_kernel(k);
+      s_num_kernels--;
+    }
+  }
+
+  kernel->last_used = ++s_clock;
+  kernel->next = s_kernels;
+  s_kernels = kernel;
+  s_num_kernels++;
+}
+
+const struct JitKernel *jit_get(const enum JitOp *ops, int n, int32_t width) {
+  if (!jit_supported(ops, n, width)) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&s_lock);
+  struct JitKernel *kernel = find_kernel(ops, n, width);
+  if (kernel != NULL) {
+    kernel->refcount++;
+    kernel->last_used = ++s_clock;
+    pthread_mutex_unlock(&s_lock);
+    return kernel;
+  }
+  pthread_mutex_unlock(&s_lock);
+
+  // compile without holding the lock; if another thread compiles the
+  // same chain in the meantime, use theirs
+  struct JitKernel *compiled = create_kernel(ops, n, width);
+  if (compiled == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&s_lock);
+  kernel = find_kernel(ops, n, width);
+  if (kernel == NULL) {
+    kernel = compiled;
+    insert_kernel(kernel);
+  } else {
+    free_kernel(compiled);
+    kernel->last_used = ++s_clock;
+  }
+  kernel->refcount++;
+  pthread_mutex_unlock(&s_lock);
+  return kernel;
+}
+
+void jit_release(const struct JitKernel *kernel) {
+  pthread_mutex_lock(&s_lock);
+  ((struct JitKernel *) kernel)->refcount--;
+  pthread_mutex_unlock(&s_lock);
+}
+
+void jit_clear(void) {
+  pthread_mutex_lock(&s_lock);
+  struct JitKernel **p = &s_kernels;
+  while (*p != NULL) {
+    struct JitKernel *k = *p;
+    if (k->refcount == 0) {
+      *p = k->next;
+      free_kernel(k);
+      s_num_kernels--;
+    } else {
+      p = &k->next;
+    }
+  }
+  pthread_mutex_unlock(&s_lock);
+}
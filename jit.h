@@ -0,0 +1,89 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdint.h>
+
+// Operations that can be compiled into a single loop at run time
+enum JitOp {
+  JIT_NONE,        // the transformation can't be compiled
+  JIT_COMPLEMENT,  // point operation: invert the color channels
+  JIT_EMBOSS,      // emboss, which reads the pixel above and to the left
+};
+
+// maximum number of operations in a chain
+#define JIT_MAX_OPS 16
+
+// A chain of operations compiled to x86-64 code for one image width.
+// The generated function computes one output row with a single SSE2
+// loop of 4 pixels per iteration: each operation's instructions are
+// emitted in sequence in the loop body, so intermediate results never
+// leave the registers, and the trip count and the offsets of the last
+// (partial) group of pixels are constants in the code.
+//
+// A chain can contain at most one emboss. Point operations before it
+// are applied to both pixels it reads, those after it to its result.
+struct JitKernel {
+  // Compute one row: in is the input row and out the output row. For
+  // chains with an emboss, above is the input row above it; the top
+  // row of the image can't be computed by the kernel (the caller uses
+  // imgproc_emboss or a band transformation for it). The output row
+  // must not overlap the input rows.
+  void (*row)(const uint32_t *in, const uint32_t *above, uint32_t *out);
+  // nonzero if the chain contains an emboss
+  int emboss;
+
+  // the chain signature, used as the cache key
+  int32_t width;
+  int num_ops;
+  enum JitOp ops[JIT_MAX_OPS];
+
+  // cache bookkeeping
+  void *code;
+  size_t code_bytes;
+  int refcount;
+  uint64_t last_used;
+  struct JitKernel *next;
+};
+
+// narrowest image that can be compiled for (the loop needs at least
+// one full group of 4 pixels after the first column)
+#define JIT_MIN_WIDTH 5
+
+// maximum number of kernels kept in the cache
+#define JIT_CACHE_SIZE 32
+
+// Check whether a chain can be compiled, without compiling it.
+//
+// Parameters:
+//   ops - the operations, in the order they are applied
+//   n - number of operations
+//   width - image width
+//
+// Returns:
+//   nonzero if jit_get can compile the chain on this machine
+int jit_supported(const enum JitOp *ops, int n, int32_t width);
+
+// Get the kernel for a chain and image width, compiling it if it isn't
+// cached already. The kernel must be released with jit_release when
+// it's no longer needed. Thread-safe.
+//
+// Parameters:
+//   ops - the operations, in the order they are applied
+//   n - number of operations
+//   width - image width
+//
+// Returns:
+//   pointer to the kernel, or NULL if the chain can't be compiled
+//   (see jit_supported) or executable memory couldn't be allocated
+const struct JitKernel *jit_get(const enum JitOp *ops, int n, int32_t width);
+
+// Release a kernel obtained from jit_get.
+//
+// Parameters:
+//   kernel - pointer to the kernel
+void jit_release(const struct JitKernel *kernel);
+
+// Remove all kernels which aren't currently in use from the cache.
+void jit_clear(void);
+
+#endif // JIT_H
@@ -0,0 +1,136 @@
+// Hardware performance counters (via perf_event_open) for
+// measuring the transformations
+
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#include "perfctr.h"
+
+static const char *s_counter_names[PERF_NUM_COUNTERS] = {
+  "cycles", "instructions", "L1d misses", "LLC misses", "dTLB misses", "branch misses", "task clock (ns)",
+};
+
+#ifdef __linux__
+#define CACHE_EVENT(cache) \
+  ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+  uint32_t type;
+  uint64_t config;
+} s_events[PERF_NUM_COUNTERS] = {
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D) },
+  { PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_LL) },
+  { PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB) },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+  { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+};
+#endif
+
+void perf_init(struct PerfCounters *pc) {
+  for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+    pc->fds[i] = -1;
+    pc->values[i] = 0;
+  }
+  pc->pixels = 0;
+}
+
+int perf_open(struct PerfCounters *pc) {
+  int num_open = 0;
+#ifdef __linux__
+  for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = s_events[i].type;
+    attr.config = s_events[i].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    // count the threads the transformation starts too (a thread's
+    // counts are added to these when it exits, so they are complete
+    // once the transformation has joined its threads)
+    attr.inherit = 1;
+
+    // each event is opened on its own (not as a group), so that the
+    // kernel can still schedule the others if there aren't enough
+    // hardware counters for all of them
+    pc->fds[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (pc->fds[i] >= 0) {
+      num_open++;
+    }
+  }
+#endif
+  return num_open;
+}
+
+void perf_start(struct PerfCounters *pc) {
+#ifdef __linux__
+  for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+    if (pc->fds[i] >= 0) {
+      ioctl(pc->fds[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(pc->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+#else
+  (void) pc;
+#endif
+}
+
+void perf_stop(struct PerfCounters *pc, uint64_t pixels) {
+#ifdef __linux__
+  for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+    if (pc->fds[i] >= 0) {
+      ioctl(pc->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+  for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+    // value, time enabled, time running
+    uint64_t data[3];
+    if (pc->fds[i] < 0 || read(pc->fds[i], data, sizeof(data)) != sizeof(data)) {
+      continue;
+    }
+    if (data[2] != 0 && data[2] < data[1]) {
+      // the event was multiplexed, so extrapolate to the whole interval
+      data[0] = (uint64_t) ((double) data[0] * data[1] / data[2]);
+    }
+    pc->values[i] += data[0];
+  }
+#endif
+  pc->pixels += pixels;
+}
+
+void perf_report(FILE *out, const struct PerfCounters *pc, const char *label) {
+  double megapixels = pc->pixels / 1e6;
+
+  fprintf(out, "%s: %.3f megapixels\n", label, megapixels);
+  fprintf(out, "  %-16s %16s %16s\n", "counter", "total", "per megapixel");
+  for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+    if (pc->fds[i] < 0) {
+      fprintf(out, "  %-16s %16s %16s\n", s_counter_names[i], "n/a", "n/a");
+    } else {
+      fprintf(out, "  %-16s %16llu %16.1f\n", s_counter_names[i],
+              (unsigned long long) pc->values[i],
+              megapixels > 0 ? pc->values[i] / megapixels : 0.0);
+    }
+  }
+  if (pc->fds[PERF_CYCLES] >= 0 && pc->fds[PERF_INSTRUCTIONS] >= 0 && pc->values[PERF_CYCLES] != 0) {
+    fprintf(out, "  instructions per cycle: %.2f\n",
+            (double) pc->values[PERF_INSTRUCTIONS] / pc->values[PERF_CYCLES]);
+  }
+}
+
+void perf_close(struct PerfCounters *pc) {
+  for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+    if (pc->fds[i] >= 0) {
+      close(pc->fds[i]);
+    }
+    pc->fds[i] = -1;
+  }
+}
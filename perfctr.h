@@ -0,0 +1,77 @@
+#ifndef PERFCTR_H
+#define PERFCTR_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// The hardware (and software) events counted around a transformation
+enum PerfCounter {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_L1D_MISSES,
+  PERF_LLC_MISSES,
+  PERF_DTLB_MISSES,
+  PERF_BRANCH_MISSES,
+  PERF_TASK_CLOCK,
+  PERF_NUM_COUNTERS
+};
+
+// A set of perf_event_open counters for the calling thread and the
+// threads it starts. A thread's counts are only added in when it
+// exits, so threads started between perf_start and perf_stop must
+// have been joined by perf_stop. Events the kernel or CPU doesn't
+// support (or isn't allowed to count, see
+// /proc/sys/kernel/perf_event_paranoid) are simply left closed and
+// reported as unavailable.
+struct PerfCounters {
+  int fds[PERF_NUM_COUNTERS];
+  uint64_t values[PERF_NUM_COUNTERS];
+  uint64_t pixels;
+};
+
+// Initialize a PerfCounters instance with no counters open.
+// perf_start and perf_stop do nothing until perf_open is called.
+//
+// Parameters:
+//   pc - pointer to PerfCounters instance to initialize
+void perf_init(struct PerfCounters *pc);
+
+// Open (but don't start) the counters. Only user-space events
+// are counted.
+//
+// Parameters:
+//   pc - pointer to PerfCounters instance initialized by perf_init
+//
+// Returns:
+//   the number of counters that could be opened
+int perf_open(struct PerfCounters *pc);
+
+// Reset and start all open counters.
+//
+// Parameters:
+//   pc - pointer to PerfCounters
+void perf_start(struct PerfCounters *pc);
+
+// Stop all open counters and add their values (scaled up if the
+// kernel had to multiplex them) to the totals.
+//
+// Parameters:
+//   pc - pointer to PerfCounters
+//   pixels - number of pixels processed while the counters ran
+void perf_stop(struct PerfCounters *pc, uint64_t pixels);
+
+// Write the counter totals, and the totals per megapixel processed.
+//
+// Parameters:
+//   out - stream to write to
+//   pc - pointer to PerfCounters
+//   label - heading for the report (e.g. program and transformation name)
+void perf_report(FILE *out, const struct PerfCounters *pc, const char *label);
+
+// Close all open counters.
+//
+// Parameters:
+//   pc - pointer to PerfCounters
+void perf_close(struct PerfCounters *pc);
+
+#endif // PERFCTR_H
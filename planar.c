@@ -0,0 +1,255 @@
+// Planar (structure of arrays) images and channel-wise kernels
+
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "planar.h"
+
+// The AVX2 versions are compiled with a target attribute (the Makefile
+// doesn't select an instruction set) and only called if the CPU
+// supports them.
+#if defined(__x86_64__)
+#define PLANAR_AVX2 __attribute__((target("avx2")))
+
+static int have_avx2(void) {
+  static int avx2 = -1;
+  if (avx2 < 0) {
+    avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+  }
+  return avx2;
+}
+#endif
+
+int planar_init(struct PlanarImage *img, int32_t width, int32_t height) {
+  size_t n = (size_t) width * height;
+  // at least one byte, so that empty images still have a valid allocation
+  uint8_t *planes = (uint8_t *) malloc(n * 4 + 1);
+  if (planes == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  img->width = width;
+  img->height = height;
+  img->r = planes;
+  img->g = planes + n;
+  img->b = planes + 2 * n;
+  img->a = planes + 3 * n;
+  return IMG_SUCCESS;
+}
+
+void planar_cleanup(struct PlanarImage *img) {
+  free(img->r);
+  img->r = img->g = img->b = img->a = NULL;
+}
+
+#if defined(__x86_64__)
+// 32 pixels per iteration: the bytes of each pixel are gathered within
+// each 128-bit lane, then whole 8-pixel groups of each channel are
+// moved into place
+PLANAR_AVX2 static size_t split_avx2(const uint32_t *in, struct PlanarImage *planar, size_t n) {
+  // a pixel is stored as the bytes a, b, g, r
+  const __m256i gather = _mm256_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15,
+                                          0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+  const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  size_t i = 0;
+
+  for (; i + 32 <= n; i += 32) {
+    __m256i v[4];
+    for (int j = 0; j < 4; j++) {
+      __m256i p = _mm256_loadu_si256((const __m256i *) (in + i + 8 * j));
+      // each 64-bit element now holds 8 values of one channel: a, b, g, r
+      v[j] = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(p, gather), order);
+    }
+    __m256i ag_lo = _mm256_unpacklo_epi64(v[0], v[1]), br_lo = _mm256_unpackhi_epi64(v[0], v[1]);
+    __m256i ag_hi = _mm256_unpacklo_epi64(v[2], v[3]), br_hi = _mm256_unpackhi_epi64(v[2], v[3]);
+    _mm256_storeu_si256((__m256i *) (planar->a + i), _mm256_permute2x128_si256(ag_lo, ag_hi, 0x20));
+    _mm256_storeu_si256((__m256i *) (planar->g + i), _mm256_permute2x128_si256(ag_lo, ag_hi, 0x31));
+    _mm256_storeu_si256((__m256i *) (planar->b + i), _mm256_permute2x128_si256(br_lo, br_hi, 0x20));
+    _mm256_storeu_si256((__m256i *) (planar->r + i), _mm256_permute2x128_si256(br_lo, br_hi, 0x31));
+  }
+  return i;
+}
+
+// 32 pixels per iteration, the reverse of split_avx2
+PLANAR_AVX2 static size_t join_avx2(const struct PlanarImage *planar, uint32_t *out, size_t n) {
+  size_t i = 0;
+
+  for (; i + 32 <= n; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *) (planar->a + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *) (planar->b + i));
+    __m256i g = _mm256_loadu_si256((const __m256i *) (planar->g + i));
+    __m256i r = _mm256_loadu_si256((const __m256i *) (planar->r + i));
+    __m256i ab_lo = _mm256_unpacklo_epi8(a, b), ab_hi = _mm256_unpackhi_epi8(a, b);
+    __m256i gr_lo = _mm256_unpacklo_epi8(g, r), gr_hi = _mm256_unpackhi_epi8(g, r);
+    // pixels 0-3 and 16-19, 4-7 and 20-23, 8-11 and 24-27, 12-15 and 28-31
+    __m256i p0 = _mm256_unpacklo_epi16(ab_lo, gr_lo), p1 = _mm256_unpackhi_epi16(ab_lo, gr_lo);
+    __m256i p2 = _mm256_unpacklo_epi16(ab_hi, gr_hi), p3 = _mm256_unpackhi_epi16(ab_hi, gr_hi);
+    _mm256_storeu_si256((__m256i *) (out + i), _mm256_permute2x128_si256(p0, p1, 0x20));
+    _mm256_storeu_si256((__m256i *) (out + i + 8), _mm256_permute2x128_si256(p2, p3, 0x20));
+    _mm256_storeu_si256((__m256i *) (out + i + 16), _mm256_permute2x128_si256(p0, p1, 0x31));
+    _mm256_storeu_si256((__m256i *) (out + i + 24), _mm256_permute2x128_si256(p2, p3, 0x31));
+  }
+  return i;
+}
+
+PLANAR_AVX2 static size_t complement_avx2(const uint8_t *in, uint8_t *out, size_t n) {
+  const __m256i ones = _mm256_set1_epi8((char) 0xFF);
+  size_t i = 0;
+
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (in + i));
+    _mm256_storeu_si256((__m256i *) (out + i), _mm256_xor_si256(v, ones));
+  }
+  return i;
+}
+
+// Emboss 16 pixels of a row (not the top row), starting at col (which
+// must be at least 1), as 16-bit lanes
+PLANAR_AVX2 static void emboss16_avx2(const struct PlanarImage *input_img, struct PlanarImage *output_img,
+                                      size_t cur, size_t above) {
+  __m256i pr = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (input_img->r + cur)));
+  __m256i pg = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (input_img->g + cur)));
+  __m256i pb = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (input_img->b + cur)));
+  __m256i nr = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (input_img->r + above)));
+  __m256i ng = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (input_img->g + above)));
+  __m256i nb = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (input_img->b + above)));
+
+  __m256i dr = _mm256_sub_epi16(nr, pr), dg = _mm256_sub_epi16(ng, pg), db = _mm256_sub_epi16(nb, pb);
+  __m256i ar = _mm256_abs_epi16(dr), ag = _mm256_abs_epi16(dg), ab = _mm256_abs_epi16(db);
+
+  // same priorities as get_max_diff: red, unless green or blue is
+  // strictly larger; then green, unless blue is strictly larger
+  __m256i not_r = _mm256_or_si256(_mm256_cmpgt_epi16(ag, ar), _mm256_cmpgt_epi16(ab, ar));
+  __m256i diff_gb = _mm256_blendv_epi8(dg, db, _mm256_cmpgt_epi16(ab, ag));
+  __m256i diff = _mm256_blendv_epi8(dr, diff_gb, not_r);
+
+  // packing with unsigned saturation clamps to 0..255
+  __m256i gray = _mm256_add_epi16(diff, _mm256_set1_epi16(128));
+  __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(gray, gray), 0xD8);
+  __m128i gray8 = _mm256_castsi256_si128(packed);
+  _mm_storeu_si128((__m128i *) (output_img->r + cur), gray8);
+  _mm_storeu_si128((__m128i *) (output_img->g + cur), gray8);
+  _mm_storeu_si128((__m128i *) (output_img->b + cur), gray8);
+}
+#endif
+
+void planar_from_image(const struct Image *img, struct PlanarImage *planar) {
+  size_t n = (size_t) img->width * img->height;
+  size_t i = 0;
+
+#if defined(__x86_64__)
+  if (have_avx2()) {
+    i = split_avx2(img->data, planar, n);
+  }
+#endif
+
+  for (; i < n; i++) {
+    uint32_t pixel = img->data[i];
+    planar->r[i] = (uint8_t) (pixel >> 24);
+    planar->g[i] = (uint8_t) (pixel >> 16);
+    planar->b[i] = (uint8_t) (pixel >> 8);
+    planar->a[i] = (uint8_t) pixel;
+  }
+}
+
+void planar_to_image(const struct PlanarImage *planar, struct Image *img) {
+  size_t n = (size_t) img->width * img->height;
+  size_t i = 0;
+
+#if defined(__x86_64__)
+  if (have_avx2()) {
+    i = join_avx2(planar, img->data, n);
+  }
+#endif
+
+  for (; i < n; i++) {
+    img->data[i] = ((uint32_t) planar->r[i] << 24) | ((uint32_t) planar->g[i] << 16)
+      | ((uint32_t) planar->b[i] << 8) | planar->a[i];
+  }
+}
+
+static void complement_plane(const uint8_t *in, uint8_t *out, size_t n) {
+  size_t i = 0;
+
+#if defined(__x86_64__)
+  if (have_avx2()) {
+    i = complement_avx2(in, out, n);
+  }
+#endif
+
+  for (; i < n; i++) {
+    out[i] = (uint8_t) ~in[i];
+  }
+}
+
+void planar_complement(const struct PlanarImage *input_img, struct PlanarImage *output_img) {
+  size_t n = (size_t) input_img->width * input_img->height;
+  complement_plane(input_img->r, output_img->r, n);
+  complement_plane(input_img->g, output_img->g, n);
+  complement_plane(input_img->b, output_img->b, n);
+  memcpy(output_img->a, input_img->a, n);
+}
+
+static void emboss_pixel(const struct PlanarImage *input_img, struct PlanarImage *output_img,
+                         size_t cur, size_t above) {
+  int32_t diff_r = input_img->r[above] - input_img->r[cur];
+  int32_t diff_g = input_img->g[above] - input_img->g[cur];
+  int32_t diff_b = input_img->b[above] - input_img->b[cur];
+  int32_t abs_r = diff_r < 0 ? -diff_r : diff_r;
+  int32_t abs_g = diff_g < 0 ? -diff_g : diff_g;
+  int32_t abs_b = diff_b < 0 ? -diff_b : diff_b;
+
+  int32_t diff;
+  if (abs_r >= abs_g && abs_r >= abs_b) {
+    diff = diff_r;
+  } else if (abs_g >= abs_b) {
+    diff = diff_g;
+  } else {
+    diff = diff_b;
+  }
+
+  int32_t gray = 128 + diff;
+  if (gray < 0) {
+    gray = 0;
+  } else if (gray > 255) {
+    gray = 255;
+  }
+  output_img->r[cur] = output_img->g[cur] = output_img->b[cur] = (uint8_t) gray;
+}
+
+void planar_emboss(const struct PlanarImage *input_img, struct PlanarImage *output_img) {
+  int32_t width = input_img->width;
+  int32_t height = input_img->height;
+  size_t n = (size_t) width * height;
+#if defined(__x86_64__)
+  int avx2 = have_avx2();
+#endif
+
+  for (int32_t row = 0; row < height; row++) {
+    size_t start = (size_t) row * width;
+
+    if (row == 0) {
+      memset(output_img->r, 128, (size_t) width);
+      memset(output_img->g, 128, (size_t) width);
+      memset(output_img->b, 128, (size_t) width);
+      continue;
+    }
+
+    output_img->r[start] = output_img->g[start] = output_img->b[start] = 128;
+    int32_t col = 1;
+#if defined(__x86_64__)
+    if (avx2) {
+      for (; col + 16 <= width; col += 16) {
+        emboss16_avx2(input_img, output_img, start + col, start - width + col - 1);
+      }
+    }
+#endif
+    for (; col < width; col++) {
+      emboss_pixel(input_img, output_img, start + col, start - width + col - 1);
+    }
+  }
+
+  memcpy(output_img->a, input_img->a, n);
+}
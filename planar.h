@@ -0,0 +1,66 @@
+#ifndef PLANAR_H
+#define PLANAR_H
+
+#include <stdint.h>
+#include "image.h"
+
+// An image stored as separate planes of red, green, blue and alpha
+// bytes (structure of arrays), rather than as packed RGBA pixels. The
+// channel-wise kernels below work on whole planes at once, without
+// extracting channels from each pixel, so one AVX2 instruction
+// processes 32 (or, for emboss, 16) channel values.
+//
+// The four planes are in one allocation; each plane holds
+// width*height bytes in row-major order.
+struct PlanarImage {
+  int32_t width;
+  int32_t height;
+  uint8_t *r;
+  uint8_t *g;
+  uint8_t *b;
+  uint8_t *a;
+};
+
+// Create a planar image of the given dimensions. The contents of
+// the planes are undefined.
+//
+// Parameters:
+//   img - pointer to PlanarImage instance to initialize
+//   width - image width (number of pixel columns)
+//   height - image height (number of pixel rows)
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int planar_init(struct PlanarImage *img, int32_t width, int32_t height);
+
+// Free the planes of a planar image (but not the struct PlanarImage
+// instance itself).
+//
+// Parameters:
+//   img - pointer to PlanarImage to clean up
+void planar_cleanup(struct PlanarImage *img);
+
+// Split packed pixels into planes. The images must have the same
+// dimensions.
+//
+// Parameters:
+//   img - pointer to the packed Image
+//   planar - pointer to the PlanarImage to fill
+void planar_from_image(const struct Image *img, struct PlanarImage *planar);
+
+// Combine planes into packed pixels. The images must have the same
+// dimensions.
+//
+// Parameters:
+//   planar - pointer to the PlanarImage
+//   img - pointer to the packed Image to fill
+void planar_to_image(const struct PlanarImage *planar, struct Image *img);
+
+// Planar versions of imgproc_complement and imgproc_emboss, with the
+// same results. The output must have the same dimensions as the input,
+// and every pixel of it is written.
+void planar_complement(const struct PlanarImage *input_img, struct PlanarImage *output_img);
+void planar_emboss(const struct PlanarImage *input_img, struct PlanarImage *output_img);
+
+#endif // PLANAR_H
@@ -14,13 +14,27 @@
 #include <stdlib.h>
 #include <string.h>
 #include "pnglite.h"
+#include "stats.h"
 
 static png_alloc_t png_alloc;
 static png_free_t png_free;
 
+/* zlib counts bytes in 32 bit uInts, so buffers larger than this are fed in pieces */
+#define PNG_ZLIB_MAX_CHUNK	0x40000000U
+
+/* the PNG spec limits chunk lengths to 2^31-1, so large IDATs are split */
+#define PNG_MAX_IDAT_LENGTH	0x40000000U
+
+static unsigned png_avail_chunk(size_t remaining)
+{
+	return remaining > PNG_ZLIB_MAX_CHUNK ? PNG_ZLIB_MAX_CHUNK : (unsigned)remaining;
+}
+
 static size_t file_read(png_t* png, void* out, size_t size, size_t numel)
 {
 	size_t result;
+	uint64_t start = stats_start();
+
 	if(png->read_fun)
 	{
 		result = png->read_fun(out, size, numel, png->user_pointer);
@@ -37,12 +51,15 @@ static size_t file_read(png_t* png, void* out, size_t size, size_t numel)
 		}
 	}
 
+	stats_stop(STATS_READ, start, out ? result*size : 0);
+
 	return result;
 }
 
 static size_t file_write(png_t* png, void* p, size_t size, size_t numel)
 {
 	size_t result;
+	uint64_t start = stats_start();
 
 	if(png->write_fun)
 	{
@@ -53,6 +70,8 @@ static size_t file_write(png_t* png, void* p, size_t size, size_t numel)
 		result = fwrite(p, size, numel, png->user_pointer);
 	}
 
+	stats_stop(STATS_WRITE, start, result*size);
+
 	return result;
 }
 
@@ -372,7 +391,7 @@ static int png_init_inflate(png_t* png)
 #endif
 
 	stream->next_out = png->png_data;
-	stream->avail_out = png->png_datalen;
+	stream->avail_out = png_avail_chunk(png->png_datalen);
 
 	return PNG_NO_ERROR;
 }
@@ -419,6 +438,8 @@ static int png_end_inflate(png_t* png)
 
 static int png_inflate(png_t* png, unsigned char* data, int len)
 {
+	uint64_t start;
+	unsigned avail_out;
 	int result;
 #if USE_ZLIB
 	z_stream *stream = png->zs;
@@ -432,17 +453,34 @@ static int png_inflate(png_t* png, unsigned char* data, int len)
 	stream->next_in = data;
 	stream->avail_in = len;
 
+	do
+	{
+		if(stream->avail_out == 0)
+		{
+			/* output window exhausted, slide it over the rest of png_data */
+			size_t done = (size_t)(stream->next_out - png->png_data);
+
+			if(done >= png->png_datalen)
+				break;
+
+			stream->avail_out = png_avail_chunk(png->png_datalen - done);
+		}
+
+		start = stats_start();
+		avail_out = stream->avail_out;
 #if USE_ZLIB
-	result = inflate(stream, Z_SYNC_FLUSH);
+		result = inflate(stream, Z_SYNC_FLUSH);
 #else
-	result = z_inflate(stream);
+		result = z_inflate(stream);
 #endif
+		stats_stop(STATS_INFLATE, start, avail_out - stream->avail_out);
 
-	if(result != Z_STREAM_END && result != Z_OK)
-	{
-		printf("%s\n", stream->msg);
-		return PNG_ZLIB_ERROR;
-	}
+		if(result != Z_STREAM_END && result != Z_OK)
+		{
+			printf("%s\n", stream->msg);
+			return PNG_ZLIB_ERROR;
+		}
+	} while(stream->avail_in != 0 && result != Z_STREAM_END);
 
 	if(stream->avail_in != 0)
 		return PNG_ZLIB_ERROR;
@@ -475,37 +513,66 @@ static int png_deflate(png_t* png, char* outdata, int outlen, int *outwritten)
 	return result;
 }
 
+static int png_write_idat_chunk(png_t* png, unsigned char* data, unsigned len)
+{
+	unsigned long crc;
+
+	crc = crc32(0L, Z_NULL, 0);
+	crc = crc32(crc, (const unsigned char *)"IDAT", 4);
+	crc = crc32(crc, data, len);
+	file_write_ul(png, len);
+	file_write(png, "IDAT", 1, 4);
+	if(file_write(png, data, 1, len) != len)
+		return PNG_IO_ERROR;
+	return file_write_ul(png, crc);
+}
+
+static int png_write_iend(png_t* png)
+{
+	unsigned long crc;
+
+	file_write_ul(png, 0);
+	file_write(png, "IEND", 1, 4);
+	crc = crc32(0L, (const unsigned char *)"IEND", 4);
+	return file_write_ul(png, crc);
+}
+
 static int png_write_idats(png_t* png, unsigned char* data)
 {
 	unsigned char *chunk;
 	unsigned long written;
-	unsigned long crc;
-	unsigned size = png->width * png->height * png->bpp + png->height;
-	unsigned chunk_size = compressBound(size);
+	size_t size = (size_t)png->width * png->height * png->bpp + png->height;
+	size_t chunk_size = compressBound(size);
+	size_t pos;
+	uint64_t start;
 
 	(void)png_init_deflate;
 	(void)png_end_deflate;
 	(void)png_deflate;
 
-	chunk = png_alloc(chunk_size + 4);
-	memcpy(chunk, "IDAT", 4);
+	chunk = png_alloc(chunk_size);
+	if(!chunk)
+		return PNG_MEMORY_ERROR;
 
 	written = chunk_size;
-	compress(chunk+4, &written, data, size);
+	start = stats_start();
+	if(compress(chunk, &written, data, size) != Z_OK)
+	{
+		png_free(chunk);
+		return PNG_ZLIB_ERROR;
+	}
+	stats_stop(STATS_DEFLATE, start, size);
 
-	crc = crc32(0L, Z_NULL, 0);
-	crc = crc32(crc, chunk, written+4);
-	set_ul(chunk+written+4, crc);
-	file_write_ul(png, written);
-	file_write(png, chunk, 1, written+8);
-	png_free(chunk);
+	/* emit the compressed stream as one or more IDAT chunks */
+	for(pos = 0; pos < written; pos += PNG_MAX_IDAT_LENGTH)
+	{
+		unsigned len = (written - pos) > PNG_MAX_IDAT_LENGTH ? PNG_MAX_IDAT_LENGTH : (unsigned)(written - pos);
 
-	file_write_ul(png, 0);
-	file_write(png, "IEND", 1, 4);
-	crc = crc32(0L, (const unsigned char *)"IEND", 4);
-	file_write_ul(png, crc);
+		png_write_idat_chunk(png, chunk+pos, len);
+	}
+	png_free(chunk);
 
-	return PNG_NO_ERROR;
+	return png_write_iend(png);
 }
 
 static int png_read_idat(png_t* png, unsigned length)
@@ -568,7 +635,7 @@ static int png_process_chunk(png_t* png)
 	{
 		if(!png->png_data) /* first IDAT */
 		{
-			png->png_datalen = png->width * png->height * png->bpp + png->height;
+			png->png_datalen = (size_t)png->width * png->height * png->bpp + png->height;
 			png->png_data = png_alloc(png->png_datalen);
 		}
 
@@ -707,61 +774,65 @@ static int png_filter(png_t* png, unsigned char* data)
 	return PNG_NO_ERROR;
 }
 
-static int png_unfilter(png_t* png, unsigned char* data)
+static int png_unfilter_row(png_t* png, unsigned char* filtered, unsigned char* out, unsigned char* prev_line)
 {
 	unsigned i;
-	unsigned pos = 0;
-	unsigned outpos = 0;
-	unsigned char *filtered = png->png_data;
-
 	int stride = png->bpp;
+	int len = png->width * stride;
+	unsigned char filter = filtered[0];
+	uint64_t start = stats_start();
 
-	while(pos < png->png_datalen)
-	{
-		unsigned char filter = filtered[pos];
-
-		pos++;
+	filtered++;
 
-		if(png->depth == 16)
+	if(png->depth == 16)
+	{
+		for(i = 0; i < png->width * stride; i+=2)
 		{
-			for(i = 0; i < png->width * stride; i+=2)
-			{
-				*(short*)(filtered+pos+i) = (filtered[pos+i] << 8) | filtered[pos+i+1];
-			}
+			*(short*)(filtered+i) = (filtered[i] << 8) | filtered[i+1];
 		}
+	}
 
-		switch(filter)
-		{
-		case 0: /* none */
-			memcpy(data+outpos, filtered+pos, png->width * stride);
-			break;
-		case 1: /* sub */
-			png_filter_sub(stride, filtered+pos, data+outpos, png->width * stride);
-			break;
-		case 2: /* up */
-			if(outpos)
-				png_filter_up(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_up(stride, filtered+pos, data+outpos, 0, png->width*stride);
-			break;
-		case 3: /* average */
-			if(outpos)
-				png_filter_average(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_average(stride, filtered+pos, data+outpos, 0, png->width*stride);
-			break;
-		case 4: /* paeth */
-			if(outpos)
-				png_filter_paeth(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_paeth(stride, filtered+pos, data+outpos, 0, png->width*stride);
-			break;
-		default:
-			return PNG_UNKNOWN_FILTER;
-		}
+	switch(filter)
+	{
+	case 0: /* none */
+		memcpy(out, filtered, len);
+		break;
+	case 1: /* sub */
+		png_filter_sub(stride, filtered, out, len);
+		break;
+	case 2: /* up */
+		png_filter_up(stride, filtered, out, prev_line, len);
+		break;
+	case 3: /* average */
+		png_filter_average(stride, filtered, out, prev_line, len);
+		break;
+	case 4: /* paeth */
+		png_filter_paeth(stride, filtered, out, prev_line, len);
+		break;
+	default:
+		return PNG_UNKNOWN_FILTER;
+	}
+
+	stats_stop(STATS_UNFILTER, start, len);
+
+	return PNG_NO_ERROR;
+}
+
+static int png_unfilter(png_t* png, unsigned char* data)
+{
+	size_t pos = 0;
+	size_t outpos = 0;
+	size_t rowlen = (size_t)png->width * png->bpp;
+	int result;
+
+	while(pos < png->png_datalen)
+	{
+		result = png_unfilter_row(png, png->png_data+pos, data+outpos, outpos ? data+outpos-rowlen : 0);
+		if(result != PNG_NO_ERROR)
+			return result;
 
-		outpos += png->width * stride;
-		pos += png->width * stride;
+		outpos += rowlen;
+		pos += rowlen + 1;
 	}
 
 	return PNG_NO_ERROR;
@@ -808,7 +879,10 @@ int png_get_data(png_t* png, unsigned char* data)
 int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int color, unsigned char* data)
 {
 	//int i;
-	unsigned i;
+	size_t i;
+	size_t rowlen;
+	int result;
+	uint64_t start;
 	unsigned char *filtered;
 	png->width = width;
 	png->height = height;
@@ -816,23 +890,325 @@ int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int co
 	png->color_type = color;
 	png->bpp = png_get_bpp(png);
 
-	filtered = png_alloc(width * height * png->bpp + height);
+	rowlen = (size_t)png->width * png->bpp;
+	filtered = png_alloc(rowlen * height + height);
+	if(!filtered)
+		return PNG_MEMORY_ERROR;
 
+	start = stats_start();
 	for(i = 0; i < png->height; i++)
 	{
-		filtered[i*png->width*png->bpp+i] = 0;
-		memcpy(&filtered[i*png->width*png->bpp+i+1], data + i * png->width*png->bpp, png->width*png->bpp);
+		filtered[i*rowlen+i] = 0;
+		memcpy(&filtered[i*rowlen+i+1], data + i * rowlen, rowlen);
 	}
 
 	png_filter(png, filtered);
+	stats_stop(STATS_FILTER, start, rowlen * height);
 	png_write_ihdr(png);
-	png_write_idats(png, filtered);
+	result = png_write_idats(png, filtered);
 
 	png_free(filtered);
 
+	return result;
+}
+
+/* size of the compressed data buffer used by png_read_row and png_write_row
+   (the latter writes IDAT chunks of this size) */
+#define PNG_STREAM_BUFSIZE	(256*1024)
+
+static void png_free_rows(png_t* png)
+{
+	if(png->rowbuf)
+		png_free(png->rowbuf);
+	if(png->prevrow)
+		png_free(png->prevrow);
+	if(png->readbuf)
+		png_free(png->readbuf);
+
+	png->rowbuf = NULL;
+	png->prevrow = NULL;
+	png->readbuf = NULL;
+	png->readbuflen = 0;
+}
+
+/* reads the next piece of IDAT data into readbuf, skipping any other chunks */
+static int png_next_idat(png_t* png)
+{
+	unsigned type;
+	unsigned length;
+	z_stream *stream = png->zs;
+
+	while(png->idat_left == 0)
+	{
+		if(file_read_ul(png, &length) != PNG_NO_ERROR)
+			return PNG_EOF_ERROR;
+
+		if(file_read(png, &type, 1, 4) != 4)
+			return PNG_FILE_ERROR;
+
+		if(type == *(unsigned int*)"IDAT")
+		{
+			png->idat_left = length;
+			png->idat_crc = crc32(0L, Z_NULL, 0);
+			png->idat_crc = crc32(png->idat_crc, (unsigned char*)"IDAT", 4);
+			if(length == 0)
+				file_read(png, 0, 1, 4); /* empty IDAT, skip the crc */
+		}
+		else if(type == *(unsigned int*)"IEND")
+			return PNG_DONE;
+		else
+			file_read(png, 0, 1, length + 4); /* unknown chunk */
+	}
+
+	/* only read part of a large IDAT, to keep memory use bounded */
+	length = png->idat_left < png->readbuflen ? png->idat_left : png->readbuflen;
+
+	if(file_read(png, png->readbuf, 1, length) != length)
+		return PNG_FILE_ERROR;
+
+	png->idat_left -= length;
+
+#if DO_CRC_CHECKS
+	png->idat_crc = crc32(png->idat_crc, png->readbuf, length);
+
+	if(png->idat_left == 0)
+	{
+		unsigned orig_crc;
+
+		file_read_ul(png, &orig_crc);
+		if(orig_crc != png->idat_crc)
+			return PNG_CRC_ERROR;
+	}
+#else
+	if(png->idat_left == 0)
+		file_read(png, 0, 1, 4);
+#endif
+
+	stream->next_in = png->readbuf;
+	stream->avail_in = length;
+
+	return PNG_NO_ERROR;
+}
+
+int png_read_begin(png_t* png)
+{
+	size_t rowlen = (size_t)png->width * png->bpp;
+	int result;
+
+	png->zs = NULL;
+	png->png_data = NULL;
+	png->png_datalen = 0;
+	png->row = 0;
+	png->idat_left = 0;
+	png->readbuflen = PNG_STREAM_BUFSIZE;
+	png->readbuf = png_alloc(png->readbuflen);
+	png->rowbuf = png_alloc(rowlen + 1);
+	png->prevrow = png_alloc(rowlen);
+
+	if(!png->readbuf || !png->rowbuf || !png->prevrow)
+	{
+		png_free_rows(png);
+		return PNG_MEMORY_ERROR;
+	}
+
+	result = png_init_inflate(png);
+	if(result != PNG_NO_ERROR)
+	{
+		png_free_rows(png);
+		return result;
+	}
+
+	return PNG_NO_ERROR;
+}
+
+int png_read_row(png_t* png, unsigned char* data)
+{
+	size_t rowlen = (size_t)png->width * png->bpp;
+	z_stream *stream = png->zs;
+	int result;
+	uint64_t start;
+	unsigned avail_out;
+
+	if(!stream || png->row >= png->height)
+		return PNG_WRONG_ARGUMENTS;
+
+	stream->next_out = png->rowbuf;
+	stream->avail_out = (unsigned)(rowlen + 1);
+
+	while(stream->avail_out != 0)
+	{
+		if(stream->avail_in == 0)
+		{
+			result = png_next_idat(png);
+			if(result == PNG_DONE)
+				return PNG_EOF_ERROR;
+			if(result != PNG_NO_ERROR)
+				return result;
+		}
+
+		start = stats_start();
+		avail_out = stream->avail_out;
+		result = inflate(stream, Z_SYNC_FLUSH);
+		stats_stop(STATS_INFLATE, start, avail_out - stream->avail_out);
+
+		if(result == Z_STREAM_END && stream->avail_out != 0)
+			return PNG_EOF_ERROR;
+
+		if(result != Z_STREAM_END && result != Z_OK)
+		{
+			printf("%s\n", stream->msg);
+			return PNG_ZLIB_ERROR;
+		}
+	}
+
+	result = png_unfilter_row(png, png->rowbuf, data, png->row ? png->prevrow : 0);
+	if(result != PNG_NO_ERROR)
+		return result;
+
+	memcpy(png->prevrow, data, rowlen);
+	png->row++;
+
 	return PNG_NO_ERROR;
 }
 
+int png_read_end(png_t* png)
+{
+	png_free_rows(png);
+
+	if(png->zs)
+	{
+		inflateEnd(png->zs);
+		png_free(png->zs);
+		png->zs = NULL;
+	}
+
+	return PNG_NO_ERROR;
+}
+
+int png_write_begin(png_t* png, unsigned width, unsigned height, char depth, int color)
+{
+	z_stream *stream;
+	int result;
+
+	png->width = width;
+	png->height = height;
+	png->depth = depth;
+	png->color_type = color;
+	png->bpp = png_get_bpp(png);
+	png->row = 0;
+	png->readbuf = NULL;
+	png->readbuflen = 0;
+	png->prevrow = NULL;
+	png->rowbuf = png_alloc((size_t)width * png->bpp + 1);
+	png->zs = NULL;
+
+	if(!png->rowbuf)
+		return PNG_MEMORY_ERROR;
+
+	/* the compressed data is collected in readbuf and written out an IDAT at a time */
+	png->readbuflen = PNG_STREAM_BUFSIZE;
+	png->readbuf = png_alloc(png->readbuflen);
+	if(!png->readbuf)
+	{
+		png_free_rows(png);
+		return PNG_MEMORY_ERROR;
+	}
+
+	result = png_init_deflate(png, 0, 0);
+	if(result != PNG_NO_ERROR)
+	{
+		png_free_rows(png);
+		return result;
+	}
+
+	stream = png->zs;
+	stream->next_out = png->readbuf;
+	stream->avail_out = png->readbuflen;
+
+	return png_write_ihdr(png);
+}
+
+/* deflates whatever is in next_in, emitting an IDAT each time the buffer fills up */
+static int png_write_deflate(png_t* png, int flush)
+{
+	z_stream *stream = png->zs;
+	int result;
+	uint64_t start;
+	unsigned avail_in;
+
+	for(;;)
+	{
+		start = stats_start();
+		avail_in = stream->avail_in;
+		result = deflate(stream, flush);
+		stats_stop(STATS_DEFLATE, start, avail_in - stream->avail_in);
+
+		if(result == Z_STREAM_ERROR)
+			return PNG_ZLIB_ERROR;
+
+		if(stream->avail_out == 0 || (result == Z_STREAM_END && stream->avail_out != png->readbuflen))
+		{
+			int err = png_write_idat_chunk(png, png->readbuf, png->readbuflen - stream->avail_out);
+			if(err != PNG_NO_ERROR)
+				return err;
+
+			stream->next_out = png->readbuf;
+			stream->avail_out = png->readbuflen;
+		}
+
+		if(flush == Z_FINISH ? result == Z_STREAM_END : stream->avail_in == 0)
+			break;
+	}
+
+	return PNG_NO_ERROR;
+}
+
+int png_write_row(png_t* png, unsigned char* data)
+{
+	size_t rowlen = (size_t)png->width * png->bpp;
+	z_stream *stream = png->zs;
+	uint64_t start;
+
+	if(!stream || png->row >= png->height)
+		return PNG_WRONG_ARGUMENTS;
+
+	/* rows are written with filter type 0 (none), like png_set_data */
+	start = stats_start();
+	png->rowbuf[0] = 0;
+	memcpy(png->rowbuf + 1, data, rowlen);
+	stats_stop(STATS_FILTER, start, rowlen);
+
+	stream->next_in = png->rowbuf;
+	stream->avail_in = (unsigned)(rowlen + 1);
+
+	png->row++;
+
+	return png_write_deflate(png, Z_NO_FLUSH);
+}
+
+int png_write_end(png_t* png)
+{
+	int result = PNG_WRONG_ARGUMENTS;
+
+	if(png->zs && png->row == png->height)
+	{
+		z_stream *stream = png->zs;
+
+		stream->next_in = NULL;
+		stream->avail_in = 0;
+		result = png_write_deflate(png, Z_FINISH);
+		if(result == PNG_NO_ERROR)
+			result = png_write_iend(png);
+	}
+
+	if(png->zs)
+		png_end_deflate(png);
+	png->zs = NULL;
+	png_free_rows(png);
+
+	return result;
+}
+
 char* png_error_string(int error)
 {
 	switch(error)
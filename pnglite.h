@@ -27,6 +27,11 @@
 /*
  * This file was modified 22-Mar-2020 by David Hovemeyer
  * to eliminate compiler warnings.
+ *
+ * Modified to use size_t for decoded/encoded data sizes so that
+ * images with more than 4 GiB of pixel data can be handled, and
+ * to add row-at-a-time decoding and encoding (png_read_row and
+ * png_write_row).
  */
 
 
@@ -90,7 +95,7 @@ typedef struct
 	void*				user_pointer;
 
 	unsigned char*			png_data;
-	unsigned			png_datalen;
+	size_t				png_datalen;
 
 	unsigned			width;
 	unsigned			height;
@@ -103,6 +108,12 @@ typedef struct
 
 	unsigned char*			readbuf;
 	unsigned			readbuflen;
+
+	unsigned			row;		/* next row for png_read_row/png_write_row */
+	unsigned char*			rowbuf;
+	unsigned char*			prevrow;
+	unsigned			idat_left;	/* bytes of the current IDAT not yet read by png_read_row */
+	unsigned long			idat_crc;
 } png_t;
 
 /*
@@ -217,6 +228,95 @@ int png_get_data(png_t* png, unsigned char* data);
 
 int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int color, unsigned char* data);
 
+/*
+	Function: png_read_begin
+
+	Prepares an opened png for decoding one row at a time with png_read_row, instead of decoding the whole
+	image at once with png_get_data. Only one row of decoded data and one IDAT chunk are held in memory.
+
+	Parameters:
+		png - png opened for reading.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_read_begin(png_t* png);
+
+/*
+	Function: png_read_row
+
+	Decodes the next row of the image. Rows are returned top to bottom.
+
+	Parameters:
+		png - png prepared with png_read_begin.
+		data - Where to store the row, must hold width*(bytes per pixel) bytes.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_read_row(png_t* png, unsigned char* data);
+
+/*
+	Function: png_read_end
+
+	Releases the decoding state allocated by png_read_begin. Rows that were not read are skipped.
+
+	Parameters:
+		png - png prepared with png_read_begin.
+
+	Returns:
+		PNG_NO_ERROR
+*/
+
+int png_read_end(png_t* png);
+
+/*
+	Function: png_write_begin
+
+	Writes the header of a png that will be encoded one row at a time with png_write_row.
+	Compressed data is written out in fixed size IDAT chunks as it is produced.
+
+	Parameters:
+		png - png opened for writing.
+		width, height, depth, color - Same as for png_set_data.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_write_begin(png_t* png, unsigned width, unsigned height, char depth, int color);
+
+/*
+	Function: png_write_row
+
+	Encodes the next row of the image.
+
+	Parameters:
+		png - png prepared with png_write_begin.
+		data - Row data, width*(bytes per pixel) bytes.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_write_row(png_t* png, unsigned char* data);
+
+/*
+	Function: png_write_end
+
+	Flushes the remaining compressed data and writes the IEND chunk. Fails if fewer than height rows were written.
+
+	Parameters:
+		png - png prepared with png_write_begin.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_write_end(png_t* png);
+
 /*
 	Function: png_close_file
 
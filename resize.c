@@ -0,0 +1,270 @@
+// Image resizing and thumbnail pyramids
+
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+#include "resize.h"
+
+// Reduce two rows of an image to one row of half the width: each output
+// pixel is the rounded average of a 2x2 block. If the input is 1 pixel
+// wide, its pixel is used for both columns.
+static void reduce_row(const uint32_t *row0, const uint32_t *row1, int32_t in_width,
+                       uint32_t *out, int32_t out_width) {
+  int32_t x = 0;
+
+#if defined(__x86_64__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i two = _mm_set1_epi16(2);
+  for (; x + 2 <= out_width && 2 * x + 4 <= in_width; x += 2) {
+    __m128i a = _mm_loadu_si128((const __m128i *) (row0 + 2 * x));
+    __m128i b = _mm_loadu_si128((const __m128i *) (row1 + 2 * x));
+    // vertical sums of input pixels 0-1 and 2-3, as 16-bit channels
+    __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+    __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+    // pixels 0 + 1 and 2 + 3
+    __m128i sums = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+    sums = _mm_srli_epi16(_mm_add_epi16(sums, two), 2);
+    _mm_storel_epi64((__m128i *) (out + x), _mm_packus_epi16(sums, sums));
+  }
+#endif
+
+  // the channels are summed two at a time, in 16-bit fields
+  for (; x < out_width; x++) {
+    int32_t x0 = 2 * x, x1 = 2 * x + 1 < in_width ? 2 * x + 1 : in_width - 1;
+    uint32_t p[4] = { row0[x0], row0[x1], row1[x0], row1[x1] };
+    uint32_t even = 0x00020002U, odd = 0x00020002U;
+    for (int i = 0; i < 4; i++) {
+      even += p[i] & 0x00FF00FFU;
+      odd += (p[i] >> 8) & 0x00FF00FFU;
+    }
+    out[x] = ((even >> 2) & 0x00FF00FFU) | (((odd >> 2) & 0x00FF00FFU) << 8);
+  }
+}
+
+int pyramid_depth(int32_t width, int32_t height) {
+  int depth = 0;
+  while (width > 1 || height > 1) {
+    width = width > 1 ? width / 2 : 1;
+    height = height > 1 ? height / 2 : 1;
+    depth++;
+  }
+  return depth;
+}
+
+// Row y of a level (0 is the full image) is complete: compute the row of
+// the next level that it completes, if any, and so on down.
+static void row_done(const struct Image *img, struct Image *levels, int num_levels, int level, int32_t y) {
+  if (level == num_levels) {
+    return;
+  }
+  const struct Image *src = level == 0 ? img : &levels[level - 1];
+  struct Image *dst = &levels[level];
+
+  // a row of the next level needs rows 2r and 2r + 1, except that a
+  // level 1 pixel high is reduced with itself
+  if (y % 2 == 0 && src->height != 1) {
+    return;
+  }
+  int32_t r = y / 2;
+  int32_t y1 = 2 * r + 1 < src->height ? 2 * r + 1 : src->height - 1;
+  if (r >= dst->height) {
+    return;
+  }
+
+  reduce_row(src->data + (size_t) 2 * r * src->width, src->data + (size_t) y1 * src->width, src->width,
+             dst->data + (size_t) r * dst->width, dst->width);
+  row_done(img, levels, num_levels, level + 1, r);
+}
+
+int pyramid_build(const struct Image *img, struct Image *levels, int num_levels) {
+  int32_t width = img->width, height = img->height;
+
+  for (int i = 0; i < num_levels; i++) {
+    width = width > 1 ? width / 2 : 1;
+    height = height > 1 ? height / 2 : 1;
+    if (img_init(&levels[i], width, height) != IMG_SUCCESS) {
+      while (--i >= 0) {
+        img_cleanup(&levels[i]);
+      }
+      return IMG_ERR_MALLOC_FAILED;
+    }
+  }
+
+  for (int32_t y = 0; y < img->height; y++) {
+    row_done(img, levels, num_levels, 0, y);
+  }
+  return IMG_SUCCESS;
+}
+
+// Add the channels of a row of pixels to per-channel sums (4 per pixel,
+// in the order of the pixel's bytes in memory: a, b, g, r).
+static void add_row(const uint32_t *row, int32_t width, uint32_t *sums) {
+  int32_t x = 0;
+
+#if defined(__x86_64__)
+  const __m128i zero = _mm_setzero_si128();
+  for (; x + 4 <= width; x += 4) {
+    __m128i p = _mm_loadu_si128((const __m128i *) (row + x));
+    __m128i lo = _mm_unpacklo_epi8(p, zero), hi = _mm_unpackhi_epi8(p, zero);
+    __m128i channels[4] = {
+      _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+      _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero),
+    };
+    for (int i = 0; i < 4; i++) {
+      __m128i *s = (__m128i *) (sums + 4 * (x + i));
+      _mm_storeu_si128(s, _mm_add_epi32(_mm_loadu_si128(s), channels[i]));
+    }
+  }
+#endif
+
+  for (; x < width; x++) {
+    for (int c = 0; c < 4; c++) {
+      sums[4 * x + c] += (row[x] >> (8 * c)) & 0xFF;
+    }
+  }
+}
+
+// The input pixels covered by output pixel i: start to end - 1, which
+// is at least one pixel.
+static void box_span(int32_t i, int32_t out_size, int32_t in_size, int32_t *start, int32_t *end) {
+  *start = (int32_t) ((int64_t) i * in_size / out_size);
+  *end = (int32_t) ((int64_t) (i + 1) * in_size / out_size);
+  if (*end <= *start) {
+    *end = *start + 1;
+  }
+}
+
+static int resize_box(const struct Image *input_img, struct Image *output_img) {
+  int32_t in_w = input_img->width, in_h = input_img->height;
+  int32_t out_w = output_img->width, out_h = output_img->height;
+
+  if (2 * out_w == in_w && 2 * out_h == in_h) {
+    for (int32_t y = 0; y < out_h; y++) {
+      reduce_row(input_img->data + (size_t) 2 * y * in_w, input_img->data + (size_t) (2 * y + 1) * in_w, in_w,
+                 output_img->data + (size_t) y * out_w, out_w);
+    }
+    return IMG_SUCCESS;
+  }
+
+  uint32_t *sums = (uint32_t *) malloc((size_t) in_w * 4 * sizeof(uint32_t));
+  if (sums == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  for (int32_t y = 0; y < out_h; y++) {
+    int32_t y0, y1;
+    box_span(y, out_h, in_h, &y0, &y1);
+    memset(sums, 0, (size_t) in_w * 4 * sizeof(uint32_t));
+    for (int32_t r = y0; r < y1; r++) {
+      add_row(input_img->data + (size_t) r * in_w, in_w, sums);
+    }
+
+    uint32_t *out = output_img->data + (size_t) y * out_w;
+    for (int32_t x = 0; x < out_w; x++) {
+      int32_t x0, x1;
+      box_span(x, out_w, in_w, &x0, &x1);
+      uint64_t count = (uint64_t) (x1 - x0) * (y1 - y0);
+      uint32_t pixel = 0;
+      for (int c = 0; c < 4; c++) {
+        uint64_t total = 0;
+        for (int32_t i = x0; i < x1; i++) {
+          total += sums[4 * i + c];
+        }
+        pixel |= (uint32_t) ((total + count / 2) / count) << (8 * c);
+      }
+      out[x] = pixel;
+    }
+  }
+
+  free(sums);
+  return IMG_SUCCESS;
+}
+
+// Position of the center of output pixel i in the input, with 8
+// fractional bits, clamped to the centers of the edge pixels.
+static int32_t bilinear_position(int32_t i, int32_t out_size, int32_t in_size) {
+  int64_t pos = (2 * (int64_t) i + 1) * in_size * 256 / (2 * (int64_t) out_size) - 128;
+  if (pos < 0) {
+    return 0;
+  }
+  if (pos > (int64_t) (in_size - 1) * 256) {
+    return (in_size - 1) * 256;
+  }
+  return (int32_t) pos;
+}
+
+// Interpolate between two rows with weight fy/256 on row1, giving each
+// channel with 8 fractional bits.
+static void lerp_rows(const uint32_t *row0, const uint32_t *row1, int32_t width, int32_t fy, uint16_t *out) {
+  int32_t x = 0;
+
+#if defined(__x86_64__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i w0 = _mm_set1_epi16((int16_t) (256 - fy)), w1 = _mm_set1_epi16((int16_t) fy);
+  for (; x + 4 <= width; x += 4) {
+    __m128i a = _mm_loadu_si128((const __m128i *) (row0 + x));
+    __m128i b = _mm_loadu_si128((const __m128i *) (row1 + x));
+    // at most 255 * 256, so the low 16 bits of the products are exact
+    __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), w0),
+                               _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), w1));
+    __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), w0),
+                               _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), w1));
+    _mm_storeu_si128((__m128i *) (out + 4 * x), lo);
+    _mm_storeu_si128((__m128i *) (out + 4 * x + 8), hi);
+  }
+#endif
+
+  for (; x < width; x++) {
+    for (int c = 0; c < 4; c++) {
+      uint32_t a = (row0[x] >> (8 * c)) & 0xFF, b = (row1[x] >> (8 * c)) & 0xFF;
+      out[4 * x + c] = (uint16_t) (a * (256 - fy) + b * fy);
+    }
+  }
+}
+
+static int resize_bilinear(const struct Image *input_img, struct Image *output_img) {
+  int32_t in_w = input_img->width, in_h = input_img->height;
+  int32_t out_w = output_img->width, out_h = output_img->height;
+
+  uint16_t *rows = (uint16_t *) malloc((size_t) in_w * 4 * sizeof(uint16_t));
+  int32_t *cols = (int32_t *) malloc((size_t) out_w * sizeof(int32_t));
+  if (rows == NULL || cols == NULL) {
+    free(rows);
+    free(cols);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+  for (int32_t x = 0; x < out_w; x++) {
+    cols[x] = bilinear_position(x, out_w, in_w);
+  }
+
+  for (int32_t y = 0; y < out_h; y++) {
+    int32_t pos = bilinear_position(y, out_h, in_h);
+    int32_t y0 = pos >> 8, y1 = y0 + 1 < in_h ? y0 + 1 : y0;
+    lerp_rows(input_img->data + (size_t) y0 * in_w, input_img->data + (size_t) y1 * in_w, in_w, pos & 0xFF, rows);
+
+    uint32_t *out = output_img->data + (size_t) y * out_w;
+    for (int32_t x = 0; x < out_w; x++) {
+      int32_t x0 = cols[x] >> 8, x1 = x0 + 1 < in_w ? x0 + 1 : x0;
+      uint32_t fx = cols[x] & 0xFF;
+      uint32_t pixel = 0;
+      for (int c = 0; c < 4; c++) {
+        uint32_t value = rows[4 * x0 + c] * (256 - fx) + rows[4 * x1 + c] * fx;
+        pixel |= ((value + 32768) >> 16) << (8 * c);
+      }
+      out[x] = pixel;
+    }
+  }
+
+  free(rows);
+  free(cols);
+  return IMG_SUCCESS;
+}
+
+int resize_image(const struct Image *input_img, struct Image *output_img, enum ResizeFilter filter) {
+  if (input_img->width == 0 || input_img->height == 0 || output_img->width == 0 || output_img->height == 0) {
+    return IMG_SUCCESS;
+  }
+  return filter == RESIZE_BILINEAR ? resize_bilinear(input_img, output_img) : resize_box(input_img, output_img);
+}
@@ -0,0 +1,56 @@
+#ifndef RESIZE_H
+#define RESIZE_H
+
+#include <stdint.h>
+#include "image.h"
+
+// Resampling filters for resize
+enum ResizeFilter {
+  // each output pixel is the average of the input pixels it covers
+  // (for enlargement, the input pixel it falls in)
+  RESIZE_BOX,
+  // each output pixel is interpolated from the 2x2 input pixels
+  // around its center
+  RESIZE_BILINEAR,
+};
+
+// Resize an image. All four channels are resampled, with fixed-point
+// weights: box averages are rounded to nearest, and bilinear weights
+// have 8 fractional bits. A box reduction to exactly half the width
+// and height uses the same 2x2 reduction as pyramid_build.
+//
+// Parameters:
+//   input_img - pointer to the input Image
+//   output_img - pointer to the output Image, whose dimensions are the
+//                new size (at least 1x1 unless the input is empty)
+//   filter - RESIZE_BOX or RESIZE_BILINEAR
+//
+// Returns:
+//   IMG_SUCCESS, or IMG_ERR_MALLOC_FAILED
+int resize_image(const struct Image *input_img, struct Image *output_img, enum ResizeFilter filter);
+
+// Number of levels below an image in its pyramid, i.e. the number of
+// times it can be halved (rounding down) before it's 1x1.
+int pyramid_depth(int32_t width, int32_t height);
+
+// Build the levels of an image pyramid: levels[0] is half the width and
+// height of img (rounded down, but at least 1), levels[1] half of that,
+// and so on. Each pixel is the rounded average of a 2x2 block of the
+// level above; at the right and bottom edges of a level that is 1 pixel
+// wide or high, the edge pixels are used twice.
+//
+// All levels are computed in one pass over img: as soon as two rows of
+// a level are complete, the row of the next level below them is, so the
+// rows being reduced are still in the cache.
+//
+// Parameters:
+//   img - pointer to the full-size image
+//   levels - array of num_levels Images, which are initialized (and
+//            must be freed with img_cleanup) if successful
+//   num_levels - number of levels, at most pyramid_depth of the image
+//
+// Returns:
+//   IMG_SUCCESS, or IMG_ERR_MALLOC_FAILED
+int pyramid_build(const struct Image *img, struct Image *levels, int num_levels);
+
+#endif // RESIZE_H
@@ -0,0 +1,223 @@
+// Content-addressed cache of transformation results
+
+#define _GNU_SOURCE // for copy_file_range
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "image.h"
+#include "xxhash.h"
+#include "resultcache.h"
+
+#define COPY_BUFSIZE (256 * 1024)
+
+// changing this invalidates all existing cache entries (e.g. if the
+// output of a transformation changes)
+static const char s_key_version[] = "imgproc-result-v2";
+
+int result_cache_key(const char *input_filename, const char *output_filename, const char *transformation, int nargs, char **args,
+                     char key[RESULT_CACHE_KEY_LEN]) {
+  int fd = open(input_filename, O_RDONLY);
+  if (fd < 0) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  unsigned char *buf = (unsigned char *) malloc(COPY_BUFSIZE);
+  if (buf == NULL) {
+    close(fd);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  struct Xxh64State state;
+  xxh64_reset(&state, 0);
+
+  // the strings are hashed including their NUL terminators, so
+  // different splits into arguments give different keys
+  xxh64_update(&state, s_key_version, sizeof(s_key_version));
+  const char *ext = img_file_ext(output_filename);
+  xxh64_update(&state, ext, strlen(ext) + 1);
+  xxh64_update(&state, transformation, strlen(transformation) + 1);
+  for (int i = 0; i < nargs; i++) {
+    xxh64_update(&state, args[i], strlen(args[i]) + 1);
+  }
+
+  ssize_t n;
+  while ((n = read(fd, buf, COPY_BUFSIZE)) > 0) {
+    xxh64_update(&state, buf, (size_t) n);
+  }
+  free(buf);
+  close(fd);
+  if (n < 0) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  snprintf(key, RESULT_CACHE_KEY_LEN, "%016llx", (unsigned long long) xxh64_digest(&state));
+  return IMG_SUCCESS;
+}
+
+// The entry for a key, with the extension of the output file (the key
+// already depends on the format, so this just keeps entries readable)
+static void entry_path(const struct ResultCache *cache, const char *key, const char *output_filename, char *path,
+                       size_t size) {
+  snprintf(path, size, "%s/%s%s", cache->dir, key, img_file_ext(output_filename));
+}
+
+// Copy a file. Returns 1 if successful, 0 if not.
+static int copy_file(const char *src, const char *dst) {
+  int in = open(src, O_RDONLY);
+  if (in < 0) {
+    return 0;
+  }
+  int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0) {
+    close(in);
+    return 0;
+  }
+
+  int ok = 1;
+#ifdef __linux__
+  // copy inside the kernel (which may share the blocks, on file
+  // systems that support it) if possible
+  ssize_t n;
+  while ((n = copy_file_range(in, NULL, out, NULL, COPY_BUFSIZE * 64, 0)) > 0)
+    ;
+  if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+    n = 0;
+  } else if (n < 0) {
+    ok = 0;
+  }
+#endif
+
+  // copy whatever is left with read/write
+  if (ok) {
+    char *buf = (char *) malloc(COPY_BUFSIZE);
+    ssize_t r;
+    ok = buf != NULL;
+    while (ok && (r = read(in, buf, COPY_BUFSIZE)) != 0) {
+      ok = r > 0 && write(out, buf, (size_t) r) == r;
+    }
+    free(buf);
+  }
+
+  close(in);
+  if (close(out) != 0) {
+    ok = 0;
+  }
+  return ok;
+}
+
+int result_cache_fetch(const struct ResultCache *cache, const char *key, const char *output_filename) {
+  char path[4096];
+  entry_path(cache, key, output_filename, path, sizeof(path));
+
+  if (access(path, R_OK) != 0) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+  if (!copy_file(path, output_filename)) {
+    // the entry may have been evicted by another process in the meantime
+    remove(output_filename);
+    return access(path, R_OK) != 0 ? IMG_ERR_COULD_NOT_OPEN : IMG_ERR_COULD_NOT_WRITE;
+  }
+
+  // mark the entry as recently used
+  utimensat(AT_FDCWD, path, NULL, 0);
+  return IMG_SUCCESS;
+}
+
+int result_cache_store(const struct ResultCache *cache, const char *key, const char *output_filename) {
+  mkdir(cache->dir, 0755);
+
+  char path[4096], tmp_path[4096];
+  entry_path(cache, key, output_filename, path, sizeof(path));
+  snprintf(tmp_path, sizeof(tmp_path), "%s/.%s.tmp%ld", cache->dir, key, (long) getpid());
+
+  if (!copy_file(output_filename, tmp_path) || rename(tmp_path, path) != 0) {
+    remove(tmp_path);
+    return IMG_ERR_COULD_NOT_WRITE;
+  }
+
+  result_cache_evict(cache);
+  return IMG_SUCCESS;
+}
+
+struct CacheEntry {
+  char name[32];
+  time_t mtime;
+  long mtime_nsec;
+  uint64_t size;
+};
+
+static int compare_entries(const void *a, const void *b) {
+  const struct CacheEntry *x = (const struct CacheEntry *) a;
+  const struct CacheEntry *y = (const struct CacheEntry *) b;
+  if (x->mtime != y->mtime) {
+    return x->mtime < y->mtime ? -1 : 1;
+  }
+  return (x->mtime_nsec > y->mtime_nsec) - (x->mtime_nsec < y->mtime_nsec);
+}
+
+// Check whether a directory entry name looks like <key><ext>
+static int is_entry_name(const char *name) {
+  size_t len = strlen(name);
+  if (len != RESULT_CACHE_KEY_LEN - 1 + 4 || strspn(name, "0123456789abcdef") != RESULT_CACHE_KEY_LEN - 1) {
+    return 0;
+  }
+  const char *ext = name + RESULT_CACHE_KEY_LEN - 1;
+  return strcmp(ext, ".png") == 0 || strcmp(ext, ".raw") == 0 || strcmp(ext, ".pam") == 0;
+}
+
+void result_cache_evict(const struct ResultCache *cache) {
+  DIR *dir = opendir(cache->dir);
+  if (dir == NULL) {
+    return;
+  }
+
+  struct CacheEntry *entries = NULL;
+  size_t num_entries = 0, capacity = 0;
+  uint64_t total = 0;
+  char path[4096];
+
+  struct dirent *d;
+  while ((d = readdir(dir)) != NULL) {
+    struct stat st;
+    if (!is_entry_name(d->d_name)) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s", cache->dir, d->d_name);
+    if (stat(path, &st) != 0) {
+      continue;
+    }
+
+    if (num_entries == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      struct CacheEntry *grown = (struct CacheEntry *) realloc(entries, capacity * sizeof(struct CacheEntry));
+      if (grown == NULL) {
+        break;
+      }
+      entries = grown;
+    }
+    struct CacheEntry *e = &entries[num_entries++];
+    memcpy(e->name, d->d_name, strlen(d->d_name) + 1); // checked by is_entry_name
+    e->mtime = st.st_mtim.tv_sec;
+    e->mtime_nsec = st.st_mtim.tv_nsec;
+    e->size = (uint64_t) st.st_size;
+    total += e->size;
+  }
+  closedir(dir);
+
+  if (total > cache->max_bytes) {
+    qsort(entries, num_entries, sizeof(struct CacheEntry), compare_entries);
+    for (size_t i = 0; i < num_entries && total > cache->max_bytes; i++) {
+      snprintf(path, sizeof(path), "%s/%s", cache->dir, entries[i].name);
+      if (remove(path) == 0) {
+        total -= entries[i].size;
+      }
+    }
+  }
+
+  free(entries);
+}
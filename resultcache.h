@@ -0,0 +1,72 @@
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include <stdint.h>
+
+// An on-disk cache of output images, keyed by a hash of the input
+// file's contents together with the transformation name and its
+// arguments and the format of the output file. Each entry is a file
+// <key><ext> in the cache directory, where <ext> is the output's
+// extension as given by img_file_ext.
+// Entries are evicted in least recently used order (a hit updates
+// the entry's modification time) once the total size of the cache
+// exceeds its limit.
+struct ResultCache {
+  const char *dir;
+  uint64_t max_bytes;
+};
+
+// length of a key string, including the NUL terminator
+#define RESULT_CACHE_KEY_LEN 17
+
+// Compute the cache key for a transformation.
+//
+// Parameters:
+//   input_filename - name of the input image file
+//   output_filename - name of the output image file (only its format
+//                     is part of the key)
+//   transformation - name of the transformation
+//   nargs - number of transformation arguments
+//   args - the transformation arguments
+//   key - receives the key (16 hex digits)
+//
+// Returns:
+//   IMG_SUCCESS if successful, IMG_ERR_COULD_NOT_OPEN if the
+//   input file couldn't be read
+int result_cache_key(const char *input_filename, const char *output_filename, const char *transformation, int nargs, char **args,
+                     char key[RESULT_CACHE_KEY_LEN]);
+
+// Look up a cached result, and copy it to the output file if found.
+//
+// Parameters:
+//   cache - pointer to ResultCache
+//   key - key computed by result_cache_key
+//   output_filename - name of the output file to create (in the
+//                     format the key was computed for)
+//
+// Returns:
+//   IMG_SUCCESS on a hit, IMG_ERR_COULD_NOT_OPEN on a miss,
+//   IMG_ERR_COULD_NOT_WRITE if the output couldn't be written
+int result_cache_fetch(const struct ResultCache *cache, const char *key, const char *output_filename);
+
+// Add a result to the cache, then evict entries until the cache is
+// within its size limit. The entry is added atomically, so
+// concurrent processes sharing a cache never see a partial entry.
+//
+// Parameters:
+//   cache - pointer to ResultCache
+//   key - key computed by result_cache_key
+//   output_filename - name of the output file to add
+//
+// Returns:
+//   IMG_SUCCESS if successful, IMG_ERR_COULD_NOT_WRITE if not
+int result_cache_store(const struct ResultCache *cache, const char *key, const char *output_filename);
+
+// Delete the least recently used entries until the total size of
+// the cache is at most its limit.
+//
+// Parameters:
+//   cache - pointer to ResultCache
+void result_cache_evict(const struct ResultCache *cache);
+
+#endif // RESULTCACHE_H
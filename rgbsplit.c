@@ -0,0 +1,65 @@
+// Splitting an image into its color channels
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+#include "rgbsplit.h"
+#include "bands.h"
+
+// the channels kept in each quadrant after the original
+#define RED_MASK   0xFF0000FFU
+#define GREEN_MASK 0x00FF00FFU
+#define BLUE_MASK  0x0000FFFFU
+
+// Split rows first to end - 1 of the input.
+static void split_rows(const struct Image *input_img, struct Image *output_img, int32_t first, int32_t end) {
+  int32_t width = input_img->width;
+  size_t out_width = (size_t) output_img->width;
+  size_t bottom = (size_t) input_img->height * out_width;
+
+  for (int32_t y = first; y < end; y++) {
+    const uint32_t *in = input_img->data + (size_t) y * width;
+    uint32_t *orig = output_img->data + (size_t) y * out_width;
+    uint32_t *red = orig + width;
+    uint32_t *green = orig + bottom;
+    uint32_t *blue = green + width;
+    int32_t x = 0;
+
+#if defined(__x86_64__)
+    const __m128i red_mask = _mm_set1_epi32((int) RED_MASK);
+    const __m128i green_mask = _mm_set1_epi32((int) GREEN_MASK);
+    const __m128i blue_mask = _mm_set1_epi32((int) BLUE_MASK);
+    for (; x + 4 <= width; x += 4) {
+      __m128i p = _mm_loadu_si128((const __m128i *) (in + x));
+      _mm_storeu_si128((__m128i *) (orig + x), p);
+      _mm_storeu_si128((__m128i *) (red + x), _mm_and_si128(p, red_mask));
+      _mm_storeu_si128((__m128i *) (green + x), _mm_and_si128(p, green_mask));
+      _mm_storeu_si128((__m128i *) (blue + x), _mm_and_si128(p, blue_mask));
+    }
+#endif
+
+    for (; x < width; x++) {
+      uint32_t p = in[x];
+      orig[x] = p;
+      red[x] = p & RED_MASK;
+      green[x] = p & GREEN_MASK;
+      blue[x] = p & BLUE_MASK;
+    }
+  }
+}
+
+struct SplitJob {
+  const struct Image *input_img;
+  struct Image *output_img;
+};
+
+static int split_band(void *ctx, int32_t first, int32_t end) {
+  struct SplitJob *job = (struct SplitJob *) ctx;
+  split_rows(job->input_img, job->output_img, first, end);
+  return IMG_SUCCESS;
+}
+
+void rgb_split(const struct Image *input_img, struct Image *output_img, int num_threads) {
+  struct SplitJob job = { input_img, output_img };
+  run_bands(input_img->height, num_threads, split_band, &job);
+}
@@ -0,0 +1,24 @@
+#ifndef RGBSPLIT_H
+#define RGBSPLIT_H
+
+#include <stdint.h>
+#include "image.h"
+
+// Split an image into its color channels, as a 2x2 grid of copies of
+// it, twice the width and height: the original at the top left, only
+// its red channel at the top right, only green at the bottom left and
+// only blue at the bottom right (the other color channels are 0, and
+// alpha is kept in all four).
+//
+// Each input pixel is read once, and its four destinations written
+// from it with the channel masks applied, 4 pixels at a time with
+// SSE2. The rows are split into bands computed by separate threads.
+//
+// Parameters:
+//   input_img - pointer to the input Image
+//   output_img - pointer to the output Image, twice the width and
+//                height of the input
+//   num_threads - maximum number of threads, or 0 for one per CPU
+void rgb_split(const struct Image *input_img, struct Image *output_img, int num_threads);
+
+#endif // RGBSPLIT_H
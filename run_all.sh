@@ -5,19 +5,44 @@
 
 error_count="0"
 
+# number of tests to run at the same time (override with JOBS=n)
+max_jobs="${JOBS:-$(nproc 2>/dev/null || echo 4)}"
+
+test_names=()
+test_stems=()
+
+# Start a test in the background. Its exit status is saved in
+# actual/<stem>.status, and reported by report_tests.
 run_test() {
   local exe="./run_test.rb"
-  echo -n "Running '${exe} $@'..."
   local out_stem=$(echo "$@" | tr ' ./' '___')
   local out_file="actual/${out_stem}.out"
   local err_file="actual/${out_stem}.err"
-  ${exe} "$@" > ${out_file} 2> ${err_file}
-  if [[ $? -ne 0 ]]; then
-    echo "FAILED"
-    error_count=$((${error_count} + 1))
-  else
-    echo "passed"
-  fi
+  local status_file="actual/${out_stem}.status"
+
+  while [[ $(jobs -rp | wc -l) -ge ${max_jobs} ]]; do
+    wait -n
+  done
+
+  rm -f ${status_file}
+  ( ${exe} "$@" > ${out_file} 2> ${err_file}; echo $? > ${status_file} ) &
+
+  test_names+=("${exe} $*")
+  test_stems+=("${out_stem}")
+}
+
+# Wait for all tests to finish, and report their results in order
+report_tests() {
+  wait
+  for i in "${!test_names[@]}"; do
+    echo -n "Running '${test_names[$i]}'..."
+    if [[ "$(cat actual/${test_stems[$i]}.status 2> /dev/null)" != "0" ]]; then
+      echo "FAILED"
+      error_count=$((${error_count} + 1))
+    else
+      echo "passed"
+    fi
+  done
 }
 
 if [[ $# != 1 ]]; then
@@ -43,6 +68,8 @@ run_test ${exe_version} dice complement
 run_test ${exe_version} dice ellipse
 run_test ${exe_version} dice emboss
 
+report_tests
+
 if [[ ${error_count} -eq 0 ]]; then
   echo "All tests passed!"
   exit 0
@@ -66,8 +66,12 @@ cmd = [exe, transformation, input_filename, actual_filename, *transformation_arg
 #puts cmd.join(' ')
 run(cmd)
 
-# use Imagemagick compare program to compare images
-cmd = ['compare', '-metric', 'mse', expected_filename, actual_filename, diff_filename]
+# compare images (a diff image is only written if they differ)
+if !File.executable?('./imgcmp')
+  STDERR.puts "./imgcmp doesn't exist or is not executable (maybe you need to run make?)"
+  exit 1
+end
+cmd = ['./imgcmp', expected_filename, actual_filename, diff_filename]
 run(cmd)
 
 puts "Test passed!"
@@ -0,0 +1,394 @@
+// Server mode: process images sent over a Unix domain socket with a
+// pool of worker threads, avoiding process startup, zlib setup and
+// fresh page faults for every image
+//
+// The main thread accepts connections and polls the idle ones. Only a
+// connection with a request to read is queued for a worker, which
+// serves that one request and hands the connection back, so idle
+// keep-alive clients never tie up a worker and busy ones take turns.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+#include "transforms.h"
+#include "imgproc_proto.h"
+#include "serve.h"
+
+// capacity of the queue of connections with a request waiting for a worker
+#define CONN_QUEUE_SIZE 256
+
+// Each worker keeps its request and response buffers between
+// requests, so they only have to grow (and be page-faulted in) once
+struct Worker {
+  pthread_t thread;
+  // connection being served (-1 if none), so that it can be shut
+  // down if the server stops while a client keeps it open
+  volatile int conn_fd;
+  struct ProtoMessage request;
+  unsigned char *out_buf;
+  size_t out_capacity;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  int fds[CONN_QUEUE_SIZE];
+  int head, count;
+} s_queue = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, { 0 }, 0, 0 };
+
+// connections to be added to those the main thread polls; a byte
+// written to the wake pipe interrupts its poll
+static struct {
+  pthread_mutex_t lock;
+  int *fds;
+  int count, capacity;
+  int wake_pipe[2];
+} s_new_idle = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, { -1, -1 } };
+
+static volatile sig_atomic_t s_stop;
+
+static void handle_stop_signal(int sig) {
+  (void) sig;
+  s_stop = 1;
+}
+
+static void queue_push(int fd) {
+  pthread_mutex_lock(&s_queue.lock);
+  while (s_queue.count == CONN_QUEUE_SIZE) {
+    pthread_cond_wait(&s_queue.not_full, &s_queue.lock);
+  }
+  s_queue.fds[(s_queue.head + s_queue.count) % CONN_QUEUE_SIZE] = fd;
+  s_queue.count++;
+  pthread_cond_signal(&s_queue.not_empty);
+  pthread_mutex_unlock(&s_queue.lock);
+}
+
+static int queue_pop(void) {
+  pthread_mutex_lock(&s_queue.lock);
+  while (s_queue.count == 0) {
+    pthread_cond_wait(&s_queue.not_empty, &s_queue.lock);
+  }
+  int fd = s_queue.fds[s_queue.head];
+  s_queue.head = (s_queue.head + 1) % CONN_QUEUE_SIZE;
+  s_queue.count--;
+  pthread_cond_signal(&s_queue.not_full);
+  pthread_mutex_unlock(&s_queue.lock);
+  return fd;
+}
+
+static int send_response(int fd, const char *status, const void *data, size_t len) {
+  const void *fields[2] = { status, data };
+  size_t lens[2] = { strlen(status), len };
+  return proto_send(fd, 2, fields, lens);
+}
+
+static int send_error(int fd, const char *message) {
+  return send_response(fd, PROTO_STATUS_ERROR, message, strlen(message));
+}
+
+// Process one request, and send the response.
+// Returns 1 if the connection can be used for further requests.
+static int handle_request(struct Worker *w, int fd) {
+  struct ProtoMessage *req = &w->request;
+  if (req->num_fields < 4) {
+    return send_error(fd, "malformed request");
+  }
+
+  const char *mode = (const char *) req->fields[0];
+  const char *transformation = (const char *) req->fields[1];
+  int path_mode = strcmp(mode, PROTO_MODE_PATH) == 0;
+  if (!path_mode && strcmp(mode, PROTO_MODE_MEM) != 0) {
+    return send_error(fd, "unknown request mode");
+  }
+
+  // the server's own standard input/output are not for clients
+  if (path_mode && (strcmp((const char *) req->fields[2], IMG_STDIO) == 0
+                    || strcmp((const char *) req->fields[3], IMG_STDIO) == 0)) {
+    return send_error(fd, "invalid file name");
+  }
+
+  const struct Transformation *xform = find_transformation(transformation);
+  if (xform == NULL) {
+    return send_error(fd, "unknown transformation");
+  }
+
+  // the apply functions expect a command line, with the
+  // transformation arguments starting at argv[4]
+  char *argv[PROTO_MAX_FIELDS + 1];
+  int argc = 0;
+  argv[argc++] = "imgprocd";
+  argv[argc++] = (char *) transformation;
+  argv[argc++] = path_mode ? (char *) req->fields[2] : "-";
+  argv[argc++] = path_mode ? (char *) req->fields[3] : "-";
+  for (uint32_t i = 4; i < req->num_fields; i++) {
+    argv[argc++] = (char *) req->fields[i];
+  }
+  argv[argc] = NULL;
+
+  struct Image input;
+  int rc = path_mode ? img_read(argv[2], &input) : img_read_mem(req->fields[2], req->lens[2], &input);
+  if (rc != IMG_SUCCESS) {
+    return send_error(fd, "couldn't read input image");
+  }
+
+  struct Image *output = create_output_img(&input, transformation, argc, argv);
+  if (output == NULL) {
+    img_cleanup(&input);
+    return send_error(fd, "couldn't create output image");
+  }
+
+  int ok;
+  if (!xform->apply(&input, output, argc, argv)) {
+    ok = send_error(fd, "transformation failed");
+  } else if (path_mode) {
+    ok = img_write(argv[3], output) == IMG_SUCCESS
+      ? send_response(fd, PROTO_STATUS_OK, "", 0)
+      : send_error(fd, "couldn't write output image");
+  } else {
+    size_t len;
+    ok = img_write_mem(output, &w->out_buf, &len, &w->out_capacity) == IMG_SUCCESS
+      ? send_response(fd, PROTO_STATUS_OK, w->out_buf, len)
+      : send_error(fd, "couldn't encode output image");
+  }
+
+  img_cleanup(&input);
+  cleanup_image(output);
+  return ok;
+}
+
+// Hand a connection (new, or after a request) to the main thread to
+// wait for its next request. Returns 0 if it couldn't be added (so it
+// should be closed).
+static int add_idle_connection(int fd) {
+  pthread_mutex_lock(&s_new_idle.lock);
+  if (s_new_idle.count == s_new_idle.capacity) {
+    int capacity = s_new_idle.capacity ? 2 * s_new_idle.capacity : 64;
+    int *grown = (int *) realloc(s_new_idle.fds, (size_t) capacity * sizeof(int));
+    if (grown == NULL) {
+      pthread_mutex_unlock(&s_new_idle.lock);
+      return 0;
+    }
+    s_new_idle.fds = grown;
+    s_new_idle.capacity = capacity;
+  }
+  s_new_idle.fds[s_new_idle.count++] = fd;
+  pthread_mutex_unlock(&s_new_idle.lock);
+
+  // if the pipe is full, the main thread is already going to wake up
+  char byte = 0;
+  ssize_t n = write(s_new_idle.wake_pipe[1], &byte, 1);
+  (void) n;
+  return 1;
+}
+
+static void *worker_main(void *arg) {
+  struct Worker *w = (struct Worker *) arg;
+
+  for (;;) {
+    int fd = queue_pop();
+    if (fd < 0) {
+      break;
+    }
+    // the connection is readable, so this only waits for the rest of
+    // a request that has started to arrive
+    w->conn_fd = fd;
+    int keep = proto_recv(fd, &w->request) == 1 && handle_request(w, fd);
+    w->conn_fd = -1;
+    if (!keep || s_stop || !add_idle_connection(fd)) {
+      close(fd);
+    }
+  }
+
+  proto_free(&w->request);
+  free(w->out_buf);
+  return NULL;
+}
+
+static void close_wake_pipe(void) {
+  close(s_new_idle.wake_pipe[0]);
+  close(s_new_idle.wake_pipe[1]);
+  s_new_idle.wake_pipe[0] = s_new_idle.wake_pipe[1] = -1;
+}
+
+int serve(const char *socket_path, int num_workers) {
+  struct sockaddr_un addr;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Error: socket path '%s' is too long\n", socket_path);
+    return 1;
+  }
+
+  if (num_workers <= 0) {
+    num_workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_workers <= 0) {
+      num_workers = 1;
+    }
+  }
+
+#if defined(__GLIBC__)
+  // keep freed image buffers in the heap rather than returning them
+  // to the kernel, so later requests reuse already-mapped pages
+  mallopt(M_MMAP_THRESHOLD, 32 << 20);
+  mallopt(M_TRIM_THRESHOLD, 256 << 20);
+#endif
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    perror("socket");
+    return 1;
+  }
+  if (pipe(s_new_idle.wake_pipe) != 0) {
+    perror("pipe");
+    close(listen_fd);
+    return 1;
+  }
+  fcntl(s_new_idle.wake_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(s_new_idle.wake_pipe[1], F_SETFL, O_NONBLOCK);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+  unlink(socket_path);
+  if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(listen_fd, 128) != 0) {
+    perror(socket_path);
+    close(listen_fd);
+    close_wake_pipe();
+    return 1;
+  }
+
+  // poll() must be interrupted by the stop signals, so no SA_RESTART
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_stop_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  struct Worker *workers = (struct Worker *) calloc((size_t) num_workers, sizeof(struct Worker));
+  if (workers == NULL) {
+    close(listen_fd);
+    close_wake_pipe();
+    return 1;
+  }
+  // the workers block the stop signals, so they interrupt the main
+  // thread's poll
+  sigset_t stop_signals, old_mask;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+  for (int i = 0; i < num_workers; i++) {
+    workers[i].conn_fd = -1;
+    pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+  }
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+  fprintf(stderr, "Listening on %s with %d worker(s)\n", socket_path, num_workers);
+
+  // pollfds[0] is the listening socket, pollfds[1] the wake pipe, and
+  // the rest are idle connections
+  struct pollfd *pollfds = NULL;
+  int num_pollfds = 2, pollfds_capacity = 0;
+  while (!s_stop) {
+    // add new connections, and those the workers have handed back
+    pthread_mutex_lock(&s_new_idle.lock);
+    if (num_pollfds + s_new_idle.count > pollfds_capacity) {
+      int capacity = 2 * (num_pollfds + s_new_idle.count) + 64;
+      struct pollfd *grown = (struct pollfd *) realloc(pollfds, (size_t) capacity * sizeof(struct pollfd));
+      if (grown == NULL) {
+        pthread_mutex_unlock(&s_new_idle.lock);
+        perror("realloc");
+        break;
+      }
+      pollfds = grown;
+      pollfds_capacity = capacity;
+    }
+    for (int i = 0; i < s_new_idle.count; i++) {
+      pollfds[num_pollfds].fd = s_new_idle.fds[i];
+      pollfds[num_pollfds].events = POLLIN;
+      num_pollfds++;
+    }
+    s_new_idle.count = 0;
+    pthread_mutex_unlock(&s_new_idle.lock);
+
+    pollfds[0].fd = listen_fd;
+    pollfds[0].events = POLLIN;
+    pollfds[1].fd = s_new_idle.wake_pipe[0];
+    pollfds[1].events = POLLIN;
+    if (poll(pollfds, (nfds_t) num_pollfds, -1) < 0) {
+      if (errno != EINTR) {
+        perror("poll");
+      }
+      continue;
+    }
+
+    if (pollfds[1].revents) {
+      char bytes[256];
+      while (read(s_new_idle.wake_pipe[0], bytes, sizeof(bytes)) > 0)
+        ;
+    }
+
+    // readable (or closed) connections go to the workers, which see
+    // end-of-file as the client hanging up
+    for (int i = 2; i < num_pollfds;) {
+      if (pollfds[i].revents) {
+        queue_push(pollfds[i].fd);
+        pollfds[i] = pollfds[--num_pollfds];
+      } else {
+        i++;
+      }
+    }
+
+    if (pollfds[0].revents) {
+      int fd = accept(listen_fd, NULL, NULL);
+      if (fd < 0) {
+        if (errno != EINTR) {
+          perror("accept");
+        }
+      } else if (!add_idle_connection(fd)) {
+        close(fd);
+      }
+    }
+  }
+
+  // each worker exits when it gets -1 instead of a connection
+  for (int i = 0; i < num_workers; i++) {
+    queue_push(-1);
+  }
+  for (int i = 0; i < num_workers; i++) {
+    int fd = workers[i].conn_fd;
+    if (fd >= 0) {
+      shutdown(fd, SHUT_RD);
+    }
+  }
+  for (int i = 0; i < num_workers; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  free(workers);
+
+  for (int i = 2; i < num_pollfds; i++) {
+    close(pollfds[i].fd);
+  }
+  free(pollfds);
+  for (int i = 0; i < s_new_idle.count; i++) {
+    close(s_new_idle.fds[i]);
+  }
+  free(s_new_idle.fds);
+  s_new_idle.fds = NULL;
+  s_new_idle.count = s_new_idle.capacity = 0;
+  close_wake_pipe();
+
+  close(listen_fd);
+  unlink(socket_path);
+  return 0;
+}
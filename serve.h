@@ -0,0 +1,17 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+// Run the image processing server: listen on a Unix domain socket
+// and process requests (see imgproc_proto.h) with a pool of worker
+// threads, until SIGINT or SIGTERM is received.
+//
+// Parameters:
+//   socket_path - path of the socket to create (an existing socket
+//                 file is replaced)
+//   num_workers - number of worker threads (0 means one per CPU)
+//
+// Returns:
+//   0 if the server shut down normally, 1 if it couldn't start
+int serve(const char *socket_path, int num_workers);
+
+#endif // SERVE_H
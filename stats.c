@@ -0,0 +1,154 @@
+// Per-stage timing, byte counts and allocation high-water marks
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+#include "stats.h"
+
+struct StageTotals {
+  uint64_t calls;
+  uint64_t ns;
+  uint64_t bytes;
+  uint64_t alloc_high_water;
+};
+
+static const char *s_stage_names[STATS_NUM_STAGES] = {
+  "read", "inflate", "unfilter", "byteswap", "transform", "filter", "deflate", "write",
+};
+
+int stats_enabled;
+
+static struct StageTotals s_totals[STATS_NUM_STAGES];
+static int32_t s_width, s_height;
+
+// the merged output histograms
+static pthread_mutex_t s_histogram_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t s_histogram[4][256];
+static uint64_t s_histogram_pixels;
+
+static const char *s_channel_names[4] = { "red", "green", "blue", "alpha" };
+
+static uint64_t monotonic_ns( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+// Bytes of heap memory currently allocated (including large
+// allocations that malloc satisfies with mmap), or 0 if unknown.
+static uint64_t heap_in_use( void ) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  struct mallinfo2 mi = mallinfo2();
+  return (uint64_t) mi.uordblks + (uint64_t) mi.hblkhd;
+#else
+  return 0;
+#endif
+}
+
+uint64_t stats_start( void ) {
+  if ( !stats_enabled )
+    return 0;
+  return monotonic_ns();
+}
+
+void stats_stop( enum StatsStage stage, uint64_t start, uint64_t bytes ) {
+  if ( !stats_enabled )
+    return;
+
+  struct StageTotals *t = &s_totals[stage];
+  t->ns += monotonic_ns() - start;
+  t->bytes += bytes;
+
+  // mallinfo2 walks every malloc arena, which would cost more than a
+  // row of work, so the heap is only sampled once per stage
+  if ( t->calls++ == 0 )
+    t->alloc_high_water = heap_in_use();
+}
+
+void stats_set_image( int32_t width, int32_t height ) {
+  s_width = width;
+  s_height = height;
+}
+
+void stats_histogram_add( struct StatsHistogram *hist, const uint32_t *pixels, size_t n ) {
+  for ( size_t i = 0; i < n; ++i ) {
+    uint32_t pixel = pixels[i];
+    uint64_t ( *set )[256] = hist->counts[i & 3];
+    set[0][pixel >> 24]++;
+    set[1][( pixel >> 16 ) & 0xFF]++;
+    set[2][( pixel >> 8 ) & 0xFF]++;
+    set[3][pixel & 0xFF]++;
+  }
+}
+
+uint64_t stats_histogram_count( const struct StatsHistogram *hist, int channel, int value ) {
+  return hist->counts[0][channel][value] + hist->counts[1][channel][value]
+    + hist->counts[2][channel][value] + hist->counts[3][channel][value];
+}
+
+void stats_histogram_merge( const struct StatsHistogram *hist ) {
+  pthread_mutex_lock( &s_histogram_lock );
+  for ( int v = 0; v < 256; ++v ) {
+    s_histogram_pixels += stats_histogram_count( hist, 0, v );
+    for ( int c = 0; c < 4; ++c )
+      s_histogram[c][v] += stats_histogram_count( hist, c, v );
+  }
+  pthread_mutex_unlock( &s_histogram_lock );
+}
+
+// Write the merged output histograms, as the "output" member
+static void write_histogram_json( FILE *out ) {
+  fprintf( out, "  \"output\": {\n" );
+  fprintf( out, "    \"pixels\": %llu,\n", (unsigned long long) s_histogram_pixels );
+  for ( int c = 0; c < 4; ++c ) {
+    const uint64_t *counts = s_histogram[c];
+    int min = 0, max = 255;
+    uint64_t total = 0;
+    while ( min < 255 && counts[min] == 0 )
+      ++min;
+    while ( max > 0 && counts[max] == 0 )
+      --max;
+    for ( int v = 0; v < 256; ++v )
+      total += counts[v] * v;
+
+    fprintf( out, "    \"%s\": { \"min\": %d, \"max\": %d, \"mean\": %.3f, \"histogram\": [",
+             s_channel_names[c], min, max, (double) total / (double) s_histogram_pixels );
+    for ( int v = 0; v < 256; ++v )
+      fprintf( out, "%s%llu", v > 0 ? ", " : "", (unsigned long long) counts[v] );
+    fprintf( out, "] }%s\n", c < 3 ? "," : "" );
+  }
+  fprintf( out, "  },\n" );
+}
+
+void stats_write_json( FILE *out, const char *transformation, uint64_t wall_ns ) {
+  struct rusage usage;
+  getrusage( RUSAGE_SELF, &usage );
+
+  fprintf( out, "{\n" );
+  fprintf( out, "  \"transformation\": \"%s\",\n", transformation );
+  fprintf( out, "  \"width\": %d,\n", s_width );
+  fprintf( out, "  \"height\": %d,\n", s_height );
+  fprintf( out, "  \"wall_ns\": %llu,\n", (unsigned long long) wall_ns );
+  fprintf( out, "  \"max_rss_bytes\": %llu,\n", (unsigned long long) usage.ru_maxrss * 1024 );
+  pthread_mutex_lock( &s_histogram_lock );
+  if ( s_histogram_pixels > 0 )
+    write_histogram_json( out );
+  pthread_mutex_unlock( &s_histogram_lock );
+  fprintf( out, "  \"stages\": {\n" );
+  for ( int i = 0; i < STATS_NUM_STAGES; ++i ) {
+    const struct StageTotals *t = &s_totals[i];
+    fprintf( out, "    \"%s\": { \"calls\": %llu, \"ns\": %llu, \"bytes\": %llu, \"alloc_high_water_bytes\": %llu }%s\n",
+             s_stage_names[i],
+             (unsigned long long) t->calls,
+             (unsigned long long) t->ns,
+             (unsigned long long) t->bytes,
+             (unsigned long long) t->alloc_high_water,
+             ( i + 1 < STATS_NUM_STAGES ) ? "," : "" );
+  }
+  fprintf( out, "  }\n" );
+  fprintf( out, "}\n" );
+}
@@ -0,0 +1,104 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// The stages of a c_imgproc run that are timed separately
+enum StatsStage {
+  STATS_READ,       // reading the input file
+  STATS_INFLATE,    // decompressing PNG image data
+  STATS_UNFILTER,   // undoing PNG scanline filters
+  STATS_BYTESWAP,   // converting between PNG bytes and struct Image pixels
+  STATS_TRANSFORM,  // the image transformation itself
+  STATS_FILTER,     // applying PNG scanline filters
+  STATS_DEFLATE,    // compressing PNG image data
+  STATS_WRITE,      // writing the output file
+  STATS_NUM_STAGES
+};
+
+// Nonzero if statistics are being collected. When this is zero,
+// stats_start and stats_stop do nothing, so instrumented code
+// costs only a branch.
+extern int stats_enabled;
+
+// Start timing one piece of work.
+//
+// Returns:
+//   a timestamp (monotonic clock, in nanoseconds) to pass to
+//   stats_stop, or 0 if statistics are disabled
+uint64_t stats_start( void );
+
+// Finish timing one piece of work, adding its duration and the
+// number of bytes it processed to the totals for the given stage.
+// The first call for a stage also samples the amount of heap memory
+// in use, as the stage's allocation high-water mark; a stage timed a
+// piece (such as a row) at a time allocates its buffers before the
+// first piece, so the other calls cost only a clock read.
+//
+// Parameters:
+//   stage - the stage the work belongs to
+//   start - timestamp returned by stats_start
+//   bytes - number of bytes processed
+void stats_stop( enum StatsStage stage, uint64_t start, uint64_t bytes );
+
+// Record the dimensions of the image being processed, so that
+// they are included in the statistics output.
+//
+// Parameters:
+//   width - image width
+//   height - image height
+void stats_set_image( int32_t width, int32_t height );
+
+// Per-channel histograms of output pixels, private to whoever is
+// filling them in (so no locking is needed until they're merged)
+struct StatsHistogram {
+  // a run of equal values would make each increment wait for the one
+  // before it, so the pixels take turns between four sets of counters:
+  // the number of pixels whose channel c (0 red, 1 green, 2 blue,
+  // 3 alpha) has value v is the sum of counts[s][c][v] over the sets s
+  // (see stats_histogram_count)
+  uint64_t counts[4][4][256];
+};
+
+// Add pixels to a histogram. This is meant to be called on rows that
+// have just been written, while they're still in the cache, and costs
+// nothing beyond the counting itself, so it can be called a row at a
+// time.
+//
+// Parameters:
+//   hist - pointer to the histogram
+//   pixels - pointer to the first pixel
+//   n - number of pixels
+void stats_histogram_add( struct StatsHistogram *hist, const uint32_t *pixels, size_t n );
+
+// Get the number of pixels added to a histogram with a given value in
+// one channel.
+//
+// Parameters:
+//   hist - pointer to the histogram
+//   channel - 0 for red, 1 green, 2 blue, 3 alpha
+//   value - channel value, 0 to 255
+//
+// Returns:
+//   the number of pixels
+uint64_t stats_histogram_count( const struct StatsHistogram *hist, int channel, int value );
+
+// Add a private histogram to the totals for the output, which
+// stats_write_json includes (as min, max, mean and the histogram of
+// each channel) once anything has been merged. This is thread-safe.
+//
+// Parameters:
+//   hist - pointer to the histogram
+void stats_histogram_merge( const struct StatsHistogram *hist );
+
+// Write the collected statistics as a JSON object.
+//
+// Parameters:
+//   out - stream to write to
+//   transformation - name of the transformation that was applied
+//   wall_ns - total wall-clock duration of the run, in nanoseconds
+void stats_write_json( FILE *out, const char *transformation, uint64_t wall_ns );
+
+#endif // STATS_H
@@ -0,0 +1,550 @@
+// Convolution kernels (stencils) over the color channels of an image
+
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+#include "stencil.h"
+#include "bands.h"
+
+const struct Stencil stencil_emboss = {
+  .radius = 1,
+  .weights = { 1, 0, 0,
+               0, -1, 0,
+               0, 0, 0 },
+  .bias = 128,
+  .output = STENCIL_OUT_MAX_DIFF,
+  .border = STENCIL_BORDER_NEUTRAL,
+};
+
+const struct Stencil stencil_blur = {
+  .radius = 1,
+  .weights = { 1, 2, 1,
+               2, 4, 2,
+               1, 2, 1 },
+  .separable = 1,
+  .row = { 1, 2, 1 },
+  .col = { 1, 2, 1 },
+  .shift = 4,
+  .output = STENCIL_OUT_CHANNELS,
+  .border = STENCIL_BORDER_REPLICATE,
+};
+
+const struct Stencil stencil_sharpen = {
+  .radius = 1,
+  .weights = { 0, -1, 0,
+               -1, 5, -1,
+               0, -1, 0 },
+  .output = STENCIL_OUT_CHANNELS,
+  .border = STENCIL_BORDER_REPLICATE,
+};
+
+const struct Stencil stencil_sobel = {
+  .radius = 1,
+  .weights = { -1, 0, 1,
+               -2, 0, 2,
+               -1, 0, 1 },
+  .weights2 = { -1, -2, -1,
+                0, 0, 0,
+                1, 2, 1 },
+  .output = STENCIL_OUT_MAGNITUDE,
+  .border = STENCIL_BORDER_REPLICATE,
+};
+
+void stencil_init(struct Stencil *st, int radius, const int16_t *weights, int shift, int32_t bias) {
+  int size = 2 * radius + 1;
+  memset(st, 0, sizeof(struct Stencil));
+  st->radius = radius;
+  memcpy(st->weights, weights, (size_t) size * size * sizeof(int16_t));
+  st->shift = shift;
+  st->bias = bias;
+  st->output = STENCIL_OUT_CHANNELS;
+  st->border = STENCIL_BORDER_REPLICATE;
+}
+
+void stencil_init_separable(struct Stencil *st, int radius, const int16_t *row, const int16_t *col,
+                            int shift, int32_t bias) {
+  int size = 2 * radius + 1;
+  int16_t weights[STENCIL_MAX_SIZE * STENCIL_MAX_SIZE];
+  for (int dy = 0; dy < size; dy++) {
+    for (int dx = 0; dx < size; dx++) {
+      weights[dy * size + dx] = (int16_t) (col[dy] * row[dx]);
+    }
+  }
+  stencil_init(st, radius, weights, shift, bias);
+  st->separable = 1;
+  memcpy(st->row, row, (size_t) size * sizeof(int16_t));
+  memcpy(st->col, col, (size_t) size * sizeof(int16_t));
+}
+
+// Extra elements at the end of each buffer row, so that groups of 8
+// pixels can run past the end of the image (the results are ignored).
+#define SLACK 16
+
+// Two adjacent taps of a kernel row, which are applied together: the
+// 16-bit values of columns dx and dx + 1 are interleaved and multiplied
+// by the interleaved weights, summing each pair into 32 bits.
+struct TapPair {
+  int dy;          // kernel row (for vertical pairs, the first of two rows)
+  int dx;          // kernel column of the first tap
+  int16_t w0, w1;  // weights of the two taps
+};
+
+#define MAX_PAIRS (STENCIL_MAX_SIZE * (STENCIL_MAX_SIZE + 1) / 2)
+
+// What stencil_apply works out from a kernel before running the bands
+struct Plan {
+  const struct Stencil *st;
+  int size;
+  int separable;
+  // the pairs of nonzero taps of weights and weights2
+  int num_pairs[2];
+  struct TapPair pairs[2][MAX_PAIRS];
+  // for the separable passes: pairs of row weights and of col weights
+  int num_row_pairs, num_col_pairs;
+  struct TapPair row_pairs[(STENCIL_MAX_SIZE + 1) / 2];
+  struct TapPair col_pairs[(STENCIL_MAX_SIZE + 1) / 2];
+  // how far the nonzero taps reach from the center in each direction
+  int top, bottom, left, right;
+  int32_t round;
+  uint8_t neutral;
+};
+
+static int make_pairs(const int16_t *weights, int size, int dy, struct TapPair *pairs) {
+  int n = 0;
+  for (int dx = 0; dx < size; dx += 2) {
+    int16_t w0 = weights[dx], w1 = dx + 1 < size ? weights[dx + 1] : 0;
+    if (w0 != 0 || w1 != 0) {
+      struct TapPair pair = { dy, dx, w0, w1 };
+      pairs[n++] = pair;
+    }
+  }
+  return n;
+}
+
+static void plan_init(struct Plan *plan, const struct Stencil *st) {
+  int size = 2 * st->radius + 1;
+  int kernels = st->output == STENCIL_OUT_MAGNITUDE ? 2 : 1;
+
+  memset(plan, 0, sizeof(struct Plan));
+  plan->st = st;
+  plan->size = size;
+  plan->round = st->shift > 0 ? 1 << (st->shift - 1) : 0;
+  plan->neutral = (uint8_t) (st->bias < 0 ? 0 : st->bias > 255 ? 255 : st->bias);
+
+  int first_row = size, last_row = -1, first_col = size, last_col = -1;
+  for (int k = 0; k < kernels; k++) {
+    const int16_t *weights = k == 0 ? st->weights : st->weights2;
+    for (int dy = 0; dy < size; dy++) {
+      plan->num_pairs[k] += make_pairs(weights + dy * size, size, dy, plan->pairs[k] + plan->num_pairs[k]);
+      for (int dx = 0; dx < size; dx++) {
+        if (weights[dy * size + dx] != 0) {
+          first_row = dy < first_row ? dy : first_row;
+          last_row = dy > last_row ? dy : last_row;
+          first_col = dx < first_col ? dx : first_col;
+          last_col = dx > last_col ? dx : last_col;
+        }
+      }
+    }
+  }
+  if (last_row >= 0) {
+    plan->top = st->radius - first_row;
+    plan->bottom = last_row - st->radius;
+    plan->left = st->radius - first_col;
+    plan->right = last_col - st->radius;
+  }
+
+  // the horizontal sums are kept in 16 bits, and the vertical sums
+  // must fit in 32 bits like the direct ones
+  int64_t row_total = 0, col_total = 0;
+  for (int i = 0; i < size; i++) {
+    row_total += st->row[i] < 0 ? -st->row[i] : st->row[i];
+    col_total += st->col[i] < 0 ? -st->col[i] : st->col[i];
+  }
+  plan->separable = st->separable && st->output == STENCIL_OUT_CHANNELS
+    && row_total * 255 <= INT16_MAX && row_total * col_total * 255 <= INT32_MAX;
+  if (plan->separable) {
+    plan->num_row_pairs = make_pairs(st->row, size, 0, plan->row_pairs);
+    for (int dy = 0; dy < size; dy += 2) {
+      struct TapPair pair = { dy, 0, st->col[dy], dy + 1 < size ? st->col[dy + 1] : 0 };
+      if (pair.w0 != 0 || pair.w1 != 0) {
+        plan->col_pairs[plan->num_col_pairs++] = pair;
+      }
+    }
+  }
+}
+
+// Map a row or column index outside 0..n-1 according to the border
+// policy. Returns -1 for STENCIL_BORDER_ZERO.
+static int32_t border_index(enum StencilBorder border, int32_t i, int32_t n) {
+  if (i >= 0 && i < n) {
+    return i;
+  }
+  if (border == STENCIL_BORDER_ZERO) {
+    return -1;
+  }
+  if (border == STENCIL_BORDER_MIRROR && n > 1) {
+    while (i < 0 || i >= n) {
+      i = i < 0 ? -i : 2 * (n - 1) - i;
+    }
+    return i;
+  }
+  return i < 0 ? 0 : n - 1;
+}
+
+// Unpack input row y into three padded 16-bit planes (red, green and
+// blue, each `stride` elements long); column x is at index x + radius.
+static void load_row(const struct Plan *plan, const struct Image *input_img, int32_t y, int16_t *planes,
+                     size_t stride) {
+  int radius = plan->st->radius;
+  int32_t width = input_img->width;
+  int16_t *r = planes, *g = planes + stride, *b = planes + 2 * stride;
+  int32_t src = border_index(plan->st->border, y, input_img->height);
+
+  if (src < 0) {
+    memset(planes, 0, 3 * stride * sizeof(int16_t));
+    return;
+  }
+  const uint32_t *in = input_img->data + (size_t) src * width;
+
+  int32_t x = 0;
+#if defined(__x86_64__)
+  const __m128i low_byte = _mm_set1_epi32(0xFF);
+  for (; x + 8 <= width; x += 8) {
+    __m128i p0 = _mm_loadu_si128((const __m128i *) (in + x));
+    __m128i p1 = _mm_loadu_si128((const __m128i *) (in + x + 4));
+    _mm_storeu_si128((__m128i *) (r + radius + x), _mm_packs_epi32(_mm_srli_epi32(p0, 24), _mm_srli_epi32(p1, 24)));
+    _mm_storeu_si128((__m128i *) (g + radius + x),
+                     _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 16), low_byte),
+                                     _mm_and_si128(_mm_srli_epi32(p1, 16), low_byte)));
+    _mm_storeu_si128((__m128i *) (b + radius + x),
+                     _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 8), low_byte),
+                                     _mm_and_si128(_mm_srli_epi32(p1, 8), low_byte)));
+  }
+#endif
+  for (; x < width; x++) {
+    r[radius + x] = (int16_t) (in[x] >> 24);
+    g[radius + x] = (int16_t) ((in[x] >> 16) & 0xFF);
+    b[radius + x] = (int16_t) ((in[x] >> 8) & 0xFF);
+  }
+
+  // the border columns on both sides, then zeros up to the end of the slack
+  for (int i = 0; i < 2 * radius; i++) {
+    int32_t col = i < radius ? i - radius : width + i - radius;
+    int32_t sx = border_index(plan->st->border, col, width);
+    uint32_t pixel = sx < 0 ? 0 : in[sx];
+    r[radius + col] = (int16_t) (pixel >> 24);
+    g[radius + col] = (int16_t) ((pixel >> 16) & 0xFF);
+    b[radius + col] = (int16_t) ((pixel >> 8) & 0xFF);
+  }
+  for (size_t i = (size_t) width + 2 * radius; i < stride; i++) {
+    r[i] = g[i] = b[i] = 0;
+  }
+}
+
+#if defined(__x86_64__)
+
+// Weighted sums of 8 pixels starting at column x of one channel, as
+// two vectors of four 32-bit sums. rows[dy] is the padded row for
+// kernel row dy.
+static void sum_pairs(const struct TapPair *pairs, int num_pairs, int16_t *const *rows, int32_t x,
+                      __m128i *lo, __m128i *hi) {
+  __m128i sum_lo = _mm_setzero_si128(), sum_hi = _mm_setzero_si128();
+  for (int i = 0; i < num_pairs; i++) {
+    const int16_t *p = rows[pairs[i].dy] + x + pairs[i].dx;
+    __m128i a = _mm_loadu_si128((const __m128i *) p);
+    __m128i b = _mm_loadu_si128((const __m128i *) (p + 1));
+    __m128i w = _mm_set1_epi32((int32_t) ((uint16_t) pairs[i].w0 | ((uint32_t) (uint16_t) pairs[i].w1 << 16)));
+    sum_lo = _mm_add_epi32(sum_lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+    sum_hi = _mm_add_epi32(sum_hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+  }
+  *lo = sum_lo;
+  *hi = sum_hi;
+}
+
+// The same for a vertical pass: each pair is two rows of 16-bit sums
+static void sum_col_pairs(const struct TapPair *pairs, int num_pairs, int16_t *const *rows, int size, int32_t x,
+                          __m128i *lo, __m128i *hi) {
+  __m128i sum_lo = _mm_setzero_si128(), sum_hi = _mm_setzero_si128();
+  for (int i = 0; i < num_pairs; i++) {
+    int dy = pairs[i].dy;
+    __m128i a = _mm_loadu_si128((const __m128i *) (rows[dy] + x));
+    __m128i b = _mm_loadu_si128((const __m128i *) (rows[dy + 1 < size ? dy + 1 : dy] + x));
+    __m128i w = _mm_set1_epi32((int32_t) ((uint16_t) pairs[i].w0 | ((uint32_t) (uint16_t) pairs[i].w1 << 16)));
+    sum_lo = _mm_add_epi32(sum_lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+    sum_hi = _mm_add_epi32(sum_hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+  }
+  *lo = sum_lo;
+  *hi = sum_hi;
+}
+
+static __m128i scale(const struct Plan *plan, __m128i sum) {
+  return _mm_sra_epi32(_mm_add_epi32(sum, _mm_set1_epi32(plan->round)), _mm_cvtsi32_si128(plan->st->shift));
+}
+
+static __m128i abs32(__m128i v) {
+  __m128i sign = _mm_srai_epi32(v, 31);
+  return _mm_sub_epi32(_mm_xor_si128(v, sign), sign);
+}
+
+static __m128i select32(__m128i mask, __m128i if_set, __m128i if_clear) {
+  return _mm_or_si128(_mm_and_si128(mask, if_set), _mm_andnot_si128(mask, if_clear));
+}
+
+// Add the bias and store 8 results, clamped to 0..255 (packing with
+// signed and then unsigned saturation clamps).
+static void store_clamped(const struct Plan *plan, __m128i lo, __m128i hi, uint8_t *out) {
+  __m128i bias = _mm_set1_epi32(plan->st->bias);
+  __m128i words = _mm_packs_epi32(_mm_add_epi32(lo, bias), _mm_add_epi32(hi, bias));
+  _mm_storel_epi64((__m128i *) out, _mm_packus_epi16(words, words));
+}
+
+// Compute the result of each channel for one output row: rows[c] holds
+// the kernel rows of channel c (input planes, or horizontal sums for
+// the separable passes).
+static void filter_row(const struct Plan *plan, int16_t *const rows[3][STENCIL_MAX_SIZE], int32_t width,
+                       uint8_t *res[3]) {
+  const struct Stencil *st = plan->st;
+
+  for (int32_t x = 0; x < width; x += 8) {
+    __m128i lo[3], hi[3];
+    for (int c = 0; c < 3; c++) {
+      if (plan->separable) {
+        sum_col_pairs(plan->col_pairs, plan->num_col_pairs, rows[c], plan->size, x, &lo[c], &hi[c]);
+      } else {
+        sum_pairs(plan->pairs[0], plan->num_pairs[0], rows[c], x, &lo[c], &hi[c]);
+      }
+      lo[c] = scale(plan, lo[c]);
+      hi[c] = scale(plan, hi[c]);
+    }
+
+    if (st->output == STENCIL_OUT_CHANNELS) {
+      for (int c = 0; c < 3; c++) {
+        store_clamped(plan, lo[c], hi[c], res[c] + x);
+      }
+    } else if (st->output == STENCIL_OUT_MAGNITUDE) {
+      for (int c = 0; c < 3; c++) {
+        __m128i lo2, hi2;
+        sum_pairs(plan->pairs[1], plan->num_pairs[1], rows[c], x, &lo2, &hi2);
+        store_clamped(plan, _mm_add_epi32(abs32(lo[c]), abs32(scale(plan, lo2))),
+                      _mm_add_epi32(abs32(hi[c]), abs32(scale(plan, hi2))), res[c] + x);
+      }
+    } else {
+      __m128i diff[2];
+      for (int h = 0; h < 2; h++) {
+        __m128i dr = h ? hi[0] : lo[0], dg = h ? hi[1] : lo[1], db = h ? hi[2] : lo[2];
+        __m128i ar = abs32(dr), ag = abs32(dg), ab = abs32(db);
+        __m128i not_r = _mm_or_si128(_mm_cmpgt_epi32(ag, ar), _mm_cmpgt_epi32(ab, ar));
+        diff[h] = select32(not_r, select32(_mm_cmpgt_epi32(ab, ag), db, dg), dr);
+      }
+      store_clamped(plan, diff[0], diff[1], res[0] + x);
+      memcpy(res[1] + x, res[0] + x, 8);
+      memcpy(res[2] + x, res[0] + x, 8);
+    }
+  }
+}
+
+// Horizontal pass of a separable kernel over one padded input row,
+// giving 16-bit sums for each column.
+static void filter_horizontal(const struct Plan *plan, int16_t *row, int32_t width, int16_t *sums) {
+  for (int32_t x = 0; x < width; x += 8) {
+    __m128i lo, hi;
+    sum_pairs(plan->row_pairs, plan->num_row_pairs, &row, x, &lo, &hi);
+    _mm_storeu_si128((__m128i *) (sums + x), _mm_packs_epi32(lo, hi));
+  }
+}
+
+#else
+
+static int32_t scale(const struct Plan *plan, int32_t sum) {
+  return (sum + plan->round) >> plan->st->shift;
+}
+
+static int32_t sum_pairs(const struct TapPair *pairs, int num_pairs, int16_t *const *rows, int32_t x) {
+  int32_t sum = 0;
+  for (int i = 0; i < num_pairs; i++) {
+    const int16_t *p = rows[pairs[i].dy] + x + pairs[i].dx;
+    sum += pairs[i].w0 * p[0] + pairs[i].w1 * p[1];
+  }
+  return sum;
+}
+
+static uint8_t clamp_biased(const struct Plan *plan, int32_t value) {
+  value += plan->st->bias;
+  return (uint8_t) (value < 0 ? 0 : value > 255 ? 255 : value);
+}
+
+static void filter_row(const struct Plan *plan, int16_t *const rows[3][STENCIL_MAX_SIZE], int32_t width,
+                       uint8_t *res[3]) {
+  const struct Stencil *st = plan->st;
+
+  for (int32_t x = 0; x < width; x++) {
+    int32_t sum[3];
+    for (int c = 0; c < 3; c++) {
+      if (plan->separable) {
+        sum[c] = 0;
+        for (int i = 0; i < plan->num_col_pairs; i++) {
+          int dy = plan->col_pairs[i].dy;
+          sum[c] += plan->col_pairs[i].w0 * rows[c][dy][x];
+          if (dy + 1 < plan->size) {
+            sum[c] += plan->col_pairs[i].w1 * rows[c][dy + 1][x];
+          }
+        }
+      } else {
+        sum[c] = sum_pairs(plan->pairs[0], plan->num_pairs[0], rows[c], x);
+      }
+      sum[c] = scale(plan, sum[c]);
+    }
+
+    if (st->output == STENCIL_OUT_CHANNELS) {
+      for (int c = 0; c < 3; c++) {
+        res[c][x] = clamp_biased(plan, sum[c]);
+      }
+    } else if (st->output == STENCIL_OUT_MAGNITUDE) {
+      for (int c = 0; c < 3; c++) {
+        int32_t sum2 = scale(plan, sum_pairs(plan->pairs[1], plan->num_pairs[1], rows[c], x));
+        res[c][x] = clamp_biased(plan, abs(sum[c]) + abs(sum2));
+      }
+    } else {
+      int32_t ar = abs(sum[0]), ag = abs(sum[1]), ab = abs(sum[2]);
+      int32_t diff = (ar >= ag && ar >= ab) ? sum[0] : (ag >= ab ? sum[1] : sum[2]);
+      res[0][x] = res[1][x] = res[2][x] = clamp_biased(plan, diff);
+    }
+  }
+}
+
+static void filter_horizontal(const struct Plan *plan, int16_t *row, int32_t width, int16_t *sums) {
+  for (int32_t x = 0; x < width; x++) {
+    sums[x] = (int16_t) sum_pairs(plan->row_pairs, plan->num_row_pairs, &row, x);
+  }
+}
+
+#endif
+
+// Write the output pixels of a row: the color channels from res, and
+// the alpha of each input pixel.
+static void store_row(const uint32_t *in, uint8_t *res[3], int32_t width, uint32_t *out) {
+  int32_t x = 0;
+#if defined(__x86_64__)
+  const __m128i zero = _mm_setzero_si128();
+  for (; x + 8 <= width; x += 8) {
+    __m128i r = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (res[0] + x)), zero);
+    __m128i g = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (res[1] + x)), zero);
+    __m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (res[2] + x)), zero);
+    for (int h = 0; h < 2; h++) {
+      __m128i r32 = h ? _mm_unpackhi_epi16(r, zero) : _mm_unpacklo_epi16(r, zero);
+      __m128i g32 = h ? _mm_unpackhi_epi16(g, zero) : _mm_unpacklo_epi16(g, zero);
+      __m128i b32 = h ? _mm_unpackhi_epi16(b, zero) : _mm_unpacklo_epi16(b, zero);
+      __m128i a32 = _mm_and_si128(_mm_loadu_si128((const __m128i *) (in + x + 4 * h)), _mm_set1_epi32(0xFF));
+      __m128i pixels = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(r32, 24), _mm_slli_epi32(g32, 16)),
+                                    _mm_or_si128(_mm_slli_epi32(b32, 8), a32));
+      _mm_storeu_si128((__m128i *) (out + x + 4 * h), pixels);
+    }
+  }
+#endif
+  for (; x < width; x++) {
+    out[x] = ((uint32_t) res[0][x] << 24) | ((uint32_t) res[1][x] << 16) | ((uint32_t) res[2][x] << 8)
+      | (in[x] & 0xFF);
+  }
+}
+
+// With STENCIL_BORDER_NEUTRAL, set the results whose neighborhood
+// leaves the image to the bias.
+static void neutral_border(const struct Plan *plan, int32_t y, int32_t width, int32_t height, uint8_t *res[3]) {
+  int32_t begin = plan->left < width ? plan->left : width;
+  int32_t end = width - plan->right > begin ? width - plan->right : begin;
+  if (y - plan->top < 0 || y + plan->bottom >= height) {
+    begin = end = width;
+  }
+
+  for (int c = 0; c < 3; c++) {
+    memset(res[c], plan->neutral, (size_t) begin);
+    memset(res[c] + end, plan->neutral, (size_t) (width - end));
+  }
+}
+
+static int32_t ring_slot(int32_t row, int size) {
+  return ((row % size) + size) % size;
+}
+
+// Compute output rows first to end - 1.
+static int run_band(const struct Plan *plan, const struct Image *input_img, struct Image *output_img,
+                    int32_t first, int32_t end) {
+  int radius = plan->st->radius, size = plan->size;
+  int32_t width = input_img->width, height = input_img->height;
+  size_t stride = (size_t) width + 2 * radius + SLACK;
+  size_t sums_stride = (size_t) width + SLACK;
+
+  // the rolling buffer holds the 3 planes of the last `size` input rows,
+  // or for separable kernels, one input row and the horizontal sums of
+  // the last `size` rows
+  size_t buf_elems = plan->separable ? 3 * stride + (size_t) size * 3 * sums_stride : (size_t) size * 3 * stride;
+  int16_t *buf = (int16_t *) malloc(buf_elems * sizeof(int16_t));
+  uint8_t *res_buf = (uint8_t *) malloc(3 * sums_stride);
+  if (buf == NULL || res_buf == NULL) {
+    free(buf);
+    free(res_buf);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+  uint8_t *res[3] = { res_buf, res_buf + sums_stride, res_buf + 2 * sums_stride };
+  int16_t *sums = buf + 3 * stride;
+
+  for (int32_t y = first; y < end; y++) {
+    // bring the input rows y - radius to y + radius into the buffer
+    for (int32_t j = (y == first ? y - radius : y + radius); j <= y + radius; j++) {
+      int32_t slot = ring_slot(j, size);
+      if (plan->separable) {
+        load_row(plan, input_img, j, buf, stride);
+        for (int c = 0; c < 3; c++) {
+          filter_horizontal(plan, buf + c * stride, width, sums + ((size_t) slot * 3 + c) * sums_stride);
+        }
+      } else {
+        load_row(plan, input_img, j, buf + (size_t) slot * 3 * stride, stride);
+      }
+    }
+
+    int16_t *rows[3][STENCIL_MAX_SIZE];
+    for (int dy = 0; dy < size; dy++) {
+      int32_t slot = ring_slot(y - radius + dy, size);
+      for (int c = 0; c < 3; c++) {
+        rows[c][dy] = plan->separable ? sums + ((size_t) slot * 3 + c) * sums_stride
+          : buf + ((size_t) slot * 3 + c) * stride;
+      }
+    }
+
+    filter_row(plan, (int16_t *const (*)[STENCIL_MAX_SIZE]) rows, width, res);
+    if (plan->st->border == STENCIL_BORDER_NEUTRAL) {
+      neutral_border(plan, y, width, height, res);
+    }
+    store_row(input_img->data + (size_t) y * width, res, width, output_img->data + (size_t) y * width);
+  }
+
+  free(buf);
+  free(res_buf);
+  return IMG_SUCCESS;
+}
+
+struct StencilJob {
+  const struct Plan *plan;
+  const struct Image *input_img;
+  struct Image *output_img;
+};
+
+static int stencil_band(void *ctx, int32_t first, int32_t end) {
+  struct StencilJob *job = (struct StencilJob *) ctx;
+  return run_band(job->plan, job->input_img, job->output_img, first, end);
+}
+
+int stencil_apply(const struct Stencil *st, struct Image *input_img, struct Image *output_img, int num_threads) {
+  int32_t height = input_img->height;
+  if (input_img->width == 0 || height == 0) {
+    return IMG_SUCCESS;
+  }
+
+  struct Plan plan;
+  plan_init(&plan, st);
+
+  struct StencilJob job = { &plan, input_img, output_img };
+  return run_bands(height, num_threads, stencil_band, &job);
+}
@@ -0,0 +1,103 @@
+#ifndef STENCIL_H
+#define STENCIL_H
+
+#include <stdint.h>
+#include "image.h"
+
+// largest kernel radius (kernels are at most 7x7)
+#define STENCIL_MAX_RADIUS 3
+#define STENCIL_MAX_SIZE (2 * STENCIL_MAX_RADIUS + 1)
+
+// How neighbors outside the image are read
+enum StencilBorder {
+  // the nearest pixel on the edge of the image
+  STENCIL_BORDER_REPLICATE,
+  // reflected at the edge, without repeating the edge pixel
+  STENCIL_BORDER_MIRROR,
+  // all color channels 0
+  STENCIL_BORDER_ZERO,
+  // never read: output pixels whose neighborhood (the taps with nonzero
+  // weights) leaves the image get the bias on every color channel
+  STENCIL_BORDER_NEUTRAL,
+};
+
+// How the weighted sums of each color channel become the output
+enum StencilOutput {
+  // each channel: bias + sum, clamped to 0..255
+  STENCIL_OUT_CHANNELS,
+  // each channel: bias + |sum| + |sum2| (sum2 uses weights2), clamped
+  STENCIL_OUT_MAGNITUDE,
+  // gray: bias + the channel sum with the largest magnitude (red on
+  // ties with green or blue, then green on ties with blue), clamped,
+  // as in emboss
+  STENCIL_OUT_MAX_DIFF,
+};
+
+// A convolution kernel applied to the red, green and blue channels of
+// each pixel (the alpha channel is copied from the center pixel). Sums
+// are computed exactly with integer weights, then divided by
+// 2^shift, rounding half up, before the bias is added.
+struct Stencil {
+  // the kernel is (2 * radius + 1) pixels square, with the weight of
+  // the neighbor dy rows below and dx columns right of the center at
+  // weights[(dy + radius) * (2 * radius + 1) + dx + radius]
+  int radius;
+  int16_t weights[STENCIL_MAX_SIZE * STENCIL_MAX_SIZE];
+  // second kernel, only for STENCIL_OUT_MAGNITUDE
+  int16_t weights2[STENCIL_MAX_SIZE * STENCIL_MAX_SIZE];
+  // if nonzero, weights is the product col[dy] * row[dx] of these
+  // vectors, and is applied as a horizontal and a vertical pass
+  int separable;
+  int16_t row[STENCIL_MAX_SIZE];
+  int16_t col[STENCIL_MAX_SIZE];
+  int shift;
+  int32_t bias;
+  enum StencilOutput output;
+  enum StencilBorder border;
+};
+
+// Built-in kernels:
+//   stencil_emboss  - the emboss transformation (same result as imgproc_emboss)
+//   stencil_blur    - 3x3 Gaussian blur, separable
+//   stencil_sharpen - 3x3 sharpen (5 at the center, -1 at the sides)
+//   stencil_sobel   - 3x3 Sobel edge magnitude |Gx| + |Gy| of each channel
+extern const struct Stencil stencil_emboss;
+extern const struct Stencil stencil_blur;
+extern const struct Stencil stencil_sharpen;
+extern const struct Stencil stencil_sobel;
+
+// Initialize a kernel with STENCIL_OUT_CHANNELS output and
+// STENCIL_BORDER_REPLICATE borders (which can be changed afterwards).
+//
+// Parameters:
+//   st - pointer to the kernel
+//   radius - the kernel radius, 0 to STENCIL_MAX_RADIUS
+//   weights - (2 * radius + 1)^2 weights, row by row
+//   shift - the sums are divided by 2^shift
+//   bias - added to each result
+void stencil_init(struct Stencil *st, int radius, const int16_t *weights, int shift, int32_t bias);
+
+// Initialize a separable kernel, whose weights are col[dy] * row[dx]
+// (each product must fit in an int16_t), like stencil_init.
+void stencil_init_separable(struct Stencil *st, int radius, const int16_t *row, const int16_t *col,
+                            int shift, int32_t bias);
+
+// Apply a kernel to an image. The image is split into bands of rows
+// computed by separate threads; each keeps the 2 * radius + 1 input
+// rows it reads in a rolling buffer of 16-bit channel planes, padded
+// at the ends according to the border policy. Separable kernels whose
+// horizontal sums fit in 16 bits use a horizontal pass per input row
+// and a vertical pass per output row, with the same results.
+//
+// Parameters:
+//   st - pointer to the kernel
+//   input_img - pointer to the input Image
+//   output_img - pointer to the output Image (same dimensions, not
+//                the same pixels as the input)
+//   num_threads - maximum number of threads, or 0 for one per CPU
+//
+// Returns:
+//   IMG_SUCCESS, or IMG_ERR_MALLOC_FAILED
+int stencil_apply(const struct Stencil *st, struct Image *input_img, struct Image *output_img, int num_threads);
+
+#endif // STENCIL_H
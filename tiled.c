@@ -0,0 +1,198 @@
+// Tiled (out-of-core) versions of the image transformations, which
+// process a TileStore a band or tile at a time
+
+#include <stdlib.h>
+#include <string.h>
+#include "imgproc.h"
+#include "tiled.h"
+#include "ellipse_mask.h"
+
+// Map the same band of rows in the input and output stores.
+static int map_band_pair(struct TileStore *input, struct TileStore *output,
+                         int32_t first_row, int32_t nrows,
+                         struct TileView *in_view, struct TileView *out_view) {
+  int rc = ts_map_rows(input, first_row, nrows, in_view);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+  rc = ts_map_rows(output, first_row, nrows, out_view);
+  if (rc != IMG_SUCCESS) {
+    ts_unmap_rows(in_view);
+  }
+  return rc;
+}
+
+int ts_complement(struct TileStore *input, struct TileStore *output) {
+  int32_t band_rows = ts_band_rows(input, 2);
+
+  for (int32_t row = 0; row < input->height; row += band_rows) {
+    int32_t nrows = input->height - row < band_rows ? input->height - row : band_rows;
+    struct TileView in_view, out_view;
+
+    int rc = map_band_pair(input, output, row, nrows, &in_view, &out_view);
+    if (rc != IMG_SUCCESS) {
+      return rc;
+    }
+
+    // complement is a point operation, so each band is just a smaller image
+    imgproc_complement(&in_view.img, &out_view.img);
+
+    ts_unmap_rows(&in_view);
+    ts_unmap_rows(&out_view);
+  }
+
+  return IMG_SUCCESS;
+}
+
+int ts_ellipse(struct TileStore *input, struct TileStore *output) {
+  int32_t band_rows = ts_band_rows(input, 2);
+
+  // the ellipse depends on the dimensions of the whole image,
+  // not those of the band
+  const struct EllipseMask *mask = ellipse_mask_get(input->width, input->height);
+  if (mask == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  for (int32_t row = 0; row < input->height; row += band_rows) {
+    int32_t nrows = input->height - row < band_rows ? input->height - row : band_rows;
+    struct TileView in_view, out_view;
+
+    int rc = map_band_pair(input, output, row, nrows, &in_view, &out_view);
+    if (rc != IMG_SUCCESS) {
+      ellipse_mask_release(mask);
+      return rc;
+    }
+
+    // the output store starts out zeroed rather than opaque black,
+    // so pixels outside the ellipse have to be written explicitly
+    for (int32_t r = 0; r < nrows; r++) {
+      int32_t start = mask->spans[2*(row + r)], end = mask->spans[2*(row + r) + 1];
+      uint32_t *in_row = in_view.img.data + (size_t) r * input->width;
+      uint32_t *out_row = out_view.img.data + (size_t) r * input->width;
+
+      for (int32_t col = 0; col < start; col++) {
+        out_row[col] = 0x000000FFU;
+      }
+      memcpy(out_row + start, in_row + start, (size_t) (end - start) * sizeof(uint32_t));
+      for (int32_t col = end; col < input->width; col++) {
+        out_row[col] = 0x000000FFU;
+      }
+    }
+
+    ts_unmap_rows(&in_view);
+    ts_unmap_rows(&out_view);
+  }
+
+  ellipse_mask_release(mask);
+  return IMG_SUCCESS;
+}
+
+int ts_emboss(struct TileStore *input, struct TileStore *output) {
+  // leave room for the halo row above each band
+  int32_t band_rows = ts_band_rows(input, 2) - 1;
+  if (band_rows < 1) {
+    band_rows = 1;
+  }
+
+  size_t row_bytes = (size_t) input->width * sizeof(uint32_t);
+  uint32_t *saved_row = (uint32_t *) malloc(row_bytes);
+  if (saved_row == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  for (int32_t row = 0; row < input->height; row += band_rows) {
+    int32_t nrows = input->height - row < band_rows ? input->height - row : band_rows;
+    int32_t halo = (row > 0) ? 1 : 0;
+    struct TileView in_view, out_view;
+
+    int rc = map_band_pair(input, output, row - halo, nrows + halo, &in_view, &out_view);
+    if (rc != IMG_SUCCESS) {
+      free(saved_row);
+      return rc;
+    }
+
+    // imgproc_emboss treats the halo row as the top border of the
+    // band, so preserve the output computed for it by the previous band
+    if (halo) {
+      memcpy(saved_row, out_view.img.data, row_bytes);
+    }
+
+    imgproc_emboss(&in_view.img, &out_view.img);
+
+    if (halo) {
+      memcpy(out_view.img.data, saved_row, row_bytes);
+    }
+
+    ts_unmap_rows(&in_view);
+    ts_unmap_rows(&out_view);
+  }
+
+  free(saved_row);
+  return IMG_SUCCESS;
+}
+
+int ts_transpose(struct TileStore *input, struct TileStore *output) {
+  // one band of input rows and one band of output rows are mapped at
+  // a time, plus two square scratch tiles which are no bigger than a band
+  int32_t tile = ts_band_rows(input, 3);
+  int32_t dim = input->width;
+
+  struct Image tile_in, tile_out;
+  int rc = img_init(&tile_in, tile, tile);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+  rc = img_init(&tile_out, tile, tile);
+  if (rc != IMG_SUCCESS) {
+    img_cleanup(&tile_in);
+    return rc;
+  }
+
+  for (int32_t row = 0; row < dim && rc == IMG_SUCCESS; row += tile) {
+    int32_t th = dim - row < tile ? dim - row : tile;
+    struct TileView in_view;
+
+    rc = ts_map_rows(input, row, th, &in_view);
+    if (rc != IMG_SUCCESS) {
+      break;
+    }
+
+    for (int32_t col = 0; col < dim; col += tile) {
+      int32_t tw = dim - col < tile ? dim - col : tile;
+      struct TileView out_view;
+
+      // the tile at (row, col) ends up at (col, row)
+      rc = ts_map_rows(output, col, tw, &out_view);
+      if (rc != IMG_SUCCESS) {
+        break;
+      }
+
+      // edge tiles may be smaller than the scratch tile, in which
+      // case part of the scratch tile is simply ignored
+      tile_in.width = tile_in.height = tile_out.width = tile_out.height = (th > tw) ? th : tw;
+
+      for (int32_t r = 0; r < th; r++) {
+        memcpy(&tile_in.data[compute_index(&tile_in, r, 0)],
+               &in_view.img.data[compute_index(&in_view.img, r, col)],
+               tw * sizeof(uint32_t));
+      }
+
+      imgproc_transpose(&tile_in, &tile_out);
+
+      for (int32_t r = 0; r < tw; r++) {
+        memcpy(&out_view.img.data[compute_index(&out_view.img, r, row)],
+               &tile_out.data[compute_index(&tile_out, r, 0)],
+               th * sizeof(uint32_t));
+      }
+
+      ts_unmap_rows(&out_view);
+    }
+
+    ts_unmap_rows(&in_view);
+  }
+
+  img_cleanup(&tile_in);
+  img_cleanup(&tile_out);
+  return rc;
+}
@@ -0,0 +1,21 @@
+#ifndef TILED_H
+#define TILED_H
+
+#include "tilestore.h"
+
+// Tiled versions of the image transformations. Each one processes
+// the input store a band (or, for transpose, a tile) at a time using
+// the corresponding imgproc_* function, and writes the result to the
+// output store, which must have the same dimensions. Emboss maps a
+// one-row halo above each band, and transpose copies each tile to
+// its mirrored position. ts_transpose requires a square image.
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int ts_complement(struct TileStore *input, struct TileStore *output);
+int ts_transpose(struct TileStore *input, struct TileStore *output);
+int ts_ellipse(struct TileStore *input, struct TileStore *output);
+int ts_emboss(struct TileStore *input, struct TileStore *output);
+
+#endif // TILED_H
@@ -0,0 +1,95 @@
+// File-backed, mmap'ed pixel storage for processing images that
+// don't fit in memory
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include "tilestore.h"
+
+int ts_init(struct TileStore *ts, int32_t width, int32_t height, size_t cache_bytes, const char *dir) {
+  if (width <= 0 || height <= 0) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  if (dir == NULL) {
+    dir = getenv("TMPDIR");
+  }
+  if (dir == NULL || dir[0] == '\0') {
+    dir = "/tmp";
+  }
+
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/imgproc-tiles-XXXXXX", dir);
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  // the file is only reachable through fd from now on, so it goes
+  // away automatically when the store is cleaned up (or the program exits)
+  unlink(path);
+
+  off_t size = (off_t) width * height * sizeof(uint32_t);
+  if (ftruncate(fd, size) != 0) {
+    close(fd);
+    return IMG_ERR_COULD_NOT_WRITE;
+  }
+
+  ts->width = width;
+  ts->height = height;
+  ts->fd = fd;
+  ts->cache_bytes = cache_bytes;
+  return IMG_SUCCESS;
+}
+
+int32_t ts_band_rows(const struct TileStore *ts, int nbands) {
+  size_t row_bytes = (size_t) ts->width * sizeof(uint32_t);
+  size_t rows = ts->cache_bytes / (row_bytes * nbands);
+
+  if (rows < 1) {
+    rows = 1;
+  }
+  if (rows > (size_t) ts->height) {
+    rows = ts->height;
+  }
+  return (int32_t) rows;
+}
+
+int ts_map_rows(struct TileStore *ts, int32_t first_row, int32_t nrows, struct TileView *view) {
+  size_t row_bytes = (size_t) ts->width * sizeof(uint32_t);
+  size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+
+  // mmap offsets must be page aligned, so map from the start of
+  // the page containing the first row
+  off_t start = (off_t) first_row * row_bytes;
+  off_t map_start = start - (off_t) (start % page_size);
+  size_t map_len = (size_t) (start - map_start) + (size_t) nrows * row_bytes;
+
+  void *base = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, ts->fd, map_start);
+  if (base == MAP_FAILED) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  view->img.width = ts->width;
+  view->img.height = nrows;
+  view->img.data = (uint32_t *) ((char *) base + (start - map_start));
+  view->first_row = first_row;
+  view->map_base = base;
+  view->map_len = map_len;
+  return IMG_SUCCESS;
+}
+
+void ts_unmap_rows(struct TileView *view) {
+  munmap(view->map_base, view->map_len);
+  view->map_base = NULL;
+  view->img.data = NULL;
+}
+
+void ts_cleanup(struct TileStore *ts) {
+  if (ts->fd >= 0) {
+    close(ts->fd);
+  }
+  ts->fd = -1;
+}
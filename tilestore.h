@@ -0,0 +1,88 @@
+#ifndef TILESTORE_H
+#define TILESTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "image.h"
+
+// A TileStore holds the pixels of an image in a temporary file rather
+// than in memory. The pixels are laid out exactly like the data array
+// of a struct Image (row-major, one uint32_t per pixel), and a band of
+// rows is mmap'ed only while it is being processed. The cache size
+// limits how many bytes of the file are mapped at any one time, so
+// the resident memory needed to process an image is bounded by the
+// cache size rather than by the image size.
+struct TileStore {
+  int32_t width;
+  int32_t height;
+  int fd;
+  size_t cache_bytes;
+};
+
+// A band of consecutive rows of a TileStore which is currently mapped
+// into memory. The img member describes just the mapped rows, so it
+// can be passed directly to the imgproc_* functions.
+struct TileView {
+  struct Image img;
+  int32_t first_row;
+  void *map_base;
+  size_t map_len;
+};
+
+// Create a TileStore for an image of the given dimensions, backed by
+// an anonymous (already unlinked) temporary file. Pixels are initially
+// all zero.
+//
+// Parameters:
+//   ts - pointer to TileStore instance to initialize
+//   width - image width (number of pixel columns)
+//   height - image height (number of pixel rows)
+//   cache_bytes - maximum number of bytes to keep mapped at once
+//   dir - directory for the temporary file, or NULL to use $TMPDIR
+//         (or /tmp if that isn't set)
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int ts_init(struct TileStore *ts, int32_t width, int32_t height, size_t cache_bytes, const char *dir);
+
+// Determine how many rows fit in one band if nbands bands
+// (of the same width as the store) must be mapped at the same time.
+//
+// Parameters:
+//   ts - pointer to TileStore
+//   nbands - number of bands that will be mapped simultaneously
+//
+// Returns:
+//   number of rows per band, at least 1 and at most the image height
+int32_t ts_band_rows(const struct TileStore *ts, int nbands);
+
+// Map rows first_row..first_row+nrows-1 of a TileStore into memory
+// (readable and writable). The view must be released with ts_unmap_rows.
+//
+// Parameters:
+//   ts - pointer to TileStore
+//   first_row - first row to map
+//   nrows - number of rows to map
+//   view - pointer to TileView to initialize
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int ts_map_rows(struct TileStore *ts, int32_t first_row, int32_t nrows, struct TileView *view);
+
+// Release a band of rows mapped by ts_map_rows. Modified pixels
+// are written back to the store.
+//
+// Parameters:
+//   view - pointer to TileView to release
+void ts_unmap_rows(struct TileView *view);
+
+// Close the temporary file backing a TileStore. This does NOT
+// de-allocate the struct TileStore instance itself.
+//
+// Parameters:
+//   ts - pointer to TileStore to clean up
+void ts_cleanup(struct TileStore *ts);
+
+#endif // TILESTORE_H
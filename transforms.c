@@ -0,0 +1,491 @@
+// The transformations which can be selected by name, shared by
+// the command line program and server mode
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "imgproc.h"
+#include "tiled.h"
+#include "ellipse_mask.h"
+#include "imgproc16.h"
+#include "stencil.h"
+#include "resize.h"
+#include "rgbsplit.h"
+#include "composite.h"
+#include "transforms.h"
+
+int apply_complement( struct Image *input_img, struct Image *output_img, int argc, char **argv );
+int apply_transpose( struct Image *input_img, struct Image *output_img, int argc, char **argv );
+int apply_ellipse( struct Image *input_img, struct Image *output_img, int argc, char **argv );
+int apply_emboss( struct Image *input_img, struct Image *output_img, int argc, char **argv );
+int apply_blur( struct Image *input_img, struct Image *output_img, int argc, char **argv );
+int apply_sharpen( struct Image *input_img, struct Image *output_img, int argc, char **argv );
+int apply_sobel( struct Image *input_img, struct Image *output_img, int argc, char **argv );
+int apply_convolve( struct Image *input_img, struct Image *output_img, int argc, char **argv );
+int apply_resize( struct Image *input_img, struct Image *output_img, int argc, char **argv );
+int apply_rotate90( struct Image *input_img, struct Image *output_img, int argc, char **argv );
+int apply_rotate180( struct Image *input_img, struct Image *output_img, int argc, char **argv );
+int apply_rotate270( struct Image *input_img, struct Image *output_img, int argc, char **argv );
+int apply_flip_h( struct Image *input_img, struct Image *output_img, int argc, char **argv );
+int apply_flip_v( struct Image *input_img, struct Image *output_img, int argc, char **argv );
+int apply_rgb( struct Image *input_img, struct Image *output_img, int argc, char **argv );
+int apply_composite( struct Image *input_img, struct Image *output_img, int argc, char **argv );
+
+// Make an output image the given size, if it isn't already (its pixels
+// are then opaque black). Returns 0, after printing an error, if it
+// couldn't be allocated.
+// The output image comes from create_output_img, which sizes it with
+// the transformation's output_size hook; this just guards the kernels
+// against an image of some other size.
+static int check_output_size( struct Image *output_img, int32_t width, int32_t height ) {
+  if ( output_img->width == width && output_img->height == height )
+    return 1;
+  fprintf( stderr, "Error: the output image is %dx%d, not %dx%d\n",
+           (int) output_img->width, (int) output_img->height, (int) width, (int) height );
+  return 0;
+}
+
+static int apply_stencil( const struct Stencil *st, struct Image *input_img, struct Image *output_img ) {
+  if ( stencil_apply( st, input_img, output_img, 0 ) != IMG_SUCCESS ) {
+    fprintf( stderr, "Error: couldn't allocate stencil buffers\n" );
+    return 0;
+  }
+  return 1;
+}
+
+int apply_blur( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
+  (void) argc;
+  (void) argv;
+  return apply_stencil( &stencil_blur, input_img, output_img );
+}
+
+int apply_sharpen( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
+  (void) argc;
+  (void) argv;
+  return apply_stencil( &stencil_sharpen, input_img, output_img );
+}
+
+int apply_sobel( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
+  (void) argc;
+  (void) argv;
+  return apply_stencil( &stencil_sobel, input_img, output_img );
+}
+
+// largest magnitude of a convolve bias
+#define CONVOLVE_MAX_BIAS ( 1 << 24 )
+
+// convolve <weights> [<shift> [<bias>]]: the weights of a 1x1, 3x3, 5x5
+// or 7x7 kernel, row by row, separated by commas
+int apply_convolve( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
+  int16_t weights[STENCIL_MAX_SIZE * STENCIL_MAX_SIZE];
+  int n = 0;
+  const char *p = argc > 4 ? argv[4] : "";
+  char *end;
+
+  while ( n < STENCIL_MAX_SIZE * STENCIL_MAX_SIZE ) {
+    long w = strtol( p, &end, 10 );
+    if ( end == p || w < INT16_MIN || w > INT16_MAX )
+      break;
+    weights[n++] = (int16_t) w;
+    p = end;
+    if ( *p != ',' )
+      break;
+    ++p;
+  }
+
+  int radius = 0;
+  while ( radius <= STENCIL_MAX_RADIUS && ( 2 * radius + 1 ) * ( 2 * radius + 1 ) < n )
+    ++radius;
+  if ( *p != '\0' || radius > STENCIL_MAX_RADIUS || ( 2 * radius + 1 ) * ( 2 * radius + 1 ) != n ) {
+    fprintf( stderr, "Error: convolve needs 1, 9, 25 or 49 comma-separated integer weights\n" );
+    return 0;
+  }
+
+  // (the bias is limited so that adding it to a sum, which is less
+  // than 2^29 in magnitude, can't overflow)
+  end = "";
+  long shift = argc > 5 ? strtol( argv[5], &end, 10 ) : 0;
+  if ( ( argc > 5 && ( end == argv[5] || *end != '\0' ) ) || shift < 0 || shift > 30 ) {
+    fprintf( stderr, "Error: convolve shift must be an integer between 0 and 30\n" );
+    return 0;
+  }
+  end = "";
+  long bias = argc > 6 ? strtol( argv[6], &end, 10 ) : 0;
+  if ( ( argc > 6 && ( end == argv[6] || *end != '\0' ) ) || bias < -CONVOLVE_MAX_BIAS || bias > CONVOLVE_MAX_BIAS ) {
+    fprintf( stderr, "Error: convolve bias must be an integer between %d and %d\n", -CONVOLVE_MAX_BIAS,
+             CONVOLVE_MAX_BIAS );
+    return 0;
+  }
+
+  struct Stencil st;
+  stencil_init( &st, radius, weights, (int) shift, (int32_t) bias );
+  return apply_stencil( &st, input_img, output_img );
+}
+
+// resize <width> <height> [box|bilinear]: either dimension may be 0
+// to keep the aspect ratio
+static int resize_output_size( int32_t *width, int32_t *height, int argc, char **argv ) {
+  char *end_w = "", *end_h = "";
+  long w = argc > 4 ? strtol( argv[4], &end_w, 10 ) : -1;
+  long h = argc > 5 ? strtol( argv[5], &end_h, 10 ) : -1;
+  if ( *end_w != '\0' || *end_h != '\0' || w < 0 || h < 0 || w > 65535 || h > 65535 || ( w == 0 && h == 0 ) )
+    return 0;
+  if ( argc > 6 && strcmp( argv[6], "box" ) != 0 && strcmp( argv[6], "bilinear" ) != 0 )
+    return 0;
+
+  if ( w == 0 )
+    w = *height > 0 ? ( (long) *width * h + *height / 2 ) / *height : 0;
+  if ( h == 0 )
+    h = *width > 0 ? ( (long) *height * w + *width / 2 ) / *width : 0;
+  // an empty image stays empty; otherwise the result is at least 1x1
+  *width = *width == 0 ? 0 : w > 0 ? w : 1;
+  *height = *height == 0 ? 0 : h > 0 ? h : 1;
+  return 1;
+}
+
+int apply_resize( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
+  int32_t width = input_img->width, height = input_img->height;
+  if ( !resize_output_size( &width, &height, argc, argv ) ) {
+    fprintf( stderr, "Error: resize needs a width and height (0 to keep the aspect ratio), then box or bilinear\n" );
+    return 0;
+  }
+  enum ResizeFilter filter = argc > 6 && strcmp( argv[6], "bilinear" ) == 0 ? RESIZE_BILINEAR : RESIZE_BOX;
+
+  if ( !check_output_size( output_img, width, height ) )
+    return 0;
+  if ( resize_image( input_img, output_img, filter ) != IMG_SUCCESS ) {
+    fprintf( stderr, "Error: couldn't allocate resize buffers\n" );
+    return 0;
+  }
+  return 1;
+}
+
+// the quarter turns swap the width and height
+static int rotated_output_size( int32_t *width, int32_t *height, int argc, char **argv ) {
+  (void) argc;
+  (void) argv;
+  int32_t w = *width;
+  *width = *height;
+  *height = w;
+  return 1;
+}
+
+int apply_rotate90( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
+  (void) argc;
+  (void) argv;
+  if ( !check_output_size( output_img, input_img->height, input_img->width ) )
+    return 0;
+  imgproc_rotate90( input_img, output_img );
+  return 1;
+}
+
+int apply_rotate180( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
+  (void) argc;
+  (void) argv;
+  imgproc_rotate180( input_img, output_img );
+  return 1;
+}
+
+int apply_rotate270( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
+  (void) argc;
+  (void) argv;
+  if ( !check_output_size( output_img, input_img->height, input_img->width ) )
+    return 0;
+  imgproc_rotate270( input_img, output_img );
+  return 1;
+}
+
+int apply_flip_h( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
+  (void) argc;
+  (void) argv;
+  imgproc_flip_h( input_img, output_img );
+  return 1;
+}
+
+int apply_flip_v( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
+  (void) argc;
+  (void) argv;
+  imgproc_flip_v( input_img, output_img );
+  return 1;
+}
+
+// the rgb grid is twice the width and height
+static int rgb_output_size( int32_t *width, int32_t *height, int argc, char **argv ) {
+  (void) argc;
+  (void) argv;
+  *width *= 2;
+  *height *= 2;
+  return 1;
+}
+
+int apply_rgb( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
+  (void) argc;
+  (void) argv;
+  if ( !check_output_size( output_img, 2 * input_img->width, 2 * input_img->height ) )
+    return 0;
+  rgb_split( input_img, output_img, 0 );
+  return 1;
+}
+
+// composite <overlay>: the overlay image is drawn over the input, from
+// its top left corner
+int apply_composite( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
+  if ( argc < 5 ) {
+    fprintf( stderr, "Error: composite needs an overlay image\n" );
+    return 0;
+  }
+
+  // raw overlays are mapped rather than read
+  struct Image overlay;
+  int mapped = img_map( argv[4], &overlay ) == IMG_SUCCESS;
+  if ( !mapped && img_read( argv[4], &overlay ) != IMG_SUCCESS ) {
+    fprintf( stderr, "Error: couldn't read overlay image '%s'\n", argv[4] );
+    return 0;
+  }
+
+  composite_over( input_img, &overlay, output_img, 0 );
+
+  if ( mapped )
+    img_unmap( &overlay );
+  else
+    img_cleanup( &overlay );
+  return 1;
+}
+
+int apply_complement_tiled( struct TileStore *input, struct TileStore *output, int argc, char **argv );
+int apply_transpose_tiled( struct TileStore *input, struct TileStore *output, int argc, char **argv );
+int apply_ellipse_tiled( struct TileStore *input, struct TileStore *output, int argc, char **argv );
+int apply_emboss_tiled( struct TileStore *input, struct TileStore *output, int argc, char **argv );
+
+int apply_complement16( struct Image16 *input_img, struct Image16 *output_img, int argc, char **argv );
+int apply_transpose16( struct Image16 *input_img, struct Image16 *output_img, int argc, char **argv );
+int apply_ellipse16( struct Image16 *input_img, struct Image16 *output_img, int argc, char **argv );
+int apply_emboss16( struct Image16 *input_img, struct Image16 *output_img, int argc, char **argv );
+
+void band_complement( struct Image *input_img, struct Image *output_img, int32_t first_row, int32_t full_height );
+void band_ellipse( struct Image *input_img, struct Image *output_img, int32_t first_row, int32_t full_height );
+void band_emboss( struct Image *input_img, struct Image *output_img, int32_t first_row, int32_t full_height );
+
+static const struct Transformation s_transformations[] = {
+  { "complement", apply_complement, apply_complement_tiled, apply_complement16,
+    XFORM_POINT, XFORM_INVOLUTION, 0, 2, band_complement, JIT_COMPLEMENT, NULL },
+  { "transpose", apply_transpose, apply_transpose_tiled, apply_transpose16,
+    XFORM_GLOBAL, XFORM_INVOLUTION | XFORM_SQUARE_ONLY, 0, 6, NULL, JIT_NONE, NULL },
+  { "ellipse", apply_ellipse, apply_ellipse_tiled, apply_ellipse16,
+    XFORM_MASK, XFORM_IDEMPOTENT, 0, 1, band_ellipse, JIT_NONE, NULL },
+  { "emboss", apply_emboss, apply_emboss_tiled, apply_emboss16,
+    XFORM_NEIGHBORHOOD, 0, 1, 20, band_emboss, JIT_EMBOSS, NULL },
+  // the stencils read rows below each pixel too, so they can't run in bands
+  { "blur", apply_blur, NULL, NULL, XFORM_GLOBAL, 0, 0, 8, NULL, JIT_NONE, NULL },
+  { "sharpen", apply_sharpen, NULL, NULL, XFORM_GLOBAL, 0, 0, 10, NULL, JIT_NONE, NULL },
+  { "sobel", apply_sobel, NULL, NULL, XFORM_GLOBAL, 0, 0, 16, NULL, JIT_NONE, NULL },
+  { "convolve", apply_convolve, NULL, NULL, XFORM_GLOBAL, 0, 0, 40, NULL, JIT_NONE, NULL },
+  { "resize", apply_resize, NULL, NULL, XFORM_GLOBAL, 0, 0, 6, NULL, JIT_NONE, resize_output_size },
+  // the quarter turns are strided like transpose; the rest stream rows
+  { "rotate90", apply_rotate90, NULL, NULL, XFORM_GLOBAL, 0, 0, 6, NULL, JIT_NONE, rotated_output_size },
+  { "rotate180", apply_rotate180, NULL, NULL, XFORM_GLOBAL, XFORM_INVOLUTION, 0, 3, NULL, JIT_NONE, NULL },
+  { "rotate270", apply_rotate270, NULL, NULL, XFORM_GLOBAL, 0, 0, 6, NULL, JIT_NONE, rotated_output_size },
+  { "flipH", apply_flip_h, NULL, NULL, XFORM_GLOBAL, XFORM_INVOLUTION, 0, 3, NULL, JIT_NONE, NULL },
+  { "flipV", apply_flip_v, NULL, NULL, XFORM_GLOBAL, XFORM_INVOLUTION, 0, 3, NULL, JIT_NONE, NULL },
+  { "rgb", apply_rgb, NULL, NULL, XFORM_GLOBAL, 0, 0, 4, NULL, JIT_NONE, rgb_output_size },
+  { "composite", apply_composite, NULL, NULL, XFORM_GLOBAL, XFORM_READS_FILES, 0, 3, NULL, JIT_NONE, NULL },
+  { NULL, NULL, NULL, NULL, XFORM_GLOBAL, 0, 0, 0, NULL, JIT_NONE, NULL },
+};
+
+const struct Transformation *find_transformation( const char *name ) {
+  for ( int i = 0; s_transformations[i].name != NULL; ++i )
+    if ( strcmp( s_transformations[i].name, name ) == 0 )
+      return &s_transformations[i];
+  return NULL;
+}
+
+struct Image *create_output_img( struct Image *input_img, const char *transformation, int argc, char **argv ) {
+  struct Image *out_img;
+  int32_t out_w = input_img->width, out_h = input_img->height;
+
+  // invalid arguments are reported by the transformation itself, so
+  // the output just keeps the input's dimensions
+  const struct Transformation *xform = find_transformation( transformation );
+  if ( xform != NULL && xform->output_size != NULL && !xform->output_size( &out_w, &out_h, argc, argv ) ) {
+    out_w = input_img->width;
+    out_h = input_img->height;
+  }
+
+  // Allocate Image object
+  out_img = (struct Image *) malloc( sizeof( struct Image ) );
+  if ( out_img == NULL )
+    return NULL;
+
+  // Set data to NULL for now
+  out_img->data = NULL;
+
+  // Attempt to initialize the Image object by calling img_init
+  if ( img_init( out_img, out_w, out_h ) != IMG_SUCCESS ) {
+    free( out_img );
+    return NULL;
+  }
+
+  // Success!
+  return out_img;
+}
+
+void cleanup_image( struct Image *img ) {
+  if ( img != NULL ) {
+    img_cleanup( img );
+    free( img );
+  }
+}
+
+struct Image16 *create_output_img16( struct Image16 *input_img ) {
+  struct Image16 *out_img = (struct Image16 *) malloc( sizeof( struct Image16 ) );
+  if ( out_img == NULL )
+    return NULL;
+
+  if ( img16_init( out_img, input_img->width, input_img->height ) != IMG_SUCCESS ) {
+    free( out_img );
+    return NULL;
+  }
+  return out_img;
+}
+
+void cleanup_image16( struct Image16 *img ) {
+  if ( img != NULL ) {
+    img16_cleanup( img );
+    free( img );
+  }
+}
+
+int apply_complement( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
+  (void) argc;
+  (void) argv;
+  imgproc_complement( input_img, output_img );
+  return 1;
+}
+
+int apply_transpose( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
+  (void) argc;
+  (void) argv;
+  int success = imgproc_transpose( input_img,  output_img );
+  if ( !success )
+    fprintf( stderr, "Error: transpose transformation failed\n" );
+  return success;
+}
+
+// The C build's kernel uses the cached masks, like band_ellipse; the
+// asm build's runs imgproc_ellipse, so asm_imgproc tests the asm kernel.
+int apply_ellipse( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
+  (void) argc;
+  (void) argv;
+  imgproc_ellipse_xform( input_img, output_img );
+  return 1;
+}
+
+int apply_emboss( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
+  (void) argc;
+  (void) argv;
+  imgproc_emboss( input_img,  output_img );
+  return 1;
+}
+
+int apply_complement_tiled( struct TileStore *input, struct TileStore *output, int argc, char **argv ) {
+  (void) argc;
+  (void) argv;
+  return ts_complement( input, output ) == IMG_SUCCESS;
+}
+
+int apply_transpose_tiled( struct TileStore *input, struct TileStore *output, int argc, char **argv ) {
+  (void) argc;
+  (void) argv;
+  if ( input->width != input->height ) {
+    fprintf( stderr, "Error: transpose transformation failed\n" );
+    return 0;
+  }
+  return ts_transpose( input, output ) == IMG_SUCCESS;
+}
+
+int apply_ellipse_tiled( struct TileStore *input, struct TileStore *output, int argc, char **argv ) {
+  (void) argc;
+  (void) argv;
+  return ts_ellipse( input, output ) == IMG_SUCCESS;
+}
+
+int apply_emboss_tiled( struct TileStore *input, struct TileStore *output, int argc, char **argv ) {
+  (void) argc;
+  (void) argv;
+  return ts_emboss( input, output ) == IMG_SUCCESS;
+}
+
+int apply_complement16( struct Image16 *input_img, struct Image16 *output_img, int argc, char **argv ) {
+  (void) argc;
+  (void) argv;
+  imgproc16_complement( input_img, output_img );
+  return 1;
+}
+
+int apply_transpose16( struct Image16 *input_img, struct Image16 *output_img, int argc, char **argv ) {
+  (void) argc;
+  (void) argv;
+  int success = imgproc16_transpose( input_img, output_img );
+  if ( !success )
+    fprintf( stderr, "Error: transpose transformation failed\n" );
+  return success;
+}
+
+int apply_ellipse16( struct Image16 *input_img, struct Image16 *output_img, int argc, char **argv ) {
+  (void) argc;
+  (void) argv;
+  return imgproc16_ellipse( input_img, output_img );
+}
+
+int apply_emboss16( struct Image16 *input_img, struct Image16 *output_img, int argc, char **argv ) {
+  (void) argc;
+  (void) argv;
+  imgproc16_emboss( input_img, output_img );
+  return 1;
+}
+
+void band_complement( struct Image *input_img, struct Image *output_img, int32_t first_row, int32_t full_height ) {
+  (void) first_row;
+  (void) full_height;
+  imgproc_complement( input_img, output_img );
+}
+
+void band_ellipse( struct Image *input_img, struct Image *output_img, int32_t first_row, int32_t full_height ) {
+  int32_t width = input_img->width;
+  const struct EllipseMask *mask = ellipse_mask_get( width, full_height );
+
+  if ( mask == NULL ) {
+    // fall back to testing each pixel against the whole image's ellipse
+    struct Image shape = { width, full_height, NULL };
+    for ( int32_t r = 0; r < input_img->height; ++r ) {
+      for ( int32_t col = 0; col < width; ++col ) {
+        size_t index = (size_t) r * width + col;
+        output_img->data[index] = is_in_ellipse( &shape, first_row + r, col ) ? input_img->data[index] : 0x000000FFU;
+      }
+    }
+    return;
+  }
+
+  for ( int32_t r = 0; r < input_img->height; ++r ) {
+    int32_t begin = mask->spans[2 * ( first_row + r )], end = mask->spans[2 * ( first_row + r ) + 1];
+    uint32_t *in = input_img->data + (size_t) r * width;
+    uint32_t *out = output_img->data + (size_t) r * width;
+
+    // the output band isn't initialized, so the pixels outside the
+    // ellipse are written explicitly
+    for ( int32_t col = 0; col < begin; ++col )
+      out[col] = 0x000000FFU;
+    memcpy( out + begin, in + begin, (size_t) ( end - begin ) * sizeof( uint32_t ) );
+    for ( int32_t col = end; col < width; ++col )
+      out[col] = 0x000000FFU;
+  }
+
+  ellipse_mask_release( mask );
+}
+
+void band_emboss( struct Image *input_img, struct Image *output_img, int32_t first_row, int32_t full_height ) {
+  (void) first_row;
+  (void) full_height;
+  // the first row of the band is treated as the top of the image
+  imgproc_emboss( input_img, output_img );
+}
@@ -0,0 +1,85 @@
+#ifndef TRANSFORMS_H
+#define TRANSFORMS_H
+
+#include "image.h"
+#include "tilestore.h"
+#include "jit.h"
+
+// How a transformation reads its input, which decides how the graph
+// planner (see imggraph.h) can schedule it
+enum TransformKind {
+  // each output pixel depends only on the input pixel at the same position
+  XFORM_POINT,
+  // the pixels inside the ellipse mask for the image's dimensions (see
+  // ellipse_mask.h) are copied, and the others become opaque black
+  XFORM_MASK,
+  // each output pixel depends on input pixels in the same row and in
+  // up to halo_rows rows above it
+  XFORM_NEIGHBORHOOD,
+  // any output pixel may depend on any input pixel
+  XFORM_GLOBAL,
+};
+
+// Transformation flags, used to simplify chains of transformations
+#define XFORM_INVOLUTION  1  // applying it twice gives back the input
+#define XFORM_IDEMPOTENT  2  // applying it twice is the same as once
+#define XFORM_SQUARE_ONLY 4  // only defined for square images
+#define XFORM_READS_FILES 8  // its arguments name files it reads (so the
+                             // arguments don't identify the result)
+
+// A transformation that can be selected by name. The argc/argv
+// parameters are the program's (shifted) command line, so any
+// transformation arguments start at argv[4].
+struct Transformation {
+  const char *name;
+  int (*apply)( struct Image *input_img, struct Image *output_img, int argc, char **argv );
+  // version of the transformation for --tiled mode (NULL if not supported)
+  int (*apply_tiled)( struct TileStore *input, struct TileStore *output, int argc, char **argv );
+  // version of the transformation for 16-bit images (NULL if not supported)
+  int (*apply16)( struct Image16 *input_img, struct Image16 *output_img, int argc, char **argv );
+
+  // planner metadata: the kind, XFORM_* flags, rows of context needed
+  // above each output row, and estimated cost in cycles per pixel
+  enum TransformKind kind;
+  int flags;
+  int halo_rows;
+  int cost;
+  // Apply the transformation to a band of rows (first_row to
+  // first_row + input_img->height - 1) of an image with full_height
+  // rows, writing every pixel of the output band. For XFORM_NEIGHBORHOOD,
+  // the first halo_rows output rows are only valid if the band starts
+  // at the top of the image. NULL if only apply can be used.
+  void (*apply_band)( struct Image *input_img, struct Image *output_img, int32_t first_row, int32_t full_height );
+  // the operation that compiled chains (see jit.h) use for it
+  enum JitOp jit_op;
+  // Work out the output dimensions from the input's, for a transformation
+  // which changes them (NULL if it doesn't). Returns 0 if the arguments
+  // are invalid. apply expects an output image of these dimensions
+  // (which create_output_img allocates).
+  int (*output_size)( int32_t *width, int32_t *height, int argc, char **argv );
+};
+
+// Find a transformation by name.
+//
+// Returns:
+//   pointer to the transformation, or NULL if there is none with that name
+const struct Transformation *find_transformation( const char *name );
+
+// Make a new empty image for the output of the named transformation.
+// Its dimensions come from the transformation's output_size (given the
+// same argc/argv as apply), so for example the "rgb" output is twice
+// the width and height of the input image; otherwise, or if the
+// arguments are invalid, it has the input image's dimensions.
+struct Image *create_output_img( struct Image *input_img, const char *transformation, int argc, char **argv );
+
+// Free memory allocated to given Image object
+void cleanup_image( struct Image *img );
+
+// Make a new empty 16-bit image with the same dimensions as the input
+// (which can't be used for "rgb").
+struct Image16 *create_output_img16( struct Image16 *input_img );
+
+// Free memory allocated to given Image16 object
+void cleanup_image16( struct Image16 *img );
+
+#endif // TRANSFORMS_H
@@ -0,0 +1,137 @@
+// XXH64 hash function
+
+#include <string.h>
+#include "xxhash.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+// XXH64 is defined on little-endian values
+static uint64_t read64(const unsigned char *p) {
+  return (uint64_t) p[0] | ((uint64_t) p[1] << 8) | ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24)
+    | ((uint64_t) p[4] << 32) | ((uint64_t) p[5] << 40) | ((uint64_t) p[6] << 48) | ((uint64_t) p[7] << 56);
+}
+
+static uint32_t read32(const unsigned char *p) {
+  return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+  acc += input * PRIME64_2;
+  acc = rotl64(acc, 31);
+  return acc * PRIME64_1;
+}
+
+static uint64_t merge_round(uint64_t acc, uint64_t val) {
+  acc ^= xxh_round(0, val);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+// Process one 32-byte stripe
+static void process_stripe(uint64_t v[4], const unsigned char *p) {
+  v[0] = xxh_round(v[0], read64(p));
+  v[1] = xxh_round(v[1], read64(p + 8));
+  v[2] = xxh_round(v[2], read64(p + 16));
+  v[3] = xxh_round(v[3], read64(p + 24));
+}
+
+void xxh64_reset(struct Xxh64State *state, uint64_t seed) {
+  state->total_len = 0;
+  state->v[0] = seed + PRIME64_1 + PRIME64_2;
+  state->v[1] = seed + PRIME64_2;
+  state->v[2] = seed;
+  state->v[3] = seed - PRIME64_1;
+  state->mem_size = 0;
+  state->seed = seed;
+}
+
+void xxh64_update(struct Xxh64State *state, const void *data, size_t len) {
+  const unsigned char *p = (const unsigned char *) data;
+  state->total_len += len;
+
+  // complete a partially filled stripe first
+  if (state->mem_size > 0) {
+    size_t n = 32 - state->mem_size;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(state->mem + state->mem_size, p, n);
+    state->mem_size += n;
+    p += n;
+    len -= n;
+    if (state->mem_size < 32) {
+      return;
+    }
+    process_stripe(state->v, state->mem);
+    state->mem_size = 0;
+  }
+
+  while (len >= 32) {
+    process_stripe(state->v, p);
+    p += 32;
+    len -= 32;
+  }
+
+  memcpy(state->mem, p, len);
+  state->mem_size = len;
+}
+
+uint64_t xxh64_digest(const struct Xxh64State *state) {
+  uint64_t h;
+
+  if (state->total_len >= 32) {
+    const uint64_t *v = state->v;
+    h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+    h = merge_round(h, v[0]);
+    h = merge_round(h, v[1]);
+    h = merge_round(h, v[2]);
+    h = merge_round(h, v[3]);
+  } else {
+    h = state->seed + PRIME64_5;
+  }
+  h += state->total_len;
+
+  // the remaining (fewer than 32) bytes
+  const unsigned char *p = state->mem;
+  size_t len = state->mem_size;
+  while (len >= 8) {
+    h ^= xxh_round(0, read64(p));
+    h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    p += 8;
+    len -= 8;
+  }
+  if (len >= 4) {
+    h ^= (uint64_t) read32(p) * PRIME64_1;
+    h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+    len -= 4;
+  }
+  while (len > 0) {
+    h ^= *p * PRIME64_5;
+    h = rotl64(h, 11) * PRIME64_1;
+    p++;
+    len--;
+  }
+
+  // avalanche
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed) {
+  struct Xxh64State state;
+  xxh64_reset(&state, seed);
+  xxh64_update(&state, data, len);
+  return xxh64_digest(&state);
+}
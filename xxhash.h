@@ -0,0 +1,56 @@
+#ifndef XXHASH_H
+#define XXHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The XXH64 non-cryptographic hash function (https://xxhash.com),
+// used to identify file contents. Data can be hashed in one call
+// (xxh64) or incrementally (xxh64_reset/xxh64_update/xxh64_digest);
+// both give the same result.
+
+struct Xxh64State {
+  uint64_t total_len;
+  uint64_t v[4];
+  unsigned char mem[32];
+  size_t mem_size;
+  uint64_t seed;
+};
+
+// Start hashing a new sequence of bytes.
+//
+// Parameters:
+//   state - pointer to Xxh64State to initialize
+//   seed - seed value (use 0 unless different hashes are needed)
+void xxh64_reset(struct Xxh64State *state, uint64_t seed);
+
+// Add bytes to the data being hashed.
+//
+// Parameters:
+//   state - pointer to Xxh64State
+//   data - pointer to the bytes
+//   len - number of bytes
+void xxh64_update(struct Xxh64State *state, const void *data, size_t len);
+
+// Get the hash of all the bytes added so far. More bytes can
+// still be added afterwards.
+//
+// Parameters:
+//   state - pointer to Xxh64State
+//
+// Returns:
+//   the hash value
+uint64_t xxh64_digest(const struct Xxh64State *state);
+
+// Hash a block of bytes in one call.
+//
+// Parameters:
+//   data - pointer to the bytes
+//   len - number of bytes
+//   seed - seed value
+//
+// Returns:
+//   the hash value
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+#endif // XXHASH_H